@@ -60,6 +60,9 @@ public:
 	/// Return whether the mapped memory region is read-only
 	bool isReadOnly() const;
 
+	/// Return whether changes to the mapped memory region are private to this process
+	bool isCopyOnWrite() const;
+
 	/// Return a string representation
 	std::string toString() const;
 
@@ -71,6 +74,15 @@ public:
 	 */
 	static ref<MemoryMappedFile> createTemporary(size_t size);
 
+	/**
+	 * \brief Map the specified file into memory with copy-on-write semantics
+	 *
+	 * The mapped region can be modified, but any changes are private to
+	 * the current process and never written back to the file. Pages are
+	 * only copied when they are written to.
+	 */
+	static ref<MemoryMappedFile> createCopyOnWrite(const fs::path &filename);
+
 	MTS_DECLARE_CLASS()
 protected:
 	/// Internal constructor
@@ -238,44 +238,61 @@ namespace math {
 	 */
 	template <typename Scalar, typename QuantizedScalar, typename Index> float makeAliasTable(
 			AliasTableEntry<QuantizedScalar, Index> *tbl, Scalar *pmf, Index size) {
-		/* Allocate temporary storage for classification purposes */
-		Index *c = new Index[size],
-		      *c_short = c - 1, *c_long  = c + size;
+		/* Allocate temporary storage for classification purposes. The
+		   probabilities are tracked in double precision, since the
+		   pairwise exchanges below accumulate round-off errors */
+		Index *c = new Index[size], *c_short = c, *c_long = c + size;
+		double *prob = new double[size];
 
 		/* Begin by computing the normalization constant */
-		Scalar sum = 0;
-		for (size_t i=0; i<size; ++i)
-			sum += pmf[i];
+		double sum = 0;
+		for (Index i=0; i<size; ++i)
+			sum += (double) pmf[i];
 
-		Scalar normalization = (Scalar) 1 / sum;
+		double normalization = 1.0 / sum;
 		for (Index i=0; i<size; ++i) {
 			/* For each entry, determine whether there is
 			   "too little" or "too much" probability mass */
-			Scalar value = size * normalization * pmf[i];
-			if (value < 1)
-				*++c_short = i;
-			else if (value > 1)
-				*--c_long  = i;
-			tbl[i].prob  = value;
+			prob[i] = size * normalization * (double) pmf[i];
+			if (prob[i] < 1)
+				*c_short++ = i;
+			else
+				*--c_long = i;
 			tbl[i].index = i;
 		}
 
-		/* Perform pairwise exchanges while there are entries
-		   with too much probability mass */
-		for (Index i=0; i < size-1 && c_long - c < size; ++i) {
-			Index short_index = c[i],
-			      long_index  = *c_long;
+		/* Perform pairwise exchanges while there are entries with too
+		   little and entries with too much probability mass. A long entry
+		   that ends up with too little mass becomes the last short entry
+		   (which occupies the array slot it was just read from) */
+		Index *short_it = c, *long_it = c_long, *c_end = c + size;
+		while (short_it != c_short && long_it != c_end) {
+			Index short_index = *short_it++,
+			      long_index  = *long_it;
 
 			tbl[short_index].index = long_index;
-			tbl[long_index].prob  -= (Scalar) 1 - tbl[short_index].prob;
+			prob[long_index] -= 1.0 - prob[short_index];
 
-			if (tbl[long_index].prob <= 1)
-				++c_long;
+			if (prob[long_index] < 1) {
+				*c_short++ = long_index;
+				++long_it;
+			}
 		}
 
+		/* Whatever remains has (up to round-off) exactly the uniform
+		   probability mass */
+		for (; short_it != c_short; ++short_it)
+			prob[*short_it] = 1;
+		for (; long_it != c_end; ++long_it)
+			prob[*long_it] = 1;
+
+		for (Index i=0; i<size; ++i)
+			tbl[i].prob = (QuantizedScalar) prob[i];
+
 		delete[] c;
+		delete[] prob;
 
-		return sum;
+		return (float) sum;
 	}
 
 	/// Generate a sample in constant time using the alias method
@@ -477,6 +477,34 @@ public:
 	/// Is the scheduler currently executing work?
 	bool isBusy() const;
 
+	/**
+	 * \brief Enable or disable work stealing between local workers
+	 *
+	 * When enabled (the default), local workers generate small batches of
+	 * work units into private queues, and idle workers steal from the
+	 * queues of busy ones. This greatly reduces contention on the central
+	 * scheduler lock when many cores process small work units. When
+	 * disabled, every work unit is acquired from the shared process queue
+	 * while holding the scheduler lock.
+	 *
+	 * May only be called while the scheduler is not running.
+	 */
+	void setWorkStealing(bool enabled);
+
+	/// Is work stealing between local workers enabled?
+	inline bool getWorkStealing() const { return m_workStealing; }
+
+	/**
+	 * \brief Set the number of work units that a local worker generates
+	 * at once when work stealing is enabled (default: 4)
+	 *
+	 * May only be called while the scheduler is not running.
+	 */
+	void setWorkBatchSize(int batchSize);
+
+	/// Return the number of work units generated at once by a local worker
+	inline int getWorkBatchSize() const { return m_workBatchSize; }
+
 	/// Initialize the scheduler of this process -- called once in main()
 	static void staticInitialization();
 
@@ -645,6 +673,59 @@ protected:
 
 	/// Announces the termination of a process
 	void signalProcessTermination(ParallelProcess *proc, ProcessRecord *rec);
+
+	/**
+	 * Update the process queue after \ref ParallelProcess::generateWork()
+	 * returned \c EFailure or \c EPause for the process on top of it
+	 */
+	void retireProcess(Item &item, std::deque<int> &queue,
+		ParallelProcess::EStatus wStatus);
+
+	/// Work unit that has been generated ahead of time by a local worker
+	struct QueuedWork {
+		int id;
+		ProcessRecord *rec;
+		ref<WorkUnit> workUnit;
+
+		inline QueuedWork() : id(-1), rec(NULL) { }
+		inline QueuedWork(int id, ProcessRecord *rec, WorkUnit *workUnit)
+			: id(id), rec(rec), workUnit(workUnit) { }
+	};
+
+	/// Private work queue of a local worker (used for work stealing)
+	struct WorkQueue {
+		ref<Mutex> mutex;
+		std::deque<QueuedWork> entries;
+
+		inline WorkQueue() : mutex(new Mutex()) { }
+	};
+
+	/**
+	 * Acquire a piece of work for a local worker when work stealing is
+	 * enabled. The main scheduler lock is only taken when the private
+	 * queue of the worker needs to be refilled.
+	 */
+	EStatus acquireQueuedWork(Item &item, bool onlyTry);
+
+	/**
+	 * Generate a batch of work units into the private queue of the
+	 * worker associated with \c item. Must be called while the
+	 * main scheduler lock is held. Returns the number of generated units.
+	 */
+	int generateQueuedWork(Item &item);
+
+	/// Take a work unit from the private queue of the specified worker
+	bool popQueuedWork(int workerIndex, QueuedWork &work);
+
+	/// Take a work unit from the private queue of some other worker
+	bool stealQueuedWork(int workerIndex, QueuedWork &work);
+
+	/**
+	 * Remove all queued work units belonging to the given process
+	 * from the private worker queues. Must be called while the main
+	 * scheduler lock is held. Returns the number of removed units.
+	 */
+	int discardQueuedWork(int id);
 private:
 	/// Global scheduler instance
 	static ref<Scheduler> m_scheduler;
@@ -662,7 +743,13 @@ private:
 	std::map<int, ResourceRecord *> m_resources;
 	/// List of all active workers
 	std::vector<Worker *> m_workers;
+	/// Private work queues of the workers (indexed by worker index)
+	std::vector<WorkQueue *> m_workQueues;
+	/// Total number of work units in the private work queues
+	volatile int32_t m_queuedWork;
 	int m_resourceCounter, m_processCounter;
+	int m_workBatchSize;
+	bool m_workStealing;
 	bool m_running;
 };
 
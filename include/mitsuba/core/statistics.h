@@ -344,6 +344,15 @@ public:
 	/// Register a counter with the statistics collector
 	void registerCounter(const StatsCounter *ctr);
 
+	/**
+	 * \brief Look up a registered counter by its category and name
+	 *
+	 * \return The counter, or \c NULL if no such counter was registered
+	 * (e.g. because the plugin defining it has not been loaded)
+	 */
+	const StatsCounter *getCounter(const std::string &category,
+		const std::string &name);
+
 	/// Record that a plugin has been loaded
 	void logPlugin(const std::string &pname, const std::string &descr);
 
@@ -63,6 +63,24 @@ public:
 	/// Develop the film and write the result to the previously specified filename
 	virtual void develop(const Scene *scene, Float renderTime) = 0;
 
+	/**
+	 * \brief Write the accumulated film contents to a stream
+	 *
+	 * In contrast to \ref develop(), this stores the raw (unnormalized)
+	 * sample sums including the reconstruction filter weights, so that
+	 * further samples can be added after \ref loadCheckpoint(). The
+	 * default implementation throws an exception.
+	 *
+	 * \sa supportsCheckpoints(), BlockedRenderProcess::setCheckpoint()
+	 */
+	virtual void saveCheckpoint(Stream *stream) const;
+
+	/// Does the film implement \ref saveCheckpoint()? (\c false by default)
+	virtual bool supportsCheckpoints() const;
+
+	/// Restore film contents previously written by \ref saveCheckpoint()
+	virtual void loadCheckpoint(Stream *stream);
+
 	/**
 	 * \brief Develop the contents of a subregion of the film and store
 	 * it inside the given bitmap
@@ -91,6 +109,17 @@ public:
 	/// Return whether or not this film records the alpha channel
 	virtual bool hasAlpha() const = 0;
 
+	/**
+	 * \brief Can image blocks be merged into the same region of
+	 * the film several times?
+	 *
+	 * This is required by multi-pass rendering, which accumulates further
+	 * samples on top of the ones already stored. Films that write every
+	 * block straight to the output file (e.g. tiled EXR images) return
+	 * \c false. The default implementation returns \c true.
+	 */
+	virtual bool isAccumulating() const;
+
 	/// Return the image reconstruction filter
 	inline ReconstructionFilter *getReconstructionFilter() { return m_filter.get(); }
 
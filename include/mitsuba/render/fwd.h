@@ -43,6 +43,8 @@ template <typename AABBType> class KDTreeBase;
 template <typename AABBType, typename TreeConstructionHeuristic, typename Derived> class GenericKDTree;
 template <typename Derived> class SAHKDTree3D;
 class ShapeKDTree;
+class ShapeBVH;
+class LightBVH;
 class LocalWorker;
 struct LuminaireSamplingRecord;
 class Medium;
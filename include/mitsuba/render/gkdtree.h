@@ -49,6 +49,18 @@
  */
 #define MTS_KD_AABB_EPSILON 1e-3f
 
+/**
+ * \brief Min-max binning and partitioning of nodes with at least this
+ * many primitives is data-parallel when building the tree in parallel
+ */
+#define MTS_KD_PARALLEL_BINNING_THRESHOLD 65536
+
+/**
+ * \brief When building the tree in parallel, min-max subtrees with at
+ * least this many primitives are handed to idle builder threads
+ */
+#define MTS_KD_PARALLEL_SUBTREE_THRESHOLD 32768
+
 #if defined(MTS_KD_DEBUG)
 #define KDAssert(expr) SAssert(expr)
 #define KDAssertEx(expr, text) SAssertEx(expr, text)
@@ -697,7 +709,9 @@ MTS_NAMESPACE_BEGIN
  * cache misses. Once the input data has been narrowed down to a
  * reasonable amount, the implementation switches over to the O(N log N)
  * builder. When multiple processors are available, the build process runs
- * in parallel.
+ * in parallel: large min-max subtrees and all O(N log N) subtrees are
+ * built by separate threads, and the binning of very large nodes is
+ * data-parallel.
  *
  * \author Wenzel Jakob
  * \ingroup librender
@@ -729,8 +743,13 @@ public:
 	 * \brief Create a new kd-tree instance initialized with
 	 * the default parameters.
 	 */
-	GenericKDTree() : m_indices(NULL) {
+	GenericKDTree() : m_indices(NULL), m_compressedIndices(NULL) {
 		m_nodes = NULL;
+		m_nodeCount = m_indexCount = 0;
+		m_compressedIndexSize = 0;
+		m_buildTime = 0;
+		m_buildMemory = 0;
+		m_sahCost = 0;
 		m_traversalCost = 15;
 		m_queryCost = 20;
 		m_emptySpaceBonus = 0.9f;
@@ -751,6 +770,8 @@ public:
 	virtual ~GenericKDTree() {
 		if (m_indices)
 			delete[] m_indices;
+		if (m_compressedIndices)
+			delete[] m_compressedIndices;
 		if (m_nodes)
 			freeAligned(m_nodes-1); // undo alignment shift
 	}
@@ -764,9 +785,50 @@ public:
 
 	/**
 	 * \brief Returns the underlying kd-tree index buffer
+	 *
+	 * This is \c NULL when the index lists have been compressed
+	 * (see \ref compressIndices()).
 	 */
 	inline IndexType *getIndices() const { return m_indices; }
 
+	/// Have the primitive index lists been compressed?
+	inline bool hasCompressedIndices() const { return m_compressedIndices != NULL; }
+
+	/**
+	 * \brief Fetch the next entry of a leaf node's primitive list
+	 *
+	 * This works with both plain and compressed index lists and should be
+	 * used by all code that iterates over the primitives of a leaf node.
+	 *
+	 * \param entry
+	 *    Position within the list. Starts at \ref KDNode::getPrimStart(), and
+	 *    is advanced past the returned entry (the list ends at
+	 *    \ref KDNode::getPrimEnd())
+	 * \param prevIdx
+	 *    Primitive index returned by the previous call for the same leaf
+	 *    (zero for the first entry)
+	 */
+	FINLINE IndexType nextPrimitive(IndexType &entry, IndexType prevIdx) const {
+		if (EXPECT_TAKEN(m_compressedIndices == NULL))
+			return m_indices[entry++];
+
+		IndexType delta = 0;
+		int shift = 0;
+		uint8_t value;
+		do {
+			value = m_compressedIndices[entry++];
+			delta |= (IndexType) (value & 0x7F) << shift;
+			shift += 7;
+		} while (value & 0x80);
+		return prevIdx + delta;
+	}
+
+	/// Return the size of the primitive index lists in bytes
+	inline size_t getIndexStorageSize() const {
+		return m_compressedIndices ? (size_t) m_compressedIndexSize
+			: sizeof(IndexType) * (size_t) m_indexCount;
+	}
+
 	/**
 	 * \brief Return the traversal cost used by the tree construction heuristic
 	 */
@@ -931,7 +993,98 @@ public:
 	inline SizeType getExactPrimitiveThreshold() const {
 		return m_exactPrimThreshold;
 	}
+
+	/// Return the number of nodes of the constructed kd-tree
+	inline SizeType getNodeCount() const {
+		return m_nodeCount;
+	}
+
+	/// Return the number of entries in the primitive index list
+	inline SizeType getIndexCount() const {
+		return m_indexCount;
+	}
+
+	/// Return the time (in milliseconds) taken by the tree construction
+	inline int getBuildTime() const {
+		return m_buildTime;
+	}
+
+	/// Return the peak amount of temporary memory used by the tree construction
+	inline size_t getBuildMemoryUsage() const {
+		return m_buildMemory;
+	}
+
+	/**
+	 * \brief Return the cost of the constructed tree according to the
+	 * tree construction heuristic (normalized by the root node measure)
+	 */
+	inline Float getHeuristicCost() const {
+		return m_sahCost;
+	}
 protected:
+	/**
+	 * \brief Compress the primitive index lists of all leaf nodes
+	 *
+	 * The entries of each leaf are sorted and stored as differences to
+	 * their predecessors using a variable-length encoding with 7 bits per
+	 * byte. This usually reduces the index storage from four bytes to one
+	 * or two bytes per entry, at the cost of some decoding work during
+	 * traversal (see \ref nextPrimitive()). Afterwards, the leaf nodes
+	 * reference byte offsets instead of entries.
+	 *
+	 * \return \c false if the compressed lists are too large to be
+	 * addressed by the leaf nodes. The index lists are left uncompressed
+	 * in this case.
+	 */
+	bool compressIndices() {
+		KDAssert(isBuilt() && m_compressedIndices == NULL);
+		std::vector<uint8_t> data;
+		std::vector<std::pair<size_t, size_t> > ranges;
+		data.reserve(2 * (size_t) m_indexCount);
+
+		for (SizeType i=0; i<m_nodeCount; ++i) {
+			const KDNode &node = m_nodes[i];
+			if (!node.isLeaf())
+				continue;
+			IndexType primStart = node.getPrimStart(),
+			          primEnd = node.getPrimEnd();
+			std::sort(m_indices + primStart, m_indices + primEnd);
+
+			size_t start = data.size();
+			IndexType prevIdx = 0;
+			for (IndexType entry = primStart; entry != primEnd; ++entry) {
+				IndexType delta = m_indices[entry] - prevIdx;
+				prevIdx = m_indices[entry];
+				while (delta >= 0x80) {
+					data.push_back((uint8_t) (delta | 0x80));
+					delta >>= 7;
+				}
+				data.push_back((uint8_t) delta);
+			}
+			ranges.push_back(std::make_pair(start, data.size() - start));
+		}
+
+		if (data.size() > (size_t) KDNode::ELeafOffsetMask)
+			return false;
+
+		size_t leaf = 0;
+		for (SizeType i=0; i<m_nodeCount; ++i) {
+			if (m_nodes[i].isLeaf()) {
+				m_nodes[i].initLeafNode((unsigned int) ranges[leaf].first,
+					(unsigned int) ranges[leaf].second);
+				++leaf;
+			}
+		}
+
+		m_compressedIndexSize = (SizeType) data.size();
+		m_compressedIndices = new uint8_t[std::max(data.size(), (size_t) 1)];
+		if (!data.empty())
+			memcpy(m_compressedIndices, &data[0], data.size());
+		delete[] m_indices;
+		m_indices = NULL;
+		return true;
+	}
+
 	/**
 	 * \brief Once the tree has been constructed, it is rewritten into
 	 * a more convenient binary storage format.
@@ -980,6 +1133,10 @@ protected:
 		if (primCount <= m_exactPrimThreshold)
 			m_parallelBuild = false;
 
+		SizeType procCount = getCoreCount();
+		if (procCount == 1)
+			m_parallelBuild = false;
+
 		BuildContext ctx(primCount, m_minMaxBins);
 
 		/* Establish an ad-hoc depth cutoff value (Formula from PBRT) */
@@ -993,12 +1150,26 @@ protected:
 		OrderedChunkAllocator &leftAlloc = ctx.leftAlloc;
 		IndexType *indices = leftAlloc.allocate<IndexType>(primCount);
 
-		ref<Timer> timer = new Timer();
+		ref<Timer> timer = new Timer(), buildTimer = new Timer();
 		AABBType &aabb = m_aabb;
 		aabb.reset();
-		for (IndexType i=0; i<primCount; ++i) {
-			aabb.expandBy(cast()->getAABB(i));
-			indices[i] = i;
+		if (m_parallelBuild) {
+			#pragma omp parallel
+			{
+				AABBType localAABB;
+				#pragma omp for schedule(static)
+				for (int i=0; i<(int) primCount; ++i) {
+					localAABB.expandBy(cast()->getAABB((IndexType) i));
+					indices[i] = (IndexType) i;
+				}
+				#pragma omp critical
+				aabb.expandBy(localAABB);
+			}
+		} else {
+			for (IndexType i=0; i<primCount; ++i) {
+				aabb.expandBy(cast()->getAABB(i));
+				indices[i] = i;
+			}
 		}
 
 		#if defined(DOUBLE_PRECISION)
@@ -1032,10 +1203,6 @@ protected:
 				m_parallelBuild ? "yes" : "no");
 		KDLog(m_logLevel, "");
 
-		SizeType procCount = getCoreCount();
-		if (procCount == 1)
-			m_parallelBuild = false;
-
 		if (m_parallelBuild) {
 			m_builders.resize(procCount);
 			for (SizeType i=0; i<procCount; ++i) {
@@ -1091,6 +1258,7 @@ protected:
 			ctx.accumulateStatisticsFrom(subCtx);
 		}
 		KDLog(m_logLevel, "   Total: %s", memString(totalUsage).c_str());
+		m_buildMemory = totalUsage;
 
 		KDLog(m_logLevel, "");
 		timer->reset();
@@ -1209,6 +1377,7 @@ protected:
 		expLeavesVisited /= rootQuantity;
 		expPrimitivesIntersected /= rootQuantity;
 		heuristicCost /= rootQuantity;
+		m_sahCost = heuristicCost;
 
 		/* Slightly enlarge the bounding box
 		   (necessary e.g. when the scene is planar) */
@@ -1256,6 +1425,8 @@ protected:
 		KDLog(m_logLevel, "   Final cost                  : %.2f", heuristicCost);
 		KDLog(m_logLevel, "");
 
+		m_buildTime = buildTimer->getMilliseconds();
+
 		#if defined(__LINUX__)
 			/* Forcefully release Heap memory back to the OS */
 			malloc_trim(0);
@@ -1390,8 +1561,11 @@ protected:
 		SizeType retractedSplits;
 		SizeType pruned;
 
-		BuildContext(SizeType primCount, SizeType binCount)
-				: minMaxBins(binCount) {
+		/// Does this context belong to a builder thread?
+		bool worker;
+
+		BuildContext(SizeType primCount, SizeType binCount, bool worker = false)
+				: minMaxBins(binCount), worker(worker) {
 			classStorage.setPrimitiveCount(primCount);
 			leafNodeCount = 0;
 			nonemptyLeafNodeCount = 0;
@@ -1444,12 +1618,15 @@ protected:
 		ref<ConditionVariable> cond, condJobTaken;
 		std::map<const KDNode *, IndexType> threadMap;
 		bool done;
+		int idleCount;
 
-		/* Job description for building a subtree */
+		/* Job description for building a subtree. Either an edge event
+		   list (O(n log n) build) or an index list (min-max binning) */
 		int depth;
 		KDNode *node;
-		AABBType nodeAABB;
+		AABBType nodeAABB, tightAABB;
 		EdgeEvent *eventStart, *eventEnd;
+		IndexType *indices;
 		SizeType primCount;
 		int badRefines;
 
@@ -1459,6 +1636,7 @@ protected:
 			condJobTaken = new ConditionVariable(mutex);
 			node = NULL;
 			done = false;
+			idleCount = 0;
 		}
 	};
 
@@ -1472,7 +1650,7 @@ protected:
 			m_id(id),
 			m_parent(parent),
 			m_context(parent->cast()->getPrimitiveCount(),
-					  parent->getMinMaxBins()),
+					  parent->getMinMaxBins(), true),
 			m_interface(parent->m_interface) {
 			setCritical(true);
 		}
@@ -1486,17 +1664,36 @@ protected:
 			OrderedChunkAllocator &leftAlloc = m_context.leftAlloc;
 			while (true) {
 				UniqueLock lock(m_interface.mutex);
+				++m_interface.idleCount;
 				while (!m_interface.done && !m_interface.node)
 					m_interface.cond->wait();
+				--m_interface.idleCount;
 				if (m_interface.done) {
 					break;
 				}
 				int depth = m_interface.depth;
 				KDNode *node = m_interface.node;
-				AABBType nodeAABB = m_interface.nodeAABB;
-				size_t eventCount = m_interface.eventEnd - m_interface.eventStart;
+				AABBType nodeAABB = m_interface.nodeAABB,
+				         tightAABB = m_interface.tightAABB;
 				SizeType primCount = m_interface.primCount;
 				int badRefines = m_interface.badRefines;
+
+				if (m_interface.indices) {
+					/* Min-max binning subtree */
+					IndexType *indices = leftAlloc.allocate<IndexType>(primCount);
+					memcpy(indices, m_interface.indices, primCount * sizeof(IndexType));
+					m_interface.threadMap[node] = m_id;
+					m_interface.node = NULL;
+					m_interface.condJobTaken->signal();
+					lock.unlock();
+
+					m_parent->buildTreeMinMax(m_context, depth, node, nodeAABB,
+						tightAABB, indices, primCount, true, badRefines);
+					leftAlloc.release(indices);
+					continue;
+				}
+
+				size_t eventCount = m_interface.eventEnd - m_interface.eventStart;
 				EdgeEvent *eventStart = leftAlloc.allocate<EdgeEvent>(eventCount),
 						  *eventEnd = eventStart + eventCount;
 				memcpy(eventStart, m_interface.eventStart,
@@ -1733,13 +1930,17 @@ protected:
 				? ctx.leftAlloc : ctx.rightAlloc;
 		EventList events = createEventList(alloc, nodeAABB, indices, primCount);
 		Float cost;
-		if (m_parallelBuild) {
+
+		/* Builder threads process the subtrees of their own min-max
+		   jobs, which avoids waiting on each other */
+		if (m_parallelBuild && !ctx.worker) {
 			LockGuard lock(m_interface.mutex);
 			m_interface.depth = depth;
 			m_interface.node = node;
 			m_interface.nodeAABB = nodeAABB;
 			m_interface.eventStart = events.start;
 			m_interface.eventEnd = events.end;
+			m_interface.indices = NULL;
 			m_interface.primCount = events.primCount;
 			m_interface.badRefines = badRefines;
 			m_interface.cond->signal();
@@ -1760,6 +1961,38 @@ protected:
 		return cost;
 	}
 
+	/**
+	 * \brief Try to hand a min-max subtree to an idle builder thread
+	 *
+	 * The index list is copied by the builder thread before this
+	 * function returns.
+	 *
+	 * \return \c false if all builder threads are busy, in which
+	 *     case the caller must build the subtree itself
+	 */
+	bool forkSubtree(unsigned int depth, KDNode *node, const AABBType &nodeAABB,
+			const AABBType &tightAABB, IndexType *indices, SizeType primCount,
+			SizeType badRefines) {
+		LockGuard lock(m_interface.mutex);
+		if (m_interface.idleCount == 0)
+			return false;
+
+		m_interface.depth = depth;
+		m_interface.node = node;
+		m_interface.nodeAABB = nodeAABB;
+		m_interface.tightAABB = tightAABB;
+		m_interface.eventStart = m_interface.eventEnd = NULL;
+		m_interface.indices = indices;
+		m_interface.primCount = primCount;
+		m_interface.badRefines = badRefines;
+		m_interface.cond->signal();
+
+		/* Wait for a worker thread to take this job */
+		while (m_interface.node)
+			m_interface.condJobTaken->wait();
+		return true;
+	}
+
 	/**
 	 * \brief Build helper function (min-max binning)
 	 *
@@ -1808,8 +2041,10 @@ protected:
 	    /*                              Binning                                 */
 	    /* ==================================================================== */
 
+		bool parallel = m_parallelBuild && !ctx.worker &&
+			primCount >= MTS_KD_PARALLEL_BINNING_THRESHOLD;
 		ctx.minMaxBins.setAABB(tightAABB);
-		ctx.minMaxBins.bin(cast(), indices, primCount);
+		ctx.minMaxBins.bin(cast(), indices, primCount, parallel);
 
 		/* ==================================================================== */
 	    /*                        Split candidate search                        */
@@ -1848,7 +2083,7 @@ protected:
 
 		typename MinMaxBins::Partition partition =
 			ctx.minMaxBins.partition(ctx, cast(), indices, bestSplit,
-			isLeftChild, m_traversalCost, m_queryCost);
+			isLeftChild, m_traversalCost, m_queryCost, parallel);
 
 		/* ==================================================================== */
 	    /*                              Recursion                               */
@@ -1876,26 +2111,39 @@ protected:
 		AABBType childAABB(nodeAABB);
 		childAABB.max[bestSplit.axis] = bestSplit.pos;
 
+		AABBType rightAABB(nodeAABB);
+		rightAABB.min[bestSplit.axis] = bestSplit.pos;
+
+		/* Hand large right subtrees to an idle builder thread, while
+		   this thread continues with the left one */
+		bool forked = false;
+		if (m_parallelBuild && !ctx.worker && bestSplit.numRight
+				>= std::max((SizeType) MTS_KD_PARALLEL_SUBTREE_THRESHOLD,
+				            m_exactPrimThreshold + 1))
+			forked = forkSubtree(depth+1, children + 1, rightAABB,
+				partition.right, partition.rightIndices, bestSplit.numRight,
+				badRefines);
+
 		Float leftCost = buildTreeMinMax(ctx, depth+1, children,
 				childAABB, partition.left, partition.leftIndices,
 				bestSplit.numLeft, true, badRefines);
 
-		childAABB.min[bestSplit.axis] = bestSplit.pos;
-		childAABB.max[bestSplit.axis] = nodeAABB.max[bestSplit.axis];
-
-		Float rightCost = buildTreeMinMax(ctx, depth+1, children + 1,
-				childAABB, partition.right, partition.rightIndices,
-				bestSplit.numRight, false, badRefines);
+		Float rightCost = forked ? 0 : buildTreeMinMax(ctx, depth+1,
+				children + 1, rightAABB, partition.right,
+				partition.rightIndices, bestSplit.numRight, false, badRefines);
 
 		TreeConstructionHeuristic tch(nodeAABB);
 		std::pair<Float, Float> prob = tch(bestSplit.axis,
 			bestSplit.pos - nodeAABB.min[bestSplit.axis],
 			nodeAABB.max[bestSplit.axis] - bestSplit.pos);
 
-		/* Compute the final cost given the updated cost
-		   values received from the children */
-		Float finalCost = m_traversalCost +
-			(prob.first * leftCost + prob.second * rightCost);
+		/* Compute the final cost given the updated cost values received
+		   from the children. Never tear down subtrees that are built by
+		   other threads (cost of -infinity), even if a child has zero
+		   probability */
+		const Float negInf = -std::numeric_limits<Float>::infinity();
+		Float finalCost = (forked || leftCost == negInf || rightCost == negInf) ? negInf
+			: m_traversalCost + (prob.first * leftCost + prob.second * rightCost);
 
 		/* Release the index lists not needed by the children anymore */
 		if (isLeftChild)
@@ -2440,13 +2688,41 @@ protected:
 		 *     a given list of primitives
 		 * \param indices Primitive indirection list
 		 * \param primCount Specifies the length of \a indices
+		 * \param parallel Bin the primitives using all available cores?
 		 */
 		void bin(const Derived *derived, IndexType *indices,
-				SizeType primCount) {
+				SizeType primCount, bool parallel = false) {
 			m_primCount = primCount;
 			memset(m_minBins, 0, sizeof(SizeType) * PointType::dim * m_binCount);
 			memset(m_maxBins, 0, sizeof(SizeType) * PointType::dim * m_binCount);
 
+			if (parallel) {
+				const int binCount = m_binCount * PointType::dim;
+				#pragma omp parallel
+				{
+					/* Bin into thread-local storage and accumulate afterwards */
+					std::vector<SizeType> minBins(binCount, 0), maxBins(binCount, 0);
+
+					#pragma omp for schedule(static)
+					for (int i=0; i<(int) primCount; ++i) {
+						const AABBType aabb = derived->getAABB(indices[i]);
+						for (int axis=0; axis<PointType::dim; ++axis) {
+							minBins[axis * m_binCount + computeIndex(math::castflt_down(aabb.min[axis]), axis)]++;
+							maxBins[axis * m_binCount + computeIndex(math::castflt_up  (aabb.max[axis]), axis)]++;
+						}
+					}
+
+					#pragma omp critical
+					{
+						for (int i=0; i<binCount; ++i) {
+							m_minBins[i] += minBins[i];
+							m_maxBins[i] += maxBins[i];
+						}
+					}
+				}
+				return;
+			}
+
 			for (SizeType i=0; i<m_primCount; ++i) {
 				const AABBType aabb = derived->getAABB(indices[i]);
 				for (int axis=0; axis<PointType::dim; ++axis) {
@@ -2518,11 +2794,15 @@ protected:
 		 * \brief Given a suitable split candiate, compute tight bounding
 		 * boxes for the left and right subtrees and return associated
 		 * primitive lists.
+		 *
+		 * When \c parallel is set to \c true, the primitives are classified
+		 * using all available cores, and only the final (cheap) scatter
+		 * into the index lists happens sequentially.
 		 */
 		Partition partition(
 				BuildContext &ctx, const Derived *derived, IndexType *primIndices,
 				SplitCandidate &split, bool isLeftChild, Float traversalCost,
-				Float queryCost) {
+				Float queryCost, bool parallel = false) {
 			SizeType numLeft = 0, numRight = 0;
 			AABBType leftBounds, rightBounds;
 			const int axis = split.axis;
@@ -2538,27 +2818,76 @@ protected:
 				rightIndices = primIndices;
 			}
 
-			for (SizeType i=0; i<m_primCount; ++i) {
-				const IndexType primIndex = primIndices[i];
-				const AABBType aabb = derived->getAABB(primIndex);
-				int startIdx = computeIndex(math::castflt_down(aabb.min[axis]), axis);
-				int endIdx   = computeIndex(math::castflt_up  (aabb.max[axis]), axis);
-
-				if (endIdx <= split.leftBin) {
-					KDAssert(numLeft < split.numLeft);
-					leftBounds.expandBy(aabb);
-					leftIndices[numLeft++] = primIndex;
-				} else if (startIdx > split.leftBin) {
-					KDAssert(numRight < split.numRight);
-					rightBounds.expandBy(aabb);
-					rightIndices[numRight++] = primIndex;
-				} else {
-					leftBounds.expandBy(aabb);
-					rightBounds.expandBy(aabb);
-					KDAssert(numLeft < split.numLeft);
-					KDAssert(numRight < split.numRight);
-					leftIndices[numLeft++] = primIndex;
-					rightIndices[numRight++] = primIndex;
+			if (parallel) {
+				/* Classify in parallel (bit 0: left, bit 1: right) */
+				std::vector<uint8_t> classification(m_primCount);
+
+				#pragma omp parallel
+				{
+					AABBType localLeftBounds, localRightBounds;
+
+					#pragma omp for schedule(static)
+					for (int i=0; i<(int) m_primCount; ++i) {
+						const AABBType aabb = derived->getAABB(primIndices[i]);
+						int startIdx = computeIndex(math::castflt_down(aabb.min[axis]), axis);
+						int endIdx   = computeIndex(math::castflt_up  (aabb.max[axis]), axis);
+						uint8_t cls = 0;
+
+						if (startIdx <= split.leftBin) {
+							localLeftBounds.expandBy(aabb);
+							cls |= 1;
+						}
+						if (endIdx > split.leftBin) {
+							localRightBounds.expandBy(aabb);
+							cls |= 2;
+						}
+						classification[i] = cls;
+					}
+
+					#pragma omp critical
+					{
+						leftBounds.expandBy(localLeftBounds);
+						rightBounds.expandBy(localRightBounds);
+					}
+				}
+
+				/* Sequentially scatter the indices. This works in-place,
+				   since an entry is never written before it has been read */
+				for (SizeType i=0; i<m_primCount; ++i) {
+					const IndexType primIndex = primIndices[i];
+					uint8_t cls = classification[i];
+					if (cls & 1) {
+						KDAssert(numLeft < split.numLeft);
+						leftIndices[numLeft++] = primIndex;
+					}
+					if (cls & 2) {
+						KDAssert(numRight < split.numRight);
+						rightIndices[numRight++] = primIndex;
+					}
+				}
+			} else {
+				for (SizeType i=0; i<m_primCount; ++i) {
+					const IndexType primIndex = primIndices[i];
+					const AABBType aabb = derived->getAABB(primIndex);
+					int startIdx = computeIndex(math::castflt_down(aabb.min[axis]), axis);
+					int endIdx   = computeIndex(math::castflt_up  (aabb.max[axis]), axis);
+
+					if (endIdx <= split.leftBin) {
+						KDAssert(numLeft < split.numLeft);
+						leftBounds.expandBy(aabb);
+						leftIndices[numLeft++] = primIndex;
+					} else if (startIdx > split.leftBin) {
+						KDAssert(numRight < split.numRight);
+						rightBounds.expandBy(aabb);
+						rightIndices[numRight++] = primIndex;
+					} else {
+						leftBounds.expandBy(aabb);
+						rightBounds.expandBy(aabb);
+						KDAssert(numLeft < split.numLeft);
+						KDAssert(numRight < split.numRight);
+						leftIndices[numLeft++] = primIndex;
+						rightIndices[numRight++] = primIndex;
+					}
 				}
 			}
 			leftBounds.clip(m_aabb);
@@ -2592,6 +2921,8 @@ protected:
 
 protected:
 	IndexType *m_indices;
+	uint8_t *m_compressedIndices;
+	SizeType m_compressedIndexSize;
 	Float m_traversalCost;
 	Float m_queryCost;
 	Float m_emptySpaceBonus;
@@ -2603,6 +2934,9 @@ protected:
 	SizeType m_minMaxBins;
 	SizeType m_nodeCount;
 	SizeType m_indexCount;
+	int m_buildTime;
+	size_t m_buildMemory;
+	Float m_sahCost;
 	std::vector<TreeBuilder *> m_builders;
 	std::vector<KDNode *> m_indirections;
 	ref<Mutex> m_indirectionLock;
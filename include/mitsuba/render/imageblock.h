@@ -24,6 +24,9 @@
 #include <mitsuba/core/sched.h>
 #include <mitsuba/core/rfilter.h>
 
+/// Edge length of the tiles tracked by sparse image blocks (in pixels)
+#define MTS_IMAGEBLOCK_TILE_SIZE 32
+
 MTS_NAMESPACE_BEGIN
 
 /**
@@ -35,6 +38,14 @@ MTS_NAMESPACE_BEGIN
  * border region storing contribuctions that are slightly outside of the block,
  * which is required to support image reconstruction filters.
  *
+ * Particle tracers instead splat samples at arbitrary positions into a
+ * full-resolution block per worker, although a single work unit usually
+ * touches only part of it. Such blocks can be made \a sparse (see
+ * \ref setSparse()), in which case clearing, merging and transmitting them
+ * only processes the tiles that were actually written to. Worker results
+ * can furthermore be merged into a shared block without holding a lock
+ * (see \ref putAtomic()).
+ *
  * \ingroup librender
  */
 class MTS_EXPORT_RENDER ImageBlock : public WorkResult {
@@ -97,15 +108,78 @@ public:
 	inline const Bitmap *getBitmap() const { return m_bitmap.get(); }
 
 	/// Clear everything to zero
-	inline void clear() { m_bitmap->clear(); }
+	inline void clear() {
+		if (m_dirty.empty())
+			m_bitmap->clear();
+		else
+			clearDirtyTiles();
+		if (m_variance)
+			memset(m_variance, 0, sizeof(Float) * 3 * m_varianceSize.x * m_varianceSize.y);
+	}
+
+	/**
+	 * \brief Enable or disable the per-pixel variance buffer
+	 *
+	 * When enabled, the spectrum variant of \ref put() additionally records
+	 * the number of samples and the first two moments of their luminance
+	 * for the pixel containing each sample (without applying the
+	 * reconstruction filter). This can be used to estimate the error of
+	 * each pixel, e.g. for adaptive sampling.
+	 */
+	void setVarianceBuffer(bool enabled);
+
+	/// Is the per-pixel variance buffer enabled?
+	inline bool hasVarianceBuffer() const { return m_variance != NULL; }
+
+	/**
+	 * \brief Return the per-pixel variance buffer (or \c NULL)
+	 *
+	 * For every pixel of the block (excluding the border region),
+	 * this contains the sample count, and the sum of the sample
+	 * luminances and of their squares. Rows are
+	 * <tt>getVarianceBufferSize().x</tt> pixels wide.
+	 */
+	inline const Float *getVarianceBuffer() const { return m_variance; }
+
+	/// Return the size of the per-pixel variance buffer
+	inline const Vector2i &getVarianceBufferSize() const { return m_varianceSize; }
+
+	/**
+	 * \brief Enable or disable tracking of the tiles that were written to
+	 *
+	 * When enabled, the block keeps a list of the tiles of
+	 * <tt>MTS_IMAGEBLOCK_TILE_SIZE^2</tt> pixels touched by \ref put().
+	 * \ref clear(), \ref load(), \ref save() and the merging of this
+	 * block into another one then skip all other tiles. The block
+	 * should be cleared after enabling tracking.
+	 */
+	void setSparse(bool sparse);
+
+	/// Does this block track the tiles that were written to?
+	inline bool isSparse() const { return !m_dirty.empty(); }
+
+	/// Return the number of tiles that were written to (sparse blocks only)
+	inline size_t getDirtyTileCount() const { return m_dirtyTiles.size(); }
 
 	/// Accumulate another image block into this one
 	inline void put(const ImageBlock *block) {
-		m_bitmap->accumulate(block->getBitmap(),
-			Point2i(block->getOffset() - m_offset
-				- Vector2i(block->getBorderSize() - m_borderSize)));
+		if (block->isSparse() || isSparse())
+			accumulate(block, false);
+		else
+			m_bitmap->accumulate(block->getBitmap(),
+				Point2i(block->getOffset() - m_offset
+					- Vector2i(block->getBorderSize() - m_borderSize)));
 	}
 
+	/**
+	 * \brief Accumulate another image block into this one using atomic
+	 * additions, which allows several threads to merge their results
+	 * concurrently without holding a lock
+	 *
+	 * This block must not be sparse. Updates the "merge time" statistics.
+	 */
+	void putAtomic(const ImageBlock *block);
+
 	/**
 	 * \brief Store a single sample inside the image block
 	 *
@@ -127,7 +201,21 @@ public:
 			temp[i] = spec[i];
 		temp[SPECTRUM_SAMPLES] = alpha;
 		temp[SPECTRUM_SAMPLES + 1] = 1.0f;
-		return put(pos, temp);
+		if (!put(pos, temp))
+			return false;
+
+		if (m_variance) {
+			const int x = (int) std::floor(pos.x) - m_offset.x,
+			          y = (int) std::floor(pos.y) - m_offset.y;
+			if (x >= 0 && y >= 0 && x < m_size.x && y < m_size.y) {
+				const Float luminance = spec.getLuminance();
+				Float *moments = m_variance + 3 * (y * m_varianceSize.x + x);
+				moments[0] += 1.0f;
+				moments[1] += luminance;
+				moments[2] += luminance * luminance;
+			}
+		}
+		return true;
 	}
 
 	/**
@@ -165,6 +253,9 @@ public:
 			              max(std::min((int) std::floor(pos.x + filterRadius), size.x - 1),
 			                  std::min((int) std::floor(pos.y + filterRadius), size.y - 1));
 
+			if (!m_dirty.empty() && min.x <= max.x && min.y <= max.y)
+				markDirty(min, max);
+
 			/* Lookup values from the pre-rasterized filter */
 			for (int x=min.x, idx = 0; x<=max.x; ++x)
 				m_weightsX[idx++] = m_filter->evalDiscretized(x-pos.x);
@@ -214,6 +305,16 @@ public:
 	/// Copy the contents of this image block to another one with the same configuration
 	void copyTo(ImageBlock *copy) const {
 		memcpy(copy->getBitmap()->getUInt8Data(), m_bitmap->getUInt8Data(), m_bitmap->getBufferSize());
+		if (m_variance && copy->m_variance)
+			memcpy(copy->m_variance, m_variance, sizeof(Float) * 3 * m_varianceSize.x * m_varianceSize.y);
+		if (copy->isSparse()) {
+			if (isSparse()) {
+				copy->m_dirty = m_dirty;
+				copy->m_dirtyTiles = m_dirtyTiles;
+			} else {
+				copy->markDirty(Point2i(0), Point2i(m_bitmap->getSize() - Vector2i(1)));
+			}
+		}
 		copy->m_size = m_size;
 		copy->m_offset = m_offset;
 		copy->m_warn = m_warn;
@@ -234,6 +335,32 @@ public:
 protected:
 	/// Virtual destructor
 	virtual ~ImageBlock();
+
+	/// Mark the tiles overlapping the given (inclusive) range of bitmap pixels
+	inline void markDirty(const Point2i &min, const Point2i &max) {
+		for (int ty = min.y / MTS_IMAGEBLOCK_TILE_SIZE; ty <= max.y / MTS_IMAGEBLOCK_TILE_SIZE; ++ty) {
+			for (int tx = min.x / MTS_IMAGEBLOCK_TILE_SIZE; tx <= max.x / MTS_IMAGEBLOCK_TILE_SIZE; ++tx) {
+				uint32_t idx = (uint32_t) (tx + ty * m_tileCount.x);
+				if (!m_dirty[idx]) {
+					m_dirty[idx] = 1;
+					m_dirtyTiles.push_back(idx);
+				}
+			}
+		}
+	}
+
+	/// Return the bitmap region covered by a tile
+	void getTile(uint32_t idx, Point2i &offset, Vector2i &size) const;
+
+	/// Clear the tiles that were written to
+	void clearDirtyTiles();
+
+	/// Accumulate another block, restricted to its dirty tiles if it is sparse
+	void accumulate(const ImageBlock *block, bool atomic);
+
+	/// Accumulate a region of another block's bitmap, which is shifted by \c delta
+	void accumulate(const ImageBlock *block, const Point2i &offset,
+		const Vector2i &size, const Vector2i &delta, bool atomic);
 protected:
 	ref<Bitmap> m_bitmap;
 	Point2i m_offset;
@@ -241,7 +368,13 @@ protected:
 	int m_borderSize;
 	const ReconstructionFilter *m_filter;
 	Float *m_weightsX, *m_weightsY;
+	Float *m_variance;
+	Vector2i m_varianceSize;
 	bool m_warn;
+	/* Tile tracking of sparse blocks */
+	Vector2i m_tileCount;
+	std::vector<uint8_t> m_dirty;
+	std::vector<uint32_t> m_dirtyTiles;
 };
 
 
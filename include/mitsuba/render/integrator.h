@@ -358,6 +358,16 @@ public:
 	 * associated rays in a pixel region is then taken as an approximation
 	 * of that pixel's radiance value. For adaptive strategies, have a look at
 	 * the \c adaptive plugin, which is an extension of this class.
+	 *
+	 * When the \c adaptivePasses parameter is larger than one, the image is
+	 * instead rendered in several passes: after the first pass, each pass
+	 * re-renders the blocks whose relative standard error is above
+	 * \c adaptiveThreshold, with more work going to noisier blocks.
+	 * Rendering stops once all blocks have converged, the number of passes
+	 * is exhausted, or a pass ends after \c adaptiveTimeLimit seconds.
+	 * Otherwise, the render job may request progressive passes and
+	 * checkpoints (see \ref RenderJob::setProgressive()).
+	 * \sa BlockedRenderProcess::setAdaptive()
 	 */
 	bool render(Scene *scene, RenderQueue *queue, const RenderJob *job,
 		int sceneResID, int sensorResID, int samplerResID);
@@ -433,6 +443,9 @@ protected:
 protected:
 	/// Used to temporarily cache a parallel process while it is in operation
 	ref<ParallelProcess> m_process;
+	int m_adaptivePasses;
+	Float m_adaptiveThreshold;
+	Float m_adaptiveTimeLimit;
 };
 
 /*
@@ -0,0 +1,158 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_LIGHTBVH_H_)
+#define __MITSUBA_RENDER_LIGHTBVH_H_
+
+#include <mitsuba/render/emitter.h>
+#include <mitsuba/core/aabb.h>
+#include <mitsuba/core/pmf.h>
+#include <boost/unordered_map.hpp>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Bounding volume hierarchy over the emitters of a scene, which
+ * is used to choose an emitter for direct illumination sampling
+ *
+ * Every node stores the bounding box, the total power, and a cone
+ * bounding the emission directions of the emitters below it. Given a
+ * reference point, each node thus provides a conservative estimate of
+ * the contribution of its emitters. An emitter is chosen by traversing
+ * the hierarchy from the root, randomly descending into one of the two
+ * children with a probability proportional to their estimates. In scenes
+ * with many emitters, this picks nearby emitters that face the reference
+ * point much more often than a distribution that ignores its location.
+ *
+ * The hierarchy is built with the surface area orientation heuristic,
+ * i.e. a surface area heuristic that also accounts for the power and
+ * the spread of emission directions of both sides of a split.
+ *
+ * Emitters without a finite position (e.g. environment and directional
+ * emitters) cannot be bounded and are instead chosen with a fixed
+ * probability according to their sampling weights. Emitters that do not
+ * emit any power are never chosen.
+ *
+ * \sa Scene::setEmitterSampling()
+ * \ingroup librender
+ */
+class MTS_EXPORT_RENDER LightBVH : public Object {
+public:
+	/// Create an empty light hierarchy
+	LightBVH();
+
+	/// Build the hierarchy over the given list of emitters
+	void build(ref_vector<Emitter> &emitters);
+
+	/**
+	 * \brief Choose an emitter for direct illumination sampling at the
+	 * reference point \c p with surface normal \c n
+	 *
+	 * \param n
+	 *    Surface normal at the reference point, or a zero vector if the
+	 *    reference point is located in a participating medium
+	 * \param sampleValue
+	 *    A uniformly distributed sample on [0, 1]. It is re-scaled into a
+	 *    new uniformly distributed sample upon return.
+	 * \param pdf
+	 *    Will be set to the discrete probability of the chosen emitter
+	 * \return
+	 *    The index of the chosen emitter in the list passed to \ref build()
+	 */
+	size_t sampleReuse(const Point &p, const Normal &n,
+			Float &sampleValue, Float &pdf) const;
+
+	/**
+	 * \brief Return the discrete probability of choosing \c emitter with
+	 * \ref sampleReuse() at the reference point \c p with normal \c n
+	 */
+	Float pdf(const Point &p, const Normal &n, const Emitter *emitter) const;
+
+	/// Return the number of nodes
+	inline size_t getNodeCount() const { return m_nodes.size(); }
+
+	/// Return a human-readable string representation
+	std::string toString() const;
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// Bounds of the position, power and emission directions of a set of emitters
+	struct LightBounds {
+		AABB aabb;
+		/// Central emission direction
+		Vector axis;
+		/// Approximate emitted power
+		Float phi;
+		/// Cosine of the spread of the normals around \c axis
+		Float cosThetaO;
+		/// Cosine of the spread of emission around the normals
+		Float cosThetaE;
+
+		inline LightBounds() : phi(0.0f) { }
+
+		/// Merge two sets of bounds
+		void expandBy(const LightBounds &bounds);
+
+		/// Estimate the contribution to a reference point
+		Float importance(const Point &p, const Normal &n) const;
+
+		/// Measure of the bounded emission directions (the "M_Omega" term of the heuristic)
+		Float orientationMeasure() const;
+	};
+
+	struct Node {
+		LightBounds bounds;
+		/// Parent node (or -1 for the root)
+		int32_t parent;
+		/// Index of the second child, or of the emitter for leaf nodes
+		uint32_t index;
+		bool leaf;
+	};
+
+	/// Emitter during construction
+	struct BuildItem {
+		LightBounds bounds;
+		uint32_t emitter;
+	};
+
+	/// Recursively build the hierarchy and return the index of the new node
+	uint32_t buildRecursive(std::vector<BuildItem> &items,
+			size_t start, size_t end, int32_t parent);
+
+	/// Compute the bounds of a finite emitter
+	static LightBounds computeBounds(Emitter *emitter);
+
+	/// Can the emitter be bounded in space?
+	static bool isFinite(const Emitter *emitter);
+
+	/// Virtual destructor
+	virtual ~LightBVH();
+private:
+	typedef boost::unordered_map<const Emitter *, uint32_t> LeafMap;
+
+	std::vector<Node> m_nodes;
+	LeafMap m_leaves;
+	std::vector<uint32_t> m_infiniteEmitters;
+	DiscreteDistribution m_infinitePDF;
+	Float m_infiniteProb;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_LIGHTBVH_H_ */
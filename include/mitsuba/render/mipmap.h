@@ -26,7 +26,12 @@
 #include <mitsuba/core/mmap.h>
 #include <mitsuba/core/timer.h>
 #include <mitsuba/core/statistics.h>
+#include <mitsuba/core/sse.h>
+#include <mitsuba/render/texcache.h>
 #include <boost/filesystem/fstream.hpp>
+#if defined(MTS_SSE) && defined(__F16C__)
+#include <immintrin.h>
+#endif
 
 MTS_NAMESPACE_BEGIN
 
@@ -36,12 +41,18 @@ MTS_NAMESPACE_BEGIN
 /// Look-up table size for a tabulated Gaussian filter
 #define MTS_MIPMAP_LUT_SIZE 64
 
+/// Number of texels per row whose EWA filter weights are computed at once
+#define MTS_MIPMAP_EWA_BATCH 32
+
 /// MIP map cache file version
 #define MTS_MIPMAP_CACHE_VERSION 0x01
 
 /// Make sure that the actual cache contents start on a cache line
 #define MTS_MIPMAP_CACHE_ALIGNMENT 64
 
+/// Tile size (log2) used when paging cached MIP maps through the \ref TextureTileCache
+#define MTS_MIPMAP_TILE_LOG_SIZE 6
+
 /* Some statistics counters */
 namespace stats {
 	extern MTS_EXPORT_RENDER StatsCounter avgEWASamples;
@@ -50,6 +61,49 @@ namespace stats {
 	extern MTS_EXPORT_RENDER StatsCounter filteredLookups;
 };
 
+/**
+ * \brief Scoped lock that serializes the creation and reuse of a MIP map
+ * cache file
+ *
+ * Plugins can be constructed by several scene loader threads at once, and
+ * textures that reference the same image derive the same cache filename.
+ * Holding this lock from the validity check of a cache file until the
+ * \ref TMIPMap has been constructed ensures that only one thread writes a
+ * given cache file, and that no other thread maps it before it is complete.
+ */
+class MTS_EXPORT_RENDER MIPMapCacheLock {
+public:
+	/// Lock the given cache file (does nothing if \c cacheFile is empty)
+	MIPMapCacheLock(const fs::path &cacheFile);
+
+	/// Release the lock
+	~MIPMapCacheLock();
+
+	/**
+	 * \brief Is the given cache file mapped by a \ref TMIPMap of this process?
+	 *
+	 * Such a file must not be overwritten, even if its contents don't match
+	 * the configuration of another MIP map (e.g. a different pixel format).
+	 * Should be called while holding the lock of the file.
+	 */
+	static bool isMapped(const fs::path &cacheFile);
+
+	/// Record that a \ref TMIPMap has mapped the given cache file
+	static void addMapping(const fs::path &cacheFile);
+
+	/// Record that a \ref TMIPMap has released the given cache file
+	static void removeMapping(const fs::path &cacheFile);
+
+	/// Per-file lock state (opaque, defined in texture.cpp)
+	struct Entry;
+private:
+	MIPMapCacheLock(const MIPMapCacheLock &);
+	MIPMapCacheLock &operator=(const MIPMapCacheLock &);
+
+	std::string m_key;
+	Entry *m_entry;
+};
+
 /// Specifies the desired antialiasing filter
 enum EMIPFilterType {
 	/// No filtering, nearest neighbor lookups
@@ -76,6 +130,15 @@ enum EMIPFilterType {
  * Generating good mip maps is costly, and therefore this class provides
  * the means to cache them on disk if desired.
  *
+ * When the \ref TextureTileCache is enabled, MIP maps that are backed by a
+ * memory-mapped cache file don't access the mapped data directly. Instead,
+ * tiles of <tt>2^MTS_MIPMAP_TILE_LOG_SIZE</tt> texels squared are copied
+ * into the shared cache on demand, which bounds the amount of texture
+ * memory that is resident at any time. The cache may also be enabled after
+ * the MIP map was created (e.g. by the \c textureMemory scene parameter).
+ * MIP maps that were generated in memory without a cache file are never
+ * paged, since their pyramid is resident in any case.
+ *
  * \tparam Value
  *    This class can be parameterized to yield MIP map classes for
  *    RGB values, color spectra, or just plain floats. This parameter
@@ -88,7 +151,8 @@ enum EMIPFilterType {
  *
  * \ingroup librender
  */
-template <typename Value, typename QuantizedValue> class TMIPMap : public Object {
+template <typename Value, typename QuantizedValue> class TMIPMap : public Object,
+		public TextureTileCache::TileSource {
 public:
 #if MTS_MIPMAP_BLOCKED == 1
 	/// Use a blocked array to store MIP map data
@@ -165,7 +229,7 @@ public:
 			Float maxValue = 1.0f,
 			Spectrum::EConversionIntent intent = Spectrum::EReflectance)
 		: m_pixelFormat(pixelFormat), m_bcu(bcu), m_bcv(bcv), m_filterType(filterType),
-		  m_weightLut(NULL), m_maxAnisotropy(maxAnisotropy) {
+		  m_weightLut(NULL), m_maxAnisotropy(maxAnisotropy), m_tileCache(NULL) {
 
 		/* Keep track of time */
 		ref<Timer> timer = new Timer();
@@ -196,14 +260,25 @@ public:
 		/* Potentially create a MIP map cache file */
 		uint8_t *mmapData = NULL, *mmapPtr = NULL;
 		if (!cacheFilename.empty()) {
-			Log(EInfo, "Generating MIP map cache file \"%s\" ..", cacheFilename.string().c_str());
-			try {
-				m_mmap = new MemoryMappedFile(cacheFilename, cacheSize);
-			} catch (std::runtime_error &e) {
-				Log(EWarn, "Unable to create MIP map cache file \"%s\" -- "
-					"retrying with a temporary file. Error message was: %s",
-					cacheFilename.string().c_str(), e.what());
+			if (MIPMapCacheLock::isMapped(cacheFilename)) {
+				/* Another MIP map with a different configuration uses this
+				   cache file -- don't overwrite it while it is mapped */
+				Log(EWarn, "MIP map cache file \"%s\" is in use by another texture "
+					"with a different configuration -- using a temporary file instead.",
+					cacheFilename.string().c_str());
 				m_mmap = MemoryMappedFile::createTemporary(cacheSize);
+			} else {
+				Log(EInfo, "Generating MIP map cache file \"%s\" ..", cacheFilename.string().c_str());
+				try {
+					m_mmap = new MemoryMappedFile(cacheFilename, cacheSize);
+					m_cacheFilename = cacheFilename;
+					MIPMapCacheLock::addMapping(m_cacheFilename);
+				} catch (std::runtime_error &e) {
+					Log(EWarn, "Unable to create MIP map cache file \"%s\" -- "
+						"retrying with a temporary file. Error message was: %s",
+						cacheFilename.string().c_str(), e.what());
+					m_mmap = MemoryMappedFile::createTemporary(cacheSize);
+				}
 			}
 			mmapData = mmapPtr = (uint8_t *) m_mmap->getData();
 		}
@@ -293,6 +368,9 @@ public:
 		Log(EDebug, "Created %s of MIP maps in %i ms", memString(
 			getBufferSize()).c_str(), timer->getMilliseconds());
 
+		if (m_mmap)
+			initializeTileCache();
+
 		if (m_filterType == EEWA) {
 			m_weightLut = static_cast<Float *>(allocAligned(sizeof(Float) * MTS_MIPMAP_LUT_SIZE));
 			for (int i=0; i<MTS_MIPMAP_LUT_SIZE; ++i) {
@@ -317,8 +395,10 @@ public:
 	 *    cache file that was previously created.
 	 */
 	TMIPMap(fs::path cacheFilename, Float maxAnisotropy = 20.0f)
-			: m_weightLut(NULL), m_maxAnisotropy(maxAnisotropy) {
+			: m_weightLut(NULL), m_maxAnisotropy(maxAnisotropy), m_tileCache(NULL) {
 		m_mmap = new MemoryMappedFile(cacheFilename);
+		m_cacheFilename = cacheFilename;
+		MIPMapCacheLock::addMapping(m_cacheFilename);
 		uint8_t *mmapPtr = (uint8_t *) m_mmap->getData();
 		Log(EInfo, "Mapped MIP map cache file \"%s\" into memory (%s).", cacheFilename.string().c_str(),
 			memString(m_mmap->getSize()).c_str());
@@ -368,6 +448,8 @@ public:
 			Assert(level == m_levels);
 		}
 
+		initializeTileCache();
+
 		if (m_filterType == EEWA) {
 			m_weightLut = static_cast<Float *>(allocAligned(sizeof(Float) * MTS_MIPMAP_LUT_SIZE));
 			for (int i=0; i<MTS_MIPMAP_LUT_SIZE; ++i) {
@@ -379,6 +461,10 @@ public:
 
 	/// Release all memory
 	~TMIPMap() {
+		if (m_tileCache)
+			m_tileCache->unregisterSource(m_tileSourceID);
+		if (!m_cacheFilename.empty())
+			MIPMapCacheLock::removeMapping(m_cacheFilename);
 		delete[] m_pyramid;
 		delete[] m_sizeRatio;
 		if (m_weightLut)
@@ -559,6 +645,14 @@ public:
 			}
 		}
 
+		if (EXPECT_NOT_TAKEN(isTiled())) {
+			const QuantizedValue *tile = static_cast<const QuantizedValue *>(
+				m_tileCache->lookup(m_tileSourceID, level,
+					x >> MTS_MIPMAP_TILE_LOG_SIZE, y >> MTS_MIPMAP_TILE_LOG_SIZE));
+			const int mask = (1 << MTS_MIPMAP_TILE_LOG_SIZE) - 1;
+			return Value(tile[((y & mask) << MTS_MIPMAP_TILE_LOG_SIZE) + (x & mask)]);
+		}
+
 		return Value(m_pyramid[level](x, y));
 	}
 
@@ -589,6 +683,16 @@ public:
 		Float dx1 = u - xPos, dx2 = 1.0f - dx1,
 		      dy1 = v - yPos, dy2 = 1.0f - dy1;
 
+		if (EXPECT_TAKEN(!isTiled() && xPos >= 0 && yPos >= 0
+				&& xPos + 1 < size.x && yPos + 1 < size.y)) {
+			/* Interior lookup, no need to handle boundary conditions */
+			const Array2DType &array = m_pyramid[level];
+			return (Value(array(xPos, yPos)) * dx2
+			      + Value(array(xPos + 1, yPos)) * dx1) * dy2
+			     + (Value(array(xPos, yPos + 1)) * dx2
+			      + Value(array(xPos + 1, yPos + 1)) * dx1) * dy1;
+		}
+
 		return evalTexel(level, xPos, yPos) * dx2 * dy2
 		     + evalTexel(level, xPos, yPos + 1) * dx2 * dy1
 		     + evalTexel(level, xPos + 1, yPos) * dx1 * dy2
@@ -722,6 +826,7 @@ public:
 			<< "   size = " << memString(getBufferSize()) << "," << endl
 			<< "   levels = " << m_levels << "," << endl
 			<< "   cached = " << (m_mmap.get() ? "yes" : "no") << "," << endl
+			<< "   tiled = " << (isTiled() ? "yes" : "no") << "," << endl
 			<< "   filterType = ";
 
 		switch (m_filterType) {
@@ -760,6 +865,196 @@ protected:
 	};
 
 
+	/**
+	 * \brief Register the memory-mapped MIP map with the texture tile cache
+	 *
+	 * Tiles are only paged through the cache while it is enabled,
+	 * see \ref isTiled().
+	 */
+	void initializeTileCache() {
+		TextureTileCache *cache = TextureTileCache::getInstance();
+		const size_t tileSize = (size_t) 1 << MTS_MIPMAP_TILE_LOG_SIZE;
+		m_tileSourceID = cache->registerSource(this,
+			tileSize * tileSize * sizeof(QuantizedValue));
+		m_tileCache = cache;
+	}
+
+	/// Are lookups currently paged through the texture tile cache?
+	inline bool isTiled() const {
+		return m_tileCache != NULL && m_tileCache->isEnabled();
+	}
+
+	/// Copy a tile from the memory-mapped pyramid (used by \ref TextureTileCache)
+	void loadTile(int level, int x, int y, void *target_) const {
+		const Array2DType &array = m_pyramid[level];
+		const int tileSize = 1 << MTS_MIPMAP_TILE_LOG_SIZE;
+		QuantizedValue *target = static_cast<QuantizedValue *>(target_);
+		int x0 = x * tileSize, y0 = y * tileSize,
+		    width = std::min(tileSize, array.getWidth() - x0),
+		    height = std::min(tileSize, array.getHeight() - y0);
+
+		for (int yt=0; yt<height; ++yt) {
+			QuantizedValue *row = target + yt * tileSize;
+			for (int xt=0; xt<width; ++xt)
+				row[xt] = array(x0 + xt, y0 + yt);
+		}
+	}
+
+	/**
+	 * \brief Compute the Gaussian filter weights of \c count consecutive
+	 * texels on a row of an EWA lookup
+	 *
+	 * \param uu0
+	 *    Horizontal offset of the first texel from the lookup position
+	 * \param vv
+	 *    Vertical offset of the row from the lookup position
+	 * \param weights
+	 *    Output array, which must have room for \c count values rounded
+	 *    up to the next multiple of four. Texels outside of the ellipse
+	 *    receive a weight of zero.
+	 * \return The number of texels inside the ellipse
+	 */
+	inline int computeEWAWeights(Float uu0, Float vv, Float As, Float Bs,
+			Float Cs, int count, Float *weights) const {
+		int nSamples = 0;
+#if defined(MTS_SSE)
+		const __m128 lutSize = _mm_set1_ps((float) MTS_MIPMAP_LUT_SIZE),
+		             four    = _mm_set1_ps(4.0f),
+		             as      = _mm_set1_ps(As),
+		             bvv     = _mm_set1_ps(Bs*vv),
+		             cvv2    = _mm_set1_ps(Cs*vv*vv);
+		__m128 uu = _mm_add_ps(_mm_set1_ps(uu0), _mm_set_ps(3, 2, 1, 0));
+		MM_ALIGN16 int32_t index[4];
+
+		for (int i=0; i<count; i += 4) {
+			/* Evaluate the quadratic form for four texels at once */
+			__m128 q = _mm_add_ps(_mm_mul_ps(_mm_add_ps(
+				_mm_mul_ps(as, uu), bvv), uu), cvv2);
+			q = _mm_max_ps(q, _mm_setzero_ps());
+			int mask = _mm_movemask_ps(_mm_cmplt_ps(q, lutSize));
+			if (i + 4 > count)
+				mask &= (1 << (count - i)) - 1;
+			_mm_store_si128((__m128i *) index, _mm_cvttps_epi32(q));
+
+			for (int j=0; j<4; ++j) {
+				if (mask & (1 << j)) {
+					weights[i+j] = m_weightLut[index[j]];
+					++nSamples;
+				} else {
+					weights[i+j] = 0.0f;
+				}
+			}
+			uu = _mm_add_ps(uu, four);
+		}
+#else
+		for (int i=0; i<count; ++i) {
+			Float uu = uu0 + i,
+			      q = (As*uu + Bs*vv)*uu + Cs*vv*vv;
+			if (q < (Float) MTS_MIPMAP_LUT_SIZE) {
+				weights[i] = m_weightLut[(int) std::max(q, (Float) 0.0f)];
+				++nSamples;
+			} else {
+				weights[i] = 0.0f;
+			}
+		}
+#endif
+		return nSamples;
+	}
+
+#if defined(MTS_SSE)
+	/// Convert gathered texel components to single precision
+	static inline void toSinglePrecision(const float *in, float *out, int count) {
+		memcpy(out, in, sizeof(float) * count);
+	}
+
+	/// Convert gathered half precision texel components to single precision
+	static inline void toSinglePrecision(const half *in, float *out, int count) {
+#if defined(__F16C__)
+		for (int i=0; i<count; i += 4)
+			_mm_store_ps(out + i, _mm_cvtph_ps(
+				_mm_loadl_epi64((const __m128i *) (in + i))));
+#else
+		/* Uses the lookup table of the half type */
+		for (int i=0; i<count; ++i)
+			out[i] = (float) in[i];
+#endif
+	}
+
+	/**
+	 * \brief Accumulates the texels of an EWA lookup whose footprint lies
+	 * in the interior of the MIP map level
+	 *
+	 * The texels of a row span with a nonzero weight are gathered into one
+	 * array per channel, converted to single precision in bulk (using F16C
+	 * for half precision data when the compiler targets it), and multiplied
+	 * by their weights four at a time.
+	 */
+	struct EWAAccumulator {
+		typedef typename QuantizedValue::Scalar QuantizedScalar;
+
+		__m128 sum[Value::dim];
+		__m128 weightSum;
+
+		inline EWAAccumulator() {
+			for (int c=0; c<Value::dim; ++c)
+				sum[c] = _mm_setzero_ps();
+			weightSum = _mm_setzero_ps();
+		}
+
+		/// Add \c count texels starting at <tt>(ut, vt)</tt>
+		inline void addSpan(const Array2DType &array, int ut, int vt,
+				int count, const Float *weights) {
+			MM_ALIGN16 QuantizedScalar texels[Value::dim][MTS_MIPMAP_EWA_BATCH];
+			MM_ALIGN16 float packedWeights[MTS_MIPMAP_EWA_BATCH];
+			MM_ALIGN16 float values[MTS_MIPMAP_EWA_BATCH];
+
+			int n = 0;
+			for (int i=0; i<count; ++i) {
+				if (weights[i] == 0)
+					continue;
+				const QuantizedValue &texel = array(ut + i, vt);
+				for (int c=0; c<Value::dim; ++c)
+					texels[c][n] = texel[c];
+				packedWeights[n++] = weights[i];
+			}
+			if (n == 0)
+				return;
+
+			/* Pad to a multiple of four (MTS_MIPMAP_EWA_BATCH is one as well) */
+			for (; n & 3; ++n) {
+				for (int c=0; c<Value::dim; ++c)
+					texels[c][n] = QuantizedScalar(0.0f);
+				packedWeights[n] = 0.0f;
+			}
+
+			for (int i=0; i<n; i += 4)
+				weightSum = _mm_add_ps(weightSum, _mm_load_ps(packedWeights + i));
+
+			for (int c=0; c<Value::dim; ++c) {
+				toSinglePrecision(texels[c], values, n);
+				__m128 channelSum = sum[c];
+				for (int i=0; i<n; i += 4)
+					channelSum = _mm_add_ps(channelSum, _mm_mul_ps(
+						_mm_load_ps(values + i), _mm_load_ps(packedWeights + i)));
+				sum[c] = channelSum;
+			}
+		}
+
+		/// Return the weighted sum of all texels and the sum of their weights
+		inline void finish(Value &result, Float &denominator) const {
+			for (int c=0; c<Value::dim; ++c)
+				result[c] = horizontalSum(sum[c]);
+			denominator = horizontalSum(weightSum);
+		}
+
+		static inline float horizontalSum(__m128 value) {
+			MM_ALIGN16 float tmp[4];
+			_mm_store_ps(tmp, value);
+			return (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+		}
+	};
+#endif
+
 	/// Calculate the elliptically weighted average of a sample and associated Jacobian
 	Value evalEWA(int level, const Point2 &uv, Float A, Float B, Float C) const {
 		Assert(A > 0);
@@ -794,33 +1089,71 @@ protected:
 		      Bs = B * MTS_MIPMAP_LUT_SIZE,
 		      Cs = C * MTS_MIPMAP_LUT_SIZE;
 
+		/* When the bounding box doesn't touch the boundary, texels can
+		   be fetched without going through evalTexel() */
+		const Array2DType &array = m_pyramid[level];
+		bool interior = !isTiled() && u0 >= 0 && v0 >= 0
+			&& u1 < size.x && v1 < size.y;
+
 		Value result(0.0f);
 		Float denominator = 0.0f;
-		Float ddq = 2*As, uu0 = (Float) u0 - u;
+		Float invTwoAs = 0.5f / As;
+		MM_ALIGN16 Float weights[MTS_MIPMAP_EWA_BATCH];
 		int nSamples = 0;
+#if defined(MTS_SSE)
+		EWAAccumulator accumulator;
+#endif
 
 		for (int vt = v0; vt <= v1; ++vt) {
 			const Float vv = (Float) vt - v;
 
-			Float q  = As*uu0*uu0 + (Bs*uu0 + Cs*vv)*vv;
-			Float dq = As*(2*uu0 + 1) + Bs*vv;
-
-			for (int ut = u0; ut <= u1; ++ut) {
-				if (q < (Float) MTS_MIPMAP_LUT_SIZE) {
-					uint32_t qi = (uint32_t) q;
-					if (qi < MTS_MIPMAP_LUT_SIZE) {
-						const Float weight = m_weightLut[(int) q];
-						result += evalTexel(level, ut, vt) * weight;
-						denominator += weight;
-						++nSamples;
+			/* Only visit the part of the row that is covered by the ellipse,
+			   i.e. where As*uu^2 + Bs*uu*vv + Cs*vv^2 < MTS_MIPMAP_LUT_SIZE.
+			   For elongated ellipses, most of the bounding box is empty. The
+			   span is conservatively rounded outwards, and the weight
+			   computation below takes care of the exact test. */
+			Float b = Bs*vv, c = Cs*vv*vv - (Float) MTS_MIPMAP_LUT_SIZE,
+			      discrim = b*b - 4*As*c;
+			if (discrim <= 0)
+				continue;
+			Float sqrtDiscrim = std::sqrt(discrim);
+			int start = std::max(u0, math::floorToInt(u + (-b - sqrtDiscrim) * invTwoAs)),
+			    end   = std::min(u1, math::ceilToInt(u + (-b + sqrtDiscrim) * invTwoAs));
+
+			for (int ut = start; ut <= end; ut += MTS_MIPMAP_EWA_BATCH) {
+				int count = std::min(end - ut + 1, MTS_MIPMAP_EWA_BATCH);
+				nSamples += computeEWAWeights((Float) ut - u, vv,
+					As, Bs, Cs, count, weights);
+
+				if (interior) {
+#if defined(MTS_SSE)
+					accumulator.addSpan(array, ut, vt, count, weights);
+#else
+					for (int i=0; i<count; ++i) {
+						const Float weight = weights[i];
+						if (weight != 0) {
+							result += Value(array(ut + i, vt)) * weight;
+							denominator += weight;
+						}
+					}
+#endif
+				} else {
+					for (int i=0; i<count; ++i) {
+						const Float weight = weights[i];
+						if (weight != 0) {
+							result += evalTexel(level, ut + i, vt) * weight;
+							denominator += weight;
+						}
 					}
 				}
-
-				q += dq;
-				dq += ddq;
 			}
 		}
 
+#if defined(MTS_SSE)
+		if (interior)
+			accumulator.finish(result, denominator);
+#endif
+
 		if (denominator == 0) {
 			/* The filter did not cover any samples..
 			   Revert to bilinear interpolation */
@@ -834,11 +1167,14 @@ protected:
 	}
 private:
 	ref<MemoryMappedFile> m_mmap;
+	fs::path m_cacheFilename;
 	Bitmap::EPixelFormat m_pixelFormat;
 	EBoundaryCondition m_bcu, m_bcv;
 	EMIPFilterType m_filterType;
 	Float *m_weightLut;
 	Float m_maxAnisotropy;
+	TextureTileCache *m_tileCache;
+	uint32_t m_tileSourceID;
 	Vector2 *m_sizeRatio;
 	Array2DType *m_pyramid;
 	int m_levels;
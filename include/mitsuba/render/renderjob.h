@@ -95,6 +95,52 @@ public:
 	/// Define whether or not this is an interactive job
 	inline void setInteractive(bool interactive) { m_interactive = interactive; }
 
+	/**
+	 * \brief Render progressively in several passes
+	 *
+	 * Every pass renders the whole image with the sample count of the
+	 * sampler. This is only supported by sampling-based integrators.
+	 *
+	 * \param passes
+	 *     Number of passes (the default of one disables progressive rendering)
+	 * \param timeLimit
+	 *     When positive, stop issuing new work after this many seconds
+	 * \sa BlockedRenderProcess::setProgressive()
+	 */
+	inline void setProgressive(int passes, Float timeLimit = 0) {
+		m_progressivePasses = passes;
+		m_timeLimit = timeLimit;
+	}
+
+	/// Return the number of progressive passes
+	inline int getProgressivePasses() const { return m_progressivePasses; }
+
+	/// Return the time limit of progressive rendering (or zero)
+	inline Float getTimeLimit() const { return m_timeLimit; }
+
+	/**
+	 * \brief Save checkpoints of the film to the given file every
+	 * \c interval seconds (at the end of a pass)
+	 *
+	 * When \c resume is set and the file exists, rendering continues
+	 * from the stored state. An empty filename disables checkpoints.
+	 * \sa BlockedRenderProcess::setCheckpoint()
+	 */
+	inline void setCheckpoint(const fs::path &filename, Float interval, bool resume) {
+		m_checkpointFile = filename;
+		m_checkpointInterval = interval;
+		m_resume = resume;
+	}
+
+	/// Return the checkpoint filename (or an empty path)
+	inline const fs::path &getCheckpointFile() const { return m_checkpointFile; }
+
+	/// Return the minimum time between two checkpoints in seconds
+	inline Float getCheckpointInterval() const { return m_checkpointInterval; }
+
+	/// Resume from an existing checkpoint file?
+	inline bool getResume() const { return m_resume; }
+
 	/// Get a pointer to the underlying scene
 	inline Scene *getScene() { return m_scene.get(); }
 
@@ -125,6 +171,11 @@ private:
 	bool m_ownsSamplerResource;
 	bool m_cancelled;
 	bool m_interactive;
+	int m_progressivePasses;
+	Float m_timeLimit;
+	fs::path m_checkpointFile;
+	Float m_checkpointInterval;
+	bool m_resume;
 };
 
 MTS_NAMESPACE_END
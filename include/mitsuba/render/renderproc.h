@@ -23,6 +23,7 @@
 #include <mitsuba/render/scene.h>
 #include <mitsuba/render/imageproc.h>
 #include <mitsuba/render/renderqueue.h>
+#include <mitsuba/core/timer.h>
 
 MTS_NAMESPACE_BEGIN
 
@@ -32,6 +33,15 @@ MTS_NAMESPACE_BEGIN
  * Splits an image into independent rectangular pixel regions, which are
  * then rendered in parallel.
  *
+ * Optionally, rendering can continue in several passes after every block
+ * was rendered once. Progressive passes (see \ref setProgressive()) render
+ * every block again, while adaptive passes (see \ref setAdaptive())
+ * distribute another round of work units over the blocks in proportion to
+ * their estimated error, so that blocks that have converged receive no
+ * further samples. Since the film accumulates all samples along with their
+ * filter weights, its state after each pass can be saved to disk and later
+ * restored to resume an interrupted rendering (see \ref setCheckpoint()).
+ *
  * \sa SamplingIntegrator
  * \ingroup librender
  */
@@ -62,6 +72,82 @@ public:
 	void setPixelFormat(Bitmap::EPixelFormat pixelFormat,
 		int channelCount = -1, bool warnInvalid = false);
 
+	/**
+	 * \brief Enable adaptive multi-pass rendering
+	 *
+	 * The first pass renders every block once. Afterwards, the relative
+	 * standard error of each pixel is estimated from the luminance of its
+	 * samples, and the errors are averaged (in the RMS sense) over every
+	 * block. Each further pass then issues as many work units as there
+	 * are blocks, which are assigned to the blocks in proportion to their
+	 * error. A block may thus be rendered several times within one pass,
+	 * each time with the sample count of the sampler.
+	 *
+	 * Estimating the error requires a sampler that generates different
+	 * samples every time that a pixel is rendered (e.g. \c independent,
+	 * \c stratified or \c ldsampler).
+	 *
+	 * \param maxPasses
+	 *    Maximum number of passes, including the first one. A value
+	 *    of one disables adaptive rendering (the default).
+	 * \param errorThreshold
+	 *    Blocks whose error is below this value are considered converged.
+	 *    Rendering stops when all blocks have converged.
+	 * \param timeLimit
+	 *    When positive, no further pass is started after this many
+	 *    seconds have elapsed. The pass that is running at that point
+	 *    (at least the first one) is completed, so that it can be
+	 *    included in the final checkpoint.
+	 */
+	void setAdaptive(int maxPasses, Float errorThreshold, Float timeLimit = 0);
+
+	/**
+	 * \brief Enable progressive multi-pass rendering
+	 *
+	 * Every pass renders all blocks once with the sample count of the
+	 * sampler, and the film averages the passes. Like adaptive rendering,
+	 * this requires a sampler that generates different samples every time
+	 * that a pixel is rendered.
+	 *
+	 * \param maxPasses
+	 *    Number of passes, including the first one
+	 * \param timeLimit
+	 *    When positive, no further pass is started after this many
+	 *    seconds have elapsed. The pass that is running at that point
+	 *    (at least the first one) is completed, so that it can be
+	 *    included in the final checkpoint.
+	 */
+	void setProgressive(int maxPasses, Float timeLimit = 0);
+
+	/**
+	 * \brief Periodically save the rendering state to a checkpoint file
+	 *
+	 * Whenever a pass completes and at least \c interval seconds have
+	 * passed since the last checkpoint (as well as after the final pass),
+	 * the accumulated film contents are written to \c filename along with
+	 * the number of finished passes, the elapsed time and the adaptive
+	 * error estimates. The file is replaced atomically, hence a process
+	 * that is killed while writing it leaves the previous checkpoint
+	 * intact. Requires progressive or adaptive rendering, and a film that
+	 * supports checkpoints (e.g. \c hdrfilm or \c ldrfilm).
+	 *
+	 * \param resume
+	 *    If \c filename exists, restore its state and continue with the
+	 *    remaining passes. The time limit accounts for the time spent
+	 *    before the interruption, and the samplers are re-seeded so that
+	 *    the new samples are independent of the restored ones.
+	 */
+	void setCheckpoint(const fs::path &filename, Float interval, bool resume);
+
+	/// Is adaptive multi-pass rendering enabled?
+	inline bool isAdaptive() const { return m_adaptive; }
+
+	/// Is progressive or adaptive multi-pass rendering enabled?
+	inline bool isMultiPass() const { return m_maxPasses > 1; }
+
+	/// Return the number of started passes
+	inline int getPassCount() const { return m_pass + 1; }
+
 	// ======================================================================
 	//! @{ \name Implementation of the ParallelProcess interface
 	// ======================================================================
@@ -78,6 +164,23 @@ public:
 protected:
 	/// Virtual destructor
 	virtual ~BlockedRenderProcess();
+
+	/**
+	 * \brief Choose the blocks rendered in the next adaptive pass
+	 * based on the current error estimates
+	 *
+	 * Leaves \c m_passBlocks empty when rendering should stop.
+	 */
+	void planPass();
+
+	/// Return the render time including the time before a resumed checkpoint
+	Float getElapsedTime() const;
+
+	/// Write a checkpoint of the state after \c passes finished passes
+	void saveCheckpoint(int passes);
+
+	/// Restore the state from the checkpoint file
+	void loadCheckpoint();
 protected:
 	ref<RenderQueue> m_queue;
 	ref<Scene> m_scene;
@@ -90,6 +193,27 @@ protected:
 	Bitmap::EPixelFormat m_pixelFormat;
 	int m_channelCount;
 	bool m_warnInvalid;
+
+	/* Multi-pass rendering */
+	bool m_adaptive;
+	int m_maxPasses, m_pass;
+	Float m_errorThreshold, m_timeLimit;
+	ref<Timer> m_timer;
+	std::vector<int> m_passBlocks;
+	size_t m_passPosition;
+	int m_outstanding;
+	bool m_paused;
+	/// Have all blocks of the current pass been handed out (and the pass not finished yet)?
+	bool m_passIssued;
+	/// Sample count, luminance sum and sum of squares for every pixel
+	std::vector<Float> m_variance;
+
+	/* Checkpointing */
+	fs::path m_checkpointFile;
+	Float m_checkpointInterval, m_lastCheckpoint, m_timeOffset;
+	int m_checkpointPasses;
+	bool m_resume;
+	uint64_t m_seed;
 };
 
 MTS_NAMESPACE_END
@@ -114,6 +114,7 @@ public:
 	using Parent::m_nodes;
 	using Parent::m_aabb;
 	using Parent::m_indices;
+	using Parent::nextPrimitive;
 
 protected:
 	void buildInternal() {
@@ -169,6 +170,51 @@ protected:
 		Point p;
 	};
 
+	/**
+	 * \brief Intersect a ray against all primitives of a leaf node
+	 *
+	 * This is called by \ref rayIntersectHavran() for every visited leaf.
+	 * The default implementation tests one primitive at a time using
+	 * \c intersect(). Subclasses may shadow this function to test several
+	 * primitives of a leaf at once.
+	 *
+	 * \return \c true if an intersection was found. In this case, \a maxt
+	 * and \a t are set to the distance of the closest intersection.
+	 */
+	template<bool shadowRay> FINLINE bool intersectLeaf(const KDNode *node,
+			const Ray &ray, Float mint, Float &maxt, Float &t, void *temp,
+			HashedMailbox &mailbox) const {
+		bool foundIntersection = false;
+		IndexType primIdx = 0;
+		for (IndexType entry=node->getPrimStart(),
+				last = node->getPrimEnd(); entry != last; ) {
+			primIdx = nextPrimitive(entry, primIdx);
+
+			#if defined(MTS_KD_MAILBOX_ENABLED)
+			if (mailbox.contains(primIdx))
+				continue;
+			#endif
+
+			bool result;
+			if (!shadowRay)
+				result = cast()->intersect(ray, primIdx, mint, maxt, t, temp);
+			else
+				result = cast()->intersect(ray, primIdx, mint, maxt);
+
+			if (result) {
+				if (shadowRay)
+					return true;
+				maxt = t;
+				foundIntersection = true;
+			}
+
+			#if defined(MTS_KD_MAILBOX_ENABLED)
+			mailbox.put(primIdx);
+			#endif
+		}
+		return foundIntersection;
+	}
+
 	/**
 	 * \brief Ray tracing kd-tree traversal loop (Havran variant)
 	 *
@@ -184,9 +230,7 @@ protected:
 		static const int nextAxisTable[] = { 1, 2, 0 };
 		#endif
 
-		#if defined(MTS_KD_MAILBOX_ENABLED)
 		HashedMailbox mailbox;
-		#endif
 
 		/* Set up the entry point */
 		uint32_t enPt = 0;
@@ -268,31 +312,11 @@ protected:
 			}
 
 			/* Reached a leaf node */
-			for (IndexType entry=currNode->getPrimStart(),
-					last = currNode->getPrimEnd(); entry != last; entry++) {
-				const IndexType primIdx = m_indices[entry];
-
-				#if defined(MTS_KD_MAILBOX_ENABLED)
-				if (mailbox.contains(primIdx))
-					continue;
-				#endif
-
-				bool result;
-				if (!shadowRay)
-					result = cast()->intersect(ray, primIdx, mint, maxt, t, temp);
-				else
-					result = cast()->intersect(ray, primIdx, mint, maxt);
-
-				if (result) {
-					if (shadowRay)
-						return true;
-					maxt = t;
-					foundIntersection = true;
-				}
-
-				#if defined(MTS_KD_MAILBOX_ENABLED)
-				mailbox.put(primIdx);
-				#endif
+			if (cast()->template intersectLeaf<shadowRay>(currNode,
+					ray, mint, maxt, t, temp, mailbox)) {
+				if (shadowRay)
+					return true;
+				foundIntersection = true;
 			}
 
 			if (stack[exPt].t > maxt)
@@ -402,9 +426,10 @@ protected:
 			}
 
 			/* Reached a leaf node */
-			for (unsigned int entry=currNode->getPrimStart(),
-					last = currNode->getPrimEnd(); entry != last; entry++) {
-				const IndexType primIdx = m_indices[entry];
+			IndexType primIdx = 0;
+			for (IndexType entry=currNode->getPrimStart(),
+					last = currNode->getPrimEnd(); entry != last; ) {
+				primIdx = nextPrimitive(entry, primIdx);
 
 				++numIntersections;
 				bool result = cast()->intersect(ray, primIdx, mint, maxt, t, temp);
@@ -468,9 +493,10 @@ protected:
 					maxt = tPlane;
 				}
 			} else {
-				for (unsigned int entry=node->getPrimStart(),
-						last = node->getPrimEnd(); entry != last; entry++) {
-					const IndexType primIdx = m_indices[entry];
+				IndexType primIdx = 0;
+				for (IndexType entry=node->getPrimStart(),
+						last = node->getPrimEnd(); entry != last; ) {
+					primIdx = nextPrimitive(entry, primIdx);
 
 					bool result;
 					if (!shadowRay)
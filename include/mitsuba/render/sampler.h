@@ -76,6 +76,16 @@ public:
 	 */
 	virtual ref<Sampler> clone();
 
+	/**
+	 * \brief Re-seed the underlying pseudorandom generator
+	 *
+	 * This is used when resuming an interrupted rendering, whose sampler
+	 * instances would otherwise repeat the samples that were already
+	 * taken. The default implementation does nothing, which is the right
+	 * behavior for deterministic sample generators.
+	 */
+	virtual void setSeed(uint64_t seed);
+
 	/**
 	 * \brief Set the film size in pixels
 	 *
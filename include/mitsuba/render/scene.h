@@ -25,6 +25,8 @@
 #include <mitsuba/core/aabb.h>
 #include <mitsuba/render/trimesh.h>
 #include <mitsuba/render/skdtree.h>
+#include <mitsuba/render/shapebvh.h>
+#include <mitsuba/render/lightbvh.h>
 #include <mitsuba/render/sensor.h>
 #include <mitsuba/render/integrator.h>
 #include <mitsuba/render/bsdf.h>
@@ -48,6 +50,33 @@ MTS_NAMESPACE_BEGIN
  */
 class MTS_EXPORT_RENDER Scene : public NetworkedObject {
 public:
+	/// Available ray tracing acceleration data structures
+	enum EAccelerator {
+		/// SAH kd-tree (\ref ShapeKDTree, the default)
+		EKDTree = 0,
+
+		/// Four-wide BVH with compressed nodes (\ref ShapeBVH)
+		EBVH,
+
+		/**
+		 * BVH with a separate top level over the geometry instances
+		 * (see \ref ShapeBVH::setTwoLevel())
+		 */
+		ETwoLevel
+	};
+
+	/// Available strategies for choosing an emitter in <tt>sampleEmitterDirect()</tt>
+	enum EEmitterSampling {
+		/// Proportional to the emitters' sampling weights (the default)
+		EEmitterWeights = 0,
+
+		/**
+		 * Proportional to the estimated contribution to the reference
+		 * point, using a hierarchy over the emitters (\ref LightBVH)
+		 */
+		ELightBVH
+	};
+
 	// =============================================================
 	//! @{ \name Initialization and rendering
 	// =============================================================
@@ -80,6 +109,36 @@ public:
 	 */
 	void invalidate();
 
+	/**
+	 * \brief Update the acceleration data structure after shapes
+	 * have been deformed or moved
+	 *
+	 * This is meant for animations, where the vertex positions of meshes
+	 * change from frame to frame (see \ref TriMesh::updateVertexPositions())
+	 * and the scene is re-rendered without being reloaded. The BVH is
+	 * refitted and only rebuilt once the refitted hierarchy has become
+	 * too inefficient (see \ref ShapeBVH::setRebuildThreshold()), whereas
+	 * the kd-tree is always rebuilt from scratch. The emitter sampling
+	 * distribution and the light BVH are recomputed as well.
+	 *
+	 * The set of shapes must stay the same -- use \ref invalidate()
+	 * when adding geometry. This function must not be called while
+	 * rendering.
+	 */
+	void updateGeometry();
+
+	/**
+	 * \brief Update the acceleration data structure after the
+	 * transformations of geometry instances have changed
+	 *
+	 * With the two-level accelerator (\ref ETwoLevel), only the top-level
+	 * BVH over the instance bounds is rebuilt, which is much cheaper than
+	 * \ref updateGeometry(). Otherwise, this is equivalent to
+	 * \ref updateGeometry(). This function must not be called while
+	 * rendering.
+	 */
+	void updateInstances();
+
 	/**
 	 * \brief Initialize the scene for bidirectional rendering algorithms.
 	 *
@@ -185,6 +244,8 @@ public:
 	 * \return \c true if an intersection was found
 	 */
 	inline bool rayIntersect(const Ray &ray, Intersection &its) const {
+		if (EXPECT_NOT_TAKEN(m_bvh.get() != NULL))
+			return m_bvh->rayIntersect(ray, its);
 		return m_kdtree->rayIntersect(ray, its);
 	}
 
@@ -219,6 +280,8 @@ public:
 	 */
 	inline bool rayIntersect(const Ray &ray, Float &t,
 			ConstShapePtr &shape, Normal &n, Point2 &uv) const {
+		if (EXPECT_NOT_TAKEN(m_bvh.get() != NULL))
+			return m_bvh->rayIntersect(ray, t, shape, n, uv);
 		return m_kdtree->rayIntersect(ray, t, shape, n, uv);
 	}
 
@@ -239,9 +302,66 @@ public:
 	 * \return \c true if an intersection was found
 	 */
 	inline bool rayIntersect(const Ray &ray) const {
+		if (EXPECT_NOT_TAKEN(m_bvh.get() != NULL))
+			return m_bvh->rayIntersect(ray);
 		return m_kdtree->rayIntersect(ray);
 	}
 
+	/**
+	 * \brief Intersect a batch of rays against all primitives stored in
+	 * the scene and return detailed intersection information
+	 *
+	 * This is functionally equivalent to calling the single-ray version
+	 * for each element, but it allows the kd-tree to trace the rays as
+	 * SIMD packets. Batches of related rays (e.g. the shading samples
+	 * taken at one surface position) benefit the most.
+	 *
+	 * \param rays
+	 *    An array of \c count rays
+	 *
+	 * \param count
+	 *    The number of rays in the batch
+	 *
+	 * \param its
+	 *    An array of \c count intersection records, which will be
+	 *    filled by the intersection query
+	 *
+	 * \param found
+	 *    An array of \c count entries, which will be set to \c true
+	 *    for every ray that intersected a primitive
+	 */
+	inline void rayIntersect(const Ray *rays, size_t count,
+			Intersection *its, bool *found) const {
+		if (EXPECT_NOT_TAKEN(m_bvh.get() != NULL))
+			m_bvh->rayIntersect(rays, count, its, found);
+		else
+			m_kdtree->rayIntersect(rays, count, its, found);
+	}
+
+	/**
+	 * \brief Test a batch of rays (or ray segments) for occlusion
+	 *
+	 * This is the batched equivalent of the shadow ray version of
+	 * \ref rayIntersect(), which is typically used to test the
+	 * visibility of several direct illumination samples at once.
+	 *
+	 * \param rays
+	 *    An array of \c count rays
+	 *
+	 * \param count
+	 *    The number of rays in the batch
+	 *
+	 * \param occluded
+	 *    An array of \c count entries, which will be set to \c true
+	 *    for every ray that is occluded
+	 */
+	inline void isOccluded(const Ray *rays, size_t count, bool *occluded) const {
+		if (EXPECT_NOT_TAKEN(m_bvh.get() != NULL))
+			m_bvh->isOccluded(rays, count, occluded);
+		else
+			m_kdtree->isOccluded(rays, count, occluded);
+	}
+
 	/**
 	 * \brief Return the transmittance between \c p1 and \c p2 at the
 	 * specified time.
@@ -844,6 +964,11 @@ public:
 	/**
 	 * \brief Return the discrete probability of choosing a
 	 * certain emitter in <tt>sampleEmitter*</tt>
+	 *
+	 * When a light hierarchy is used (see \ref setEmitterSampling()),
+	 * this does not apply to the direct illumination sampling
+	 * routines, whose probabilities depend on the reference point
+	 * (see \ref pdfEmitterDirect()).
 	 */
 	inline Float pdfEmitterDiscrete(const Emitter *emitter) const {
 		return emitter->getSamplingWeight() * m_emitterPDF.getNormalization();
@@ -1066,11 +1191,66 @@ public:
 	/// Return the scene's film
 	inline const Film *getFilm() const { return m_sensor->getFilm(); }
 
-	/// Return the scene's kd-tree accelerator
+	/**
+	 * \brief Return the scene's kd-tree accelerator
+	 *
+	 * When the scene uses a different acceleration data structure
+	 * (see \ref setAccelerator()), the kd-tree is never built.
+	 */
 	inline ShapeKDTree *getKDTree() { return m_kdtree; }
 	/// Return the scene's kd-tree accelerator
 	inline const ShapeKDTree *getKDTree() const { return m_kdtree.get(); }
 
+	/// Return the scene's BVH accelerator (or \c NULL when the kd-tree is used)
+	inline ShapeBVH *getBVH() { return m_bvh; }
+	/// Return the scene's BVH accelerator (or \c NULL when the kd-tree is used)
+	inline const ShapeBVH *getBVH() const { return m_bvh.get(); }
+
+	/**
+	 * \brief Select the acceleration data structure used for ray tracing
+	 *
+	 * This must happen before the scene is initialized. Both structures
+	 * compute identical intersections, hence this only affects the
+	 * performance and memory usage.
+	 */
+	void setAccelerator(EAccelerator accelerator);
+
+	/// Return the acceleration data structure used for ray tracing
+	inline EAccelerator getAccelerator() const {
+		if (!m_bvh)
+			return EKDTree;
+		return m_bvh->isTwoLevel() ? ETwoLevel : EBVH;
+	}
+
+	/**
+	 * \brief Select how emitters are chosen for direct illumination sampling
+	 *
+	 * With \ref ELightBVH, the emitter is chosen according to its estimated
+	 * contribution to the reference point, which greatly reduces noise in
+	 * scenes with many emitters. All other emitter sampling routines (e.g.
+	 * \ref sampleEmitterPosition()) are unaffected.
+	 */
+	void setEmitterSampling(EEmitterSampling emitterSampling);
+
+	/// Return how emitters are chosen for direct illumination sampling
+	inline EEmitterSampling getEmitterSampling() const {
+		return m_lightBVH.get() ? ELightBVH : EEmitterWeights;
+	}
+
+	/// Return the light hierarchy (or \c NULL when it is not used)
+	inline const LightBVH *getLightBVH() const { return m_lightBVH.get(); }
+
+	/**
+	 * \brief Return an axis-aligned bounding box containing all shapes
+	 * that are handled by the acceleration data structure
+	 *
+	 * In contrast to \ref getAABB(), this does not include the
+	 * sensor and emitter positions.
+	 */
+	inline const AABB &getGeometryAABB() const {
+		return m_bvh.get() ? m_bvh->getAABB() : m_kdtree->getAABB();
+	}
+
 	/// Return the a list of all subsurface integrators
 	inline ref_vector<Subsurface> &getSubsurfaceIntegrators() { return m_ssIntegrators; }
 	/// Return the a list of all subsurface integrators
@@ -1143,8 +1323,30 @@ protected:
 	/// Add a shape to the scene
 	void addShape(Shape *shape);
 	/// \endcond
+
+	/// Choose an emitter for direct illumination sampling at the reference point of \c dRec
+	inline size_t sampleEmitterIndexDirect(const DirectSamplingRecord &dRec,
+			Float &sampleValue, Float &pdf) const {
+		if (m_lightBVH.get())
+			return m_lightBVH->sampleReuse(dRec.ref, dRec.refN, sampleValue, pdf);
+		else
+			return m_emitterPDF.sampleReuse(sampleValue, pdf);
+	}
+
+	/// (Re-)build the discrete emitter PDF and the light BVH (if enabled)
+	void buildEmitterSampling();
+
+	/**
+	 * \brief Refresh emitters that depend on the shape they are attached
+	 * to, and rebuild the emitter sampling data structures
+	 *
+	 * Called by \ref updateGeometry() and \ref updateInstances()
+	 */
+	void updateEmitters();
 private:
 	ref<ShapeKDTree> m_kdtree;
+	ref<ShapeBVH> m_bvh;
+	ref<LightBVH> m_lightBVH;
 	ref<Sensor> m_sensor;
 	ref<Integrator> m_integrator;
 	ref<Sampler> m_sampler;
@@ -1163,6 +1365,8 @@ private:
 	DiscreteDistribution m_emitterPDF;
 	AABB m_aabb;
 	uint32_t m_blockSize;
+	/// Texture tile cache limit to restore on destruction (-1 if unchanged)
+	int64_t m_prevTextureMemory;
 	bool m_degenerateSensor;
 	bool m_degenerateEmitters;
 };
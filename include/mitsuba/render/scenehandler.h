@@ -71,6 +71,9 @@ private:
 /// Push a cleanup handler to be executed after loading the scene is done
 extern MTS_EXPORT_RENDER void pushSceneCleanupHandler(void (*cleanup)());
 
+/// Is the calling thread one of the threads that construct scene objects in parallel?
+extern MTS_EXPORT_RENDER bool isSceneLoaderThread();
+
 /**
  * \brief XML parser for Mitsuba scene files. To be used with the
  * SAX interface of Xerces-C++.
@@ -134,6 +137,10 @@ protected:
 	void clear();
 
 private:
+	struct LoadTask;
+	class LoadQueue;
+	class LoadThread;
+
 	/**
 	 * Enumeration of all possible tags that can be encountered in a
 	 * Mitsuba scene file
@@ -160,11 +167,34 @@ private:
 		Properties properties;
 		std::map<std::string, std::string> attributes;
 		std::vector<std::pair<std::string, ConfigurableObject *> > children;
+		/// Child slots that are still being filled by \ref LoadTask instances
+		std::vector<std::pair<size_t, LoadTask *> > pending;
 	};
 
 
 	typedef std::pair<ETag, const Class *> TagEntry;
 	typedef boost::unordered_map<std::string, TagEntry> TagMap;
+	typedef std::map<std::string, LoadTask *> PendingObjectMap;
+
+	/**
+	 * \brief Construct an object on one of the loader threads
+	 *
+	 * Used for elements that load a file (meshes, bitmap textures,
+	 * volumes, ..). Only the plugin constructor runs in parallel;
+	 * the remaining steps are done by \ref resolve().
+	 */
+	void submit(ParseContext &context, const TagEntry &tag, const std::string &name);
+
+	/**
+	 * \brief Wait until a submitted object has been constructed, then
+	 * attach its children, configure it and register its ID
+	 *
+	 * Returns the object that should be added to the parent element
+	 */
+	ConfigurableObject *resolve(LoadTask *task);
+
+	/// Resolve all outstanding objects in submission order
+	void resolveAll();
 
 	const xercesc::Locator *m_locator;
 	xercesc::XMLTranscoder* m_transcoder;
@@ -176,6 +206,10 @@ private:
 	TagMap m_tags;
 	Transform m_transform;
 	ref<AnimatedTransform> m_animatedTransform;
+	ref<LoadQueue> m_loadQueue;
+	std::vector<ref<LoadTask> > m_tasks;
+	PendingObjectMap m_pendingObjects;
+	ref<Timer> m_loadTimer;
 	bool m_isIncludedFile;
 };
 
@@ -187,6 +187,9 @@ public:
 	/// Is this a compound shape consisting of several sub-objects?
 	virtual bool isCompound() const;
 
+	/// Is this an instance of a shape group (see the \c instance plugin)?
+	virtual bool isInstance() const;
+
 	/**
 	 * \brief Return a sub-element of a compound shape.
 	 *
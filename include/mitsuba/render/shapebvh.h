@@ -0,0 +1,398 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_SHAPEBVH_H_)
+#define __MITSUBA_RENDER_SHAPEBVH_H_
+
+#include <mitsuba/render/skdtree.h>
+
+/// Maximal depth of the 4-wide BVH (determines the traversal stack size)
+#define MTS_BVH_MAXDEPTH 64
+
+/// Largest number of primitives that can be stored in a BVH leaf
+#define MTS_BVH_MAX_LEAF_SIZE 8
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Four-wide bounding volume hierarchy with compressed nodes
+ *
+ * This is an alternative to \ref ShapeKDTree, which can be selected using
+ * the scene's \c accelerator parameter. It is constructed with the binned
+ * surface area heuristic and has four children per node. Each node uses
+ * a single 64-byte cache line: the children's bounding boxes are quantized
+ * to 8 bits per coordinate relative to a grid spanning the node's bounds.
+ * The quantization is conservative, hence it only affects the traversal
+ * performance and never the computed intersections.
+ *
+ * Unlike the kd-tree, every primitive is referenced exactly once. The
+ * precomputed triangle data (\ref TriAccel) is stored in leaf order, so
+ * there is no separate index list. When compiled with SSE support in
+ * single precision, the four child boxes of a node are tested at once.
+ *
+ * Primitive intersection tests and intersection records are exactly the
+ * same as in the kd-tree, so both structures yield identical
+ * \ref Intersection results.
+ *
+ * In two-level mode (see \ref setTwoLevel()), geometry instances are
+ * kept in a separate BVH over their (motion-aware) bounds. The instanced
+ * shape groups share their own acceleration data structures, so changing
+ * the instance transformations only requires rebuilding this small
+ * top-level hierarchy (see \ref updateInstances()).
+ *
+ * \sa ShapeKDTree
+ * \ingroup librender
+ */
+class MTS_EXPORT_RENDER ShapeBVH : public Object {
+public:
+	typedef uint32_t IndexType;
+	typedef uint32_t SizeType;
+
+	// =============================================================
+	//! @{ \name Initialization and construction
+	// =============================================================
+
+	/// Create an empty BVH
+	ShapeBVH();
+
+	/// Add a shape to the BVH
+	void addShape(const Shape *shape);
+
+	/**
+	 * \brief Return the list of stored shapes
+	 *
+	 * In two-level mode, this excludes the geometry instances
+	 * (see \ref getInstanceBVH()).
+	 */
+	inline const std::vector<const Shape *> &getShapes() const { return m_shapes; }
+
+	/// Return the total number of low-level primitives (excluding the instances)
+	inline SizeType getPrimitiveCount() const { return m_primitiveCount; }
+
+	/// Return an axis-aligned bounding box containing all primitives
+	inline const AABB &getAABB() const {
+		return m_instanceBVH.get() ? m_combinedAABB : m_aabb;
+	}
+
+	/**
+	 * \brief Keep geometry instances in a separate top-level BVH
+	 * (default: \c false)
+	 *
+	 * Must be set before adding any shapes.
+	 */
+	void setTwoLevel(bool twoLevel);
+
+	/// Are geometry instances kept in a separate top-level BVH?
+	inline bool isTwoLevel() const { return m_twoLevel; }
+
+	/// Return the top-level BVH over the instances (or \c NULL)
+	inline const ShapeBVH *getInstanceBVH() const { return m_instanceBVH.get(); }
+
+	/**
+	 * \brief Set the largest number of primitives that may be stored in
+	 * a leaf (1..8, default: 4)
+	 *
+	 * Smaller leaves are created when the surface area heuristic
+	 * predicts that this is beneficial.
+	 */
+	void setMaxLeafSize(int maxLeafSize);
+
+	/// Return the largest number of primitives that may be stored in a leaf
+	inline int getMaxLeafSize() const { return m_maxLeafSize; }
+
+	/// Build the BVH (needs to be called before tracing any rays)
+	void build();
+
+	/// Has the BVH been built?
+	inline bool isBuilt() const { return m_nodes != NULL; }
+
+	/// Return the number of nodes
+	inline SizeType getNodeCount() const { return m_nodeCount; }
+
+	/// Return the time (in milliseconds) taken by the last call to \ref build()
+	inline int getBuildTime() const { return m_buildTime; }
+
+	/// Return the memory used by the nodes and primitive data (in bytes)
+	size_t getMemoryUsage() const;
+
+	//! @}
+	// =============================================================
+
+	// =============================================================
+	//! @{ \name Dynamic geometry
+	// =============================================================
+
+	/**
+	 * \brief Refit the node bounds to the current shape geometry
+	 *
+	 * This accounts for moved vertices (see \ref
+	 * TriMesh::updateVertexPositions()) in time linear in the number
+	 * of primitives, while keeping the topology of the hierarchy. The
+	 * set of shapes and the number of primitives must stay the same.
+	 */
+	void refit();
+
+	/**
+	 * \brief Refit the BVH, and rebuild it when its quality has degraded
+	 *
+	 * A rebuild happens when the refitted hierarchy's SAH cost exceeds
+	 * the cost after the last build by more than the rebuild threshold.
+	 *
+	 * \return \c true if the BVH was rebuilt
+	 */
+	bool update();
+
+	/**
+	 * \brief Set the relative SAH cost increase that triggers a
+	 * rebuild in \ref update() (must be >= 1, default: 1.5)
+	 */
+	void setRebuildThreshold(Float threshold);
+
+	/// Return the relative SAH cost increase that triggers a rebuild
+	inline Float getRebuildThreshold() const { return m_rebuildThreshold; }
+
+	/**
+	 * \brief Rebuild the top-level BVH over the geometry instances
+	 *
+	 * This accounts for changed instance transformations. The
+	 * remaining geometry and the instanced shape groups are left
+	 * untouched. Does nothing unless two-level mode is active.
+	 */
+	void updateInstances();
+
+	/// Return the SAH cost of the hierarchy (relative to the root node)
+	inline Float getCost() const { return m_cost; }
+
+	/// Return the SAH cost of the hierarchy right after the last build
+	inline Float getBuildCost() const { return m_buildCost; }
+
+	//! @}
+	// =============================================================
+
+	// =============================================================
+	//! @{ \name Ray tracing routines
+	// =============================================================
+
+	/// Equivalent of \ref ShapeKDTree::rayIntersect(const Ray &, Intersection &) const
+	bool rayIntersect(const Ray &ray, Intersection &its) const;
+
+	/// Equivalent of \ref ShapeKDTree::rayIntersect(const Ray &, Float &, ConstShapePtr &, Normal &, Point2 &) const
+	bool rayIntersect(const Ray &ray, Float &t, ConstShapePtr &shape,
+		Normal &n, Point2 &uv) const;
+
+	/// Equivalent of \ref ShapeKDTree::rayIntersect(const Ray &) const
+	bool rayIntersect(const Ray &ray) const;
+
+	/**
+	 * \brief Batched equivalent of \ref rayIntersect(const Ray &, Intersection &) const
+	 *
+	 * The BVH already tests four boxes at a time for every ray, hence
+	 * the rays are simply traced one after the other.
+	 */
+	void rayIntersect(const Ray *rays, size_t count,
+		Intersection *its, bool *found) const;
+
+	/// Batched equivalent of \ref rayIntersect(const Ray &) const
+	void isOccluded(const Ray *rays, size_t count, bool *occluded) const;
+
+	//! @}
+	// =============================================================
+
+	/// Return a string representation
+	std::string toString() const;
+
+	MTS_DECLARE_CLASS()
+protected:
+	friend class Instance;
+
+	/**
+	 * \brief Compressed BVH node with four children (64 bytes)
+	 *
+	 * Child \c i covers the region <tt>origin + lower[.][i] * scale</tt>
+	 * to <tt>origin + upper[.][i] * scale</tt>.
+	 *
+	 * A child reference with the most significant bit set denotes a leaf:
+	 * bits 3-30 then store the offset of its first primitive, and
+	 * bits 0-2 store the primitive count minus one. Unused children are
+	 * marked with \ref EEmptyChild.
+	 */
+	struct BVHNode {
+		float origin[3];
+		float scale[3];
+		uint8_t lower[3][4];
+		uint8_t upper[3][4];
+		uint32_t children[4];
+	};
+
+	enum {
+		ELeafFlag   = 0x80000000,
+		EEmptyChild = 0xFFFFFFFF
+	};
+
+	/// Primitive reference used during construction
+	struct BuildPrimitive {
+		AABB aabb;
+		IndexType shapeIndex;
+		IndexType primIndex;
+	};
+
+	/// Range of primitives that is being split during construction
+	struct BuildRange {
+		SizeType begin, end;
+		AABB aabb;
+	};
+
+	/// Temporarily holds some intersection information
+	struct IntersectionCache {
+		SizeType shapeIndex;
+		SizeType primIndex;
+		Float u, v;
+	};
+
+	/// Virtual destructor
+	virtual ~ShapeBVH();
+
+	/// Recursively build the subtree for a range of primitives
+	uint32_t buildRecursive(std::vector<BVHNode> &nodes,
+		std::vector<BuildPrimitive> &prims, const BuildRange &range, int depth);
+
+	/**
+	 * \brief Find the best binned SAH split of a primitive range
+	 *
+	 * \return The SAH cost of the best split (to be compared against
+	 * the cost of a leaf), or +infinity if no valid split exists
+	 */
+	Float findSplit(const std::vector<BuildPrimitive> &prims,
+		const BuildRange &range, int &axis, Float &split) const;
+
+	/**
+	 * \brief Split a range into two
+	 *
+	 * Uses the binned SAH unless \c median is set, and falls back to
+	 * a median split when no valid SAH split exists.
+	 */
+	void splitRange(std::vector<BuildPrimitive> &prims, const BuildRange &range,
+		bool median, BuildRange &left, BuildRange &right) const;
+
+	/// Conservatively quantize the child bounds of a node
+	void quantize(BVHNode &node, const AABB &aabb,
+		const AABB *children, int childCount) const;
+
+	/**
+	 * \brief Recompute the bounds of all nodes from the bounds of the
+	 * primitives (given in leaf order) and return the SAH cost
+	 *
+	 * \param requantize
+	 *    Should the quantized child bounds be updated?
+	 */
+	Float refitNodes(const std::vector<AABB> &primAABBs, bool requantize);
+
+	/// Check whether a primitive is intersected by the given ray
+	FINLINE bool intersect(const Ray &ray, IndexType idx, Float mint,
+		Float maxt, Float &t, void *temp) const {
+		IntersectionCache *cache =
+			static_cast<IntersectionCache *>(temp);
+
+		const TriAccel &ta = m_triAccel[idx];
+		if (EXPECT_TAKEN(ta.k != KNoTriangleFlag)) {
+			Float tempU, tempV, tempT;
+			if (ta.rayIntersect(ray, mint, maxt, tempU, tempV, tempT)) {
+				t = tempT;
+				cache->shapeIndex = ta.shapeIndex;
+				cache->primIndex = ta.primIndex;
+				cache->u = tempU;
+				cache->v = tempV;
+				return true;
+			}
+		} else {
+			const Shape *shape = m_shapes[ta.shapeIndex];
+			if (shape->rayIntersect(ray, mint, maxt, t,
+					reinterpret_cast<uint8_t*>(temp) + 2*sizeof(IndexType))) {
+				cache->shapeIndex = ta.shapeIndex;
+				cache->primIndex = KNoTriangleFlag;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/// Check whether a primitive is intersected by the given ray (shadow ray version)
+	FINLINE bool intersect(const Ray &ray, IndexType idx,
+			Float mint, Float maxt) const {
+		const TriAccel &ta = m_triAccel[idx];
+		Float tempU, tempV, tempT;
+		if (EXPECT_TAKEN(ta.k != KNoTriangleFlag))
+			return ta.rayIntersect(ray, mint, maxt, tempU, tempV, tempT);
+		else
+			return m_shapes[ta.shapeIndex]->rayIntersect(ray, mint, maxt);
+	}
+
+	/**
+	 * \brief Traverse the BVH
+	 *
+	 * \tparam shadowRay
+	 *    When \c true, the traversal stops at the first intersection
+	 */
+	template<bool shadowRay> bool traverse(const Ray &ray, Float mint,
+		Float maxt, Float &t, void *temp) const;
+
+	/// Plain shadow ray query (used by the 'instance' plugin)
+	bool rayIntersect(const Ray &ray, Float mint, Float maxt) const;
+
+	/// Plain intersection query (used by the 'instance' plugin)
+	bool rayIntersect(const Ray &ray, Float mint, Float maxt, Float &t, void *temp) const;
+
+	/// Update the bounds of the geometry and the instances
+	void updateCombinedAABB();
+
+	/// Fill an intersection record using the information collected in \ref traverse()
+	template<bool BarycentricPos> FINLINE void fillIntersectionRecord(const Ray &ray,
+			const void *temp, Intersection &its) const {
+		const IntersectionCache *cache = reinterpret_cast<const IntersectionCache *>(temp);
+		const Shape *shape = m_shapes[cache->shapeIndex];
+		if (m_triangleFlag[cache->shapeIndex]) {
+			static_cast<const TriMesh *>(shape)->fillTriangleIntersectionRecord<BarycentricPos>(
+				ray, cache->primIndex, cache->u, cache->v, its);
+		} else {
+			shape->fillIntersectionRecord(ray,
+				reinterpret_cast<const uint8_t*>(temp) + 2*sizeof(IndexType), its);
+		}
+
+		computeShadingFrame(its.shFrame.n, its.dpdu, its.shFrame);
+		its.wi = its.toLocal(-ray.d);
+	}
+private:
+	std::vector<const Shape *> m_shapes;
+	std::vector<bool> m_triangleFlag;
+	BVHNode *m_nodes;
+	TriAccel *m_triAccel;
+	SizeType m_nodeCount;
+	SizeType m_primitiveCount;
+	AABB m_aabb, m_combinedAABB;
+	ref<ShapeBVH> m_instanceBVH;
+	bool m_twoLevel;
+	int m_maxLeafSize;
+	int m_buildTime;
+	Float m_cost, m_buildCost;
+	Float m_rebuildThreshold;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_SHAPEBVH_H_ */
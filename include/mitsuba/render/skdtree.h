@@ -23,6 +23,7 @@
 #include <mitsuba/render/shape.h>
 #include <mitsuba/render/sahkdtree3.h>
 #include <mitsuba/render/triaccel.h>
+#include <mitsuba/core/mmap.h>
 
 #if defined(MTS_KD_CONSERVE_MEMORY)
 #if defined(MTS_HAS_COHERENT_RT)
@@ -62,6 +63,10 @@ typedef const Shape * ConstShapePtr;
  * test is used instead, which doesn't need any extra storage. However, it also
  * tends to be quite a bit slower.
  *
+ * The same can be selected at runtime using \ref setCompactStorage(), which
+ * additionally compresses the primitive index lists. This is meant for
+ * scenes that would otherwise not fit into memory.
+ *
  * \sa GenericKDTree
  * \ingroup librender
  */
@@ -100,6 +105,42 @@ public:
 	/// Build the kd-tree (needs to be called before tracing any rays)
 	void build();
 
+	/**
+	 * \brief Specify a directory for persistent kd-tree cache files
+	 *
+	 * When set, \ref build() computes a hash of the geometry and of the
+	 * construction parameters and looks for a matching cache file in this
+	 * directory. If there is one, the tree is memory-mapped from it and
+	 * construction is skipped entirely. Otherwise, the tree is built as
+	 * usual and written to a new cache file. An empty path (the default)
+	 * disables caching.
+	 */
+	inline void setCacheDirectory(const fs::path &path) { m_cacheDirectory = path; }
+
+	/// Return the directory used for persistent kd-tree cache files
+	inline const fs::path &getCacheDirectory() const { return m_cacheDirectory; }
+
+	/**
+	 * \brief Trade some performance for a smaller memory footprint?
+	 *
+	 * When set, no per-triangle "TriAccel" data (48 bytes) is precomputed
+	 * and triangles are intersected using the vertex data of their meshes.
+	 * The primitive index lists are stored in compressed form (see
+	 * \ref GenericKDTree::compressIndices()). Ray packets still traverse
+	 * the tree together, but their triangles are tested one ray at a time.
+	 * Default: \c false
+	 */
+	inline void setCompactStorage(bool compact) { m_compact = compact; }
+
+	/// Is the compact storage mode enabled?
+	inline bool getCompactStorage() const { return m_compact; }
+
+	/**
+	 * \brief Return the memory used by the nodes, index lists and
+	 * precomputed triangle data (in bytes)
+	 */
+	size_t getMemoryUsage() const;
+
 	//! @}
 	// =============================================================
 
@@ -175,6 +216,51 @@ public:
 	 */
 	bool rayIntersect(const Ray &ray) const;
 
+	/**
+	 * \brief Intersect a batch of rays against all primitives stored in
+	 * the kd-tree and return detailed intersection information
+	 *
+	 * When coherent ray tracing support is compiled in, the rays are
+	 * sorted by direction octant and traversed as SSE packets of four.
+	 * Rays that do not fill up a packet are traced individually. The
+	 * results match those of the single-ray version.
+	 *
+	 * \param rays
+	 *    An array of \c count rays
+	 *
+	 * \param count
+	 *    The number of rays in the batch
+	 *
+	 * \param its
+	 *    An array of \c count intersection records, which will be
+	 *    filled by the intersection query
+	 *
+	 * \param found
+	 *    An array of \c count entries, which will be set to \c true
+	 *    for every ray that intersected a primitive
+	 */
+	void rayIntersect(const Ray *rays, size_t count,
+		Intersection *its, bool *found) const;
+
+	/**
+	 * \brief Test a batch of rays (or ray segments) for occlusion
+	 *
+	 * This is the batched equivalent of the shadow ray version of
+	 * \ref rayIntersect(). Traversal of a packet stops as soon as every
+	 * ray in it has found \a some intersection.
+	 *
+	 * \param rays
+	 *    An array of \c count rays
+	 *
+	 * \param count
+	 *    The number of rays in the batch
+	 *
+	 * \param occluded
+	 *    An array of \c count entries, which will be set to \c true
+	 *    for every ray that is occluded
+	 */
+	void isOccluded(const Ray *rays, size_t count, bool *occluded) const;
+
 #if defined(MTS_HAS_COHERENT_RT)
 	/**
 	 * \brief Intersect four rays with the stored triangle meshes while making
@@ -250,7 +336,34 @@ protected:
 		IntersectionCache *cache =
 			static_cast<IntersectionCache *>(temp);
 
-#if defined(MTS_KD_CONSERVE_MEMORY)
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+		if (EXPECT_TAKEN(m_triAccel != NULL)) {
+			const TriAccel &ta = m_triAccel[idx];
+			if (EXPECT_TAKEN(ta.k != KNoTriangleFlag)) {
+				Float tempU, tempV, tempT;
+				if (ta.rayIntersect(ray, mint, maxt, tempU, tempV, tempT)) {
+					t = tempT;
+					cache->shapeIndex = ta.shapeIndex;
+					cache->primIndex = ta.primIndex;
+					cache->u = tempU;
+					cache->v = tempV;
+					return true;
+				}
+			} else {
+				uint32_t shapeIndex = ta.shapeIndex;
+				const Shape *shape = m_shapes[shapeIndex];
+				if (shape->rayIntersect(ray, mint, maxt, t,
+						reinterpret_cast<uint8_t*>(temp) + 2*sizeof(IndexType))) {
+					cache->shapeIndex = shapeIndex;
+					cache->primIndex = KNoTriangleFlag;
+					return true;
+				}
+			}
+			return false;
+		}
+#endif
+
+		/* No precomputed data (compact storage) -- use the mesh directly */
 		IndexType shapeIdx = findShape(idx);
 		if (EXPECT_TAKEN(m_triangleFlag[shapeIdx])) {
 			const TriMesh *mesh =
@@ -277,29 +390,6 @@ protected:
 				return true;
 			}
 		}
-#else
-		const TriAccel &ta = m_triAccel[idx];
-		if (EXPECT_TAKEN(m_triAccel[idx].k != KNoTriangleFlag)) {
-			Float tempU, tempV, tempT;
-			if (ta.rayIntersect(ray, mint, maxt, tempU, tempV, tempT)) {
-				t = tempT;
-				cache->shapeIndex = ta.shapeIndex;
-				cache->primIndex = ta.primIndex;
-				cache->u = tempU;
-				cache->v = tempV;
-				return true;
-			}
-		} else {
-			uint32_t shapeIndex = ta.shapeIndex;
-			const Shape *shape = m_shapes[shapeIndex];
-			if (shape->rayIntersect(ray, mint, maxt, t,
-					reinterpret_cast<uint8_t*>(temp) + 2*sizeof(IndexType))) {
-				cache->shapeIndex = shapeIndex;
-				cache->primIndex = KNoTriangleFlag;
-				return true;
-			}
-		}
-#endif
 		return false;
 	}
 
@@ -309,7 +399,19 @@ protected:
 	 */
 	FINLINE bool intersect(const Ray &ray, IndexType idx,
 			Float mint, Float maxt) const {
-#if defined(MTS_KD_CONSERVE_MEMORY)
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+		if (EXPECT_TAKEN(m_triAccel != NULL)) {
+			const TriAccel &ta = m_triAccel[idx];
+			if (EXPECT_TAKEN(ta.k != KNoTriangleFlag)) {
+				Float tempU, tempV, tempT;
+				return ta.rayIntersect(ray, mint, maxt, tempU, tempV, tempT);
+			} else {
+				return m_shapes[ta.shapeIndex]->rayIntersect(ray, mint, maxt);
+			}
+		}
+#endif
+
+		/* No precomputed data (compact storage) -- use the mesh directly */
 		IndexType shapeIdx = findShape(idx);
 		if (EXPECT_TAKEN(m_triangleFlag[shapeIdx])) {
 			const TriMesh *mesh =
@@ -323,17 +425,6 @@ protected:
 			const Shape *shape = m_shapes[shapeIdx];
 			return shape->rayIntersect(ray, mint, maxt);
 		}
-#else
-		const TriAccel &ta = m_triAccel[idx];
-		uint32_t shapeIndex = ta.shapeIndex;
-		const Shape *shape = m_shapes[shapeIndex];
-		if (EXPECT_TAKEN(m_triAccel[idx].k != KNoTriangleFlag)) {
-			Float tempU, tempV, tempT;
-			return ta.rayIntersect(ray, mint, maxt, tempU, tempV, tempT);
-		} else {
-			return shape->rayIntersect(ray, mint, maxt);
-		}
-#endif
 	}
 
 	/**
@@ -345,79 +436,8 @@ protected:
 		const IntersectionCache *cache = reinterpret_cast<const IntersectionCache *>(temp);
 		const Shape *shape = m_shapes[cache->shapeIndex];
 		if (m_triangleFlag[cache->shapeIndex]) {
-			const TriMesh *trimesh = static_cast<const TriMesh *>(shape);
-			const Triangle &tri = trimesh->getTriangles()[cache->primIndex];
-			const Point *vertexPositions = trimesh->getVertexPositions();
-			const Normal *vertexNormals = trimesh->getVertexNormals();
-			const Point2 *vertexTexcoords = trimesh->getVertexTexcoords();
-			const Color3 *vertexColors = trimesh->getVertexColors();
-			const TangentSpace *vertexTangents = trimesh->getUVTangents();
-			const Vector b(1 - cache->u - cache->v, cache->u, cache->v);
-
-			const uint32_t idx0 = tri.idx[0], idx1 = tri.idx[1], idx2 = tri.idx[2];
-			const Point &p0 = vertexPositions[idx0];
-			const Point &p1 = vertexPositions[idx1];
-			const Point &p2 = vertexPositions[idx2];
-
-			if (BarycentricPos)
-				its.p = p0 * b.x + p1 * b.y + p2 * b.z;
-			else
-				its.p = ray(its.t);
-
-			Vector side1(p1-p0), side2(p2-p0);
-			Normal faceNormal(cross(side1, side2));
-			Float length = faceNormal.length();
-			if (!faceNormal.isZero())
-				faceNormal /= length;
-
-			if (EXPECT_NOT_TAKEN(vertexTangents)) {
-				const TangentSpace &ts = vertexTangents[cache->primIndex];
-				its.dpdu = ts.dpdu;
-				its.dpdv = ts.dpdv;
-			} else {
-				its.dpdu = side1;
-				its.dpdv = side2;
-			}
-
-			if (EXPECT_TAKEN(vertexNormals)) {
-				const Normal
-					&n0 = vertexNormals[idx0],
-					&n1 = vertexNormals[idx1],
-					&n2 = vertexNormals[idx2];
-
-				its.shFrame.n = normalize(n0 * b.x + n1 * b.y + n2 * b.z);
-
-				/* Ensure that the geometric & shading normals face the same direction */
-				if (dot(faceNormal, its.shFrame.n) < 0)
-					faceNormal = -faceNormal;
-			} else {
-				its.shFrame.n = faceNormal;
-			}
-			its.geoFrame = Frame(faceNormal);
-
-			if (EXPECT_TAKEN(vertexTexcoords)) {
-				const Point2 &t0 = vertexTexcoords[idx0];
-				const Point2 &t1 = vertexTexcoords[idx1];
-				const Point2 &t2 = vertexTexcoords[idx2];
-				its.uv = t0 * b.x + t1 * b.y + t2 * b.z;
-			} else {
-				its.uv = Point2(b.y, b.z);
-			}
-
-			if (EXPECT_NOT_TAKEN(vertexColors)) {
-				const Color3 &c0 = vertexColors[idx0],
-							 &c1 = vertexColors[idx1],
-							 &c2 = vertexColors[idx2];
-				Color3 result(c0 * b.x + c1 * b.y + c2 * b.z);
-				its.color.fromLinearRGB(result[0], result[1],
-					result[2], Spectrum::EReflectance);
-			}
-
-			its.shape = trimesh;
-			its.hasUVPartials = false;
-			its.primIndex = cache->primIndex;
-			its.instance = NULL;
-			its.time = ray.time;
+			static_cast<const TriMesh *>(shape)->fillTriangleIntersectionRecord<BarycentricPos>(
+				ray, cache->primIndex, cache->u, cache->v, its);
 		} else {
 			shape->fillIntersectionRecord(ray,
 				reinterpret_cast<const uint8_t*>(temp) + 2*sizeof(IndexType), its);
@@ -459,6 +479,38 @@ protected:
 
 	/// Virtual destructor
 	virtual ~ShapeKDTree();
+
+	/**
+	 * \brief Hash the geometry and construction parameters (used as cache key)
+	 *
+	 * Returns zero when the tree cannot be cached, because the
+	 * state of one of the shapes could not be serialized.
+	 */
+	uint64_t computeCacheHash() const;
+
+	/// Try to memory-map a previously built tree from a cache file
+	bool loadCache(const fs::path &filename, uint64_t hash);
+
+	/// Write the built tree to a cache file
+	void saveCache(const fs::path &filename, uint64_t hash) const;
+
+#if defined(MTS_HAS_COHERENT_RT)
+	/**
+	 * \brief Packet traversal shared by the public packet and batch
+	 * query functions
+	 *
+	 * \param rays
+	 *    Optional pointers to the four source rays. They are used to
+	 *    supply time values to non-triangle shapes (may be \c NULL)
+	 */
+	template<bool shadowRay> void rayIntersectPacket(const Ray * const *rays,
+		const RayPacket4 &packet, const RayInterval4 &interval,
+		Intersection4 &its, void *temp) const;
+
+	/// Sort up to 64 rays into per-octant index lists and trace them as packets
+	template<bool shadowRay> void rayIntersectStream(const Ray *rays, size_t count,
+		Intersection *its, bool *found) const;
+#endif
 private:
 	std::vector<const Shape *> m_shapes;
 	std::vector<bool> m_triangleFlag;
@@ -466,6 +518,9 @@ private:
 #if !defined(MTS_KD_CONSERVE_MEMORY)
 	TriAccel *m_triAccel;
 #endif
+	fs::path m_cacheDirectory;
+	ref<MemoryMappedFile> m_cacheFile;
+	bool m_compact;
 };
 
 MTS_NAMESPACE_END
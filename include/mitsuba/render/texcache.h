@@ -0,0 +1,177 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+#if !defined(__MITSUBA_RENDER_TEXCACHE_H_)
+#define __MITSUBA_RENDER_TEXCACHE_H_
+
+#include <mitsuba/core/tls.h>
+#include <mitsuba/core/lock.h>
+#include <boost/unordered_map.hpp>
+#include <list>
+
+/// Number of tiles that are remembered by each thread
+#define MTS_TEXCACHE_LOCAL_SIZE 32
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Memory-bounded cache of texture tiles
+ *
+ * Scenes with large amounts of texture data can easily exceed the available
+ * memory when all MIP map pyramids are kept resident. This class implements
+ * a process-wide cache of fixed-size texture tiles, which are loaded on
+ * demand by their owners (e.g. a \ref TMIPMap backed by a memory-mapped
+ * cache file). When the total size of the cached tiles exceeds a
+ * configurable limit, the least recently used tiles are evicted.
+ *
+ * A lookup first consults a small table of recently used tiles that is
+ * private to the current thread, which does not require any locking.
+ * Only when this fails, the shared cache is searched (and the tile is
+ * loaded if necessary). Tiles are reference counted, hence a tile that was
+ * evicted from the shared cache remains valid while it is still referenced
+ * by a thread-local table. This adds at most
+ * <tt>MTS_TEXCACHE_LOCAL_SIZE</tt> tiles per thread to the memory limit.
+ *
+ * The cache is disabled by default (i.e. the memory limit is zero). It can
+ * be enabled using the \c -m parameter of the \c mitsuba executable or the
+ * \c textureMemory scene parameter. Only sources that are backed by data
+ * outside of main memory benefit from it; MIP maps that were generated
+ * in memory without a cache file do not participate.
+ *
+ * \ingroup librender
+ */
+class MTS_EXPORT_RENDER TextureTileCache : public Object {
+public:
+	/// Interface of objects whose contents can be paged through the cache
+	class MTS_EXPORT_RENDER TileSource {
+	public:
+		/**
+		 * \brief Load the tile with integer coordinates (\c x, \c y) from
+		 * the specified MIP map level into \c target
+		 *
+		 * This function may be called by several threads at once.
+		 */
+		virtual void loadTile(int level, int x, int y, void *target) const = 0;
+
+		virtual ~TileSource() { }
+	};
+
+	/// Return the process-wide texture tile cache
+	static TextureTileCache *getInstance();
+
+	/// Set the maximum amount of memory used by cached tiles (in bytes, 0 disables the cache)
+	void setMemoryLimit(size_t limit);
+
+	/// Return the maximum amount of memory used by cached tiles (in bytes)
+	inline size_t getMemoryLimit() const { return m_memoryLimit; }
+
+	/// Is the cache enabled?
+	inline bool isEnabled() const { return m_memoryLimit > 0; }
+
+	/// Return the amount of memory currently used by the shared cache (in bytes)
+	size_t getMemoryUsage() const;
+
+	/**
+	 * \brief Register a tile source and return an identifier
+	 * that must be used for subsequent lookups
+	 *
+	 * \param source
+	 *    Object that is responsible for loading the tiles
+	 * \param tileSize
+	 *    Size of a single tile in bytes
+	 */
+	uint32_t registerSource(const TileSource *source, size_t tileSize);
+
+	/// Unregister a tile source and release all associated tiles
+	void unregisterSource(uint32_t id);
+
+	/**
+	 * \brief Return a pointer to the contents of the specified tile
+	 *
+	 * The returned pointer stays valid until the current thread
+	 * performs its next lookup.
+	 */
+	const void *lookup(uint32_t id, int level, int x, int y);
+
+	/// Return a human-readable string representation
+	std::string toString() const;
+
+	MTS_DECLARE_CLASS()
+protected:
+	struct TileKey {
+		uint32_t id;
+		int level, x, y;
+
+		inline bool operator==(const TileKey &key) const {
+			return id == key.id && level == key.level && x == key.x && y == key.y;
+		}
+
+		inline size_t hash() const {
+			size_t value = id;
+			value = value * 31 + (size_t) level;
+			value = value * 2654435761u + (size_t) x;
+			value = value * 2654435761u + (size_t) y;
+			return value ^ (value >> 16);
+		}
+	};
+
+	struct TileKeyHash {
+		inline size_t operator()(const TileKey &key) const { return key.hash(); }
+	};
+
+	struct Tile;
+	struct LocalCache;
+	struct Source {
+		const TileSource *source;
+		size_t tileSize;
+	};
+
+	typedef boost::unordered_map<TileKey, Tile *, TileKeyHash> TileMap;
+	typedef boost::unordered_map<uint32_t, Source> SourceMap;
+	typedef std::list<Tile *> TileList;
+
+	/// Create a new (disabled) cache
+	TextureTileCache();
+
+	/// Release all memory
+	virtual ~TextureTileCache();
+
+	/// Look up a tile in the shared cache, or load it (with a reference for the caller)
+	Tile *lookupShared(const TileKey &key);
+
+	/// Evict tiles until the memory limit is satisfied (expects the lock to be held)
+	void evict();
+
+	static void incRef(Tile *tile);
+	static void decRef(Tile *tile);
+private:
+	static ref<TextureTileCache> m_instance;
+	mutable ThreadLocal<LocalCache> m_localCache;
+	mutable ref<Mutex> m_mutex;
+	TileMap m_tiles;
+	TileList m_lru;
+	SourceMap m_sources;
+	size_t m_memoryLimit;
+	size_t m_memoryUsage;
+	uint32_t m_sourceCounter;
+};
+
+MTS_NAMESPACE_END
+
+#endif /* __MITSUBA_RENDER_TEXCACHE_H_ */
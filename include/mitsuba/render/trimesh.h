@@ -24,6 +24,12 @@
 #include <mitsuba/core/pmf.h>
 #include <mitsuba/render/shape.h>
 
+/* File format identifier and versions of serialized meshes */
+#define MTS_FILEFORMAT_HEADER     0x041C
+#define MTS_FILEFORMAT_VERSION_V3 0x0003
+#define MTS_FILEFORMAT_VERSION_V4 0x0004
+#define MTS_FILEFORMAT_VERSION_V5 0x0005
+
 MTS_NAMESPACE_BEGIN
 
 /**
@@ -130,12 +136,12 @@ public:
 
 	/// Return the vertex positions (const version)
 	inline const Point *getVertexPositions() const { return m_positions; };
-	/// Return the vertex positions
+	/// Return the vertex positions (call \ref copyMappedArrays() before modifying them)
 	inline Point *getVertexPositions() { return m_positions; };
 
 	/// Return the vertex normals (const version)
 	inline const Normal *getVertexNormals() const { return m_normals; };
-	/// Return the vertex normals
+	/// Return the vertex normals (call \ref copyMappedArrays() before modifying them)
 	inline Normal *getVertexNormals() { return m_normals; };
 	/// Does the mesh have vertex normals?
 	inline bool hasVertexNormals() const { return m_normals != NULL; };
@@ -239,6 +245,39 @@ public:
 	 */
 	void rebuildTopology(Float maxAngle);
 
+	/**
+	 * \brief Replace all arrays that reference a memory-mapped file
+	 * by private copies
+	 *
+	 * Must be called before the mesh data is modified in place, since
+	 * several meshes loaded from the same file on the same thread
+	 * may share one mapping (see \ref loadMapped()). Does nothing
+	 * when the mesh does not reference a mapped file.
+	 */
+	void copyMappedArrays();
+
+	/**
+	 * \brief Notify the mesh that its vertex positions have changed
+	 *
+	 * This should be called after the array returned by
+	 * \ref getVertexPositions() was modified in place (e.g. to advance
+	 * an animation by one frame). Before modifying it, the mesh must be
+	 * detached from a potentially shared file mapping by calling
+	 * \ref copyMappedArrays(). This function updates the bounding box, discards
+	 * the area sampling table and recomputes the vertex normals and UV
+	 * tangents if the mesh has them. The topology must stay the same.
+	 * It calls \ref copyMappedArrays() itself, so that the recomputed
+	 * data never shows up in other meshes loaded from the same file.
+	 *
+	 * Afterwards, \ref Scene::updateGeometry() must be called so that the
+	 * acceleration data structure accounts for the new positions.
+	 *
+	 * \param recomputeNormals
+	 *   When set to \c false, existing vertex normals are left unchanged
+	 *   (e.g. because the caller has updated them as well)
+	 */
+	void updateVertexPositions(bool recomputeNormals = true);
+
 	/// Serialize to a file/network stream
 	void serialize(Stream *stream, InstanceManager *manager) const;
 
@@ -251,6 +290,17 @@ public:
 	 */
 	void serialize(Stream *stream) const;
 
+	/**
+	 * \brief Serialize to a file stream without compression
+	 *
+	 * Produces the same kind of stable triangle data as \ref serialize(Stream *),
+	 * but stores it uncompressed with all arrays aligned relative to the
+	 * beginning of the file. Such files can be memory-mapped, in which case
+	 * the mesh directly references the file contents instead of
+	 * decompressing and copying them (see \ref loadMapped()).
+	 */
+	void serializeUncompressed(Stream *stream) const;
+
 	/**
 	 * \brief Build a discrete probability distribution
 	 * for sampling.
@@ -281,6 +331,99 @@ public:
 	void getNormalDerivative(const Intersection &its,
 		Vector &dndu, Vector &dndv, bool shadingFrame) const;
 
+	/**
+	 * \brief Fill an intersection record for a hit on one of the triangles
+	 *
+	 * This is used by the acceleration data structures once they have
+	 * determined the closest intersection. The shading frame and the
+	 * local incident direction are not computed here.
+	 *
+	 * \param ray
+	 *     The ray that hit the triangle (\c its.t must already be set)
+	 * \param primIndex
+	 *     Index of the intersected triangle
+	 * \param u
+	 *     First barycentric coordinate of the hit
+	 * \param v
+	 *     Second barycentric coordinate of the hit
+	 * \param its
+	 *     Intersection record to be filled
+	 * \tparam BarycentricPos
+	 *     Compute the intersection position by interpolating the
+	 *     vertex positions (as opposed to evaluating \c ray(its.t))
+	 */
+	template<bool BarycentricPos> FINLINE void fillTriangleIntersectionRecord(
+			const Ray &ray, uint32_t primIndex, Float u, Float v,
+			Intersection &its) const {
+		const Triangle &tri = m_triangles[primIndex];
+		const Vector b(1 - u - v, u, v);
+
+		const uint32_t idx0 = tri.idx[0], idx1 = tri.idx[1], idx2 = tri.idx[2];
+		const Point &p0 = m_positions[idx0];
+		const Point &p1 = m_positions[idx1];
+		const Point &p2 = m_positions[idx2];
+
+		if (BarycentricPos)
+			its.p = p0 * b.x + p1 * b.y + p2 * b.z;
+		else
+			its.p = ray(its.t);
+
+		Vector side1(p1-p0), side2(p2-p0);
+		Normal faceNormal(cross(side1, side2));
+		Float length = faceNormal.length();
+		if (!faceNormal.isZero())
+			faceNormal /= length;
+
+		if (EXPECT_NOT_TAKEN(m_tangents)) {
+			const TangentSpace &ts = m_tangents[primIndex];
+			its.dpdu = ts.dpdu;
+			its.dpdv = ts.dpdv;
+		} else {
+			its.dpdu = side1;
+			its.dpdv = side2;
+		}
+
+		if (EXPECT_TAKEN(m_normals)) {
+			const Normal
+				&n0 = m_normals[idx0],
+				&n1 = m_normals[idx1],
+				&n2 = m_normals[idx2];
+
+			its.shFrame.n = normalize(n0 * b.x + n1 * b.y + n2 * b.z);
+
+			/* Ensure that the geometric & shading normals face the same direction */
+			if (dot(faceNormal, its.shFrame.n) < 0)
+				faceNormal = -faceNormal;
+		} else {
+			its.shFrame.n = faceNormal;
+		}
+		its.geoFrame = Frame(faceNormal);
+
+		if (EXPECT_TAKEN(m_texcoords)) {
+			const Point2 &t0 = m_texcoords[idx0];
+			const Point2 &t1 = m_texcoords[idx1];
+			const Point2 &t2 = m_texcoords[idx2];
+			its.uv = t0 * b.x + t1 * b.y + t2 * b.z;
+		} else {
+			its.uv = Point2(b.y, b.z);
+		}
+
+		if (EXPECT_NOT_TAKEN(m_colors)) {
+			const Color3 &c0 = m_colors[idx0],
+						 &c1 = m_colors[idx1],
+						 &c2 = m_colors[idx2];
+			Color3 result(c0 * b.x + c1 * b.y + c2 * b.z);
+			its.color.fromLinearRGB(result[0], result[1],
+				result[2], Spectrum::EReflectance);
+		}
+
+		its.shape = this;
+		its.hasUVPartials = false;
+		its.primIndex = primIndex;
+		its.instance = NULL;
+		its.time = ray.time;
+	}
+
 	/**
 	 * \brief Return the number of primitives (triangles, hairs, ..)
 	 * contributed to the scene by this shape
@@ -310,20 +453,6 @@ public:
 	/// Return a string representation
 	std::string toString() const;
 
-	//! @}
-	// =============================================================
-
-	MTS_DECLARE_CLASS()
-protected:
-	/// Create a new triangle mesh
-	TriMesh(const Properties &props);
-
-	/// Virtual destructor
-	virtual ~TriMesh();
-
-	/// Load a Mitsuba compressed triangle mesh substream
-	void loadCompressed(Stream *stream, int idx = 0);
-
 	/**
 	 * \brief Reads the header information of a compressed file, returning
 	 * the version ID.
@@ -350,8 +479,42 @@ protected:
 	 static int readOffsetDictionary(Stream *stream, short version,
 		 std::vector<size_t>& outOffsets);
 
+	//! @}
+	// =============================================================
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// Create a new triangle mesh
+	TriMesh(const Properties &props);
+
+	/// Virtual destructor
+	virtual ~TriMesh();
+
+	/// Load a Mitsuba compressed triangle mesh substream
+	void loadCompressed(Stream *stream, int idx = 0);
+
+	/**
+	 * \brief Load a triangle mesh substream from a memory-mapped file
+	 *
+	 * When the substream was written by \ref serializeUncompressed() using
+	 * the same floating point precision, the mesh arrays point directly
+	 * into the mapped file. The mapping may be shared with other meshes,
+	 * hence \ref copyMappedArrays() must be called before modifying
+	 * the data in place. Other file versions are decompressed from the mapped memory.
+	 *
+	 * \param offset
+	 *    Position of the substream (i.e. its header) within the file
+	 */
+	void loadMapped(MemoryMappedFile *file, size_t offset);
+
 	/// Prepare internal tables for sampling uniformly wrt. area
 	void prepareSamplingTable();
+
+	/// Release a mesh data array, unless it references a memory-mapped file
+	template <typename T> void freeArray(T *&ptr);
+
+	/// Helper function used by \ref copyMappedArrays()
+	template <typename T> void copyMappedArray(T *&ptr, size_t count);
 protected:
 	AABB m_aabb;
 	Triangle *m_triangles;
@@ -370,6 +533,9 @@ protected:
 	Float m_surfaceArea;
 	Float m_invSurfaceArea;
 	ref<Mutex> m_mutex;
+
+	/* File referenced by the mesh data arrays, if any */
+	ref<MemoryMappedFile> m_mappedFile;
 };
 
 MTS_NAMESPACE_END
@@ -51,6 +51,22 @@ public:
 	/// Look up a spectrum value by position
 	virtual Spectrum lookupSpectrum(const Point &p) const;
 
+	/**
+	 * \brief Look up floating point values at several positions
+	 *
+	 * Equivalent to calling \ref lookupFloat() for each point (which is
+	 * what the default implementation does), but data sources can
+	 * override it to amortize the cost of virtual calls and to process
+	 * several points with vector instructions.
+	 *
+	 * \param p        Array of \c count lookup positions
+	 * \param result   Array of \c count entries that receives the values
+	 */
+	virtual void lookupFloats(const Point *p, Float *result, size_t count) const;
+
+	/// Look up spectrum values at several positions (see \ref lookupFloats())
+	virtual void lookupSpectra(const Point *p, Spectrum *result, size_t count) const;
+
 	/// Are vector-valued lookups permitted?
 	virtual bool supportsVectorLookups() const;
 
@@ -71,6 +87,16 @@ public:
 	 */
 	virtual Float getMaximumFloatValue() const = 0;
 
+	/**
+	 * \brief Return an upper bound of the values that \ref lookupFloat
+	 * could return within the given axis-aligned region (in world space)
+	 *
+	 * This is used to build spatially varying majorants for
+	 * Woodcock tracking. The default implementation returns
+	 * \ref getMaximumFloatValue().
+	 */
+	virtual Float getMaximumFloatValue(const AABB &aabb) const;
+
 	MTS_DECLARE_CLASS()
 protected:
 	/// Virtual destructor
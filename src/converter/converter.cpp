@@ -36,6 +36,8 @@
 #include <xercesc/util/XMLUni.hpp>
 #include <mitsuba/core/fresolver.h>
 #include <mitsuba/core/fstream.h>
+#include <mitsuba/core/timer.h>
+#include <mitsuba/render/trimesh.h>
 #include <boost/algorithm/string.hpp>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -305,3 +307,45 @@ void GeometryConverter::convert(const fs::path &inputFile,
 	m_filename = outputFile;
 }
 
+void GeometryConverter::writeMesh(const TriMesh *mesh, Stream *stream) const {
+	if (m_compressGeometry)
+		mesh->serialize(stream);
+	else
+		mesh->serializeUncompressed(stream);
+}
+
+void GeometryConverter::convertSerialized(const fs::path &inputFile,
+		const fs::path &outputFile) {
+	ref<Timer> timer = new Timer();
+	ref<FileStream> input = new FileStream(inputFile, FileStream::EReadOnly);
+	input->setByteOrder(Stream::ELittleEndian);
+
+	const short version = TriMesh::readHeader(input);
+	std::vector<size_t> offsets;
+	if (TriMesh::readOffsetDictionary(input, version, offsets) < 0) {
+		/* Assume there is a single mesh in the file at offset 0 */
+		offsets.resize(1, 0);
+	}
+
+	ref<FileStream> output = new FileStream(outputFile, FileStream::ETruncReadWrite);
+	output->setByteOrder(Stream::ELittleEndian);
+
+	std::vector<size_t> dict;
+	for (size_t i=0; i<offsets.size(); ++i) {
+		input->seek(offsets[i]);
+		ref<TriMesh> mesh = new TriMesh(input);
+		dict.push_back(output->getPos());
+		writeMesh(mesh, output);
+	}
+
+	for (size_t i=0; i<dict.size(); ++i)
+		output->writeULong((uint64_t) dict[i]);
+	output->writeUInt((uint32_t) dict.size());
+
+	SLog(EInfo, "Converted " SIZE_T_FMT " meshes from \"%s\" (%s) to \"%s\" (%s, %s) in %i ms",
+		dict.size(), inputFile.filename().string().c_str(),
+		memString(input->getSize()).c_str(), outputFile.filename().string().c_str(),
+		memString(output->getSize()).c_str(), m_compressGeometry ? "compressed"
+		: "uncompressed", timer->getMilliseconds());
+	output->close();
+}
@@ -17,6 +17,7 @@
 */
 
 #include <mitsuba/core/fresolver.h>
+#include <mitsuba/render/fwd.h>
 #include <set>
 
 using namespace mitsuba;
@@ -29,6 +30,7 @@ public:
 		m_xres = m_yres = -1;
 		m_filmType = "hdrfilm";
 		m_packGeometry = true;
+		m_compressGeometry = true;
 		m_importMaterials = true;
 		m_importAnimations = false;
 	}
@@ -38,12 +40,25 @@ public:
 		const fs::path &sceneName,
 		const fs::path &adjustmentFile);
 
+	/**
+	 * \brief Re-encode all meshes of a serialized geometry file
+	 *
+	 * Depending on \ref setCompressGeometry(), the meshes are
+	 * written in the compressed or the uncompressed (memory-mappable)
+	 * version of the file format.
+	 */
+	void convertSerialized(const fs::path &inputFile, const fs::path &outputFile);
+
+	/// Write a mesh to a serialized geometry file
+	void writeMesh(const TriMesh *mesh, Stream *stream) const;
+
 	virtual fs::path locateResource(const fs::path &resource) = 0;
 
 	inline void setSRGB(bool srgb) { m_srgb = srgb; }
 	inline void setMapSmallerSide(bool mapSmallerSide) { m_mapSmallerSide = mapSmallerSide; }
 	inline void setResolution(int xres, int yres) { m_xres = xres; m_yres = yres; }
 	inline void setPackGeometry(bool packGeometry) { m_packGeometry = packGeometry; }
+	inline void setCompressGeometry(bool compressGeometry) { m_compressGeometry = compressGeometry; }
 	inline void setImportMaterials(bool importMaterials) { m_importMaterials = importMaterials; }
 	inline void setImportAnimations(bool importAnimations) { m_importAnimations = importAnimations; }
 	inline void setFilmType(const std::string &filmType) { m_filmType = filmType; }
@@ -65,4 +80,5 @@ public:
 	fs::path m_geometryFileName;
 	std::vector<size_t> m_geometryDict;
 	bool m_packGeometry;
+	bool m_compressGeometry;
 };
@@ -37,6 +37,7 @@
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/statistics.h>
 #include <mitsuba/core/version.h>
+#include <boost/algorithm/string.hpp>
 #if defined(__WINDOWS__)
 #include <mitsuba/core/getopt.h>
 #endif
@@ -54,6 +55,7 @@ public:
 void help() {
 	cout << "COLLADA 1.4 & Wavefront OBJ Importer, Copyright (c) " MTS_YEAR " Wenzel Jakob" << endl
 		<< "Syntax: mtsimport [options] <DAE/ZAE/OBJ scene> <XML output file> [Adjustment file]" << endl
+		<< "    or: mtsimport [options] <SERIALIZED input file> <SERIALIZED output file>" << endl
 		<< "Options/Arguments:" << endl
 		<<  "   -h          Display this help text" << endl << endl
 		<<  "   -a p1;p2;.. Add one or more entries to the resource search path" << endl << endl
@@ -62,6 +64,8 @@ void help() {
 		<<  "   -m          Map the larger image side to the full field of view" << endl << endl
 		<<  "   -z          Import animations" << endl << endl
 		<<  "   -y          Don't pack all geometry data into a single file" << endl << endl
+		<<  "   -u          Store geometry uncompressed, so that it can be memory-mapped" << endl
+		<<  "               during loading. This trades disk space for loading speed." << endl << endl
 		<<  "   -n          Don't import any materials (an adjustments file will be necessary)" << endl << endl
 		<<  "   -l <type>   Override the type of film (e.g. 'hdrfilm', 'ldrfilm', ..)" << endl << endl
 		<<  "   -r <w>x<h>  Override the image resolution to e.g. 1920x1080" << endl << endl
@@ -77,11 +81,11 @@ int importMain(int argc, char **argv) {
 	FileResolver *fileResolver = Thread::getThread()->getFileResolver();
 	ELogLevel logLevel = EInfo;
 	bool packGeometry = true, importMaterials = true,
-		 importAnimations = false;
+		 importAnimations = false, compressGeometry = true;
 
 	optind = 1;
 
-	while ((optchar = getopt(argc, argv, "snzvyhmr:a:l:")) != -1) {
+	while ((optchar = getopt(argc, argv, "snzvyuhmr:a:l:")) != -1) {
 		switch (optchar) {
 			case 'a': {
 					std::vector<std::string> paths = tokenize(optarg, ";");
@@ -110,6 +114,9 @@ int importMain(int argc, char **argv) {
 			case 'y':
 				packGeometry = false;
 				break;
+			case 'u':
+				compressGeometry = false;
+				break;
 			case 'r': {
 					std::vector<std::string> tokens = tokenize(optarg, "x");
 					if (tokens.size() != 2)
@@ -144,11 +151,15 @@ int importMain(int argc, char **argv) {
 	converter.setImportAnimations(importAnimations);
 	converter.setMapSmallerSide(mapSmallerSide);
 	converter.setPackGeometry(packGeometry);
+	converter.setCompressGeometry(compressGeometry);
 	converter.setFilmType(filmType);
 
 	const Logger *logger = Thread::getThread()->getLogger();
 	size_t initialWarningCount = logger->getWarningCount();
-	converter.convert(argv[optind], "", argv[optind+1], argc > optind+2 ? argv[optind+2] : "");
+	if (boost::ends_with(boost::to_lower_copy(std::string(argv[optind])), ".serialized"))
+		converter.convertSerialized(argv[optind], argv[optind+1]);
+	else
+		converter.convert(argv[optind], "", argv[optind+1], argc > optind+2 ? argv[optind+2] : "");
 	size_t warningCount = logger->getWarningCount() - initialWarningCount;
 
 	if (warningCount > 0)
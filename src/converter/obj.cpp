@@ -203,13 +203,13 @@ void GeometryConverter::convertOBJ(const fs::path &inputFile,
 			SLog(EInfo, "Saving \"%s\"", filename.c_str());
 			ref<FileStream> stream = new FileStream(meshesDirectory / filename, FileStream::ETruncReadWrite);
 			stream->setByteOrder(Stream::ELittleEndian);
-			mesh->serialize(stream);
+			writeMesh(mesh, stream);
 			stream->close();
 			os << "\t\t<string name=\"filename\" value=\"meshes/" << filename.c_str() << "\"/>" << endl;
 		} else {
 			m_geometryDict.push_back((uint64_t) m_geometryFile->getPos());
 			SLog(EInfo, "Saving mesh \"%s\" ..", mesh->getName().c_str());
-			mesh->serialize(m_geometryFile);
+			writeMesh(mesh, m_geometryFile);
 			os << "\t\t<string name=\"filename\" value=\"" << m_geometryFileName.filename().string() << "\"/>" << endl;
 			os << "\t\t<integer name=\"shapeIndex\" value=\"" << (m_geometryDict.size()-1) << "\"/>" << endl;
 		}
@@ -85,6 +85,14 @@ public:
 		configure();
 	}
 
+	void configure() {
+		Emitter::configure();
+
+		/* Recompute the power, e.g. after Scene::updateGeometry() */
+		if (m_shape)
+			m_power = m_radiance * M_PI * m_shape->getSurfaceArea();
+	}
+
 	void serialize(Stream *stream, InstanceManager *manager) const {
 		Emitter::serialize(stream, manager);
 		m_radiance.serialize(stream);
@@ -68,7 +68,7 @@ public:
 		/* Create a bounding sphere that surrounds the scene */
 		BSphere sceneBSphere(scene->getAABB().getBSphere());
 		sceneBSphere.radius = std::max(Epsilon, sceneBSphere.radius * 1.5f);
-		BSphere geoBSphere(scene->getKDTree()->getAABB().getBSphere());
+		BSphere geoBSphere(scene->getGeometryAABB().getBSphere());
 
 		if (sceneBSphere != m_sceneBSphere || geoBSphere != m_geoBSphere) {
 			m_sceneBSphere = sceneBSphere;
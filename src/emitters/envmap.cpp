@@ -22,9 +22,11 @@
 #include <mitsuba/core/mstream.h>
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/timer.h>
+#include <mitsuba/core/pmf.h>
 #include <mitsuba/render/mipmap.h>
 #include <mitsuba/hw/gpuprogram.h>
 #include <mitsuba/hw/gputexture.h>
+#include <boost/algorithm/string.hpp>
 
 MTS_NAMESPACE_BEGIN
 
@@ -65,6 +67,19 @@ MTS_NAMESPACE_BEGIN
  *         Specifies the relative amount of samples
  *         allocated to this emitter. \default{1}
  *     }
+ *     \parameter{sampling}{\String}{
+ *         Specifies how directions are importance sampled from the
+ *         environment map. The following choices are available:
+ *         \begin{enumerate}[(i)]
+ *             \item \code{inversion}: Invert the marginal and conditional
+ *             cumulative distribution functions using binary searches.
+ *             This preserves the stratification of the input samples.
+ *             \item \code{alias}: Use Walker's alias method, which generates
+ *             samples in constant time but destroys their stratification.
+ *         \end{enumerate}
+ *         Both methods sample from the same distribution.
+ *         \default{\code{inversion}}
+ *     }
  * }
  * \renderings{
  *   \rendering{The museum environment map by Bernhard Vogl that is used
@@ -95,15 +110,29 @@ MTS_NAMESPACE_BEGIN
  * named \emph{filename}\code{.mip} when given a large input image. This
  * significantly accelerates the loading times of subsequent renderings. When this
  * is not desired, specify \code{cache=false} to the plugin.
+ *
+ * The \code{alias} sampling method is mainly useful for very large environment maps
+ * with independent (i.e. non-stratified) sample generators, where the binary searches
+ * of the default method cause many cache misses. The \code{emitbench} utility
+ * (see \code{mtsutil emitbench -h}) reports the sampling throughput and variance of
+ * both methods for a given image.
  */
 class EnvironmentMap : public Emitter {
 public:
 	/* Store the environment in a blocked MIP map using half precision */
 	typedef TSpectrum<half, SPECTRUM_SAMPLES> SpectrumHalf;
 	typedef TMIPMap<Spectrum, SpectrumHalf> MIPMap;
+	typedef math::AliasTableEntry<float, uint32_t> AliasEntry;
+
+	/// Available methods for importance sampling the environment map
+	enum ESamplingMethod {
+		EInversion = 0,
+		EAlias
+	};
 
 	EnvironmentMap(const Properties &props) : Emitter(props),
-			m_mipmap(NULL), m_cdfRows(NULL), m_cdfCols(NULL), m_rowWeights(NULL) {
+			m_mipmap(NULL), m_cdfRows(NULL), m_cdfCols(NULL), m_aliasRows(NULL),
+			m_aliasCols(NULL), m_rowWeights(NULL) {
 		m_type |= EOnSurface | EEnvironmentEmitter;
 		uint64_t timestamp = 0;
 		bool tryReuseCache = false;
@@ -130,7 +159,7 @@ public:
 			   reuse cache files that have been created previously */
 			cacheFile = m_filename;
 			cacheFile.replace_extension(".mip");
-			tryReuseCache = fs::exists(cacheFile) && props.getBoolean("cache", true);
+			tryReuseCache = props.getBoolean("cache", true);
 		}
 
 		/* Gamma override */
@@ -141,6 +170,11 @@ public:
 		EMIPFilterType filterType = EEWA;
 		Float maxAnisotropy = 10.0f;
 
+		/* A bitmap texture or another environment map loaded on a different
+		   thread may share this cache file, so check and create it under a lock */
+		MIPMapCacheLock cacheLock(cacheFile);
+		tryReuseCache = tryReuseCache && fs::exists(cacheFile);
+
 		if (tryReuseCache && MIPMap::validateCacheFile(cacheFile, timestamp,
 				ENVMAP_PIXELFORMAT, ReconstructionFilter::ERepeat,
 				ReconstructionFilter::EClamp, filterType, m_gamma)) {
@@ -186,14 +220,25 @@ public:
 
 		/* Scale factor */
 		m_scale = props.getFloat("scale", 1.0f);
+
+		std::string sampling = boost::to_lower_copy(props.getString("sampling", "inversion"));
+		if (sampling == "inversion")
+			m_samplingMethod = EInversion;
+		else if (sampling == "alias")
+			m_samplingMethod = EAlias;
+		else
+			Log(EError, "Unknown sampling method '%s' -- must be "
+				"'inversion' or 'alias'!", sampling.c_str());
 	}
 
 	EnvironmentMap(Stream *stream, InstanceManager *manager) : Emitter(stream, manager),
-			m_mipmap(NULL), m_cdfRows(NULL), m_cdfCols(NULL), m_rowWeights(NULL) {
+			m_mipmap(NULL), m_cdfRows(NULL), m_cdfCols(NULL), m_aliasRows(NULL),
+			m_aliasCols(NULL), m_rowWeights(NULL) {
 		m_filename = stream->readString();
 		Log(EDebug, "Unserializing texture \"%s\"", m_filename.filename().string().c_str());
 		m_gamma = stream->readFloat();
 		m_scale = stream->readFloat();
+		m_samplingMethod = (ESamplingMethod) stream->readUInt();
 		m_sceneBSphere = BSphere(stream);
 		m_geoBSphere = BSphere(stream);
 
@@ -227,6 +272,10 @@ public:
 			delete[] m_cdfRows;
 		if (m_cdfCols)
 			delete[] m_cdfCols;
+		if (m_aliasRows)
+			delete[] m_aliasRows;
+		if (m_aliasCols)
+			delete[] m_aliasCols;
 		if (m_rowWeights)
 			delete[] m_rowWeights;
 	}
@@ -236,6 +285,7 @@ public:
 		stream->writeString(m_filename.string());
 		stream->writeFloat(m_gamma);
 		stream->writeFloat(m_scale);
+		stream->writeUInt(m_samplingMethod);
 		m_sceneBSphere.serialize(stream);
 		m_geoBSphere.serialize(stream);
 
@@ -261,53 +311,22 @@ public:
 		Emitter::configure();
 
 		if (!m_rowWeights) {
-			/// Build CDF tables to sample the environment map
 			const MIPMap::Array2DType &array = m_mipmap->getArray();
 			m_size = array.getSize();
 
-			size_t nEntries = (size_t) (m_size.x + 1) * (size_t) m_size.y,
-				totalStorage = sizeof(float) * (m_size.x + 1 + nEntries);
+			size_t nPixels = (size_t) m_size.x * (size_t) m_size.y, totalStorage;
+			if (m_samplingMethod == EInversion)
+				totalStorage = sizeof(float) * (m_size.y + 1 + nPixels + m_size.y);
+			else
+				totalStorage = sizeof(AliasEntry) * (m_size.y + nPixels);
 
 			Log(EInfo, "Precomputing data structures for environment map sampling (%s)",
 				memString(totalStorage).c_str());
 
 			ref<Timer> timer = new Timer();
-			m_cdfCols = new float[nEntries];
-			m_cdfRows = new float[m_size.y + 1];
 			m_rowWeights = new Float[m_size.y];
-
-			size_t colPos = 0, rowPos = 0;
-			Float rowSum = 0.0f;
-
-			/* Build a marginal & conditional cumulative distribution
-			   function over luminances weighted by sin(theta) */
-			m_cdfRows[rowPos++] = 0;
-			for (int y=0; y<m_size.y; ++y) {
-				Float colSum = 0;
-
-				m_cdfCols[colPos++] = 0;
-				for (int x=0; x<m_size.x; ++x) {
-					Spectrum value(array(x, y));
-
-					colSum += value.getLuminance();
-					m_cdfCols[colPos++] = (float) colSum;
-				}
-
-				float normalization = 1.0f / (float) colSum;
-				for (int x=1; x<m_size.x; ++x)
-					m_cdfCols[colPos-x-1] *= normalization;
-				m_cdfCols[colPos-1] = 1.0f;
-
-				Float weight = std::sin((y + 0.5f) * M_PI / m_size.y);
-				m_rowWeights[y] = weight;
-				rowSum += colSum * weight;
-				m_cdfRows[rowPos++] = (float) rowSum;
-			}
-
-			float normalization = 1.0f / (float) rowSum;
-			for (int y=1; y<m_size.y; ++y)
-				m_cdfRows[rowPos-y-1] *= normalization;
-			m_cdfRows[rowPos-1] = 1.0f;
+			Float rowSum = m_samplingMethod == EInversion
+				? buildInversionTables(array) : buildAliasTables(array);
 
 			if (rowSum == 0)
 				Log(EError, "The environment map is completely black -- this is not allowed.");
@@ -328,11 +347,107 @@ public:
 		m_power = surfaceArea * m_scale / m_normalization;
 	}
 
+	/**
+	 * \brief Build marginal & conditional cumulative distribution
+	 * functions over luminances weighted by sin(theta)
+	 *
+	 * \return The sum of all weighted luminances
+	 */
+	Float buildInversionTables(const MIPMap::Array2DType &array) {
+		size_t nEntries = (size_t) (m_size.x + 1) * (size_t) m_size.y;
+		m_cdfCols = new float[nEntries];
+		m_cdfRows = new float[m_size.y + 1];
+
+		size_t colPos = 0, rowPos = 0;
+		Float rowSum = 0.0f;
+
+		m_cdfRows[rowPos++] = 0;
+		for (int y=0; y<m_size.y; ++y) {
+			Float colSum = 0;
+
+			m_cdfCols[colPos++] = 0;
+			for (int x=0; x<m_size.x; ++x) {
+				Spectrum value(array(x, y));
+
+				colSum += value.getLuminance();
+				m_cdfCols[colPos++] = (float) colSum;
+			}
+
+			float normalization = 1.0f / (float) colSum;
+			for (int x=1; x<m_size.x; ++x)
+				m_cdfCols[colPos-x-1] *= normalization;
+			m_cdfCols[colPos-1] = 1.0f;
+
+			Float weight = std::sin((y + 0.5f) * M_PI / m_size.y);
+			m_rowWeights[y] = weight;
+			rowSum += colSum * weight;
+			m_cdfRows[rowPos++] = (float) rowSum;
+		}
+
+		float normalization = 1.0f / (float) rowSum;
+		for (int y=1; y<m_size.y; ++y)
+			m_cdfRows[rowPos-y-1] *= normalization;
+		m_cdfRows[rowPos-1] = 1.0f;
+
+		return rowSum;
+	}
+
+	/**
+	 * \brief Build marginal & conditional alias tables over
+	 * luminances weighted by sin(theta)
+	 *
+	 * These describe the same distribution as the tables created
+	 * by \ref buildInversionTables().
+	 *
+	 * \return The sum of all weighted luminances
+	 */
+	Float buildAliasTables(const MIPMap::Array2DType &array) {
+		m_aliasCols = new AliasEntry[(size_t) m_size.x * (size_t) m_size.y];
+		m_aliasRows = new AliasEntry[m_size.y];
+
+		Float *luminances = new Float[m_size.x];
+		Float *rowValues = new Float[m_size.y];
+		Float rowSum = 0.0f;
+
+		for (int y=0; y<m_size.y; ++y) {
+			Float colSum = 0;
+			for (int x=0; x<m_size.x; ++x) {
+				Spectrum value(array(x, y));
+				luminances[x] = value.getLuminance();
+				colSum += luminances[x];
+			}
+
+			AliasEntry *row = m_aliasCols + (size_t) y * (size_t) m_size.x;
+			if (colSum > 0) {
+				math::makeAliasTable(row, luminances, (uint32_t) m_size.x);
+			} else {
+				/* This row is never sampled -- just avoid invalid entries */
+				for (int x=0; x<m_size.x; ++x) {
+					row[x].prob = 1.0f;
+					row[x].index = (uint32_t) x;
+				}
+			}
+
+			Float weight = std::sin((y + 0.5f) * M_PI / m_size.y);
+			m_rowWeights[y] = weight;
+			rowValues[y] = colSum * weight;
+			rowSum += colSum * weight;
+		}
+
+		if (rowSum > 0 && std::isfinite(rowSum))
+			math::makeAliasTable(m_aliasRows, rowValues, (uint32_t) m_size.y);
+
+		delete[] luminances;
+		delete[] rowValues;
+
+		return rowSum;
+	}
+
 	ref<Shape> createShape(const Scene *scene) {
 		/* Create a bounding sphere that surrounds the scene */
 		BSphere sceneBSphere(scene->getAABB().getBSphere());
 		sceneBSphere.radius = std::max(Epsilon, sceneBSphere.radius * 1.5f);
-		BSphere geoBSphere(scene->getKDTree()->getAABB().getBSphere());
+		BSphere geoBSphere(scene->getGeometryAABB().getBSphere());
 
 		if (sceneBSphere != m_sceneBSphere || geoBSphere != m_geoBSphere) {
 			m_sceneBSphere = sceneBSphere;
@@ -566,8 +681,14 @@ public:
 	/// Helper function that samples a direction from the environment map
 	void internalSampleDirection(Point2 sample, Vector &d, Spectrum &value, Float &pdf) const {
 		/* Sample a discrete pixel position */
-		uint32_t row = sampleReuse(m_cdfRows, m_size.y, sample.y),
-		         col = sampleReuse(m_cdfCols + row * (m_size.x+1), m_size.x, sample.x);
+		uint32_t row, col;
+		if (m_samplingMethod == EAlias) {
+			row = math::sampleAliasReuse(m_aliasRows, (uint32_t) m_size.y, sample.y);
+			col = math::sampleAliasReuse(m_aliasCols + row * m_size.x, (uint32_t) m_size.x, sample.x);
+		} else {
+			row = sampleReuse(m_cdfRows, m_size.y, sample.y);
+			col = sampleReuse(m_cdfCols + row * (m_size.x+1), m_size.x, sample.x);
+		}
 
 		/* Using the remaining bits of precision to shift the sample by an offset
 		   drawn from a tent function. This effectively creates a sampling strategy
@@ -641,6 +762,7 @@ public:
 		oss << "EnvironmentMap[" << endl
 			<< "  filename = \"" << m_filename.string() << "\"," << endl
 			<< "  samplingWeight = " << m_samplingWeight << "," << endl
+			<< "  sampling = " << (m_samplingMethod == EAlias ? "alias" : "inversion") << "," << endl
 			<< "  bsphere = " << m_sceneBSphere.toString() << "," << endl
 			<< "  worldTransform = " << indent(m_worldTransform.toString()) << "," << endl
 			<< "  mipmap = " << indent(m_mipmap->toString()) << "," << endl
@@ -663,6 +785,8 @@ private:
 private:
 	MIPMap *m_mipmap;
 	float *m_cdfRows, *m_cdfCols;
+	AliasEntry *m_aliasRows, *m_aliasCols;
+	ESamplingMethod m_samplingMethod;
 	Float *m_rowWeights;
 	fs::path m_filename;
 	Float m_gamma, m_scale;
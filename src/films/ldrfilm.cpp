@@ -227,6 +227,27 @@ public:
 		m_storage->put(block);
 	}
 
+	bool supportsCheckpoints() const {
+		return true;
+	}
+
+	void saveCheckpoint(Stream *stream) const {
+		stream->writeInt(m_storage->getBitmap()->getChannelCount());
+		m_cropSize.serialize(stream);
+		m_storage->save(stream);
+	}
+
+	void loadCheckpoint(Stream *stream) {
+		int channelCount = stream->readInt();
+		Vector2i cropSize(stream);
+		if (channelCount != m_storage->getBitmap()->getChannelCount() || cropSize != m_cropSize)
+			Log(EError, "The checkpoint (%ix%i, %i channels) does not match the "
+				"film configuration (%ix%i, %i channels)!", cropSize.x, cropSize.y,
+				channelCount, m_cropSize.x, m_cropSize.y,
+				m_storage->getBitmap()->getChannelCount());
+		m_storage->load(stream);
+	}
+
 	void setBitmap(const Bitmap *bitmap, Float multiplier) {
 		bitmap->convert(m_storage->getBitmap(), multiplier);
 	}
@@ -490,6 +490,11 @@ public:
 
 	void clear() { /* Do nothing */ }
 
+	bool isAccumulating() const {
+		/* Every tile is written to disk exactly once */
+		return false;
+	}
+
 	bool hasAlpha() const {
 		for (size_t i=0; i<m_pixelFormats.size(); ++i) {
 			if (m_pixelFormats[i] == Bitmap::ELuminanceAlpha ||
@@ -45,8 +45,12 @@ public:
 	}
 
 	ref<WorkResult> createWorkResult() const {
-		return new BDPTWorkResult(m_config, m_rfilter.get(),
+		ref<BDPTWorkResult> result = new BDPTWorkResult(m_config, m_rfilter.get(),
 			Vector2i(m_config.blockSize));
+		/* The light paths of a block usually only reach a part of the image */
+		if (m_config.lightImage)
+			result->getLightImage()->setSparse(true);
+		return result.get();
 	}
 
 	void prepare() {
@@ -359,6 +363,11 @@ void BDPTProcess::processResult(const WorkResult *wr, bool cancelled) {
 		return;
 	const BDPTWorkResult *result = static_cast<const BDPTWorkResult *>(wr);
 	ImageBlock *block = const_cast<ImageBlock *>(result->getImageBlock());
+
+	/* The light image is merged without holding the lock */
+	if (m_config.lightImage)
+		m_result->putLightImage(result);
+
 	LockGuard lock(m_resultMutex);
 	m_progress->update(++m_resultCount);
 	if (m_config.lightImage) {
@@ -71,8 +71,6 @@ void BDPTWorkResult::put(const BDPTWorkResult *workResult) {
 		m_debugBlocks[i]->put(workResult->m_debugBlocks[i].get());
 #endif
 	m_block->put(workResult->m_block.get());
-	if (m_lightImage)
-		m_lightImage->put(workResult->m_lightImage.get());
 }
 
 void BDPTWorkResult::clear() {
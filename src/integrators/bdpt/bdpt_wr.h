@@ -48,7 +48,7 @@ public:
 	/// Serialize a work result to a binary data stream
 	virtual void save(Stream *stream) const;
 
-	/// Aaccumulate another work result into this one
+	/// Accumulate another work result (except for the light image) into this one
 	void put(const BDPTWorkResult *workResult);
 
 #if BDPT_DEBUG == 1
@@ -79,6 +79,20 @@ public:
 		return m_lightImage.get();
 	}
 
+	inline ImageBlock *getLightImage() {
+		return m_lightImage.get();
+	}
+
+	/**
+	 * \brief Merge the light image of another work result
+	 *
+	 * This uses atomic additions and can be called by several threads
+	 * at the same time (unlike \ref put(), which merges the rest).
+	 */
+	inline void putLightImage(const BDPTWorkResult *workResult) {
+		m_lightImage->putAtomic(workResult->m_lightImage.get());
+	}
+
 	inline void setSize(const Vector2i &size) {
 		m_block->setSize(size);
 	}
@@ -20,6 +20,9 @@
 
 MTS_NAMESPACE_BEGIN
 
+/// Number of occlusion rays that are traced together
+#define MTS_AO_BATCH_SIZE 16
+
 /*! \plugin{ao}{Ambient occlusion integrator}
  * \order{0}
  * \parameters{
@@ -110,16 +113,30 @@ public:
 			sample = rRec.nextSample2D();
 		}
 
+		/* Generate the occlusion rays in batches, which allows the kd-tree
+		   to trace them as SIMD packets */
 		const Intersection &its = rRec.its;
-		for (size_t i=0; i<numShadingSamples; ++i) {
-			Vector d = its.toWorld(warp::squareToCosineHemisphere(sampleArray[i]));
+		Ray shadowRays[MTS_AO_BATCH_SIZE];
+		bool occluded[MTS_AO_BATCH_SIZE];
+		size_t unoccluded = 0;
+
+		for (size_t i=0; i<numShadingSamples; i += MTS_AO_BATCH_SIZE) {
+			size_t batchSize = std::min(numShadingSamples - i, (size_t) MTS_AO_BATCH_SIZE);
+
+			for (size_t j=0; j<batchSize; ++j) {
+				Vector d = its.toWorld(warp::squareToCosineHemisphere(sampleArray[i+j]));
+				shadowRays[j] = Ray(its.p, d, Epsilon, m_rayLength, ray.time);
+			}
+
+			rRec.scene->isOccluded(shadowRays, batchSize, occluded);
 
-			Ray shadowRay(its.p, d, Epsilon, m_rayLength, ray.time);
-			if (!rRec.scene->rayIntersect(shadowRay))
-				Li += Spectrum(1.0f);
+			for (size_t j=0; j<batchSize; ++j) {
+				if (!occluded[j])
+					++unoccluded;
+			}
 		}
 
-		Li /= static_cast<Float>(numShadingSamples);
+		Li = Spectrum(unoccluded / static_cast<Float>(numShadingSamples));
 
 		return Li;
 	}
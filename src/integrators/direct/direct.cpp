@@ -20,6 +20,9 @@
 
 MTS_NAMESPACE_BEGIN
 
+/// Number of emitter samples whose visibility is tested together
+#define MTS_DIRECT_BATCH_SIZE 16
+
 /*! \plugin{direct}{Direct illumination integrator}
  * \order{1}
  * \parameters{
@@ -216,11 +219,23 @@ public:
 		DirectSamplingRecord dRec(its);
 		if (bsdf->getType() & BSDF::ESmooth) {
 			/* Only use direct illumination sampling when the surface's
-			   BSDF has smooth (i.e. non-Dirac delta) component */
-			for (size_t i=0; i<numDirectSamples; ++i) {
-				/* Estimate the direct illumination if this is requested */
-				Spectrum value = scene->sampleEmitterDirect(dRec, sampleArray[i]);
-				if (!value.isZero()) {
+			   BSDF has smooth (i.e. non-Dirac delta) component. The
+			   visibility of the samples is tested in batches, which
+			   allows the kd-tree to trace the shadow rays as packets */
+			Ray shadowRays[MTS_DIRECT_BATCH_SIZE];
+			Spectrum contributions[MTS_DIRECT_BATCH_SIZE];
+			bool occluded[MTS_DIRECT_BATCH_SIZE];
+
+			for (size_t i=0; i<numDirectSamples; i += MTS_DIRECT_BATCH_SIZE) {
+				size_t batchSize = std::min(numDirectSamples - i,
+					(size_t) MTS_DIRECT_BATCH_SIZE), shadowRayCount = 0;
+
+				for (size_t j=0; j<batchSize; ++j) {
+					/* Estimate the direct illumination if this is requested */
+					Spectrum value = scene->sampleEmitterDirect(dRec, sampleArray[i+j], false);
+					if (value.isZero())
+						continue;
+
 					const Emitter *emitter = static_cast<const Emitter *>(dRec.object);
 
 					/* Allocate a record for querying the BSDF */
@@ -238,9 +253,20 @@ public:
 						const Float weight = miWeight(dRec.pdf * fracLum,
 								bsdfPdf * fracBSDF) * weightLum;
 
-						Li += value * bsdfVal * weight;
+						/* Defer the visibility test (same segment as in
+						   Scene::sampleEmitterDirect) */
+						shadowRays[shadowRayCount] = Ray(dRec.ref, dRec.d, Epsilon,
+								dRec.dist*(1-ShadowEpsilon), dRec.time);
+						contributions[shadowRayCount++] = value * bsdfVal * weight;
 					}
 				}
+
+				scene->isOccluded(shadowRays, shadowRayCount, occluded);
+
+				for (size_t j=0; j<shadowRayCount; ++j) {
+					if (!occluded[j])
+						Li += contributions[j];
+				}
 			}
 		}
 
@@ -140,6 +140,12 @@ public:
 		ref<BlockedRenderProcess> proc = new BlockedRenderProcess(job,
 			queue, scene->getBlockSize());
 
+		/* Samples are stored using the multi-channel variant of ImageBlock::put(),
+		   which does not record the moments needed to estimate the error */
+		if (m_adaptivePasses > 1)
+			Log(EWarn, "The multi-channel integrator does not support adaptive "
+				"rendering -- ignoring the 'adaptivePasses' parameter.");
+
 		proc->setPixelFormat(
 				m_integrators.size() > 1 ? Bitmap::EMultiSpectrumAlphaWeight : Bitmap::ESpectrumAlphaWeight,
 				(int) (m_integrators.size() * SPECTRUM_SAMPLES + 2), false);
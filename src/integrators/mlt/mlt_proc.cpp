@@ -57,8 +57,11 @@ public:
 	}
 
 	ref<WorkResult> createWorkResult() const {
-		return new ImageBlock(Bitmap::ESpectrum,
+		ref<ImageBlock> result = new ImageBlock(Bitmap::ESpectrum,
 			m_film->getCropSize(), m_film->getReconstructionFilter());
+		/* Markov chains often remain within a part of the image */
+		result->setSparse(true);
+		return result.get();
 	}
 
 	void prepare() {
@@ -381,9 +384,10 @@ void MLTProcess::develop() {
 }
 
 void MLTProcess::processResult(const WorkResult *wr, bool cancelled) {
-	LockGuard lock(m_resultMutex);
 	const ImageBlock *result = static_cast<const ImageBlock *>(wr);
-	m_accum->put(result);
+	m_accum->putAtomic(result);
+
+	LockGuard lock(m_resultMutex);
 	m_progress->update(++m_resultCounter);
 	m_refreshTimeout = std::min(2000U, m_refreshTimeout * 2);
 
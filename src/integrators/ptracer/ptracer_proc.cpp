@@ -25,16 +25,12 @@ MTS_NAMESPACE_BEGIN
 /* ==================================================================== */
 
 void CaptureParticleWorkResult::load(Stream *stream) {
-	size_t nEntries = (size_t) m_size.x * (size_t) m_size.y;
-	stream->readFloatArray(reinterpret_cast<Float *>(m_bitmap->getFloatData()),
-		nEntries * SPECTRUM_SAMPLES);
+	ImageBlock::load(stream);
 	m_range->load(stream);
 }
 
 void CaptureParticleWorkResult::save(Stream *stream) const {
-	size_t nEntries = (size_t) m_size.x * (size_t) m_size.y;
-	stream->writeFloatArray(reinterpret_cast<const Float *>(m_bitmap->getFloatData()),
-		nEntries * SPECTRUM_SAMPLES);
+	ImageBlock::save(stream);
 	m_range->save(stream);
 }
 
@@ -211,9 +207,11 @@ void CaptureParticleProcess::processResult(const WorkResult *wr, bool cancelled)
 	if (cancelled)
 		return;
 
+	/* Merge without holding the lock, so that workers don't serialize here */
+	m_accum->putAtomic(result);
+
 	LockGuard lock(m_resultMutex);
 	increaseResultCount(range->getSize());
-	m_accum->put(result);
 	if (m_job->isInteractive() || m_receivedResultCount == m_workCount)
 		develop();
 }
@@ -40,6 +40,8 @@ public:
 	 : ImageBlock(Bitmap::ESpectrum, res, filter) {
 		setOffset(Point2i(0, 0));
 		setSize(res);
+		/* A work unit usually only splats into a part of the image */
+		setSparse(true);
 		m_range = new RangeWorkUnit();
 	}
 
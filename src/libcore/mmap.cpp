@@ -18,10 +18,12 @@ struct MemoryMappedFile::MemoryMappedFilePrivate {
 	size_t size;
 	void *data;
 	bool readOnly;
+	bool copyOnWrite;
 	bool temp;
 
 	MemoryMappedFilePrivate(const fs::path &f = "", size_t s = 0)
-		: filename(f), size(s), data(NULL), readOnly(false), temp(false) {}
+		: filename(f), size(s), data(NULL), readOnly(false),
+		  copyOnWrite(false), temp(false) {}
 
 	void create() {
 		#if defined(__LINUX__) || defined(__OSX__)
@@ -122,26 +124,31 @@ struct MemoryMappedFile::MemoryMappedFilePrivate {
 		size = (size_t) fs::file_size(filename);
 
 		#if defined(__LINUX__) || defined(__OSX__)
-			int fd = open(filename.string().c_str(), readOnly ? O_RDONLY : O_RDWR);
+			int fd = open(filename.string().c_str(),
+				(readOnly || copyOnWrite) ? O_RDONLY : O_RDWR);
 			if (fd == -1)
 				Log(EError, "Could not open \"%s\"!", filename.string().c_str());
-			data = mmap(NULL, size, PROT_READ | (readOnly ? 0 : PROT_WRITE), MAP_SHARED, fd, 0);
+			data = mmap(NULL, size, PROT_READ | (readOnly ? 0 : PROT_WRITE),
+				copyOnWrite ? MAP_PRIVATE : MAP_SHARED, fd, 0);
 			if (data == NULL)
 				Log(EError, "Could not map \"%s\" to memory!", filename.string().c_str());
 			if (close(fd) != 0)
 				Log(EError, "close(): unable to close file!");
 		#elif defined(__WINDOWS__)
-			file = CreateFile(filename.string().c_str(), GENERIC_READ | (readOnly ? 0 : GENERIC_WRITE),
+			file = CreateFile(filename.string().c_str(),
+				GENERIC_READ | ((readOnly || copyOnWrite) ? 0 : GENERIC_WRITE),
 				FILE_SHARE_WRITE|FILE_SHARE_READ, NULL, OPEN_EXISTING,
 				FILE_ATTRIBUTE_NORMAL, NULL);
 			if (file == INVALID_HANDLE_VALUE)
 				Log(EError, "Could not open \"%s\": %s", filename.string().c_str(),
 					lastErrorText().c_str());
-			fileMapping = CreateFileMapping(file, NULL, readOnly ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+			fileMapping = CreateFileMapping(file, NULL, readOnly ? PAGE_READONLY :
+				(copyOnWrite ? PAGE_WRITECOPY : PAGE_READWRITE), 0, 0, NULL);
 			if (fileMapping == NULL)
 				Log(EError, "CreateFileMapping: Could not map \"%s\" to memory: %s",
 					filename.string().c_str(), lastErrorText().c_str());
-			data = (void *) MapViewOfFile(fileMapping, readOnly ? FILE_MAP_READ : FILE_MAP_WRITE, 0, 0, 0);
+			data = (void *) MapViewOfFile(fileMapping, readOnly ? FILE_MAP_READ :
+				(copyOnWrite ? FILE_MAP_COPY : FILE_MAP_WRITE), 0, 0, 0);
 			if (data == NULL)
 				Log(EError, "MapViewOfFile: Could not map \"%s\" to memory: %s",
 					filename.string().c_str(), lastErrorText().c_str());
@@ -219,6 +226,8 @@ MemoryMappedFile::~MemoryMappedFile() {
 void MemoryMappedFile::resize(size_t size) {
 	if (!d->data)
 		Log(EError, "Internal error in MemoryMappedFile::resize()!");
+	if (d->copyOnWrite)
+		Log(EError, "MemoryMappedFile::resize(): copy-on-write mappings cannot be resized!");
 	bool temp = d->temp;
 	d->temp = false;
 	d->unmap();
@@ -249,6 +258,20 @@ const fs::path &MemoryMappedFile::getFilename() const {
 	return d->filename;
 }
 
+bool MemoryMappedFile::isCopyOnWrite() const {
+	return d->copyOnWrite;
+}
+
+ref<MemoryMappedFile> MemoryMappedFile::createCopyOnWrite(const fs::path &filename) {
+	ref<MemoryMappedFile> result = new MemoryMappedFile();
+	result->d->filename = filename;
+	result->d->copyOnWrite = true;
+	result->d->map();
+	SLog(ETrace, "Mapped \"%s\" into memory (%s, copy-on-write)..",
+		filename.filename().string().c_str(), memString(result->d->size).c_str());
+	return result;
+}
+
 ref<MemoryMappedFile> MemoryMappedFile::createTemporary(size_t size) {
 	ref<MemoryMappedFile> result = new MemoryMappedFile();
 	result->d->size = size;
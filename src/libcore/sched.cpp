@@ -19,6 +19,7 @@
 #include <mitsuba/core/sched.h>
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/mstream.h>
+#include <mitsuba/core/atomic.h>
 
 #include <boost/thread/thread.hpp>
 
@@ -56,12 +57,31 @@ Scheduler::Scheduler() {
 	m_workAvailable = new ConditionVariable(m_mutex);
 	m_resourceCounter = 0;
 	m_processCounter = 0;
+	m_queuedWork = 0;
+	m_workBatchSize = 4;
+	m_workStealing = true;
 	m_running = false;
 }
 
 Scheduler::~Scheduler() {
 	for (size_t i=0; i<m_workers.size(); ++i)
 		m_workers[i]->decRef();
+	for (size_t i=0; i<m_workQueues.size(); ++i)
+		delete m_workQueues[i];
+}
+
+void Scheduler::setWorkStealing(bool enabled) {
+	if (m_running)
+		Log(EError, "setWorkStealing(): the scheduler must be paused!");
+	m_workStealing = enabled;
+}
+
+void Scheduler::setWorkBatchSize(int batchSize) {
+	if (m_running)
+		Log(EError, "setWorkBatchSize(): the scheduler must be paused!");
+	if (batchSize < 1)
+		Log(EError, "setWorkBatchSize(): the batch size must be positive!");
+	m_workBatchSize = batchSize;
 }
 
 void Scheduler::registerWorker(Worker *worker) {
@@ -378,6 +398,9 @@ bool Scheduler::cancel(ParallelProcess *process, bool reduceInflight) {
 	for (size_t i=0; i<m_workers.size(); ++i)
 		m_workers[i]->signalProcessCancellation(rec->id);
 
+	/* Drop queued work units that have not been started yet */
+	rec->inflight -= discardQueuedWork(rec->id);
+
 	/* Ensure that this process won't be scheduled again */
 	m_localQueue.erase(std::remove(m_localQueue.begin(), m_localQueue.end(), rec->id),
 		m_localQueue.end());
@@ -426,6 +449,9 @@ bool Scheduler::cancel(ParallelProcess *process, bool reduceInflight) {
 
 Scheduler::EStatus Scheduler::acquireWork(Item &item,
 		bool local, bool onlyTry, bool keepLock) {
+	if (local && m_workStealing && !keepLock)
+		return acquireQueuedWork(item, onlyTry);
+
 	UniqueLock lock(m_mutex);
 	std::deque<int> &queue = local ? m_localQueue : m_remoteQueue;
 	while (true) {
@@ -462,25 +488,10 @@ Scheduler::EStatus Scheduler::acquireWork(Item &item,
 			continue;
 		}
 
-		if (wStatus == ParallelProcess::ESuccess) {
+		if (wStatus == ParallelProcess::ESuccess)
 			break;
-		} else if (wStatus == ParallelProcess::EFailure) {
-#if defined(DEBUG_SCHED)
-			if (item.rec->morework)
-				Log(item.rec->logLevel, "Process %i has finished generating work", item.rec->id);
-#endif
-			item.rec->morework = false;
-			item.rec->active = false;
-			queue.pop_front();
-			if (item.rec->inflight == 0)
-				signalProcessTermination(item.proc, item.rec);
-		} else if (wStatus == ParallelProcess::EPause) {
-#if defined(DEBUG_SCHED)
-			Log(item.rec->logLevel, "Pausing process %i", item.rec->id);
-#endif
-			item.rec->active = false;
-			queue.pop_front();
-		}
+		else
+			retireProcess(item, queue, wStatus);
 	}
 
 	item.rec->inflight++;
@@ -495,6 +506,164 @@ Scheduler::EStatus Scheduler::acquireWork(Item &item,
 	return EOK;
 }
 
+void Scheduler::retireProcess(Item &item, std::deque<int> &queue,
+		ParallelProcess::EStatus wStatus) {
+	if (wStatus == ParallelProcess::EFailure) {
+#if defined(DEBUG_SCHED)
+		if (item.rec->morework)
+			Log(item.rec->logLevel, "Process %i has finished generating work", item.rec->id);
+#endif
+		item.rec->morework = false;
+		item.rec->active = false;
+		queue.pop_front();
+		if (item.rec->inflight == 0)
+			signalProcessTermination(item.proc, item.rec);
+	} else if (wStatus == ParallelProcess::EPause) {
+#if defined(DEBUG_SCHED)
+		Log(item.rec->logLevel, "Pausing process %i", item.rec->id);
+#endif
+		item.rec->active = false;
+		queue.pop_front();
+	}
+}
+
+Scheduler::EStatus Scheduler::acquireQueuedWork(Item &item, bool onlyTry) {
+	QueuedWork work;
+
+	while (true) {
+		if (!m_running)
+			return EStop;
+
+		if (!popQueuedWork(item.workerIndex, work) &&
+			!stealQueuedWork(item.workerIndex, work)) {
+			/* The private queue is empty and there was nothing to steal
+			   -- generate a new batch of work while holding the lock */
+			UniqueLock lock(m_mutex);
+
+			if (onlyTry && m_localQueue.size() == 0 && m_queuedWork == 0)
+				return ENone;
+
+			/* Wait until a process has work or until some other worker
+			   has queued work units, and return if stop() is called */
+			while (m_localQueue.size() == 0 && m_queuedWork == 0 && m_running)
+				m_workAvailable->wait();
+
+			if (!m_running)
+				return EStop;
+
+			/* Wake up idle workers so that they can steal the surplus */
+			int generated = generateQueuedWork(item);
+			for (int i=1; i<generated; ++i)
+				m_workAvailable->signal();
+			continue;
+		}
+
+		if (item.id != work.id) {
+			/* First work unit from this parallel process - establish
+			   connections to referenced resources and prepare the
+			   work processor */
+			try {
+				setProcessByID(item, work.id);
+			} catch (const std::exception &ex) {
+				Log(EWarn, "Caught an exception - canceling process %i: %s",
+					work.id, ex.what());
+				item.id = -1;
+				cancel(item.proc, true);
+				continue;
+			}
+		}
+		break;
+	}
+
+	item.workUnit = work.workUnit;
+	item.stop = work.rec->cancelled;
+	return EOK;
+}
+
+int Scheduler::generateQueuedWork(Item &item) {
+	WorkQueue *wq = m_workQueues[item.workerIndex];
+	int generated = 0;
+
+	while (generated < m_workBatchSize && m_localQueue.size() > 0) {
+		/* Try to create a work unit from the parallel
+		   process currently on top of the queue */
+		ParallelProcess::EStatus wStatus;
+		ref<WorkUnit> workUnit;
+		try {
+			int id = m_localQueue.front();
+			if (item.id != id)
+				setProcessByID(item, id);
+
+			workUnit = item.wp->createWorkUnit();
+			wStatus = item.proc->generateWork(workUnit, item.workerIndex);
+		} catch (const std::exception &ex) {
+			Log(EWarn, "Caught an exception - canceling process %i: %s",
+				item.id, ex.what());
+			cancel(item.proc);
+			continue;
+		}
+
+		if (wStatus == ParallelProcess::ESuccess) {
+			item.rec->inflight++;
+			LockGuard lock(wq->mutex);
+			wq->entries.push_back(QueuedWork(item.id, item.rec, workUnit));
+			atomicAdd(&m_queuedWork, 1);
+			++generated;
+		} else {
+			retireProcess(item, m_localQueue, wStatus);
+		}
+	}
+
+	return generated;
+}
+
+bool Scheduler::popQueuedWork(int workerIndex, QueuedWork &work) {
+	WorkQueue *wq = m_workQueues[workerIndex];
+	LockGuard lock(wq->mutex);
+	if (wq->entries.empty())
+		return false;
+	work = wq->entries.front();
+	wq->entries.pop_front();
+	atomicAdd(&m_queuedWork, -1);
+	return true;
+}
+
+bool Scheduler::stealQueuedWork(int workerIndex, QueuedWork &work) {
+	int queueCount = (int) m_workQueues.size();
+	for (int i=1; i<queueCount && m_queuedWork > 0; ++i) {
+		/* Steal from the opposite end to stay clear of the owner */
+		WorkQueue *wq = m_workQueues[(workerIndex + i) % queueCount];
+		LockGuard lock(wq->mutex);
+		if (wq->entries.empty())
+			continue;
+		work = wq->entries.back();
+		wq->entries.pop_back();
+		atomicAdd(&m_queuedWork, -1);
+		return true;
+	}
+	return false;
+}
+
+int Scheduler::discardQueuedWork(int id) {
+	int discarded = 0;
+	for (size_t i=0; i<m_workQueues.size(); ++i) {
+		WorkQueue *wq = m_workQueues[i];
+		LockGuard lock(wq->mutex);
+		std::deque<QueuedWork>::iterator it = wq->entries.begin();
+		while (it != wq->entries.end()) {
+			if (it->id == id) {
+				it = wq->entries.erase(it);
+				++discarded;
+			} else {
+				++it;
+			}
+		}
+	}
+	if (discarded > 0)
+		atomicAdd(&m_queuedWork, -discarded);
+	return discarded;
+}
+
 void Scheduler::signalProcessTermination(ParallelProcess *proc, ProcessRecord *rec) {
 #if defined(DEBUG_SCHED)
 	Log(rec->logLevel, "Process %i is complete.", rec->id);
@@ -529,6 +698,21 @@ void Scheduler::start() {
 	if (m_workers.size() == 0)
 		Log(EError, "Cannot start the scheduler - there are no registered workers!");
 
+	/* (Re-)create the private worker queues. Work units that were
+	   queued before the scheduler was paused are carried over and
+	   distributed round-robin over all new queues */
+	std::vector<WorkQueue *> workQueues(m_workers.size());
+	for (size_t i=0; i<workQueues.size(); ++i)
+		workQueues[i] = new WorkQueue();
+	size_t target = 0;
+	for (size_t i=0; i<m_workQueues.size(); ++i) {
+		std::deque<QueuedWork> &entries = m_workQueues[i]->entries;
+		for (size_t j=0; j<entries.size(); ++j)
+			workQueues[target++ % workQueues.size()]->entries.push_back(entries[j]);
+		delete m_workQueues[i];
+	}
+	m_workQueues = workQueues;
+
 	int coreIndex = 0;
 	for (size_t i=0; i<m_workers.size(); ++i) {
 		m_workers[i]->start(this, (int) i, coreIndex);
@@ -561,6 +745,9 @@ void Scheduler::stop() {
 	Log(EDebug, "Stopping ..");
 #endif
 	LockGuard lock(m_mutex);
+	for (size_t i=0; i<m_workQueues.size(); ++i)
+		m_workQueues[i]->entries.clear();
+	m_queuedWork = 0;
 	for (std::map<const ParallelProcess *, ProcessRecord *>::iterator
 			it = m_processes.begin(); it != m_processes.end(); ++it) {
 		(*it).first->decRef();
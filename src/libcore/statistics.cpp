@@ -130,6 +130,17 @@ void Statistics::registerCounter(const StatsCounter *ctr) {
 	m_counters.push_back(ctr);
 }
 
+const StatsCounter *Statistics::getCounter(const std::string &category,
+		const std::string &name) {
+	LockGuard lock(m_mutex);
+	for (size_t i=0; i<m_counters.size(); ++i) {
+		if (m_counters[i]->getCategory() == category &&
+			m_counters[i]->getName() == name)
+			return m_counters[i];
+	}
+	return NULL;
+}
+
 void Statistics::logPlugin(const std::string &name, const std::string &descr) {
 	m_plugins.push_back(std::pair<std::string, std::string>(name, descr));
 }
@@ -101,7 +101,7 @@ void VPLShaderManager::setScene(const Scene *scene) {
 			if (shape->getClass()->getName() == "Instance") {
 				const Instance *instance = static_cast<const Instance *>(shape);
 				const std::vector<const Shape *> &instantiatedShapes =
-						instance->getShapeGroup()->getKDTree()->getShapes();
+						instance->getShapeGroup()->getShapes();
 
 				for (size_t j=0; j<instantiatedShapes.size(); ++j) {
 					shape = instantiatedShapes[j];
@@ -165,7 +165,7 @@ void VPLShaderManager::setScene(const Scene *scene) {
 		if (shape->getClass()->getName() == "Instance") {
 			const Instance *instance = static_cast<const Instance *>(shape);
 			const std::vector<const Shape *> &instantiatedShapes =
-					instance->getShapeGroup()->getKDTree()->getShapes();
+					instance->getShapeGroup()->getShapes();
 			const AnimatedTransform *atrafo = instance->getWorldTransform();
 			const Matrix4x4 &trafo = atrafo->eval(0).getMatrix();
 
@@ -363,7 +363,7 @@ void VPLShaderManager::setVPL(const VPL &vpl) {
 		}
 
 		if (m_nearClip >= m_farClip) {
-			BSphere bsphere(m_scene->getKDTree()->getAABB().getBSphere());
+			BSphere bsphere(m_scene->getGeometryAABB().getBSphere());
 			Float minDist = 0;
 
 			if ((vpl.type == ESurfaceVPL || vpl.type == EPointEmitterVPL) &&
@@ -384,7 +384,7 @@ void VPLShaderManager::setVPL(const VPL &vpl) {
 	} else {
 		m_shadowMapType = ShadowMapGenerator::EDirectional;
 		m_shadowMapTransform = m_shadowGen->directionalFindGoodFrame(
-			m_scene->getKDTree()->getAABB(), vpl.its.shFrame.n);
+			m_scene->getGeometryAABB(), vpl.its.shFrame.n);
 	}
 
 	bool is2D =
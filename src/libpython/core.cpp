@@ -1804,6 +1804,10 @@ void export_core() {
 		.def("getInstance", &Scheduler::getInstance, BP_RETURN_VALUE)
 		.def("isRunning", &Scheduler::isRunning)
 		.def("isBusy", &Scheduler::isBusy)
+		.def("setWorkStealing", &Scheduler::setWorkStealing)
+		.def("getWorkStealing", &Scheduler::getWorkStealing)
+		.def("setWorkBatchSize", &Scheduler::setWorkBatchSize)
+		.def("getWorkBatchSize", &Scheduler::getWorkBatchSize)
 		.staticmethod("getInstance");
 
 	BP_CLASS(AbstractAnimationTrack, Object, bp::no_init)
@@ -187,24 +187,31 @@ typedef InternalArray<Point2>       InternalPoint2Array;
 typedef InternalArray<Color3>       InternalColor3Array;
 typedef InternalArray<TangentSpace> InternalTangentSpaceArray;
 
+/* The arrays below can be modified from Python, hence detach
+   the mesh from a potentially shared file mapping first */
 static InternalUInt32Array trimesh_getTriangles(TriMesh *triMesh) {
 	BOOST_STATIC_ASSERT(sizeof(Triangle) == 3*sizeof(uint32_t));
+	triMesh->copyMappedArrays();
 	return InternalUInt32Array(triMesh, (uint32_t *) triMesh->getTriangles(), triMesh->getTriangleCount()*3);
 }
 
 static InternalPoint3Array trimesh_getVertexPositions(TriMesh *triMesh) {
+	triMesh->copyMappedArrays();
 	return InternalPoint3Array(triMesh, triMesh->getVertexPositions(), triMesh->getVertexCount());
 }
 
 static InternalNormalArray trimesh_getVertexNormals(TriMesh *triMesh) {
+	triMesh->copyMappedArrays();
 	return InternalNormalArray(triMesh, triMesh->getVertexNormals(), triMesh->getVertexCount());
 }
 
 static InternalPoint2Array trimesh_getVertexTexcoords(TriMesh *triMesh) {
+	triMesh->copyMappedArrays();
 	return InternalPoint2Array(triMesh, triMesh->getVertexTexcoords(), triMesh->getVertexCount());
 }
 
 static InternalColor3Array trimesh_getVertexColors(TriMesh *triMesh) {
+	triMesh->copyMappedArrays();
 	return InternalColor3Array(triMesh, triMesh->getVertexColors(), triMesh->getVertexCount());
 }
 
@@ -361,6 +368,7 @@ void export_render() {
 		.def(bp::init<Stream *, InstanceManager *>())
 		.def("initialize", &Scene::initialize)
 		.def("invalidate", &Scene::invalidate)
+		.def("updateGeometry", &Scene::updateGeometry)
 		.def("preprocess", &Scene::preprocess)
 		.def("render", &Scene::render)
 		.def("postprocess", &Scene::postprocess)
@@ -574,6 +582,8 @@ void export_render() {
 		.def("computeUVTangents", &TriMesh::computeUVTangents)
 		.def("computeNormals", &TriMesh::computeNormals)
 		.def("rebuildTopology", &TriMesh::rebuildTopology)
+		.def("copyMappedArrays", &TriMesh::copyMappedArrays)
+		.def("updateVertexPositions", &TriMesh::updateVertexPositions)
 		.def("serialize", triMesh_serialize1)
 		.def("serialize", triMesh_serialize2)
 		.def("writeOBJ", &TriMesh::writeOBJ)
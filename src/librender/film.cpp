@@ -74,6 +74,22 @@ void Film::serialize(Stream *stream, InstanceManager *manager) const {
 	manager->serialize(stream, m_filter.get());
 }
 
+bool Film::isAccumulating() const {
+	return true;
+}
+
+bool Film::supportsCheckpoints() const {
+	return false;
+}
+
+void Film::saveCheckpoint(Stream *stream) const {
+	Log(EError, "%s does not support checkpoints!", getClass()->getName().c_str());
+}
+
+void Film::loadCheckpoint(Stream *stream) {
+	Log(EError, "%s does not support checkpoints!", getClass()->getName().c_str());
+}
+
 void Film::addChild(const std::string &name, ConfigurableObject *child) {
 	const Class *cClass = child->getClass();
 
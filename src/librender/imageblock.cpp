@@ -17,12 +17,19 @@
 */
 
 #include <mitsuba/render/imageblock.h>
+#include <mitsuba/core/statistics.h>
+#include <mitsuba/core/atomic.h>
+#include <mitsuba/core/timer.h>
 
 MTS_NAMESPACE_BEGIN
 
+static StatsCounter avgMergeTime("Image block", "Average atomic merge time (us)", EAverage);
+static StatsCounter mergedTiles("Image block", "Tiles merged from sparse blocks", EPercentage);
+
 ImageBlock::ImageBlock(Bitmap::EPixelFormat fmt, const Vector2i &size,
 		const ReconstructionFilter *filter, int channels, bool warn) : m_offset(0),
-		m_size(size), m_filter(filter), m_weightsX(NULL), m_weightsY(NULL), m_warn(warn) {
+		m_size(size), m_filter(filter), m_weightsX(NULL), m_weightsY(NULL),
+		m_variance(NULL), m_varianceSize(size), m_warn(warn) {
 	m_borderSize = filter ? filter->getBorderSize() : 0;
 
 	/* Allocate a small bitmap data structure for the block */
@@ -40,24 +47,193 @@ ImageBlock::ImageBlock(Bitmap::EPixelFormat fmt, const Vector2i &size,
 ImageBlock::~ImageBlock() {
 	if (m_weightsX)
 		delete[] m_weightsX;
+	if (m_variance)
+		delete[] m_variance;
+}
+
+void ImageBlock::setVarianceBuffer(bool enabled) {
+	if (enabled && !m_variance) {
+		size_t size = 3 * (size_t) m_varianceSize.x * (size_t) m_varianceSize.y;
+		m_variance = new Float[size];
+		memset(m_variance, 0, sizeof(Float) * size);
+	} else if (!enabled && m_variance) {
+		delete[] m_variance;
+		m_variance = NULL;
+	}
+}
+
+void ImageBlock::setSparse(bool sparse) {
+	if (sparse == isSparse())
+		return;
+	m_dirtyTiles.clear();
+	if (sparse) {
+		const Vector2i &size = m_bitmap->getSize();
+		m_tileCount = Vector2i(
+			(size.x + MTS_IMAGEBLOCK_TILE_SIZE - 1) / MTS_IMAGEBLOCK_TILE_SIZE,
+			(size.y + MTS_IMAGEBLOCK_TILE_SIZE - 1) / MTS_IMAGEBLOCK_TILE_SIZE);
+		m_dirty.resize((size_t) m_tileCount.x * (size_t) m_tileCount.y, 0);
+		/* The current contents are unknown */
+		markDirty(Point2i(0), Point2i(size - Vector2i(1)));
+	} else {
+		m_dirty.clear();
+	}
+}
+
+void ImageBlock::getTile(uint32_t idx, Point2i &offset, Vector2i &size) const {
+	const Vector2i &bitmapSize = m_bitmap->getSize();
+	offset = Point2i(
+		(int) (idx % (uint32_t) m_tileCount.x) * MTS_IMAGEBLOCK_TILE_SIZE,
+		(int) (idx / (uint32_t) m_tileCount.x) * MTS_IMAGEBLOCK_TILE_SIZE);
+	size = Vector2i(
+		std::min(MTS_IMAGEBLOCK_TILE_SIZE, bitmapSize.x - offset.x),
+		std::min(MTS_IMAGEBLOCK_TILE_SIZE, bitmapSize.y - offset.y));
+}
+
+void ImageBlock::clearDirtyTiles() {
+	const int channels = m_bitmap->getChannelCount(),
+	          width = m_bitmap->getWidth();
+	Float *data = m_bitmap->getFloatData();
+
+	for (size_t i=0; i<m_dirtyTiles.size(); ++i) {
+		Point2i offset;
+		Vector2i size;
+		getTile(m_dirtyTiles[i], offset, size);
+		for (int y=offset.y; y<offset.y + size.y; ++y)
+			memset(data + ((size_t) y * width + offset.x) * channels, 0,
+				sizeof(Float) * size.x * channels);
+		m_dirty[m_dirtyTiles[i]] = 0;
+	}
+	m_dirtyTiles.clear();
+}
+
+void ImageBlock::accumulate(const ImageBlock *block, bool atomic) {
+	Assert(block->getChannelCount() == getChannelCount());
+	const Vector2i delta = block->getOffset() - m_offset
+		- Vector2i(block->getBorderSize() - m_borderSize);
+
+	if (!block->isSparse()) {
+		accumulate(block, Point2i(0), block->getBitmap()->getSize(), delta, atomic);
+		return;
+	}
+
+	for (size_t i=0; i<block->m_dirtyTiles.size(); ++i) {
+		Point2i offset;
+		Vector2i size;
+		block->getTile(block->m_dirtyTiles[i], offset, size);
+		accumulate(block, offset, size, delta, atomic);
+	}
+}
+
+void ImageBlock::accumulate(const ImageBlock *block, const Point2i &offset,
+		const Vector2i &size, const Vector2i &delta, bool atomic) {
+	const int channels = m_bitmap->getChannelCount();
+	const Vector2i &targetSize = m_bitmap->getSize();
+	const int sourceWidth = block->getBitmap()->getWidth();
+
+	/* Clip against the target bitmap */
+	const Point2i start(
+		std::max(offset.x + delta.x, 0),
+		std::max(offset.y + delta.y, 0));
+	const Point2i end(
+		std::min(offset.x + size.x + delta.x, targetSize.x),
+		std::min(offset.y + size.y + delta.y, targetSize.y));
+	if (start.x >= end.x || start.y >= end.y)
+		return;
+
+	if (isSparse())
+		markDirty(start, end - Vector2i(1));
+
+	const size_t count = (size_t) (end.x - start.x) * channels;
+	for (int y=start.y; y<end.y; ++y) {
+		const Float *source = block->getBitmap()->getFloatData()
+			+ ((size_t) (y - delta.y) * sourceWidth + (start.x - delta.x)) * channels;
+		Float *target = m_bitmap->getFloatData()
+			+ ((size_t) y * targetSize.x + start.x) * channels;
+
+		if (atomic) {
+			for (size_t i=0; i<count; ++i) {
+				if (source[i] != 0)
+					atomicAdd(target + i, source[i]);
+			}
+		} else {
+			for (size_t i=0; i<count; ++i)
+				target[i] += source[i];
+		}
+	}
+}
+
+void ImageBlock::putAtomic(const ImageBlock *block) {
+	Assert(!isSparse());
+	ref<Timer> timer = new Timer();
+	accumulate(block, true);
+
+	avgMergeTime += (size_t) timer->getMicroseconds();
+	avgMergeTime.incrementBase();
+	if (block->isSparse()) {
+		mergedTiles += block->m_dirtyTiles.size();
+		mergedTiles.incrementBase(block->m_dirty.size());
+	}
 }
 
 void ImageBlock::load(Stream *stream) {
 	m_offset = Point2i(stream);
 	m_size = Vector2i(stream);
-	stream->readFloatArray(
-		m_bitmap->getFloatData(),
-		(size_t) m_bitmap->getSize().x *
-		(size_t) m_bitmap->getSize().y * m_bitmap->getChannelCount());
+	if (isSparse()) {
+		clearDirtyTiles();
+		const int channels = m_bitmap->getChannelCount(),
+		          width = m_bitmap->getWidth();
+		uint32_t tileCount = stream->readUInt();
+		for (uint32_t i=0; i<tileCount; ++i) {
+			uint32_t idx = stream->readUInt();
+			if (idx >= m_dirty.size())
+				Log(EError, "ImageBlock::load(): invalid tile index!");
+			Point2i offset;
+			Vector2i size;
+			getTile(idx, offset, size);
+			markDirty(offset, offset + size - Vector2i(1));
+			for (int y=offset.y; y<offset.y + size.y; ++y)
+				stream->readFloatArray(m_bitmap->getFloatData()
+					+ ((size_t) y * width + offset.x) * channels,
+					(size_t) size.x * channels);
+		}
+	} else {
+		stream->readFloatArray(
+			m_bitmap->getFloatData(),
+			(size_t) m_bitmap->getSize().x *
+			(size_t) m_bitmap->getSize().y * m_bitmap->getChannelCount());
+	}
+	if (m_variance)
+		stream->readFloatArray(m_variance,
+			3 * (size_t) m_varianceSize.x * (size_t) m_varianceSize.y);
 }
 
 void ImageBlock::save(Stream *stream) const {
 	m_offset.serialize(stream);
 	m_size.serialize(stream);
-	stream->writeFloatArray(
-		m_bitmap->getFloatData(),
-		(size_t) m_bitmap->getSize().x *
-		(size_t) m_bitmap->getSize().y * m_bitmap->getChannelCount());
+	if (isSparse()) {
+		/* Only transmit the tiles that were written to */
+		const int channels = m_bitmap->getChannelCount(),
+		          width = m_bitmap->getWidth();
+		stream->writeUInt((uint32_t) m_dirtyTiles.size());
+		for (size_t i=0; i<m_dirtyTiles.size(); ++i) {
+			Point2i offset;
+			Vector2i size;
+			getTile(m_dirtyTiles[i], offset, size);
+			stream->writeUInt(m_dirtyTiles[i]);
+			for (int y=offset.y; y<offset.y + size.y; ++y)
+				stream->writeFloatArray(m_bitmap->getFloatData()
+					+ ((size_t) y * width + offset.x) * channels,
+					(size_t) size.x * channels);
+		}
+	} else {
+		stream->writeFloatArray(
+			m_bitmap->getFloatData(),
+			(size_t) m_bitmap->getSize().x *
+			(size_t) m_bitmap->getSize().y * m_bitmap->getChannelCount());
+	}
+	if (m_variance)
+		stream->writeFloatArray(m_variance,
+			3 * (size_t) m_varianceSize.x * (size_t) m_varianceSize.y);
 }
 
 
@@ -19,6 +19,7 @@
 #include <mitsuba/core/statistics.h>
 #include <mitsuba/render/integrator.h>
 #include <mitsuba/render/renderproc.h>
+#include <mitsuba/render/renderjob.h>
 
 MTS_NAMESPACE_BEGIN
 
@@ -43,13 +44,36 @@ void Integrator::configureSampler(const Scene *scene, Sampler *sampler) {
 const Integrator *Integrator::getSubIntegrator(int idx) const { return NULL; }
 
 SamplingIntegrator::SamplingIntegrator(const Properties &props)
- : Integrator(props) { }
+ : Integrator(props) {
+	/* Maximum number of adaptive rendering passes (1 = disabled) */
+	m_adaptivePasses = props.getInteger("adaptivePasses", 1);
+
+	/* Blocks whose relative standard error is below this
+	   threshold receive no further samples */
+	m_adaptiveThreshold = props.getFloat("adaptiveThreshold", 0.01f);
+
+	/* Stop starting new adaptive passes after this many
+	   seconds (0 = unlimited) */
+	m_adaptiveTimeLimit = props.getFloat("adaptiveTimeLimit", 0.0f);
+
+	if (m_adaptivePasses < 1)
+		Log(EError, "'adaptivePasses' must be at least one!");
+	if (m_adaptiveThreshold < 0)
+		Log(EError, "'adaptiveThreshold' must be nonnegative!");
+}
 
 SamplingIntegrator::SamplingIntegrator(Stream *stream, InstanceManager *manager)
- : Integrator(stream, manager) { }
+ : Integrator(stream, manager) {
+	m_adaptivePasses = stream->readInt();
+	m_adaptiveThreshold = stream->readFloat();
+	m_adaptiveTimeLimit = stream->readFloat();
+}
 
 void SamplingIntegrator::serialize(Stream *stream, InstanceManager *manager) const {
 	Integrator::serialize(stream, manager);
+	stream->writeInt(m_adaptivePasses);
+	stream->writeFloat(m_adaptiveThreshold);
+	stream->writeFloat(m_adaptiveTimeLimit);
 }
 
 Spectrum SamplingIntegrator::E(const Scene *scene, const Intersection &its,
@@ -109,8 +133,45 @@ bool SamplingIntegrator::render(Scene *scene,
 		nCores == 1 ? "core" : "cores");
 
 	/* This is a sampling-based integrator - parallelize */
-	ref<ParallelProcess> proc = new BlockedRenderProcess(job,
+	ref<BlockedRenderProcess> proc = new BlockedRenderProcess(job,
 		queue, scene->getBlockSize());
+
+	if (m_adaptivePasses > 1) {
+		if (job && (job->getProgressivePasses() > 1 || job->getTimeLimit() > 0))
+			Log(EWarn, "The integrator performs adaptive rendering (adaptivePasses=%i) "
+				"-- ignoring the progressive pass count and time limit of the "
+				"render job!", m_adaptivePasses);
+		proc->setAdaptive(m_adaptivePasses, m_adaptiveThreshold, m_adaptiveTimeLimit);
+	} else if (job && job->getProgressivePasses() > 1)
+		proc->setProgressive(job->getProgressivePasses(), job->getTimeLimit());
+
+	if (proc->isMultiPass() && !film->isAccumulating())
+		Log(EError, "%s rendering requires a film that can accumulate several "
+			"passes, which is not the case for \"%s\"!", proc->isAdaptive()
+			? "Adaptive" : "Progressive", film->getClass()->getName().c_str());
+
+	if (proc->isMultiPass()) {
+		/* Deterministic sequences produce the same samples every
+		   time a block is rendered, which defeats extra passes */
+		std::string samplerName = sampler->getClass()->getName();
+		if (samplerName == "HaltonSampler" || samplerName == "HammersleySampler"
+			|| samplerName == "SobolSampler")
+			Log(EWarn, "The sampler \"%s\" generates the same samples in every "
+				"pass -- use the independent, stratified or ldsampler "
+				"plugin instead!", samplerName.c_str());
+	}
+
+	if (job && !job->getCheckpointFile().empty()) {
+		if (proc->isMultiPass() && !film->supportsCheckpoints())
+			Log(EError, "The film \"%s\" does not support checkpoints!",
+				film->getClass()->getName().c_str());
+		else if (proc->isMultiPass())
+			proc->setCheckpoint(job->getCheckpointFile(),
+				job->getCheckpointInterval(), job->getResume());
+		else
+			Log(EWarn, "Checkpoints require progressive or adaptive rendering "
+				"with more than one pass -- ignoring.");
+	}
 	int integratorResID = sched->registerResource(this);
 	proc->bindResource("integrator", integratorResID);
 	proc->bindResource("scene", sceneResID);
@@ -0,0 +1,449 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/lightbvh.h>
+#include <mitsuba/render/trimesh.h>
+#include <mitsuba/core/timer.h>
+
+/// Number of buckets used to evaluate split candidates
+#define MTS_LIGHTBVH_BUCKETS 12
+
+MTS_NAMESPACE_BEGIN
+
+/// Cosine of the difference of two angles, clamped to zero degrees
+static inline Float cosSubClamped(Float sinA, Float cosA, Float sinB, Float cosB) {
+	if (cosA > cosB)
+		return 1.0f;
+	return cosA * cosB + sinA * sinB;
+}
+
+/// Sine of the difference of two angles, clamped to zero degrees
+static inline Float sinSubClamped(Float sinA, Float cosA, Float sinB, Float cosB) {
+	if (cosA > cosB)
+		return 0.0f;
+	return sinA * cosB - cosA * sinB;
+}
+
+void LightBVH::LightBounds::expandBy(const LightBounds &bounds) {
+	if (bounds.phi == 0)
+		return;
+	if (phi == 0) {
+		*this = bounds;
+		return;
+	}
+
+	aabb.expandBy(bounds.aabb);
+	phi += bounds.phi;
+	cosThetaE = std::min(cosThetaE, bounds.cosThetaE);
+
+	/* Merge the two cones of normal directions */
+	Float thetaA = math::safe_acos(cosThetaO),
+	      thetaB = math::safe_acos(bounds.cosThetaO),
+	      thetaD = unitAngle(axis, bounds.axis);
+
+	if (std::min(thetaD + thetaB, (Float) M_PI) <= thetaA)
+		return;
+	if (std::min(thetaD + thetaA, (Float) M_PI) <= thetaB) {
+		axis = bounds.axis;
+		cosThetaO = bounds.cosThetaO;
+		return;
+	}
+
+	Float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+	Vector rotAxis = cross(axis, bounds.axis);
+	if (thetaO >= M_PI || rotAxis.lengthSquared() == 0) {
+		cosThetaO = -1.0f;
+		return;
+	}
+
+	axis = normalize(Transform::rotate(normalize(rotAxis),
+		radToDeg(thetaO - thetaA))(axis));
+	cosThetaO = std::cos(thetaO);
+}
+
+Float LightBVH::LightBounds::importance(const Point &p, const Normal &n) const {
+	/* Conservative estimate following "Importance Sampling of Many Lights
+	   with Adaptive Tree Splitting" by Conty Estevez and Kulla (2018) */
+	Point center = aabb.getCenter();
+	Vector wi = p - center;
+	Float dist2 = wi.lengthSquared(),
+	      radius2 = 0.25f * aabb.getExtents().lengthSquared();
+
+	/* Avoid the singularity close to the emitters */
+	Float clampedDist2 = std::max(dist2, std::sqrt(radius2));
+	if (dist2 > 0)
+		wi /= std::sqrt(dist2);
+
+	/* Angle between the cone axis and the direction to the reference point */
+	Float cosThetaW = dot(axis, wi),
+	      sinThetaW = math::safe_sqrt(1 - cosThetaW * cosThetaW);
+
+	/* Angle subtended by the bounding sphere of the emitters */
+	Float cosThetaB = -1.0f;
+	if (dist2 > radius2)
+		cosThetaB = math::safe_sqrt(1 - radius2 / dist2);
+	Float sinThetaB = math::safe_sqrt(1 - cosThetaB * cosThetaB);
+
+	/* Minimal angle between any emitter normal and any direction to the
+	   reference point */
+	Float sinThetaO = math::safe_sqrt(1 - cosThetaO * cosThetaO),
+	      cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO),
+	      sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO),
+	      cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+
+	if (cosThetaP <= cosThetaE)
+		return 0.0f;
+
+	Float result = phi * cosThetaP / clampedDist2;
+
+	/* Account for the foreshortening at the reference point */
+	if (!n.isZero()) {
+		Float cosThetaI = std::abs(dot(wi, n)),
+		      sinThetaI = math::safe_sqrt(1 - cosThetaI * cosThetaI);
+		result *= cosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+	}
+
+	return std::max(result, (Float) 0.0f);
+}
+
+Float LightBVH::LightBounds::orientationMeasure() const {
+	Float thetaO = math::safe_acos(cosThetaO),
+	      thetaE = math::safe_acos(cosThetaE),
+	      thetaW = std::min(thetaO + thetaE, (Float) M_PI),
+	      sinThetaO = std::sin(thetaO);
+
+	return 2 * M_PI * (1 - cosThetaO) + 0.5f * M_PI * (2 * thetaW * sinThetaO
+		- std::cos(thetaO - 2 * thetaW) - 2 * thetaO * sinThetaO + cosThetaO);
+}
+
+LightBVH::LightBVH() : m_infiniteProb(0.0f) { }
+
+LightBVH::~LightBVH() { }
+
+bool LightBVH::isFinite(const Emitter *emitter) {
+	return !emitter->isEnvironmentEmitter()
+		&& !(emitter->getType() & Emitter::EDeltaDirection)
+		&& emitter->getAABB().isValid();
+}
+
+LightBVH::LightBounds LightBVH::computeBounds(Emitter *emitter) {
+	LightBounds bounds;
+	bounds.aabb = emitter->getAABB();
+
+	/* The importance weight of a sampled position is the emitted power */
+	PositionSamplingRecord pRec(0.0f);
+	bounds.phi = emitter->samplePosition(pRec, Point2(0.5f)).getLuminance()
+		* emitter->getSamplingWeight();
+
+	/* Emission is restricted to the hemisphere around the surface normal.
+	   Other emitters are bounded by the full sphere of directions. */
+	bounds.axis = Vector(0.0f, 0.0f, 1.0f);
+	bounds.cosThetaO = -1.0f;
+	bounds.cosThetaE = 0.0f;
+
+	Shape *shape = emitter->getShape();
+	if (!emitter->isOnSurface() || !shape)
+		return bounds;
+
+	ref<TriMesh> mesh = shape->createTriMesh();
+	if (!mesh)
+		return bounds;
+
+	const Triangle *triangles = mesh->getTriangles();
+	const Point *positions = mesh->getVertexPositions();
+	const Normal *normals = mesh->getVertexNormals();
+	size_t triangleCount = mesh->getTriangleCount();
+
+	/* Area-weighted average of the face normals */
+	Vector sum(0.0f);
+	Float area = 0.0f;
+	for (size_t i=0; i<triangleCount; ++i) {
+		const Triangle &tri = triangles[i];
+		Vector n = cross(positions[tri.idx[1]] - positions[tri.idx[0]],
+			positions[tri.idx[2]] - positions[tri.idx[0]]);
+		sum += n;
+		area += n.length();
+	}
+
+	Float length = sum.length();
+	if (length <= 1e-3f * area)
+		return bounds;
+	Vector axis = sum / length;
+
+	/* Spread of the face normals (and shading normals, if available) */
+	Float cosThetaO = 1.0f;
+	for (size_t i=0; i<triangleCount; ++i) {
+		const Triangle &tri = triangles[i];
+		Vector n = cross(positions[tri.idx[1]] - positions[tri.idx[0]],
+			positions[tri.idx[2]] - positions[tri.idx[0]]);
+		Float nLength = n.length();
+		if (nLength > 0)
+			cosThetaO = std::min(cosThetaO, dot(axis, n) / nLength);
+	}
+	if (normals) {
+		for (size_t i=0; i<mesh->getVertexCount(); ++i)
+			cosThetaO = std::min(cosThetaO, dot(axis, normalize(Vector(normals[i]))));
+	}
+
+	bounds.axis = axis;
+	bounds.cosThetaO = std::max(cosThetaO, (Float) -1.0f);
+	return bounds;
+}
+
+void LightBVH::build(ref_vector<Emitter> &emitters) {
+	ref<Timer> timer = new Timer();
+
+	m_nodes.clear();
+	m_leaves.clear();
+	m_infiniteEmitters.clear();
+	m_infinitePDF.clear();
+	m_infiniteProb = 0.0f;
+
+	std::vector<BuildItem> items;
+	items.reserve(emitters.size());
+	size_t skipped = 0;
+	for (size_t i=0; i<emitters.size(); ++i) {
+		Emitter *emitter = emitters[i].get();
+		if (!isFinite(emitter)) {
+			m_infiniteEmitters.push_back((uint32_t) i);
+			m_infinitePDF.append(emitter->getSamplingWeight());
+			continue;
+		}
+
+		BuildItem item;
+		item.bounds = computeBounds(emitter);
+		item.emitter = (uint32_t) i;
+		if (item.bounds.phi > 0)
+			items.push_back(item);
+		else
+			++skipped;
+	}
+
+	if (!items.empty()) {
+		m_nodes.reserve(2 * items.size() - 1);
+		buildRecursive(items, 0, items.size(), -1);
+
+		for (size_t i=0; i<m_nodes.size(); ++i) {
+			if (m_nodes[i].leaf)
+				m_leaves[emitters[m_nodes[i].index].get()] = (uint32_t) i;
+		}
+	}
+
+	if (!m_infiniteEmitters.empty()) {
+		if (m_infinitePDF.normalize() > 0) {
+			m_infiniteProb = m_infiniteEmitters.size() /
+				(Float) (m_infiniteEmitters.size() + (m_nodes.empty() ? 0 : 1));
+		} else {
+			m_infiniteEmitters.clear();
+			m_infinitePDF.clear();
+		}
+	}
+
+	if (skipped > 0)
+		Log(EWarn, "Light hierarchy: ignoring " SIZE_T_FMT " emitters "
+			"without any emitted power", skipped);
+
+	Log(EDebug, "Built a light hierarchy over " SIZE_T_FMT " emitters ("
+		SIZE_T_FMT " nodes, " SIZE_T_FMT " infinite emitters) in %i ms",
+		items.size(), m_nodes.size(), m_infiniteEmitters.size(),
+		timer->getMilliseconds());
+}
+
+uint32_t LightBVH::buildRecursive(std::vector<BuildItem> &items,
+		size_t start, size_t end, int32_t parent) {
+	uint32_t nodeIndex = (uint32_t) m_nodes.size();
+	m_nodes.push_back(Node());
+	m_nodes[nodeIndex].parent = parent;
+
+	if (end - start == 1) {
+		Node &node = m_nodes[nodeIndex];
+		node.bounds = items[start].bounds;
+		node.index = items[start].emitter;
+		node.leaf = true;
+		return nodeIndex;
+	}
+
+	LightBounds bounds;
+	AABB centroidBounds;
+	for (size_t i=start; i<end; ++i) {
+		bounds.expandBy(items[i].bounds);
+		centroidBounds.expandBy(items[i].bounds.aabb.getCenter());
+	}
+
+	/* Evaluate the surface area orientation heuristic over a set of
+	   buckets along each axis. The squared diagonal is added to the
+	   surface area so that sets of point emitters (whose boxes are
+	   flat or degenerate) are still split in a balanced way. */
+	Vector extents = bounds.aabb.getExtents();
+	Float maxExtent = std::max(extents.x, std::max(extents.y, extents.z));
+	Float bestCost = std::numeric_limits<Float>::infinity();
+	int bestAxis = -1, bestBucket = -1;
+
+	for (int axis=0; axis<3; ++axis) {
+		Float cMin = centroidBounds.min[axis], cMax = centroidBounds.max[axis];
+		if (cMax <= cMin)
+			continue;
+
+		LightBounds buckets[MTS_LIGHTBVH_BUCKETS];
+		Float scale = MTS_LIGHTBVH_BUCKETS / (cMax - cMin);
+		for (size_t i=start; i<end; ++i) {
+			int b = std::min(MTS_LIGHTBVH_BUCKETS - 1,
+				(int) ((items[i].bounds.aabb.getCenter()[axis] - cMin) * scale));
+			buckets[b].expandBy(items[i].bounds);
+		}
+
+		/* Regularization factor that favors splitting along long axes */
+		Float kr = maxExtent / std::max(extents[axis], Epsilon);
+
+		for (int b=0; b<MTS_LIGHTBVH_BUCKETS - 1; ++b) {
+			LightBounds left, right;
+			for (int i=0; i<=b; ++i)
+				left.expandBy(buckets[i]);
+			for (int i=b+1; i<MTS_LIGHTBVH_BUCKETS; ++i)
+				right.expandBy(buckets[i]);
+			if (left.phi == 0 || right.phi == 0)
+				continue;
+
+			Float cost = kr * (
+				left.phi * left.orientationMeasure() * (left.aabb.getSurfaceArea()
+					+ left.aabb.getExtents().lengthSquared()) +
+				right.phi * right.orientationMeasure() * (right.aabb.getSurfaceArea()
+					+ right.aabb.getExtents().lengthSquared()));
+
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBucket = b;
+			}
+		}
+	}
+
+	size_t mid = start;
+	if (bestAxis != -1) {
+		Float cMin = centroidBounds.min[bestAxis], cMax = centroidBounds.max[bestAxis];
+		Float scale = MTS_LIGHTBVH_BUCKETS / (cMax - cMin);
+		for (size_t i=start; i<end; ++i) {
+			int b = std::min(MTS_LIGHTBVH_BUCKETS - 1,
+				(int) ((items[i].bounds.aabb.getCenter()[bestAxis] - cMin) * scale));
+			if (b <= bestBucket)
+				std::swap(items[i], items[mid++]);
+		}
+	}
+
+	/* Fall back to an equal split if no useful split plane was found */
+	if (mid == start || mid == end)
+		mid = (start + end) / 2;
+
+	uint32_t left = buildRecursive(items, start, mid, (int32_t) nodeIndex);
+	uint32_t right = buildRecursive(items, mid, end, (int32_t) nodeIndex);
+	Assert(left == nodeIndex + 1);
+
+	Node &node = m_nodes[nodeIndex];
+	node.bounds = bounds;
+	node.index = right;
+	node.leaf = false;
+	return nodeIndex;
+}
+
+size_t LightBVH::sampleReuse(const Point &p, const Normal &n,
+		Float &sampleValue, Float &pdf) const {
+	pdf = 1.0f;
+
+	if (m_infiniteProb > 0) {
+		if (sampleValue < m_infiniteProb) {
+			sampleValue = std::min(sampleValue / m_infiniteProb, ONE_MINUS_EPS);
+			Float infinitePdf;
+			size_t index = m_infinitePDF.sampleReuse(sampleValue, infinitePdf);
+			pdf = m_infiniteProb * infinitePdf;
+			return m_infiniteEmitters[index];
+		}
+		sampleValue = std::min((sampleValue - m_infiniteProb)
+			/ (1 - m_infiniteProb), ONE_MINUS_EPS);
+		pdf = 1 - m_infiniteProb;
+	}
+
+	if (m_nodes.empty()) {
+		pdf = 0.0f;
+		return 0;
+	}
+
+	uint32_t index = 0;
+	while (!m_nodes[index].leaf) {
+		const Node &node = m_nodes[index];
+		Float left = m_nodes[index + 1].bounds.importance(p, n),
+		      right = m_nodes[node.index].bounds.importance(p, n);
+
+		if (left == 0 && right == 0) {
+			/* None of the emitters can illuminate the reference point */
+			pdf = 0.0f;
+			return 0;
+		}
+
+		Float probLeft = left / (left + right);
+		if (sampleValue < probLeft) {
+			sampleValue = std::min(sampleValue / probLeft, ONE_MINUS_EPS);
+			pdf *= probLeft;
+			index = index + 1;
+		} else {
+			sampleValue = std::min((sampleValue - probLeft)
+				/ (1 - probLeft), ONE_MINUS_EPS);
+			pdf *= 1 - probLeft;
+			index = node.index;
+		}
+	}
+
+	return m_nodes[index].index;
+}
+
+Float LightBVH::pdf(const Point &p, const Normal &n, const Emitter *emitter) const {
+	LeafMap::const_iterator it = m_leaves.find(emitter);
+	if (it == m_leaves.end()) {
+		if (m_infiniteProb == 0 || isFinite(emitter))
+			return 0.0f;
+		return m_infiniteProb * emitter->getSamplingWeight()
+			* m_infinitePDF.getNormalization();
+	}
+
+	Float result = 1 - m_infiniteProb;
+	uint32_t index = it->second;
+	while (m_nodes[index].parent >= 0) {
+		uint32_t parent = (uint32_t) m_nodes[index].parent;
+		Float left = m_nodes[parent + 1].bounds.importance(p, n),
+		      right = m_nodes[m_nodes[parent].index].bounds.importance(p, n),
+		      own = (index == parent + 1) ? left : right;
+		if (own == 0)
+			return 0.0f;
+		result *= own / (left + right);
+		index = parent;
+	}
+
+	return result;
+}
+
+std::string LightBVH::toString() const {
+	std::ostringstream oss;
+	oss << "LightBVH[" << endl
+		<< "  nodes = " << m_nodes.size() << "," << endl
+		<< "  finiteEmitters = " << m_leaves.size() << "," << endl
+		<< "  infiniteEmitters = " << m_infiniteEmitters.size() << endl
+		<< "]";
+	return oss.str();
+}
+
+MTS_IMPLEMENT_CLASS(LightBVH, false, Object)
+MTS_NAMESPACE_END
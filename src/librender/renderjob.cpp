@@ -72,6 +72,10 @@ RenderJob::RenderJob(const std::string &threadName,
 		m_ownsSamplerResource = false;
 	}
 	m_cancelled = false;
+	m_progressivePasses = 1;
+	m_timeLimit = 0.0f;
+	m_checkpointInterval = 0.0f;
+	m_resume = false;
 }
 
 RenderJob::~RenderJob() {
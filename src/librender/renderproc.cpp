@@ -18,17 +18,27 @@
 
 #include <mitsuba/core/statistics.h>
 #include <mitsuba/core/sfcurve.h>
+#include <mitsuba/core/fstream.h>
 #include <mitsuba/render/renderproc.h>
 #include <mitsuba/render/rectwu.h>
 
+/// Offset that avoids huge relative errors of very dark pixels
+#define MTS_ADAPTIVE_ERROR_EPSILON 0.01f
+
+/// Identifies checkpoint files written by BlockedRenderProcess
+#define MTS_CHECKPOINT_HEADER 0x4B43
+#define MTS_CHECKPOINT_VERSION 1
+
 MTS_NAMESPACE_BEGIN
 
 class BlockRenderer : public WorkProcessor {
 public:
 	BlockRenderer(Bitmap::EPixelFormat pixelFormat, int channelCount, int blockSize,
-		int borderSize, bool warnInvalid) : m_pixelFormat(pixelFormat),
-		m_channelCount(channelCount), m_blockSize(blockSize),
-		m_borderSize(borderSize), m_warnInvalid(warnInvalid) { }
+		int borderSize, bool warnInvalid, bool varianceBuffer, uint64_t seed)
+		: m_pixelFormat(pixelFormat), m_channelCount(channelCount),
+		m_blockSize(blockSize), m_borderSize(borderSize),
+		m_warnInvalid(warnInvalid), m_varianceBuffer(varianceBuffer),
+		m_seed(seed) { }
 
 	BlockRenderer(Stream *stream, InstanceManager *manager) {
 		m_pixelFormat = (Bitmap::EPixelFormat) stream->readInt();
@@ -36,6 +46,8 @@ public:
 		m_blockSize = stream->readInt();
 		m_borderSize = stream->readInt();
 		m_warnInvalid = stream->readBool();
+		m_varianceBuffer = stream->readBool();
+		m_seed = stream->readULong();
 	}
 
 	ref<WorkUnit> createWorkUnit() const {
@@ -43,16 +55,21 @@ public:
 	}
 
 	ref<WorkResult> createWorkResult() const {
-		return new ImageBlock(m_pixelFormat,
+		ref<ImageBlock> block = new ImageBlock(m_pixelFormat,
 			Vector2i(m_blockSize),
 			m_sensor->getFilm()->getReconstructionFilter(),
 			m_channelCount, m_warnInvalid);
+		if (m_varianceBuffer)
+			block->setVarianceBuffer(true);
+		return block.get();
 	}
 
 	void prepare() {
 		Scene *scene = static_cast<Scene *>(getResource("scene"));
 		m_scene = new Scene(scene);
 		m_sampler = static_cast<Sampler *>(getResource("sampler"));
+		if (m_seed != 0) /* Resumed from a checkpoint: avoid repeating samples */
+			m_sampler->setSeed(m_seed + (uint64_t) Thread::getID());
 		m_sensor = static_cast<Sensor *>(getResource("sensor"));
 		m_integrator = static_cast<SamplingIntegrator *>(getResource("integrator"));
 		m_scene->removeSensor(scene->getSensor());
@@ -91,11 +108,13 @@ public:
 		stream->writeInt(m_blockSize);
 		stream->writeInt(m_borderSize);
 		stream->writeBool(m_warnInvalid);
+		stream->writeBool(m_varianceBuffer);
+		stream->writeULong(m_seed);
 	}
 
 	ref<WorkProcessor> clone() const {
 		return new BlockRenderer(m_pixelFormat, m_channelCount,
-			m_blockSize, m_borderSize, m_warnInvalid);
+			m_blockSize, m_borderSize, m_warnInvalid, m_varianceBuffer, m_seed);
 	}
 
 	MTS_DECLARE_CLASS()
@@ -111,6 +130,8 @@ private:
 	int m_blockSize;
 	int m_borderSize;
 	bool m_warnInvalid;
+	bool m_varianceBuffer;
+	uint64_t m_seed;
 	HilbertCurve2D<uint8_t> m_hilbertCurve;
 };
 
@@ -121,6 +142,18 @@ BlockedRenderProcess::BlockedRenderProcess(const RenderJob *parent, RenderQueue
 	m_pixelFormat = Bitmap::ESpectrumAlphaWeight;
 	m_channelCount = -1;
 	m_warnInvalid = true;
+	m_maxPasses = 1;
+	m_pass = 0;
+	m_errorThreshold = 0.0f;
+	m_timeLimit = 0.0f;
+	m_passPosition = 0;
+	m_outstanding = 0;
+	m_paused = m_passIssued = false;
+	m_adaptive = false;
+	m_checkpointInterval = m_lastCheckpoint = m_timeOffset = 0.0f;
+	m_checkpointPasses = 0;
+	m_resume = false;
+	m_seed = 0;
 }
 
 BlockedRenderProcess::~BlockedRenderProcess() {
@@ -134,9 +167,34 @@ void BlockedRenderProcess::setPixelFormat(Bitmap::EPixelFormat pixelFormat, int
 	m_warnInvalid = warnInvalid;
 }
 
+void BlockedRenderProcess::setAdaptive(int maxPasses, Float errorThreshold, Float timeLimit) {
+	if (maxPasses < 1)
+		Log(EError, "The number of passes must be at least one!");
+	m_adaptive = maxPasses > 1;
+	m_maxPasses = maxPasses;
+	m_errorThreshold = errorThreshold;
+	m_timeLimit = timeLimit;
+}
+
+void BlockedRenderProcess::setProgressive(int maxPasses, Float timeLimit) {
+	if (maxPasses < 1)
+		Log(EError, "The number of passes must be at least one!");
+	m_adaptive = false;
+	m_maxPasses = maxPasses;
+	m_errorThreshold = 0.0f;
+	m_timeLimit = timeLimit;
+}
+
+void BlockedRenderProcess::setCheckpoint(const fs::path &filename,
+		Float interval, bool resume) {
+	m_checkpointFile = filename;
+	m_checkpointInterval = interval;
+	m_resume = resume;
+}
+
 ref<WorkProcessor> BlockedRenderProcess::createWorkProcessor() const {
 	return new BlockRenderer(m_pixelFormat, m_channelCount,
-			m_blockSize, m_borderSize, m_warnInvalid);
+			m_blockSize, m_borderSize, m_warnInvalid, isAdaptive(), m_seed);
 }
 
 void BlockedRenderProcess::processResult(const WorkResult *result, bool cancelled) {
@@ -144,12 +202,96 @@ void BlockedRenderProcess::processResult(const WorkResult *result, bool cancelle
 	UniqueLock lock(m_resultMutex);
 	m_film->put(block);
 	m_progress->update(++m_resultCount);
+
+	if (!m_variance.empty() && block->hasVarianceBuffer()) {
+		/* Accumulate the per-pixel sample moments */
+		const Float *src = block->getVarianceBuffer();
+		const Point2i pos = block->getOffset() - Vector2i(m_offset);
+		const Vector2i &size = block->getSize();
+		const int srcWidth = block->getVarianceBufferSize().x;
+
+		for (int y=0; y<size.y; ++y) {
+			Float *dest = &m_variance[3 * ((size_t) (pos.y + y) * m_size.x + pos.x)];
+			const Float *row = src + 3 * y * srcWidth;
+			for (int i=0; i<3*size.x; ++i)
+				dest[i] += row[i];
+		}
+	}
+
+	bool finishPass = --m_outstanding == 0 && m_passIssued
+		&& isMultiPass() && !cancelled;
 	lock.unlock();
 	m_queue->signalWorkEnd(m_parent, block, cancelled);
+
+	if (!finishPass)
+		return;
+
+	/* All samples of the current pass are now in the film. Plan the next
+	   pass and write the checkpoint here rather than in generateWork(),
+	   which runs while the scheduler is locked. generateWork() pauses
+	   the process until this is done (m_passIssued is still set). An
+	   elapsed time limit makes this the final pass */
+	int finishedPasses = m_pass + 1;
+	if (m_timeLimit > 0 && getElapsedTime() > m_timeLimit) {
+		Log(EInfo, "Time limit reached after %i %s", finishedPasses,
+			finishedPasses == 1 ? "pass" : "passes");
+		m_passBlocks.clear();
+		m_passPosition = 0;
+	} else {
+		planPass();
+	}
+
+	if (!m_checkpointFile.empty() && finishedPasses > m_checkpointPasses &&
+		(m_passBlocks.empty() || getElapsedTime() - m_lastCheckpoint
+		 >= m_checkpointInterval))
+		saveCheckpoint(finishedPasses);
+
+	lock.lock();
+	bool resume = m_paused;
+	m_paused = m_passIssued = false;
+	lock.unlock();
+
+	/* Resubmit the paused process to start the next pass */
+	if (resume)
+		Scheduler::getInstance()->schedule(this);
 }
 
 ParallelProcess::EStatus BlockedRenderProcess::generateWork(WorkUnit *unit, int worker) {
-	EStatus status = BlockedImageProcess::generateWork(unit, worker);
+	EStatus status = EFailure;
+
+	if (m_numBlocksGenerated < m_numBlocksTotal) {
+		/* First pass: render every block once */
+		status = BlockedImageProcess::generateWork(unit, worker);
+		if (status == ESuccess) {
+			LockGuard lock(m_resultMutex);
+			++m_outstanding;
+			m_passIssued = m_numBlocksGenerated == m_numBlocksTotal;
+		}
+	} else if (isMultiPass()) {
+		LockGuard lock(m_resultMutex);
+		if (m_passIssued) {
+			/* Pause until all results of the current pass have arrived
+			   (processResult() then plans the next pass and resubmits
+			   the process) */
+			m_paused = true;
+			return EPause;
+		}
+
+		if (m_passPosition < m_passBlocks.size()) {
+			RectangularWorkUnit &rect = *static_cast<RectangularWorkUnit *>(unit);
+			int index = m_passBlocks[m_passPosition++];
+			Point2i pos(index % m_numBlocks.x, index / m_numBlocks.x);
+			pos *= m_blockSize;
+			rect.setOffset(pos + m_offset);
+			rect.setSize(Vector2i(
+				std::min(m_size.x-pos.x, m_blockSize),
+				std::min(m_size.y-pos.y, m_blockSize)));
+			++m_outstanding;
+			m_passIssued = m_passPosition == m_passBlocks.size();
+			status = ESuccess;
+		}
+	}
+
 	if (status == ESuccess)
 		m_queue->signalWorkBegin(m_parent, static_cast<RectangularWorkUnit *>(unit), worker);
 	return status;
@@ -176,11 +318,205 @@ void BlockedRenderProcess::bindResource(const std::string &name, int id) {
 		BlockedImageProcess::init(offset, size, m_blockSize);
 		if (m_progress)
 			delete m_progress;
-		m_progress = new ProgressReporter("Rendering", m_numBlocksTotal, m_parent);
+		m_progress = new ProgressReporter("Rendering",
+			(long long) m_numBlocksTotal * m_maxPasses, m_parent);
+
+		m_pass = 0;
+		m_passBlocks.clear();
+		m_passPosition = 0;
+		m_outstanding = 0;
+		m_paused = m_passIssued = false;
+		m_variance.clear();
+		if (isAdaptive())
+			m_variance.resize(3 * (size_t) size.x * (size_t) size.y, 0.0f);
+		if (isMultiPass())
+			m_timer = new Timer();
+
+		m_timeOffset = m_lastCheckpoint = 0.0f;
+		m_checkpointPasses = 0;
+		m_seed = 0;
+		if (!m_checkpointFile.empty() && m_resume && fs::exists(m_checkpointFile))
+			loadCheckpoint();
 	}
 	BlockedImageProcess::bindResource(name, id);
 }
 
+void BlockedRenderProcess::planPass() {
+	m_passBlocks.clear();
+	m_passPosition = 0;
+
+	if (m_pass + 1 >= m_maxPasses)
+		return;
+
+	if (!isAdaptive()) {
+		/* Progressive rendering: render every block once more */
+		m_passBlocks.resize(m_numBlocksTotal);
+		for (int index=0; index<m_numBlocksTotal; ++index)
+			m_passBlocks[index] = index;
+		++m_pass;
+		Log(EDebug, "Progressive rendering: pass %i of %i", m_pass + 1, m_maxPasses);
+		return;
+	}
+
+	/* Compute the RMS relative standard error of every block */
+	std::vector<std::pair<Float, int> > errors;
+	errors.reserve(m_numBlocksTotal);
+	Float totalError = 0, maxError = 0, totalSamples = 0;
+
+	UniqueLock lock(m_resultMutex);
+	for (int index=0; index<m_numBlocksTotal; ++index) {
+		Point2i pos(index % m_numBlocks.x, index / m_numBlocks.x);
+		pos *= m_blockSize;
+		Point2i end(std::min(pos.x + m_blockSize, m_size.x),
+		            std::min(pos.y + m_blockSize, m_size.y));
+
+		Float errorSum = 0;
+		int pixelCount = 0;
+		for (int y=pos.y; y<end.y; ++y) {
+			for (int x=pos.x; x<end.x; ++x) {
+				const Float *moments = &m_variance[3 * ((size_t) y * m_size.x + x)];
+				const Float n = moments[0];
+				totalSamples += n;
+				if (n < 2)
+					continue;
+				const Float mean = moments[1] / n,
+				      variance = std::max((Float) 0,
+				          (moments[2] - moments[1] * mean) / (n - 1)),
+				      denom = mean + MTS_ADAPTIVE_ERROR_EPSILON;
+				errorSum += variance / (n * denom * denom);
+				++pixelCount;
+			}
+		}
+
+		Float error = pixelCount > 0 ? std::sqrt(errorSum / pixelCount) : 0.0f;
+		maxError = std::max(maxError, error);
+		if (error > m_errorThreshold) {
+			errors.push_back(std::make_pair(error, index));
+			totalError += error;
+		}
+	}
+	lock.unlock();
+
+	if (totalSamples == 0) {
+		/* Samples stored via the multi-channel variant of ImageBlock::put()
+		   are not tracked, hence there is no error estimate to work with */
+		Log(EWarn, "Adaptive rendering: the integrator did not record any per-pixel "
+			"statistics (e.g. because it writes multi-channel samples) -- "
+			"stopping after the first pass.");
+		return;
+	}
+
+	if (errors.empty()) {
+		Log(EInfo, "Adaptive rendering: all blocks converged after %i %s "
+			"(max. error %f)", m_pass + 1, m_pass == 0 ? "pass" : "passes", maxError);
+		return;
+	}
+
+	/* Distribute one work unit per block in proportion to the error,
+	   starting with the blocks that need it the most */
+	std::sort(errors.begin(), errors.end(), std::greater<std::pair<Float, int> >());
+	Float accum = 0;
+	int issued = 0;
+	for (size_t i=0; i<errors.size(); ++i) {
+		accum += errors[i].first * m_numBlocksTotal / totalError;
+		int count = (int) (accum + 0.5f) - issued;
+		for (int j=0; j<count; ++j)
+			m_passBlocks.push_back(errors[i].second);
+		issued += count;
+	}
+
+	++m_pass;
+	Log(EInfo, "Adaptive rendering: pass %i, %i of %i blocks above the error "
+		"threshold (max. error %f)", m_pass + 1, (int) errors.size(),
+		m_numBlocksTotal, maxError);
+}
+
+Float BlockedRenderProcess::getElapsedTime() const {
+	return m_timeOffset + (m_timer.get() ? m_timer->getSeconds() : (Float) 0);
+}
+
+void BlockedRenderProcess::saveCheckpoint(int passes) {
+	fs::path tempFile = m_checkpointFile.string() + ".tmp";
+	ref<Timer> timer = new Timer();
+
+	/* A failed checkpoint should not bring down the rendering */
+	try {
+		ref<FileStream> stream = new FileStream(tempFile, FileStream::ETruncWrite);
+		stream->writeShort(MTS_CHECKPOINT_HEADER);
+		stream->writeShort(MTS_CHECKPOINT_VERSION);
+		stream->writeInt(passes);
+		stream->writeFloat(getElapsedTime());
+		stream->writeBool(m_adaptive);
+		if (m_adaptive) {
+			stream->writeSize(m_variance.size());
+			stream->writeFloatArray(&m_variance[0], m_variance.size());
+		}
+		m_film->saveCheckpoint(stream);
+		stream->close();
+
+		/* Replace the previous checkpoint only once the new one is complete */
+		fs::rename(tempFile, m_checkpointFile);
+	} catch (const std::exception &ex) {
+		Log(EWarn, "Could not write the checkpoint file \"%s\": %s",
+			m_checkpointFile.string().c_str(), ex.what());
+		return;
+	}
+
+	m_checkpointPasses = passes;
+	m_lastCheckpoint = getElapsedTime();
+	Log(EInfo, "Wrote a checkpoint after %i %s to \"%s\" (took %s)", passes,
+		passes == 1 ? "pass" : "passes", m_checkpointFile.string().c_str(),
+		timeString(timer->getSeconds()).c_str());
+}
+
+void BlockedRenderProcess::loadCheckpoint() {
+	ref<FileStream> stream = new FileStream(m_checkpointFile, FileStream::EReadOnly);
+	if (stream->readShort() != MTS_CHECKPOINT_HEADER)
+		Log(EError, "\"%s\" is not a valid checkpoint file!",
+			m_checkpointFile.string().c_str());
+	if (stream->readShort() != MTS_CHECKPOINT_VERSION)
+		Log(EError, "The checkpoint file \"%s\" was created by an incompatible "
+			"version of Mitsuba!", m_checkpointFile.string().c_str());
+
+	int passes = stream->readInt();
+	Float elapsed = stream->readFloat();
+	bool adaptive = stream->readBool();
+	if (adaptive != m_adaptive)
+		Log(EError, "The checkpoint file \"%s\" was created by %s rendering, "
+			"which does not match the current configuration!",
+			m_checkpointFile.string().c_str(), adaptive ? "adaptive" : "progressive");
+	if (adaptive) {
+		size_t size = stream->readSize();
+		if (size != m_variance.size())
+			Log(EError, "The checkpoint file \"%s\" does not match the image size!",
+				m_checkpointFile.string().c_str());
+		stream->readFloatArray(&m_variance[0], size);
+	}
+	m_film->loadCheckpoint(stream);
+
+	/* Skip the first pass and continue after the restored ones */
+	m_numBlocksGenerated = m_numBlocksTotal;
+	m_pass = passes - 1;
+	m_checkpointPasses = passes;
+	m_timeOffset = m_lastCheckpoint = elapsed;
+	m_resultCount = std::min(passes, m_maxPasses) * m_numBlocksTotal;
+	m_progress->update(m_resultCount);
+
+	/* Derive a new seed from the number of restored passes, so that
+	   resuming twice from the same checkpoint is reproducible */
+	m_seed = (uint64_t) passes * 0x9E3779B97F4A7C15ULL;
+
+	/* Don't start another pass when the time limit was already reached */
+	m_passBlocks.clear();
+	m_passPosition = 0;
+	if (m_timeLimit <= 0 || elapsed <= m_timeLimit)
+		planPass();
+
+	Log(EInfo, "Resuming from the checkpoint \"%s\" after %i %s (%s)",
+		m_checkpointFile.string().c_str(), passes, passes == 1 ? "pass" : "passes",
+		timeString(elapsed).c_str());
+}
+
 MTS_IMPLEMENT_CLASS(BlockedRenderProcess, false, BlockedImageProcess)
 MTS_IMPLEMENT_CLASS_S(BlockRenderer, false, WorkProcessor)
 MTS_NAMESPACE_END
@@ -48,6 +48,8 @@ void Sampler::serialize(Stream *stream, InstanceManager *manager) const {
 
 void Sampler::setFilmResolution(const Vector2i &, bool) { }
 
+void Sampler::setSeed(uint64_t) { }
+
 void Sampler::generate(const Point2i &) {
 	m_sampleIndex = 0;
 	m_dimension1DArray = m_dimension2DArray = 0;
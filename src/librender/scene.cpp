@@ -18,8 +18,10 @@
 
 #include <mitsuba/render/scene.h>
 #include <mitsuba/render/renderjob.h>
+#include <mitsuba/render/texcache.h>
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/statistics.h>
+#include <boost/algorithm/string.hpp>
 
 #define DEFAULT_BLOCKSIZE 32
 
@@ -30,14 +32,16 @@ MTS_NAMESPACE_BEGIN
 // ===========================================================================
 
 Scene::Scene()
- : NetworkedObject(Properties()), m_blockSize(DEFAULT_BLOCKSIZE) {
+ : NetworkedObject(Properties()), m_blockSize(DEFAULT_BLOCKSIZE),
+   m_prevTextureMemory(-1) {
 	m_kdtree = new ShapeKDTree();
 	m_sourceFile = new fs::path();
 	m_destinationFile = new fs::path();
 }
 
 Scene::Scene(const Properties &props)
- : NetworkedObject(props), m_blockSize(DEFAULT_BLOCKSIZE) {
+ : NetworkedObject(props), m_blockSize(DEFAULT_BLOCKSIZE),
+   m_prevTextureMemory(-1) {
 	m_kdtree = new ShapeKDTree();
 	/* kd-tree construction: Enable primitive clipping? Generally leads to a
 	  significant improvement of the resulting tree. */
@@ -76,12 +80,71 @@ Scene::Scene(const Properties &props)
 	   in succession before a leaf node will be created.*/
 	if (props.hasProperty("kdMaxBadRefines"))
 		m_kdtree->setMaxBadRefines(props.getInteger("kdMaxBadRefines"));
+	/* kd-tree construction: compact storage (compressed index lists and
+	   no precomputed triangle data) to reduce memory usage in very large scenes */
+	if (props.hasProperty("kdCompact"))
+		m_kdtree->setCompactStorage(props.getBoolean("kdCompact"));
+	/* kd-tree construction: directory for persistent kd-tree cache files.
+	   When geometry and parameters match a cached tree, it is memory-mapped
+	   instead of being rebuilt. */
+	if (props.hasProperty("kdCacheDirectory"))
+		m_kdtree->setCacheDirectory(props.getString("kdCacheDirectory"));
+	/* Acceleration data structure used for ray tracing: "kdtree" (default),
+	   "bvh" (a 4-wide BVH with compressed nodes) or "twolevel" (a BVH with
+	   a separate top level over the geometry instances) */
+	std::string accelerator = boost::to_lower_copy(
+		props.getString("accelerator", "kdtree"));
+	if (accelerator == "bvh")
+		setAccelerator(EBVH);
+	else if (accelerator == "twolevel")
+		setAccelerator(ETwoLevel);
+	else if (accelerator != "kdtree")
+		Log(EError, "Unknown acceleration data structure \"%s\" (must be "
+			"\"kdtree\", \"bvh\" or \"twolevel\")", accelerator.c_str());
+	/* BVH construction: maximum number of primitives per leaf (1-8) */
+	if (props.hasProperty("bvhMaxLeafSize")) {
+		if (!m_bvh.get())
+			Log(EError, "The 'bvhMaxLeafSize' parameter requires a BVH accelerator");
+		m_bvh->setMaxLeafSize(props.getInteger("bvhMaxLeafSize"));
+	}
+	/* BVH refitting: relative SAH cost increase that triggers a rebuild
+	   when the scene geometry is updated (see updateGeometry()) */
+	if (props.hasProperty("bvhRebuildThreshold")) {
+		if (!m_bvh.get())
+			Log(EError, "The 'bvhRebuildThreshold' parameter requires a BVH accelerator");
+		m_bvh->setRebuildThreshold(props.getFloat("bvhRebuildThreshold"));
+	}
+	/* Emitter selection for direct illumination sampling: "weights"
+	   (default, proportional to the emitters' sampling weights) or
+	   "lightbvh" (according to the estimated contribution, see LightBVH) */
+	std::string emitterSampling = boost::to_lower_copy(
+		props.getString("emitterSampling", "weights"));
+	if (emitterSampling == "lightbvh")
+		setEmitterSampling(ELightBVH);
+	else if (emitterSampling != "weights")
+		Log(EError, "Unknown emitter sampling strategy \"%s\" (must be "
+			"\"weights\" or \"lightbvh\")", emitterSampling.c_str());
+	/* Texture paging: maximum amount of memory (in MiB) used by the shared
+	   tile cache of MIP maps that are backed by a cache file. The cache is
+	   process-wide, hence this overrides the command line parameter '-m'
+	   until the scene is destroyed, which restores the previous limit. */
+	if (props.hasProperty("textureMemory")) {
+		int64_t textureMemory = props.getLong("textureMemory");
+		if (textureMemory < 0)
+			Log(EError, "The 'textureMemory' parameter must be nonnegative");
+		TextureTileCache *cache = TextureTileCache::getInstance();
+		m_prevTextureMemory = (int64_t) cache->getMemoryLimit();
+		cache->setMemoryLimit((size_t) textureMemory * 1024 * 1024);
+	}
 	m_sourceFile = new fs::path();
 	m_destinationFile = new fs::path();
 }
 
-Scene::Scene(Scene *scene) : NetworkedObject(Properties()) {
+Scene::Scene(Scene *scene) : NetworkedObject(Properties()),
+	m_prevTextureMemory(-1) {
 	m_kdtree = scene->m_kdtree;
+	m_bvh = scene->m_bvh;
+	m_lightBVH = scene->m_lightBVH;
 	m_blockSize = scene->m_blockSize;
 	m_aabb = scene->m_aabb;
 	m_environmentEmitter = scene->m_environmentEmitter;
@@ -104,7 +167,7 @@ Scene::Scene(Scene *scene) : NetworkedObject(Properties()) {
 }
 
 Scene::Scene(Stream *stream, InstanceManager *manager)
- : NetworkedObject(stream, manager) {
+ : NetworkedObject(stream, manager), m_prevTextureMemory(-1) {
 	m_kdtree = new ShapeKDTree();
 	m_kdtree->setQueryCost(stream->readFloat());
 	m_kdtree->setTraversalCost(stream->readFloat());
@@ -116,6 +179,15 @@ Scene::Scene(Stream *stream, InstanceManager *manager)
 	m_kdtree->setParallelBuild(stream->readBool());
 	m_kdtree->setRetract(stream->readBool());
 	m_kdtree->setMaxBadRefines(stream->readUInt());
+	m_kdtree->setCompactStorage(stream->readBool());
+	if (stream->readBool()) {
+		m_bvh = new ShapeBVH();
+		m_bvh->setTwoLevel(stream->readBool());
+		m_bvh->setMaxLeafSize(stream->readInt());
+		m_bvh->setRebuildThreshold(stream->readFloat());
+	}
+	if (stream->readBool())
+		m_lightBVH = new LightBVH();
 	m_blockSize = stream->readUInt();
 	m_degenerateSensor = stream->readBool();
 	m_degenerateEmitters = stream->readBool();
@@ -165,6 +237,8 @@ Scene::Scene(Stream *stream, InstanceManager *manager)
 }
 
 Scene::~Scene() {
+	if (m_prevTextureMemory >= 0)
+		TextureTileCache::getInstance()->setMemoryLimit((size_t) m_prevTextureMemory);
 	delete m_destinationFile;
 	delete m_sourceFile;
 }
@@ -182,6 +256,14 @@ void Scene::serialize(Stream *stream, InstanceManager *manager) const {
 	stream->writeBool(m_kdtree->getParallelBuild());
 	stream->writeBool(m_kdtree->getRetract());
 	stream->writeUInt(m_kdtree->getMaxBadRefines());
+	stream->writeBool(m_kdtree->getCompactStorage());
+	stream->writeBool(m_bvh.get() != NULL);
+	if (m_bvh.get()) {
+		stream->writeBool(m_bvh->isTwoLevel());
+		stream->writeInt(m_bvh->getMaxLeafSize());
+		stream->writeFloat(m_bvh->getRebuildThreshold());
+	}
+	stream->writeBool(m_lightBVH.get() != NULL);
 	stream->writeUInt(m_blockSize);
 	stream->writeBool(m_degenerateSensor);
 	stream->writeBool(m_degenerateEmitters);
@@ -317,10 +399,100 @@ void Scene::configure() {
 
 void Scene::invalidate() {
 	m_kdtree = new ShapeKDTree();
+	if (m_bvh.get()) {
+		ref<ShapeBVH> bvh = new ShapeBVH();
+		bvh->setTwoLevel(m_bvh->isTwoLevel());
+		bvh->setMaxLeafSize(m_bvh->getMaxLeafSize());
+		bvh->setRebuildThreshold(m_bvh->getRebuildThreshold());
+		m_bvh = bvh;
+	}
+}
+
+void Scene::updateGeometry() {
+	if (m_bvh.get() ? !m_bvh->isBuilt() : !m_kdtree->isBuilt())
+		Log(EError, "updateGeometry(): the scene has not been initialized yet!");
+
+	if (m_bvh.get()) {
+		m_bvh->update();
+	} else {
+		/* The kd-tree cannot be refitted -- rebuild it with the same
+		   parameters. The cache directory is not carried over, since
+		   every frame would otherwise create a new cache file. */
+		ref<ShapeKDTree> kdtree = new ShapeKDTree();
+		kdtree->setQueryCost(m_kdtree->getQueryCost());
+		kdtree->setTraversalCost(m_kdtree->getTraversalCost());
+		kdtree->setEmptySpaceBonus(m_kdtree->getEmptySpaceBonus());
+		kdtree->setStopPrims(m_kdtree->getStopPrims());
+		kdtree->setClip(m_kdtree->getClip());
+		kdtree->setMaxDepth(m_kdtree->getMaxDepth());
+		kdtree->setExactPrimitiveThreshold(m_kdtree->getExactPrimitiveThreshold());
+		kdtree->setParallelBuild(m_kdtree->getParallelBuild());
+		kdtree->setRetract(m_kdtree->getRetract());
+		kdtree->setMaxBadRefines(m_kdtree->getMaxBadRefines());
+		kdtree->setCompactStorage(m_kdtree->getCompactStorage());
+
+		const std::vector<const Shape *> &shapes = m_kdtree->getShapes();
+		for (size_t i=0; i<shapes.size(); ++i)
+			kdtree->addShape(shapes[i]);
+		kdtree->build();
+		m_kdtree = kdtree;
+	}
+
+	updateEmitters();
+
+	/* Update the scene bounds and the shapes that depend on them */
+	initializeBidirectional();
+}
+
+void Scene::updateInstances() {
+	if (!m_bvh.get() || !m_bvh->isTwoLevel()) {
+		updateGeometry();
+		return;
+	}
+
+	if (!m_bvh->isBuilt())
+		Log(EError, "updateInstances(): the scene has not been initialized yet!");
+
+	m_bvh->updateInstances();
+	updateEmitters();
+
+	/* Update the scene bounds and the shapes that depend on them */
+	initializeBidirectional();
+}
+
+void Scene::setAccelerator(EAccelerator accelerator) {
+	if (m_kdtree->isBuilt() || (m_bvh.get() && m_bvh->isBuilt()))
+		Log(EError, "The acceleration data structure cannot be changed "
+			"after the scene has been initialized!");
+	if (accelerator == EBVH || accelerator == ETwoLevel) {
+		if (!m_bvh.get() || m_bvh->isTwoLevel() != (accelerator == ETwoLevel)) {
+			ref<ShapeBVH> bvh = new ShapeBVH();
+			bvh->setTwoLevel(accelerator == ETwoLevel);
+			if (m_bvh.get()) {
+				bvh->setMaxLeafSize(m_bvh->getMaxLeafSize());
+				bvh->setRebuildThreshold(m_bvh->getRebuildThreshold());
+			}
+			m_bvh = bvh;
+		}
+	} else {
+		m_bvh = NULL;
+	}
+}
+
+void Scene::setEmitterSampling(EEmitterSampling emitterSampling) {
+	if (emitterSampling == ELightBVH) {
+		if (!m_lightBVH.get()) {
+			m_lightBVH = new LightBVH();
+			if (m_emitterPDF.isNormalized())
+				m_lightBVH->build(m_emitters);
+		}
+	} else {
+		m_lightBVH = NULL;
+	}
 }
 
 void Scene::initialize() {
-	if (!m_kdtree->isBuilt()) {
+	if (m_bvh.get() ? !m_bvh->isBuilt() : !m_kdtree->isBuilt()) {
 		/* Expand all geometry */
 		ref_vector<Shape> temp;
 		temp.reserve(m_shapes.size());
@@ -341,10 +513,13 @@ void Scene::initialize() {
 				SIZE_T_FMT ".", primitiveCount, effPrimitiveCount);
 		}
 
-		/* Build the kd-tree */
-		m_kdtree->build();
+		/* Build the acceleration data structure */
+		if (m_bvh.get())
+			m_bvh->build();
+		else
+			m_kdtree->build();
 
-		m_aabb = m_kdtree->getAABB();
+		m_aabb = getGeometryAABB();
 	}
 
 	/* Make sure that there are no duplicates */
@@ -372,19 +547,39 @@ void Scene::initialize() {
 			emitter->configure();
 		}
 
-		/* Calculate a discrete PDF to importance sample emitters */
-		for (ref_vector<Emitter>::iterator it = m_emitters.begin();
-				it != m_emitters.end(); ++it)
-			m_emitterPDF.append(it->get()->getSamplingWeight());
-
-		m_emitterPDF.normalize();
+		buildEmitterSampling();
 	}
 
 	initializeBidirectional();
 }
 
+void Scene::buildEmitterSampling() {
+	/* Calculate a discrete PDF to importance sample emitters */
+	m_emitterPDF.clear();
+	for (ref_vector<Emitter>::iterator it = m_emitters.begin();
+			it != m_emitters.end(); ++it)
+		m_emitterPDF.append(it->get()->getSamplingWeight());
+
+	m_emitterPDF.normalize();
+
+	if (m_lightBVH.get())
+		m_lightBVH->build(m_emitters);
+}
+
+void Scene::updateEmitters() {
+	/* Area emitters cache the power and bounds of their (deformed) shape,
+	   and the light BVH caches those of the emitters */
+	for (ref_vector<Emitter>::iterator it = m_emitters.begin();
+			it != m_emitters.end(); ++it) {
+		if ((*it)->isOnSurface() && (*it)->getShape())
+			(*it)->configure();
+	}
+
+	buildEmitterSampling();
+}
+
 void Scene::initializeBidirectional() {
-	m_aabb = m_kdtree->getAABB();
+	m_aabb = getGeometryAABB();
 	m_degenerateEmitters = true;
 	m_specialShapes.clear();
 
@@ -586,7 +781,10 @@ void Scene::addShape(Shape *shape) {
 		if (shape->getClass()->derivesFrom(MTS_CLASS(TriMesh)))
 			m_meshes.push_back(static_cast<TriMesh *>(shape));
 
-		m_kdtree->addShape(shape);
+		if (m_bvh.get())
+			m_bvh->addShape(shape);
+		else
+			m_kdtree->addShape(shape);
 		m_shapes.push_back(shape);
 	}
 }
@@ -599,6 +797,7 @@ std::string Scene::toString() const {
 		<< "  sampler = " << indent(m_sampler.toString()) << "," << endl
 		<< "  integrator = " << indent(m_integrator.toString()) << "," << endl
 		<< "  kdtree = " << indent(m_kdtree.toString()) << "," << endl
+		<< "  bvh = " << indent(m_bvh.toString()) << "," << endl
 		<< "  environmentEmitter = " << indent(m_environmentEmitter.toString()) << "," << endl
 		<< "  shapes = " << indent(containerToString(m_shapes.begin(), m_shapes.end())) << "," << endl
 		<< "  emitters = " << indent(containerToString(m_emitters.begin(), m_emitters.end())) << "," << endl
@@ -831,7 +1030,9 @@ Spectrum Scene::sampleEmitterDirect(DirectSamplingRecord &dRec,
 
 	/* Randomly pick an emitter */
 	Float emPdf;
-	size_t index = m_emitterPDF.sampleReuse(sample.x, emPdf);
+	size_t index = sampleEmitterIndexDirect(dRec, sample.x, emPdf);
+	if (emPdf == 0)
+		return Spectrum(0.0f);
 	const Emitter *emitter = m_emitters[index].get();
 	Spectrum value = emitter->sampleDirect(dRec, sample);
 
@@ -839,7 +1040,7 @@ Spectrum Scene::sampleEmitterDirect(DirectSamplingRecord &dRec,
 		if (testVisibility) {
 			Ray ray(dRec.ref, dRec.d, Epsilon,
 					dRec.dist*(1-ShadowEpsilon), dRec.time);
-			if (m_kdtree->rayIntersect(ray))
+			if (rayIntersect(ray))
 				return Spectrum(0.0f);
 		}
 		dRec.object = emitter;
@@ -857,7 +1058,9 @@ Spectrum Scene::sampleAttenuatedEmitterDirect(DirectSamplingRecord &dRec,
 
 	/* Randomly pick an emitter */
 	Float emPdf;
-	size_t index = m_emitterPDF.sampleReuse(sample.x, emPdf);
+	size_t index = sampleEmitterIndexDirect(dRec, sample.x, emPdf);
+	if (emPdf == 0)
+		return Spectrum(0.0f);
 	const Emitter *emitter = m_emitters[index].get();
 	Spectrum value = emitter->sampleDirect(dRec, sample);
 
@@ -880,7 +1083,9 @@ Spectrum Scene::sampleAttenuatedEmitterDirect(DirectSamplingRecord &dRec,
 
 	/* Randomly pick an emitter */
 	Float emPdf;
-	size_t index = m_emitterPDF.sampleReuse(sample.x, emPdf);
+	size_t index = sampleEmitterIndexDirect(dRec, sample.x, emPdf);
+	if (emPdf == 0)
+		return Spectrum(0.0f);
 	const Emitter *emitter = m_emitters[index].get();
 	Spectrum value = emitter->sampleDirect(dRec, sample);
 
@@ -905,7 +1110,7 @@ Spectrum Scene::sampleSensorDirect(DirectSamplingRecord &dRec,
 		if (testVisibility) {
 			Ray ray(dRec.ref, dRec.d, Epsilon,
 					dRec.dist*(1-ShadowEpsilon), dRec.time);
-			if (m_kdtree->rayIntersect(ray))
+			if (rayIntersect(ray))
 				return Spectrum(0.0f);
 		}
 		dRec.object = m_sensor.get();
@@ -948,6 +1153,8 @@ Spectrum Scene::sampleAttenuatedSensorDirect(DirectSamplingRecord &dRec,
 
 Float Scene::pdfEmitterDirect(const DirectSamplingRecord &dRec) const {
 	const Emitter *emitter = static_cast<const Emitter *>(dRec.object);
+	if (m_lightBVH.get())
+		return emitter->pdfDirect(dRec) * m_lightBVH->pdf(dRec.ref, dRec.refN, emitter);
 	return emitter->pdfDirect(dRec) * pdfEmitterDiscrete(emitter);
 }
 
@@ -30,24 +30,178 @@
 #include <xercesc/sax/Locator.hpp>
 #include <mitsuba/render/scenehandler.h>
 #include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/timer.h>
+#include <mitsuba/core/lock.h>
 #include <mitsuba/render/scene.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/unordered_set.hpp>
+#include <algorithm>
+#include <deque>
 
 MTS_NAMESPACE_BEGIN
 XERCES_CPP_NAMESPACE_USE
 
 #define TRANSCODE_BLOCKSIZE 2048
 
+/// Time (in ms) after which an idle loader thread exits
+#define LOADER_IDLE_TIMEOUT 200
+
+/// Number of slowest objects that are listed in the load summary
+#define LOADER_SUMMARY_COUNT 5
+
 #define XMLLog(level, fmt, ...) Thread::getThread()->getLogger()->log(\
 	level, NULL, __FILE__, __LINE__, "In file \"%s\" (near line %i): " fmt, \
 	m_locator ? transcode(m_locator->getSystemId()).c_str() : "<unknown>", \
 	m_locator ? m_locator->getLineNumber() : -1, \
 	## __VA_ARGS__)
 
+#define LoadLog(task, level, fmt, ...) Thread::getThread()->getLogger()->log(\
+	level, NULL, __FILE__, __LINE__, "In file \"%s\" (near line %i): " fmt, \
+	(task)->file.c_str(), (task)->line, ## __VA_ARGS__)
+
 typedef void (*CleanupFun) ();
 typedef boost::unordered_set<CleanupFun> CleanupSet;
 static PrimitiveThreadLocal<CleanupSet> __cleanup_tls;
+static PrimitiveThreadLocal<bool> __loader_tls;
+
+/**
+ * Element whose plugin constructor is executed by a \ref LoadThread,
+ * while the parser continues with the remainder of the document
+ */
+struct SceneHandler::LoadTask : public Object {
+	const Class *cls;
+	Properties props;
+	std::string name, nodeName, id;
+	std::string file, description;
+	int line;
+	std::vector<std::pair<std::string, ConfigurableObject *> > children;
+	ref<FileResolver> resolver;
+	std::vector<CleanupFun> cleanup;
+	ref<ConfigurableObject> object, expanded;
+	std::string error;
+	int loadTime;
+	bool done, resolved;
+
+	LoadTask() : cls(NULL), line(-1), loadTime(0),
+		done(false), resolved(false) { }
+protected:
+	virtual ~LoadTask() {
+		for (size_t i=0; i<children.size(); ++i)
+			if (children[i].second)
+				children[i].second->decRef();
+	}
+};
+
+/**
+ * Work queue shared by the loader threads. Threads are spawned on demand
+ * (up to the number of cores) and exit after being idle for a while.
+ */
+class SceneHandler::LoadQueue : public Object {
+public:
+	LoadQueue(size_t maxThreads) : m_maxThreads(maxThreads),
+			m_threadCount(0), m_idleCount(0) {
+		m_mutex = new Mutex();
+		m_cond = new ConditionVariable(m_mutex);
+	}
+
+	void submit(LoadTask *task);
+
+	/// Block until the given task has been processed
+	void wait(LoadTask *task) {
+		LockGuard lock(m_mutex);
+		while (!task->done)
+			m_cond->wait();
+	}
+
+	/// Fetch the next task (returns \c NULL when the thread should exit)
+	ref<LoadTask> next() {
+		LockGuard lock(m_mutex);
+		while (m_queue.empty()) {
+			++m_idleCount;
+			bool signalled = m_cond->wait(LOADER_IDLE_TIMEOUT);
+			--m_idleCount;
+			if (!signalled && m_queue.empty()) {
+				--m_threadCount;
+				return NULL;
+			}
+		}
+		ref<LoadTask> task = m_queue.front();
+		m_queue.pop_front();
+		return task;
+	}
+
+	/// Mark a task as processed and wake up the parser
+	void finish(LoadTask *task) {
+		LockGuard lock(m_mutex);
+		task->done = true;
+		m_cond->broadcast();
+	}
+
+	/// Discard all tasks that have not been started yet
+	void cancel() {
+		LockGuard lock(m_mutex);
+		for (size_t i=0; i<m_queue.size(); ++i)
+			m_queue[i]->done = true;
+		m_queue.clear();
+		m_cond->broadcast();
+	}
+
+	inline size_t getMaxThreads() const { return m_maxThreads; }
+protected:
+	virtual ~LoadQueue() { }
+private:
+	std::deque<ref<LoadTask> > m_queue;
+	ref<Mutex> m_mutex;
+	ref<ConditionVariable> m_cond;
+	size_t m_maxThreads, m_threadCount, m_idleCount;
+};
+
+class SceneHandler::LoadThread : public Thread {
+public:
+	LoadThread(LoadQueue *queue, size_t index)
+		: Thread(formatString("load%i", (int) index)), m_queue(queue) { }
+
+	void run() {
+		__loader_tls.get() = true;
+		ref<LoadTask> task;
+		while ((task = m_queue->next()) != NULL) {
+			Thread::getThread()->setFileResolver(task->resolver);
+			ref<Timer> timer = new Timer();
+			try {
+				task->object = PluginManager::getInstance()->createObject(
+					task->cls, task->props);
+			} catch (const std::exception &ex) {
+				task->error = ex.what();
+			}
+			task->loadTime = timer->getMilliseconds();
+
+			/* Cleanup handlers are invoked by the parser thread
+			   once the whole scene has been loaded */
+			CleanupSet &cleanup = __cleanup_tls.get();
+			task->cleanup.insert(task->cleanup.end(),
+				cleanup.begin(), cleanup.end());
+			cleanup.clear();
+
+			m_queue->finish(task);
+		}
+	}
+protected:
+	virtual ~LoadThread() { }
+private:
+	ref<LoadQueue> m_queue;
+};
+
+void SceneHandler::LoadQueue::submit(LoadTask *task) {
+	LockGuard lock(m_mutex);
+	m_queue.push_back(task);
+	if (m_idleCount > 0) {
+		m_cond->broadcast();
+	} else if (m_threadCount < m_maxThreads) {
+		ref<LoadThread> thread = new LoadThread(this, m_threadCount++);
+		thread->start();
+		thread->detach();
+	}
+}
 
 SceneHandler::SceneHandler(const ParameterMap &params,
 	NamedObjectMap *namedObjects, bool isIncludedFile) : m_params(params),
@@ -55,6 +209,11 @@ SceneHandler::SceneHandler(const ParameterMap &params,
 	m_pluginManager = PluginManager::getInstance();
 	m_locator = NULL;
 
+	/* Objects that are loaded from files are constructed in parallel */
+	int coreCount = getCoreCount();
+	if (coreCount > 1)
+		m_loadQueue = new LoadQueue((size_t) coreCount);
+
 	if (m_isIncludedFile) {
 		SAssert(namedObjects != NULL);
 	} else {
@@ -111,6 +270,8 @@ SceneHandler::SceneHandler(const ParameterMap &params,
 }
 
 SceneHandler::~SceneHandler() {
+	if (m_loadQueue)
+		m_loadQueue->cancel();
 	delete m_transcoder;
 	clear();
 	if (!m_isIncludedFile)
@@ -164,6 +325,31 @@ void SceneHandler::startDocument() {
 void SceneHandler::endDocument() {
 	SAssert(m_scene != NULL);
 
+	if (!m_tasks.empty()) {
+		/* Wait for objects that are still being loaded */
+		resolveAll();
+
+		/* Sort by decreasing load time */
+		std::vector<std::pair<int, LoadTask *> > tasks(m_tasks.size());
+		int totalTime = 0;
+		for (size_t i=0; i<m_tasks.size(); ++i) {
+			tasks[i] = std::make_pair(-m_tasks[i]->loadTime, m_tasks[i].get());
+			totalTime += m_tasks[i]->loadTime;
+		}
+		std::sort(tasks.begin(), tasks.end());
+
+		SLog(EInfo, "Loaded %i objects using up to %i threads (%s of load "
+			"time in %s)", (int) tasks.size(), (int) m_loadQueue->getMaxThreads(),
+			timeString(totalTime / 1000.0f, true).c_str(),
+			timeString(m_loadTimer->getMilliseconds() / 1000.0f, true).c_str());
+		for (size_t i=0; i<tasks.size(); ++i)
+			SLog(i < LOADER_SUMMARY_COUNT ? EInfo : EDebug, "  %s: %s",
+				tasks[i].second->description.c_str(),
+				timeString(tasks[i].second->loadTime / 1000.0f, true).c_str());
+
+		m_tasks.clear();
+	}
+
 	/* Call cleanup handlers */
 	CleanupSet &cleanup = __cleanup_tls.get();
 	for (CleanupSet::iterator it = cleanup.begin();
@@ -172,6 +358,100 @@ void SceneHandler::endDocument() {
 	cleanup.clear();
 }
 
+void SceneHandler::submit(ParseContext &context, const TagEntry &tag,
+		const std::string &name) {
+	ref<LoadTask> task = new LoadTask();
+	task->cls = tag.second;
+	task->props = context.properties;
+	task->name = name;
+	task->nodeName = context.attributes["name"];
+	task->id = context.attributes["id"];
+	task->file = m_locator ? transcode(m_locator->getSystemId()) : "<unknown>";
+	task->line = m_locator ? (int) m_locator->getLineNumber() : -1;
+	task->description = formatString("%s%s (%s, \"%s\")", name.c_str(),
+		task->id.empty() ? "" : (" \"" + task->id + "\"").c_str(),
+		context.properties.getPluginName().c_str(),
+		fs::path(context.properties.getString("filename")).filename().string().c_str());
+	task->children.swap(context.children);
+	task->resolver = Thread::getThread()->getFileResolver();
+
+	if (!task->id.empty()) {
+		if (m_namedObjects->find(task->id) != m_namedObjects->end() ||
+			m_pendingObjects.find(task->id) != m_pendingObjects.end())
+			XMLLog(EError, "Duplicate ID '%s' used in scene description!", task->id.c_str());
+		m_pendingObjects[task->id] = task;
+	}
+
+	/* Reserve a slot in the parent's children list */
+	if (context.parent != NULL) {
+		context.parent->pending.push_back(std::make_pair(
+			context.parent->children.size(), task.get()));
+		context.parent->children.push_back(std::pair<std::string,
+			ConfigurableObject *>(task->nodeName, (ConfigurableObject *) NULL));
+	}
+
+	if (m_tasks.empty())
+		m_loadTimer = new Timer();
+	m_tasks.push_back(task);
+	m_loadQueue->submit(task);
+}
+
+ConfigurableObject *SceneHandler::resolve(LoadTask *task) {
+	if (task->resolved)
+		return task->object;
+
+	m_loadQueue->wait(task);
+	task->resolved = true;
+
+	CleanupSet &cleanup = __cleanup_tls.get();
+	cleanup.insert(task->cleanup.begin(), task->cleanup.end());
+
+	if (!task->id.empty())
+		m_pendingObjects.erase(task->id);
+
+	if (task->object == NULL)
+		LoadLog(task, EError, "Error while creating object: %s", task->error.c_str());
+
+	ConfigurableObject *object = task->object;
+
+	/* If the object has children, append them */
+	for (std::vector<std::pair<std::string, ConfigurableObject *> >
+			::iterator it = task->children.begin();
+			it != task->children.end(); ++it) {
+		if (it->second != NULL) {
+			object->addChild(it->first, it->second);
+			it->second->setParent(object);
+			it->second->decRef();
+		}
+	}
+	task->children.clear();
+
+	object->configure();
+
+	if (object->getClass()->derivesFrom(MTS_CLASS(Texture)))
+		task->expanded = static_cast<Texture *>(object)->expand();
+	else
+		task->expanded = object;
+
+	/* Warn about unqueried properties */
+	std::vector<std::string> unq = task->props.getUnqueried();
+	for (unsigned int i=0; i<unq.size(); ++i)
+		LoadLog(task, EWarn, "Unqueried attribute \"%s\" in element \"%s\"",
+			unq[i].c_str(), task->name.c_str());
+
+	if (!task->id.empty()) {
+		(*m_namedObjects)[task->id] = task->expanded;
+		task->expanded->incRef();
+	}
+
+	return object;
+}
+
+void SceneHandler::resolveAll() {
+	for (size_t i=0; i<m_tasks.size(); ++i)
+		resolve(m_tasks[i]);
+}
+
 void SceneHandler::characters(const XMLCh* const name,
 		const XMLSize_t length) {
 	std::string value = trim(transcode(name));
@@ -270,9 +550,22 @@ void pushSceneCleanupHandler(void (*cleanup)()) {
 	__cleanup_tls.get().insert(cleanup);
 }
 
+bool isSceneLoaderThread() {
+	return __loader_tls.get();
+}
+
 void SceneHandler::endElement(const XMLCh* const xmlName) {
 	std::string name = transcode(xmlName);
 	ParseContext &context = m_context.top();
+
+	/* Wait for children that were constructed in parallel */
+	for (size_t i=0; i<context.pending.size(); ++i) {
+		ConfigurableObject *child = resolve(context.pending[i].second);
+		child->incRef();
+		context.children[context.pending[i].first].second = child;
+	}
+	context.pending.clear();
+
 	std::string type = boost::to_lower_copy(context.attributes["type"]);
 	context.properties.setPluginName(type);
 	if (context.attributes.find("id") != context.attributes.end())
@@ -297,6 +590,8 @@ void SceneHandler::endElement(const XMLCh* const xmlName) {
 
 		case EReference: {
 				std::string id = context.attributes["id"];
+				if (m_pendingObjects.find(id) != m_pendingObjects.end())
+					resolve(m_pendingObjects[id]);
 				if (m_namedObjects->find(id) == m_namedObjects->end())
 					XMLLog(EError, "Referenced object '%s' not found!", id.c_str());
 				object = (*m_namedObjects)[id];
@@ -645,10 +940,13 @@ void SceneHandler::endElement(const XMLCh* const xmlName) {
 
 		case EAlias: {
 				std::string id = context.attributes["id"], as = context.attributes["as"];
+				if (m_pendingObjects.find(id) != m_pendingObjects.end())
+					resolve(m_pendingObjects[id]);
 				if (m_namedObjects->find(id) == m_namedObjects->end())
 					XMLLog(EError, "Referenced object '%s' not found!", id.c_str());
 				ConfigurableObject *obj = (*m_namedObjects)[id];
-				if (m_namedObjects->find(as) != m_namedObjects->end())
+				if (m_namedObjects->find(as) != m_namedObjects->end() ||
+					m_pendingObjects.find(as) != m_pendingObjects.end())
 					XMLLog(EError, "Duplicate ID '%s' used in scene description!", id.c_str());
 				obj->incRef();
 				(*m_namedObjects)[as] = obj;
@@ -656,6 +954,9 @@ void SceneHandler::endElement(const XMLCh* const xmlName) {
 			break;
 
 		case EInclude: {
+				/* The included file may reference any object defined so far */
+				resolveAll();
+
 				SAXParser* parser = new SAXParser();
 				FileResolver *resolver = Thread::getThread()->getFileResolver();
 				fs::path schemaPath = resolver->resolveAbsolute("data/schema/scene.xsd");
@@ -694,6 +995,18 @@ void SceneHandler::endElement(const XMLCh* const xmlName) {
 
 				Properties &props = context.properties;
 
+				/* Objects that are loaded from a file and don't depend on
+				   the rest of the scene are constructed in parallel */
+				if (m_loadQueue != NULL && props.hasProperty("filename")
+					&& (tag.first == EShape || tag.first == ETexture
+					 || tag.first == EVolume || tag.first == EEmitter)
+					&& !(props.hasProperty("toWorld") && props.getType("toWorld")
+					 == Properties::EAnimatedTransform)) {
+					submit(context, tag, name);
+					m_context.pop();
+					return;
+				}
+
 				/* Convenience hack: allow passing animated transforms to arbitrary shapes
 				   and then internally rewrite this into a shape group + animated instance */
 				if (tag.second == MTS_CLASS(Shape)
@@ -781,7 +1094,8 @@ void SceneHandler::endElement(const XMLCh* const xmlName) {
 		}
 
 		if (id != "" && name != "ref") {
-			if (m_namedObjects->find(id) != m_namedObjects->end())
+			if (m_namedObjects->find(id) != m_namedObjects->end() ||
+				m_pendingObjects.find(id) != m_pendingObjects.end())
 				XMLLog(EError, "Duplicate ID '%s' used in scene description!", id.c_str());
 			(*m_namedObjects)[id] = object;
 			if (object)
@@ -85,6 +85,10 @@ bool Shape::isCompound() const {
 	return false;
 }
 
+bool Shape::isInstance() const {
+	return false;
+}
+
 std::string Shape::getName() const {
 	return m_name;
 }
@@ -0,0 +1,848 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/shapebvh.h>
+#include <mitsuba/render/trimesh.h>
+#include <mitsuba/core/statistics.h>
+#include <mitsuba/core/timer.h>
+
+#if defined(MTS_SSE) && defined(SINGLE_PRECISION)
+#include <mitsuba/core/sse.h>
+#define MTS_BVH_SSE 1
+#endif
+
+/// Number of bins used by the SAH-based construction
+#define MTS_BVH_BINS 16
+
+/// Past this depth, primitive ranges are split at the median
+#define MTS_BVH_MEDIAN_DEPTH 48
+
+MTS_NAMESPACE_BEGIN
+
+static StatsCounter raysTraced("BVH", "Normal rays traced");
+static StatsCounter shadowRaysTraced("BVH", "Shadow rays traced");
+
+/* Relative costs used by the surface area heuristic */
+static const Float bvhTraversalCost = 1.0f;
+static const Float bvhIntersectionCost = 1.0f;
+
+/// Decrease a single precision value by at least one ulp
+static inline float roundDown(float value) {
+	return value - std::max(std::abs(value),
+		std::numeric_limits<float>::min()) * std::numeric_limits<float>::epsilon();
+}
+
+/// Increase a single precision value by at least one ulp
+static inline float roundUp(float value) {
+	return value + std::max(std::abs(value),
+		std::numeric_limits<float>::min()) * std::numeric_limits<float>::epsilon();
+}
+
+ShapeBVH::ShapeBVH() : m_nodes(NULL), m_triAccel(NULL), m_nodeCount(0),
+		m_primitiveCount(0), m_twoLevel(false), m_maxLeafSize(4), m_buildTime(0), m_cost(0),
+		m_buildCost(0), m_rebuildThreshold(1.5f) {
+}
+
+ShapeBVH::~ShapeBVH() {
+	if (m_nodes)
+		freeAligned(m_nodes);
+	if (m_triAccel)
+		freeAligned(m_triAccel);
+	for (size_t i=0; i<m_shapes.size(); ++i)
+		m_shapes[i]->decRef();
+}
+
+void ShapeBVH::addShape(const Shape *shape) {
+	Assert(!isBuilt());
+	if (shape->isCompound())
+		Log(EError, "Cannot add compound shapes to a BVH - expand them first!");
+	if (m_twoLevel && shape->isInstance()) {
+		if (!m_instanceBVH) {
+			m_instanceBVH = new ShapeBVH();
+			m_instanceBVH->setMaxLeafSize(m_maxLeafSize);
+		}
+		m_instanceBVH->addShape(shape);
+		return;
+	}
+	if (shape->getClass()->derivesFrom(MTS_CLASS(TriMesh))) {
+		m_primitiveCount += (SizeType)
+			static_cast<const TriMesh *>(shape)->getTriangleCount();
+		m_triangleFlag.push_back(true);
+	} else {
+		m_primitiveCount += 1;
+		m_triangleFlag.push_back(false);
+	}
+	shape->incRef();
+	m_shapes.push_back(shape);
+}
+
+void ShapeBVH::setMaxLeafSize(int maxLeafSize) {
+	if (maxLeafSize < 1 || maxLeafSize > MTS_BVH_MAX_LEAF_SIZE)
+		Log(EError, "The maximum BVH leaf size must be in the range 1..%i!",
+			MTS_BVH_MAX_LEAF_SIZE);
+	m_maxLeafSize = maxLeafSize;
+}
+
+void ShapeBVH::setTwoLevel(bool twoLevel) {
+	if (!m_shapes.empty() || m_instanceBVH.get())
+		Log(EError, "setTwoLevel(): shapes have already been added!");
+	m_twoLevel = twoLevel;
+}
+
+size_t ShapeBVH::getMemoryUsage() const {
+	size_t result = sizeof(BVHNode) * (size_t) m_nodeCount
+		+ sizeof(TriAccel) * (size_t) m_primitiveCount;
+	if (m_instanceBVH.get())
+		result += m_instanceBVH->getMemoryUsage();
+	return result;
+}
+
+void ShapeBVH::updateCombinedAABB() {
+	if (!m_instanceBVH)
+		return;
+	m_combinedAABB = m_aabb;
+	m_combinedAABB.expandBy(m_instanceBVH->getAABB());
+}
+
+void ShapeBVH::build() {
+	Assert(!isBuilt());
+	ref<Timer> timer = new Timer();
+
+	/* Three bits of a leaf reference store the primitive count */
+	if (m_primitiveCount >= (1u << 28))
+		Log(EError, "The BVH supports at most 2^28 primitives!");
+
+	std::vector<BuildPrimitive> prims(m_primitiveCount);
+	BuildRange range;
+	range.begin = 0;
+	range.end = m_primitiveCount;
+
+	SizeType idx = 0;
+	for (IndexType i=0; i<m_shapes.size(); ++i) {
+		const Shape *shape = m_shapes[i];
+		if (m_triangleFlag[i]) {
+			const TriMesh *mesh = static_cast<const TriMesh *>(shape);
+			const Triangle *triangles = mesh->getTriangles();
+			const Point *positions = mesh->getVertexPositions();
+			for (IndexType j=0; j<mesh->getTriangleCount(); ++j) {
+				BuildPrimitive &prim = prims[idx++];
+				prim.aabb = triangles[j].getAABB(positions);
+				prim.shapeIndex = i;
+				prim.primIndex = j;
+				range.aabb.expandBy(prim.aabb);
+			}
+		} else {
+			BuildPrimitive &prim = prims[idx++];
+			prim.aabb = shape->getAABB();
+			prim.shapeIndex = i;
+			prim.primIndex = KNoTriangleFlag;
+			range.aabb.expandBy(prim.aabb);
+		}
+	}
+	Assert(idx == m_primitiveCount);
+	m_aabb = range.aabb;
+
+	std::vector<BVHNode> nodes;
+	nodes.reserve(m_primitiveCount / 2 + 1);
+
+	uint32_t root = m_primitiveCount > 0 ?
+		buildRecursive(nodes, prims, range, 0) : (uint32_t) EEmptyChild;
+
+	if (root != 0) {
+		/* The whole scene fits into a leaf (or is empty) -- create a
+		   root node so that the traversal always starts at a node */
+		Assert(nodes.empty());
+		nodes.push_back(BVHNode());
+		BVHNode &node = nodes[0];
+		quantize(node, range.aabb, &range.aabb, root == EEmptyChild ? 0 : 1);
+		for (int i=0; i<4; ++i)
+			node.children[i] = EEmptyChild;
+		node.children[0] = root;
+	}
+
+	/* Copy the nodes into a cache line-aligned array */
+	m_nodeCount = (SizeType) nodes.size();
+	m_nodes = static_cast<BVHNode *>(allocAligned(sizeof(BVHNode) * nodes.size()));
+	memcpy(m_nodes, &nodes[0], sizeof(BVHNode) * nodes.size());
+	std::vector<BVHNode>().swap(nodes);
+
+	/* Precompute the triangle intersection information in leaf order */
+	m_triAccel = static_cast<TriAccel *>(allocAligned(
+		std::max((SizeType) 1, m_primitiveCount) * sizeof(TriAccel)));
+	for (SizeType i=0; i<m_primitiveCount; ++i) {
+		const BuildPrimitive &prim = prims[i];
+		TriAccel &ta = m_triAccel[i];
+		if (m_triangleFlag[prim.shapeIndex]) {
+			const TriMesh *mesh = static_cast<const TriMesh *>(m_shapes[prim.shapeIndex]);
+			const Triangle &tri = mesh->getTriangles()[prim.primIndex];
+			const Point *positions = mesh->getVertexPositions();
+			ta.load(positions[tri.idx[0]], positions[tri.idx[1]], positions[tri.idx[2]]);
+			ta.shapeIndex = prim.shapeIndex;
+			ta.primIndex = prim.primIndex;
+		} else {
+			/* Create a 'fake' triangle, which redirects to a Shape */
+			memset(&ta, 0, sizeof(TriAccel));
+			ta.shapeIndex = prim.shapeIndex;
+			ta.k = KNoTriangleFlag;
+		}
+	}
+
+	/* Determine the SAH cost, which is the reference for later refits */
+	std::vector<AABB> primAABBs(m_primitiveCount);
+	for (SizeType i=0; i<m_primitiveCount; ++i)
+		primAABBs[i] = prims[i].aabb;
+	m_cost = m_buildCost = refitNodes(primAABBs, false);
+
+	m_buildTime = timer->getMilliseconds();
+	Log(EInfo, "Created a 4-wide BVH with %u nodes for %u primitives "
+		"(%s, SAH cost %.2f, took %i ms)", m_nodeCount, m_primitiveCount,
+		memString(getMemoryUsage()).c_str(), m_cost, m_buildTime);
+
+	if (m_instanceBVH.get()) {
+		if (!m_instanceBVH->isBuilt())
+			m_instanceBVH->build();
+		updateCombinedAABB();
+	}
+}
+
+void ShapeBVH::refit() {
+	Assert(isBuilt());
+	ref<Timer> timer = new Timer();
+
+	/* Recompute the triangle data and primitive bounds in leaf order */
+	std::vector<AABB> primAABBs(m_primitiveCount);
+	for (SizeType i=0; i<m_primitiveCount; ++i) {
+		TriAccel &ta = m_triAccel[i];
+		const Shape *shape = m_shapes[ta.shapeIndex];
+		if (m_triangleFlag[ta.shapeIndex]) {
+			const TriMesh *mesh = static_cast<const TriMesh *>(shape);
+			const Triangle &tri = mesh->getTriangles()[ta.primIndex];
+			const Point *positions = mesh->getVertexPositions();
+			ta.load(positions[tri.idx[0]], positions[tri.idx[1]], positions[tri.idx[2]]);
+			primAABBs[i] = tri.getAABB(positions);
+		} else {
+			primAABBs[i] = shape->getAABB();
+		}
+	}
+
+	m_cost = refitNodes(primAABBs, true);
+
+	if (m_instanceBVH.get()) {
+		m_instanceBVH->refit();
+		updateCombinedAABB();
+	}
+
+	Log(EDebug, "Refitted the BVH (SAH cost %.2f, was %.2f after the last "
+		"build, took %i ms)", m_cost, m_buildCost, timer->getMilliseconds());
+}
+
+bool ShapeBVH::update() {
+	refit();
+
+	if (!(m_cost > m_buildCost * m_rebuildThreshold))
+		return false;
+
+	Log(EInfo, "The refitted BVH is too inefficient (SAH cost %.2f vs. "
+		"%.2f) -- rebuilding ..", m_cost, m_buildCost);
+	freeAligned(m_nodes);
+	freeAligned(m_triAccel);
+	m_nodes = NULL;
+	m_triAccel = NULL;
+	m_nodeCount = 0;
+	build();
+	return true;
+}
+
+void ShapeBVH::updateInstances() {
+	Assert(isBuilt());
+	if (!m_instanceBVH)
+		return;
+
+	/* The top level only references the instances, hence
+	   rebuilding it is cheap compared to a refit of the
+	   underlying geometry */
+	ref<ShapeBVH> instanceBVH = new ShapeBVH();
+	instanceBVH->setMaxLeafSize(m_maxLeafSize);
+	const std::vector<const Shape *> &instances = m_instanceBVH->getShapes();
+	for (size_t i=0; i<instances.size(); ++i)
+		instanceBVH->addShape(instances[i]);
+	instanceBVH->build();
+	m_instanceBVH = instanceBVH;
+	updateCombinedAABB();
+}
+
+void ShapeBVH::setRebuildThreshold(Float threshold) {
+	if (!(threshold >= 1))
+		Log(EError, "The BVH rebuild threshold must be >= 1!");
+	m_rebuildThreshold = threshold;
+}
+
+Float ShapeBVH::refitNodes(const std::vector<AABB> &primAABBs, bool requantize) {
+	std::vector<AABB> nodeAABBs(m_nodeCount);
+	Float cost = 0;
+
+	/* Children are always stored after their parents */
+	for (SizeType i=m_nodeCount; i-- > 0; ) {
+		BVHNode &node = m_nodes[i];
+		AABB childAABBs[4], &aabb = nodeAABBs[i];
+		int childCount = 0;
+
+		while (childCount < 4 && node.children[childCount] != EEmptyChild) {
+			uint32_t child = node.children[childCount];
+			AABB &childAABB = childAABBs[childCount++];
+			if (child & ELeafFlag) {
+				SizeType primStart = (child & ~ELeafFlag) >> 3,
+				         primCount = (child & 7) + 1;
+				for (SizeType j=primStart; j<primStart+primCount; ++j)
+					childAABB.expandBy(primAABBs[j]);
+				cost += bvhIntersectionCost * primCount * childAABB.getSurfaceArea();
+			} else {
+				childAABB = nodeAABBs[child];
+			}
+			aabb.expandBy(childAABB);
+		}
+
+		if (aabb.isValid())
+			cost += bvhTraversalCost * aabb.getSurfaceArea();
+		if (requantize)
+			quantize(node, aabb, childAABBs, childCount);
+	}
+
+	m_aabb = nodeAABBs[0];
+	Float area = m_aabb.isValid() ? m_aabb.getSurfaceArea() : (Float) 0;
+	return area > 0 ? cost / area : cost;
+}
+
+uint32_t ShapeBVH::buildRecursive(std::vector<BVHNode> &nodes,
+		std::vector<BuildPrimitive> &prims, const BuildRange &range, int depth) {
+	SizeType count = range.end - range.begin;
+
+	if (count <= (SizeType) m_maxLeafSize) {
+		/* Create a leaf unless the SAH predicts that splitting is better */
+		int axis;
+		Float split;
+		if (count == 1 || depth >= MTS_BVH_MEDIAN_DEPTH ||
+			findSplit(prims, range, axis, split) >= bvhIntersectionCost * count)
+			return ELeafFlag | (range.begin << 3) | (count - 1);
+	}
+
+	/* Repeatedly split the largest child until there are four of them.
+	   Past a certain depth, the child with the most primitives is split
+	   instead, which bounds the depth of the hierarchy */
+	bool median = depth >= MTS_BVH_MEDIAN_DEPTH;
+	BuildRange children[4];
+	int childCount = 1;
+	children[0] = range;
+
+	while (childCount < 4) {
+		int best = -1;
+		Float bestValue = -1;
+		for (int i=0; i<childCount; ++i) {
+			SizeType childSize = children[i].end - children[i].begin;
+			if (childSize < 2)
+				continue;
+			Float value = median ? (Float) childSize
+				: children[i].aabb.getSurfaceArea();
+			if (value > bestValue) {
+				best = i;
+				bestValue = value;
+			}
+		}
+		if (best < 0)
+			break;
+
+		BuildRange left, right;
+		splitRange(prims, children[best], median, left, right);
+		children[best] = left;
+		children[childCount++] = right;
+	}
+
+	AABB childAABBs[4];
+	for (int i=0; i<childCount; ++i)
+		childAABBs[i] = children[i].aabb;
+
+	uint32_t nodeIndex = (uint32_t) nodes.size();
+	nodes.push_back(BVHNode());
+	quantize(nodes[nodeIndex], range.aabb, childAABBs, childCount);
+	for (int i=0; i<4; ++i)
+		nodes[nodeIndex].children[i] = EEmptyChild;
+
+	for (int i=0; i<childCount; ++i) {
+		uint32_t child = buildRecursive(nodes, prims, children[i], depth + 1);
+		nodes[nodeIndex].children[i] = child;
+	}
+
+	return nodeIndex;
+}
+
+Float ShapeBVH::findSplit(const std::vector<BuildPrimitive> &prims,
+		const BuildRange &range, int &axis, Float &split) const {
+	AABB centroidAABB;
+	for (SizeType i=range.begin; i<range.end; ++i)
+		centroidAABB.expandBy(prims[i].aabb.getCenter());
+
+	Float bestCost = std::numeric_limits<Float>::infinity();
+
+	for (int dim=0; dim<3; ++dim) {
+		Float min = centroidAABB.min[dim],
+		      extent = centroidAABB.max[dim] - min;
+		if (!(extent > 0))
+			continue;
+
+		AABB binAABB[MTS_BVH_BINS];
+		SizeType binCount[MTS_BVH_BINS];
+		memset(binCount, 0, sizeof(binCount));
+		Float scale = MTS_BVH_BINS / extent;
+
+		for (SizeType i=range.begin; i<range.end; ++i) {
+			const AABB &aabb = prims[i].aabb;
+			int bin = std::min((int) ((aabb.getCenter()[dim] - min) * scale),
+				MTS_BVH_BINS - 1);
+			binCount[bin]++;
+			binAABB[bin].expandBy(aabb);
+		}
+
+		/* Sweep from the right to compute the costs of the right halves */
+		Float rightArea[MTS_BVH_BINS];
+		SizeType rightCount[MTS_BVH_BINS];
+		AABB accum;
+		SizeType accumCount = 0;
+		for (int bin=MTS_BVH_BINS-1; bin>0; --bin) {
+			accum.expandBy(binAABB[bin]);
+			accumCount += binCount[bin];
+			rightArea[bin] = accumCount > 0 ? accum.getSurfaceArea() : 0;
+			rightCount[bin] = accumCount;
+		}
+
+		accum.reset();
+		accumCount = 0;
+		for (int bin=0; bin<MTS_BVH_BINS-1; ++bin) {
+			accum.expandBy(binAABB[bin]);
+			accumCount += binCount[bin];
+			if (accumCount == 0 || rightCount[bin+1] == 0)
+				continue;
+			Float cost = accum.getSurfaceArea() * accumCount
+				+ rightArea[bin+1] * rightCount[bin+1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				axis = dim;
+				split = min + (bin + 1) / scale;
+			}
+		}
+	}
+
+	if (bestCost == std::numeric_limits<Float>::infinity())
+		return bestCost;
+
+	Float area = range.aabb.getSurfaceArea();
+	if (!(area > 0))
+		return bvhTraversalCost;
+
+	return bvhTraversalCost + bvhIntersectionCost * bestCost / area;
+}
+
+namespace {
+	/// Predicate used to partition primitives by their centroid
+	struct CentroidPredicate {
+		int axis;
+		Float split;
+
+		template <typename T> inline bool operator()(const T &prim) const {
+			return prim.aabb.getCenter()[axis] < split;
+		}
+	};
+
+	/// Comparator used by the median split
+	struct CentroidComparator {
+		int axis;
+
+		template <typename T> inline bool operator()(const T &a, const T &b) const {
+			return a.aabb.getCenter()[axis] < b.aabb.getCenter()[axis];
+		}
+	};
+}
+
+void ShapeBVH::splitRange(std::vector<BuildPrimitive> &prims, const BuildRange &range,
+		bool median, BuildRange &left, BuildRange &right) const {
+	SizeType mid = range.begin;
+
+	if (!median) {
+		CentroidPredicate pred;
+		if (findSplit(prims, range, pred.axis, pred.split)
+				!= std::numeric_limits<Float>::infinity())
+			mid = (SizeType) (std::partition(prims.begin() + range.begin,
+				prims.begin() + range.end, pred) - prims.begin());
+	}
+
+	if (mid == range.begin || mid == range.end) {
+		/* No usable SAH split -- split at the median along the
+		   largest axis of the centroid bounds */
+		AABB centroidAABB;
+		for (SizeType i=range.begin; i<range.end; ++i)
+			centroidAABB.expandBy(prims[i].aabb.getCenter());
+		CentroidComparator comp;
+		comp.axis = centroidAABB.getLargestAxis();
+		mid = range.begin + (range.end - range.begin) / 2;
+		std::nth_element(prims.begin() + range.begin, prims.begin() + mid,
+			prims.begin() + range.end, comp);
+	}
+
+	left.begin = range.begin; left.end = mid;
+	right.begin = mid; right.end = range.end;
+	left.aabb.reset(); right.aabb.reset();
+	for (SizeType i=left.begin; i<left.end; ++i)
+		left.aabb.expandBy(prims[i].aabb);
+	for (SizeType i=right.begin; i<right.end; ++i)
+		right.aabb.expandBy(prims[i].aabb);
+}
+
+void ShapeBVH::quantize(BVHNode &node, const AABB &aabb,
+		const AABB *children, int childCount) const {
+	for (int axis=0; axis<3; ++axis) {
+		/* Choose a grid that is guaranteed to cover the node */
+		float origin = aabb.isValid() ? (float) aabb.min[axis] : 0.0f;
+		while ((Float) origin > aabb.min[axis])
+			origin = roundDown(origin);
+		float scale = aabb.isValid() ? (float) ((aabb.max[axis] - origin) / 255) : 0.0f;
+		while ((Float) origin + 255 * (Float) scale < aabb.max[axis])
+			scale = roundUp(scale);
+
+		node.origin[axis] = origin;
+		node.scale[axis] = scale;
+
+		for (int i=0; i<4; ++i) {
+			if (i >= childCount) {
+				/* Unused slots get an empty box */
+				node.lower[axis][i] = 255;
+				node.upper[axis][i] = 0;
+				continue;
+			}
+
+			const AABB &child = children[i];
+			int lower = 0, upper = 255;
+			if (scale > 0) {
+				lower = (int) std::floor((child.min[axis] - origin) / scale);
+				upper = (int) std::ceil((child.max[axis] - origin) / scale);
+				lower = std::min(std::max(lower, 0), 255);
+				upper = std::min(std::max(upper, 0), 255);
+			}
+
+			/* Compensate for rounding errors */
+			while (lower > 0 && (Float) origin + lower * (Float) scale > child.min[axis])
+				--lower;
+			while (upper < 255 && (Float) origin + upper * (Float) scale < child.max[axis])
+				++upper;
+
+			node.lower[axis][i] = (uint8_t) lower;
+			node.upper[axis][i] = (uint8_t) upper;
+		}
+	}
+}
+
+#if defined(MTS_BVH_SSE)
+/// Convert four quantized coordinates into single precision values
+static FINLINE __m128 loadQuantized(const uint8_t *values) {
+	int32_t packed;
+	memcpy(&packed, values, sizeof(int32_t));
+	const __m128i zero = _mm_setzero_si128();
+	__m128i result = _mm_cvtsi32_si128(packed);
+	result = _mm_unpacklo_epi8(result, zero);
+	result = _mm_unpacklo_epi16(result, zero);
+	return _mm_cvtepi32_ps(result);
+}
+#endif
+
+/// Traversal stack entry
+struct BVHStackEntry {
+	uint32_t child;
+	Float mint;
+};
+
+template<bool shadowRay> bool ShapeBVH::traverse(const Ray &ray,
+		Float mint, Float maxt, Float &t, void *temp) const {
+	BVHStackEntry stack[3 * MTS_BVH_MAXDEPTH + 1];
+	int stackSize = 0;
+	uint32_t current = 0;
+	bool foundIntersection = false;
+
+#if defined(MTS_BVH_SSE)
+	const __m128
+		rayO[3] = { _mm_set1_ps(ray.o.x), _mm_set1_ps(ray.o.y), _mm_set1_ps(ray.o.z) },
+		rayRcp[3] = { _mm_set1_ps(ray.dRcp.x), _mm_set1_ps(ray.dRcp.y), _mm_set1_ps(ray.dRcp.z) },
+		rayMinT = _mm_set1_ps(mint);
+	const __m128i emptyChild = _mm_set1_epi32(-1);
+#endif
+
+	while (true) {
+		if (EXPECT_TAKEN(!(current & ELeafFlag))) {
+			const BVHNode &node = m_nodes[current];
+			Float childMinT[4];
+			int hitMask = 0;
+
+#if defined(MTS_BVH_SSE)
+			__m128 tNear = rayMinT, tFar = _mm_set1_ps(maxt);
+			for (int axis=0; axis<3; ++axis) {
+				const __m128
+					a = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.origin[axis]),
+						rayO[axis]), rayRcp[axis]),
+					b = _mm_mul_ps(_mm_set1_ps(node.scale[axis]), rayRcp[axis]),
+					t0 = _mm_add_ps(_mm_mul_ps(loadQuantized(node.lower[axis]), b), a),
+					t1 = _mm_add_ps(_mm_mul_ps(loadQuantized(node.upper[axis]), b), a);
+
+				/* The operand order makes NaNs (0*inf) leave the interval unchanged */
+				tNear = _mm_max_ps(_mm_min_ps(t0, t1), tNear);
+				tFar = _mm_min_ps(_mm_max_ps(t0, t1), tFar);
+			}
+
+			/* Integer comparison, since the marker is a NaN bit pattern */
+			const __m128 empty = _mm_castsi128_ps(_mm_cmpeq_epi32(emptyChild,
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(node.children))));
+			hitMask = _mm_movemask_ps(_mm_andnot_ps(empty,
+				_mm_cmple_ps(tNear, _mm_mul_ps(tFar, SSEConstants::op_eps.ps))));
+			_mm_storeu_ps(childMinT, tNear);
+#else
+			for (int i=0; i<4; ++i) {
+				if (node.children[i] == EEmptyChild)
+					continue;
+				Float tNear = mint, tFar = maxt;
+				for (int axis=0; axis<3; ++axis) {
+					const Float
+						lower = (Float) node.origin[axis] + node.lower[axis][i] * (Float) node.scale[axis],
+						upper = (Float) node.origin[axis] + node.upper[axis][i] * (Float) node.scale[axis],
+						t0 = (lower - ray.o[axis]) * ray.dRcp[axis],
+						t1 = (upper - ray.o[axis]) * ray.dRcp[axis];
+
+					/* Written so that NaNs (0*inf) leave the interval unchanged */
+					const Float tMin = t0 < t1 ? t0 : t1, tMax = t0 < t1 ? t1 : t0;
+					if (tMin > tNear)
+						tNear = tMin;
+					if (tMax < tFar)
+						tFar = tMax;
+				}
+				if (tNear <= tFar * (1 + Epsilon)) {
+					hitMask |= 1 << i;
+					childMinT[i] = tNear;
+				}
+			}
+#endif
+
+			if (hitMask != 0) {
+				/* Push the intersected children so that the closest
+				   one ends up at the top of the stack */
+				int order[4], hitCount = 0;
+				for (int i=0; i<4; ++i) {
+					if (!(hitMask & (1 << i)))
+						continue;
+					int pos = hitCount++;
+					while (pos > 0 && childMinT[order[pos-1]] < childMinT[i]) {
+						order[pos] = order[pos-1];
+						--pos;
+					}
+					order[pos] = i;
+				}
+				for (int i=0; i<hitCount-1; ++i) {
+					stack[stackSize].child = node.children[order[i]];
+					stack[stackSize].mint = childMinT[order[i]];
+					++stackSize;
+				}
+				current = node.children[order[hitCount-1]];
+				continue;
+			}
+		} else {
+			/* Arrived at a leaf node - intersect against primitives */
+			const IndexType primStart = (current & ~ELeafFlag) >> 3;
+			const IndexType primEnd = primStart + (current & 7) + 1;
+
+			for (IndexType idx=primStart; idx != primEnd; ++idx) {
+				if (shadowRay) {
+					if (intersect(ray, idx, mint, maxt))
+						return true;
+				} else {
+					Float tempT;
+					if (intersect(ray, idx, mint, maxt, tempT, temp)) {
+						t = maxt = tempT;
+						foundIntersection = true;
+					}
+				}
+			}
+		}
+
+		/* Pop from the stack, skipping entries beyond the closest intersection */
+		do {
+			if (stackSize == 0)
+				return foundIntersection;
+			--stackSize;
+		} while (!shadowRay && stack[stackSize].mint > maxt * (1 + Epsilon));
+		current = stack[stackSize].child;
+	}
+}
+
+bool ShapeBVH::rayIntersect(const Ray &ray, Float mint, Float maxt) const {
+	Float t;
+	return maxt > mint && traverse<true>(ray, mint, maxt, t, NULL);
+}
+
+bool ShapeBVH::rayIntersect(const Ray &ray, Float mint, Float maxt,
+		Float &t, void *temp) const {
+	return maxt > mint && traverse<false>(ray, mint, maxt, t, temp);
+}
+
+bool ShapeBVH::rayIntersect(const Ray &ray, Intersection &its) const {
+	uint8_t temp[MTS_KD_INTERSECTION_TEMP];
+	its.t = std::numeric_limits<Float>::infinity();
+
+	++raysTraced;
+
+	/* Use an adaptive ray epsilon */
+	Float rayMinT = ray.mint;
+	if (rayMinT == Epsilon)
+		rayMinT *= std::max(std::max(std::max(std::abs(ray.o.x),
+			std::abs(ray.o.y)), std::abs(ray.o.z)), Epsilon);
+
+	if (EXPECT_TAKEN(ray.maxt > rayMinT)) {
+		bool found = traverse<false>(ray, rayMinT, ray.maxt, its.t, temp);
+
+		if (m_instanceBVH.get()) {
+			uint8_t instanceTemp[MTS_KD_INTERSECTION_TEMP];
+			if (m_instanceBVH->traverse<false>(ray, rayMinT,
+					found ? its.t : ray.maxt, its.t, instanceTemp)) {
+				m_instanceBVH->fillIntersectionRecord<true>(ray, instanceTemp, its);
+				return true;
+			}
+		}
+
+		if (found) {
+			fillIntersectionRecord<true>(ray, temp, its);
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ShapeBVH::rayIntersect(const Ray &ray, Float &t, ConstShapePtr &shape,
+		Normal &n, Point2 &uv) const {
+	uint8_t temp[MTS_KD_INTERSECTION_TEMP];
+	t = std::numeric_limits<Float>::infinity();
+
+	++raysTraced;
+
+	/* Use an adaptive ray epsilon */
+	Float rayMinT = ray.mint;
+	if (rayMinT == Epsilon)
+		rayMinT *= std::max(std::max(std::max(std::abs(ray.o.x),
+			std::abs(ray.o.y)), std::abs(ray.o.z)), Epsilon);
+
+	if (EXPECT_NOT_TAKEN(!(ray.maxt > rayMinT)))
+		return false;
+
+	/* Determine which of the two levels contains the closest hit */
+	uint8_t instanceTemp[MTS_KD_INTERSECTION_TEMP];
+	const ShapeBVH *bvh = this;
+	const uint8_t *hitTemp = temp;
+	bool found = traverse<false>(ray, rayMinT, ray.maxt, t, temp);
+	if (m_instanceBVH.get() && m_instanceBVH->traverse<false>(ray, rayMinT,
+			found ? t : ray.maxt, t, instanceTemp)) {
+		bvh = m_instanceBVH.get();
+		hitTemp = instanceTemp;
+		found = true;
+	}
+	if (!found)
+		return false;
+
+	const IntersectionCache *cache = reinterpret_cast<const IntersectionCache *>(hitTemp);
+	shape = bvh->m_shapes[cache->shapeIndex];
+
+	if (bvh->m_triangleFlag[cache->shapeIndex]) {
+		const TriMesh *trimesh = static_cast<const TriMesh *>(shape);
+		const Triangle &tri = trimesh->getTriangles()[cache->primIndex];
+		const Point *vertexPositions = trimesh->getVertexPositions();
+		const Point2 *vertexTexcoords = trimesh->getVertexTexcoords();
+		const uint32_t idx0 = tri.idx[0], idx1 = tri.idx[1], idx2 = tri.idx[2];
+		const Point &p0 = vertexPositions[idx0];
+		const Point &p1 = vertexPositions[idx1];
+		const Point &p2 = vertexPositions[idx2];
+		n = normalize(cross(p1-p0, p2-p0));
+
+		if (EXPECT_TAKEN(vertexTexcoords)) {
+			const Vector b(1 - cache->u - cache->v, cache->u, cache->v);
+			const Point2 &t0 = vertexTexcoords[idx0];
+			const Point2 &t1 = vertexTexcoords[idx1];
+			const Point2 &t2 = vertexTexcoords[idx2];
+			uv = t0 * b.x + t1 * b.y + t2 * b.z;
+		} else {
+			uv = Point2(0.0f);
+		}
+	} else {
+		Intersection its;
+		its.t = t;
+		shape->fillIntersectionRecord(ray, hitTemp + 2*sizeof(IndexType), its);
+		n = its.geoFrame.n;
+		uv = its.uv;
+		if (its.shape)
+			shape = its.shape;
+	}
+
+	return true;
+}
+
+bool ShapeBVH::rayIntersect(const Ray &ray) const {
+	Float t;
+
+	++shadowRaysTraced;
+
+	/* Use an adaptive ray epsilon */
+	Float rayMinT = ray.mint;
+	if (rayMinT == Epsilon)
+		rayMinT *= std::max(std::max(std::abs(ray.o.x),
+			std::abs(ray.o.y)), std::abs(ray.o.z));
+
+	if (!(ray.maxt > rayMinT))
+		return false;
+
+	return traverse<true>(ray, rayMinT, ray.maxt, t, NULL) ||
+		(m_instanceBVH.get() && m_instanceBVH->traverse<true>(
+			ray, rayMinT, ray.maxt, t, NULL));
+}
+
+void ShapeBVH::rayIntersect(const Ray *rays, size_t count,
+		Intersection *its, bool *found) const {
+	for (size_t i=0; i<count; ++i)
+		found[i] = rayIntersect(rays[i], its[i]);
+}
+
+void ShapeBVH::isOccluded(const Ray *rays, size_t count, bool *occluded) const {
+	for (size_t i=0; i<count; ++i)
+		occluded[i] = rayIntersect(rays[i]);
+}
+
+std::string ShapeBVH::toString() const {
+	std::ostringstream oss;
+	oss << "ShapeBVH[" << endl
+		<< "  shapes = " << m_shapes.size() << "," << endl
+		<< "  primitives = " << m_primitiveCount << "," << endl
+		<< "  nodes = " << m_nodeCount << "," << endl
+		<< "  maxLeafSize = " << m_maxLeafSize << "," << endl
+		<< "  instances = " << (m_instanceBVH.get() ? m_instanceBVH->getShapes().size() : 0) << "," << endl
+		<< "  memoryUsage = " << memString(getMemoryUsage()) << "," << endl
+		<< "  aabb = " << m_aabb.toString() << endl
+		<< "]";
+	return oss.str();
+}
+
+MTS_IMPLEMENT_CLASS(ShapeBVH, false, Object)
+MTS_NAMESPACE_END
@@ -17,7 +17,9 @@
 */
 
 #include <mitsuba/render/skdtree.h>
+#include <mitsuba/render/trimesh.h>
 #include <mitsuba/core/statistics.h>
+#include <mitsuba/core/mstream.h>
 
 #if defined(MTS_SSE)
 #include <mitsuba/core/sse.h>
@@ -27,7 +29,7 @@
 
 MTS_NAMESPACE_BEGIN
 
-ShapeKDTree::ShapeKDTree() {
+ShapeKDTree::ShapeKDTree() : m_compact(false) {
 #if !defined(MTS_KD_CONSERVE_MEMORY)
 	m_triAccel = NULL;
 #endif
@@ -35,6 +37,15 @@ ShapeKDTree::ShapeKDTree() {
 }
 
 ShapeKDTree::~ShapeKDTree() {
+	if (m_cacheFile) {
+		/* The tree data is owned by the memory-mapped cache file */
+		m_nodes = NULL;
+		m_indices = NULL;
+		m_compressedIndices = NULL;
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+		m_triAccel = NULL;
+#endif
+	}
 #if !defined(MTS_KD_CONSERVE_MEMORY)
 	if (m_triAccel)
 		freeAligned(m_triAccel);
@@ -46,6 +57,9 @@ ShapeKDTree::~ShapeKDTree() {
 static StatsCounter raysTraced("General", "Normal rays traced");
 static StatsCounter shadowRaysTraced("General", "Shadow rays traced");
 
+/// Number of rays that are sorted into packets at a time by the batch queries
+#define MTS_KD_STREAM_SIZE 64
+
 void ShapeKDTree::addShape(const Shape *shape) {
 	Assert(!isBuilt());
 	if (shape->isCompound())
@@ -69,44 +83,335 @@ void ShapeKDTree::build() {
 	for (size_t i=1; i<m_shapeMap.size(); ++i)
 		m_shapeMap[i] += m_shapeMap[i-1];
 
+	fs::path cacheFile;
+	uint64_t hash = 0;
+	if (!m_cacheDirectory.empty() && getPrimitiveCount() > 0)
+		hash = computeCacheHash();
+	if (hash != 0) {
+		cacheFile = m_cacheDirectory / formatString("%016llx.kdcache",
+			(unsigned long long) hash);
+		if (fs::exists(cacheFile) && loadCache(cacheFile, hash))
+			return;
+	}
+
 	SAHKDTree3D<ShapeKDTree>::buildInternal();
 
+	if (m_compact && !compressIndices())
+		Log(EWarn, "The compressed kd-tree index lists would be too large "
+			"-- keeping them uncompressed.");
+
 #if !defined(MTS_KD_CONSERVE_MEMORY)
-	ref<Timer> timer = new Timer();
-	SizeType primCount = getPrimitiveCount();
-	Log(EDebug, "Precomputing triangle intersection information (%s)",
-			memString(sizeof(TriAccel)*primCount).c_str());
-	m_triAccel = static_cast<TriAccel *>(allocAligned(primCount * sizeof(TriAccel)));
+	if (!m_compact) {
+		ref<Timer> timer = new Timer();
+		SizeType primCount = getPrimitiveCount();
+		Log(EDebug, "Precomputing triangle intersection information (%s)",
+				memString(sizeof(TriAccel)*primCount).c_str());
+		m_triAccel = static_cast<TriAccel *>(allocAligned(primCount * sizeof(TriAccel)));
+
+		IndexType idx = 0;
+		for (IndexType i=0; i<m_shapes.size(); ++i) {
+			const Shape *shape = m_shapes[i];
+			if (m_triangleFlag[i]) {
+				const TriMesh *mesh = static_cast<const TriMesh *>(shape);
+				const Triangle *triangles = mesh->getTriangles();
+				const Point *positions = mesh->getVertexPositions();
+				for (IndexType j=0; j<mesh->getTriangleCount(); ++j) {
+					const Triangle &tri = triangles[j];
+					const Point &v0 = positions[tri.idx[0]];
+					const Point &v1 = positions[tri.idx[1]];
+					const Point &v2 = positions[tri.idx[2]];
+					m_triAccel[idx].load(v0, v1, v2);
+					m_triAccel[idx].shapeIndex = i;
+					m_triAccel[idx].primIndex = j;
+					++idx;
+				}
+			} else {
+				/* Create a 'fake' triangle, which redirects to a Shape */
+				memset(&m_triAccel[idx], 0, sizeof(TriAccel));
+				m_triAccel[idx].shapeIndex = i;
+				m_triAccel[idx].k = KNoTriangleFlag;
+				++idx;
+			}
+		}
+		Log(EDebug, "Finished -- took %i ms.", timer->getMilliseconds());
+		Log(m_logLevel, "");
+		KDAssert(idx == primCount);
+	}
+#endif
+
+	size_t memoryUsage = getMemoryUsage();
+	Log(EInfo, "kd-tree memory usage: %s (%.1f bytes per primitive%s)",
+		memString(memoryUsage).c_str(), memoryUsage /
+		(Float) std::max(getPrimitiveCount(), (SizeType) 1),
+		m_compact ? ", compact storage" : "");
+
+	if (!cacheFile.empty())
+		saveCache(cacheFile, hash);
+}
+
+/* ==================================================================== */
+/*                      Persistent kd-tree cache files                  */
+/* ==================================================================== */
+
+/// Increase this whenever the cache file layout changes
+#define MTS_KD_CACHE_VERSION 0x02
+
+/// Make sure that all arrays in the cache file start on a cache line
+#define MTS_KD_CACHE_ALIGNMENT 64
+
+namespace {
+	struct KDCacheHeader {
+		char identifier[3];
+		uint8_t version;
+		uint8_t floatSize;
+		uint8_t hasTriAccel;
+		uint8_t compressedIndices;
+		uint8_t reserved;
+		uint32_t primCount;
+		uint32_t nodeCount;
+		uint32_t indexCount;
+		uint32_t indexSize;
+		uint64_t hash;
+		Float aabb[6];
+		Float tightAABB[6];
+		Float heuristicCost;
+	};
+
+	inline size_t alignCacheOffset(size_t offset) {
+		size_t padding = offset % MTS_KD_CACHE_ALIGNMENT;
+		return padding ? (offset + MTS_KD_CACHE_ALIGNMENT - padding) : offset;
+	}
+
+	/// Compute the byte offsets of the arrays stored in a cache file
+	inline void getCacheLayout(uint32_t primCount, uint32_t nodeCount,
+			uint32_t indexSize, bool hasTriAccel, size_t &nodeOffset,
+			size_t &indexOffset, size_t &triAccelOffset, size_t &fileSize) {
+		/* The node array is preceded by one unused entry, which
+		   reproduces the alignment shift (see KDNode::getSibling) */
+		nodeOffset = alignCacheOffset(sizeof(KDCacheHeader));
+		indexOffset = alignCacheOffset(nodeOffset
+			+ sizeof(ShapeKDTree::KDNode) * ((size_t) nodeCount + 1));
+		triAccelOffset = alignCacheOffset(indexOffset + (size_t) indexSize);
+		fileSize = triAccelOffset
+			+ (hasTriAccel ? sizeof(TriAccel) * (size_t) primCount : 0);
+	}
+
+	/// Incrementally hash a region of memory (FNV-1a over 64-bit words)
+	uint64_t hashData(const void *data, size_t size, uint64_t hash) {
+		const uint8_t *ptr = static_cast<const uint8_t *>(data);
+		const uint64_t prime = 0x100000001b3ULL;
+		size_t nWords = size / sizeof(uint64_t);
+		for (size_t i=0; i<nWords; ++i) {
+			uint64_t value;
+			memcpy(&value, ptr + i * sizeof(uint64_t), sizeof(uint64_t));
+			hash = (hash ^ value) * prime;
+			hash ^= hash >> 32;
+		}
+		for (size_t i=nWords * sizeof(uint64_t); i<size; ++i)
+			hash = (hash ^ ptr[i]) * prime;
+		return hash;
+	}
+
+	template <typename T> inline uint64_t hashValue(const T &value, uint64_t hash) {
+		return hashData(&value, sizeof(T), hash);
+	}
+}
 
-	IndexType idx = 0;
-	for (IndexType i=0; i<m_shapes.size(); ++i) {
+uint64_t ShapeKDTree::computeCacheHash() const {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hash = hashValue((uint32_t) MTS_KD_CACHE_VERSION, hash);
+	hash = hashValue((uint32_t) sizeof(Float), hash);
+
+	/* Construction parameters (the parallel build produces the same tree) */
+	hash = hashValue(m_traversalCost, hash);
+	hash = hashValue(m_queryCost, hash);
+	hash = hashValue(m_emptySpaceBonus, hash);
+	hash = hashValue((uint8_t) m_clip, hash);
+	hash = hashValue((uint8_t) m_retract, hash);
+	hash = hashValue(m_maxDepth, hash);
+	hash = hashValue(m_stopPrims, hash);
+	hash = hashValue(m_maxBadRefines, hash);
+	hash = hashValue(m_exactPrimThreshold, hash);
+	hash = hashValue(m_minMaxBins, hash);
+	hash = hashValue((uint8_t) m_compact, hash);
+
+	/* Geometry. Triangle meshes contribute their full vertex and index
+	   data. Other shapes contribute their complete serialized state,
+	   since the bounds alone do not determine their clipped bounds */
+	for (size_t i=0; i<m_shapes.size(); ++i) {
 		const Shape *shape = m_shapes[i];
+		hash = hashValue((uint8_t) m_triangleFlag[i], hash);
 		if (m_triangleFlag[i]) {
 			const TriMesh *mesh = static_cast<const TriMesh *>(shape);
-			const Triangle *triangles = mesh->getTriangles();
-			const Point *positions = mesh->getVertexPositions();
-			for (IndexType j=0; j<mesh->getTriangleCount(); ++j) {
-				const Triangle &tri = triangles[j];
-				const Point &v0 = positions[tri.idx[0]];
-				const Point &v1 = positions[tri.idx[1]];
-				const Point &v2 = positions[tri.idx[2]];
-				m_triAccel[idx].load(v0, v1, v2);
-				m_triAccel[idx].shapeIndex = i;
-				m_triAccel[idx].primIndex = j;
-				++idx;
-			}
+			hash = hashValue((uint64_t) mesh->getTriangleCount(), hash);
+			hash = hashValue((uint64_t) mesh->getVertexCount(), hash);
+			hash = hashData(mesh->getTriangles(),
+				sizeof(Triangle) * mesh->getTriangleCount(), hash);
+			hash = hashData(mesh->getVertexPositions(),
+				sizeof(Point) * mesh->getVertexCount(), hash);
 		} else {
-			/* Create a 'fake' triangle, which redirects to a Shape */
-			memset(&m_triAccel[idx], 0, sizeof(TriAccel));
-			m_triAccel[idx].shapeIndex = i;
-			m_triAccel[idx].k = KNoTriangleFlag;
-			++idx;
+			ref<MemoryStream> mstream = new MemoryStream();
+			ref<InstanceManager> manager = new InstanceManager();
+			try {
+				manager->serialize(mstream, shape);
+			} catch (const std::exception &ex) {
+				Log(EDebug, "Not caching the kd-tree, since the shape \"%s\" "
+					"cannot be serialized: %s", shape->getName().c_str(), ex.what());
+				return 0;
+			}
+			hash = hashData(mstream->getData(), mstream->getSize(), hash);
+			AABB aabb = shape->getAABB();
+			hash = hashData(&aabb.min, sizeof(Point), hash);
+			hash = hashData(&aabb.max, sizeof(Point), hash);
 		}
 	}
-	Log(EDebug, "Finished -- took %i ms.", timer->getMilliseconds());
-	Log(m_logLevel, "");
-	KDAssert(idx == primCount);
+
+	/* Zero is reserved for "do not cache" */
+	return hash != 0 ? hash : 1;
+}
+
+bool ShapeKDTree::loadCache(const fs::path &filename, uint64_t hash) {
+	ref<Timer> timer = new Timer();
+	ref<MemoryMappedFile> mmap;
+	try {
+		mmap = new MemoryMappedFile(filename, true);
+	} catch (const std::exception &ex) {
+		Log(EWarn, "Unable to map the kd-tree cache file \"%s\": %s",
+			filename.string().c_str(), ex.what());
+		return false;
+	}
+
+	bool hasTriAccel = false;
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+	hasTriAccel = !m_compact;
+#endif
+
+	KDCacheHeader header;
+	if (mmap->getSize() < sizeof(KDCacheHeader))
+		return false;
+	memcpy(&header, mmap->getData(), sizeof(KDCacheHeader));
+
+	size_t nodeOffset, indexOffset, triAccelOffset, fileSize;
+	getCacheLayout(header.primCount, header.nodeCount, header.indexSize,
+		hasTriAccel, nodeOffset, indexOffset, triAccelOffset, fileSize);
+
+	if (memcmp(header.identifier, "KDC", 3) != 0
+		|| header.version != MTS_KD_CACHE_VERSION
+		|| header.floatSize != sizeof(Float)
+		|| header.hasTriAccel != (uint8_t) hasTriAccel
+		|| header.hash != hash
+		|| header.primCount != getPrimitiveCount()
+		|| mmap->getSize() != fileSize) {
+		Log(EDebug, "Ignoring outdated kd-tree cache file \"%s\"",
+			filename.string().c_str());
+		return false;
+	}
+
+	uint8_t *data = static_cast<uint8_t *>(mmap->getData());
+	m_nodes = reinterpret_cast<KDNode *>(data + nodeOffset) + 1;
+	if (header.compressedIndices) {
+		m_compressedIndices = data + indexOffset;
+		m_compressedIndexSize = header.indexSize;
+	} else {
+		m_indices = reinterpret_cast<IndexType *>(data + indexOffset);
+	}
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+	if (hasTriAccel)
+		m_triAccel = reinterpret_cast<TriAccel *>(data + triAccelOffset);
 #endif
+	m_nodeCount = header.nodeCount;
+	m_indexCount = header.indexCount;
+	m_sahCost = header.heuristicCost;
+	for (int i=0; i<3; ++i) {
+		m_aabb.min[i] = header.aabb[i];
+		m_aabb.max[i] = header.aabb[i+3];
+		m_tightAABB.min[i] = header.tightAABB[i];
+		m_tightAABB.max[i] = header.tightAABB[i+3];
+	}
+	m_cacheFile = mmap;
+	m_buildTime = timer->getMilliseconds();
+
+	Log(EInfo, "Loaded a cached kd-tree (%i primitives, %s, %.1f bytes per "
+		"primitive) from \"%s\"", getPrimitiveCount(), memString(fileSize).c_str(),
+		getMemoryUsage() / (Float) getPrimitiveCount(),
+		filename.filename().string().c_str());
+	return true;
+}
+
+void ShapeKDTree::saveCache(const fs::path &filename, uint64_t hash) const {
+	bool hasTriAccel = false;
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+	hasTriAccel = m_triAccel != NULL;
+#endif
+
+	size_t indexSize = getIndexStorageSize();
+	if (indexSize > (size_t) 0xFFFFFFFFu) {
+		Log(EWarn, "The kd-tree is too large to be cached");
+		return;
+	}
+
+	size_t nodeOffset, indexOffset, triAccelOffset, fileSize;
+	getCacheLayout(getPrimitiveCount(), m_nodeCount, (uint32_t) indexSize,
+		hasTriAccel, nodeOffset, indexOffset, triAccelOffset, fileSize);
+
+	KDCacheHeader header;
+	memset(&header, 0, sizeof(KDCacheHeader));
+	memcpy(header.identifier, "KDC", 3);
+	header.version = MTS_KD_CACHE_VERSION;
+	header.floatSize = (uint8_t) sizeof(Float);
+	header.hasTriAccel = (uint8_t) hasTriAccel;
+	header.compressedIndices = (uint8_t) hasCompressedIndices();
+	header.primCount = getPrimitiveCount();
+	header.nodeCount = m_nodeCount;
+	header.indexCount = m_indexCount;
+	header.indexSize = (uint32_t) indexSize;
+	header.hash = hash;
+	header.heuristicCost = m_sahCost;
+	for (int i=0; i<3; ++i) {
+		header.aabb[i] = m_aabb.min[i];
+		header.aabb[i+3] = m_aabb.max[i];
+		header.tightAABB[i] = m_tightAABB.min[i];
+		header.tightAABB[i+3] = m_tightAABB.max[i];
+	}
+
+	/* Write to a temporary file first, so that concurrently running
+	   processes never get to see an incomplete cache file */
+	fs::path tempFile = filename.parent_path()
+		/ fs::unique_path("%%%%-%%%%-%%%%-%%%%.tmp");
+	try {
+		fs::create_directories(filename.parent_path());
+		ref<MemoryMappedFile> mmap = new MemoryMappedFile(tempFile, fileSize);
+		uint8_t *data = static_cast<uint8_t *>(mmap->getData());
+		memset(data, 0, fileSize);
+		memcpy(data, &header, sizeof(KDCacheHeader));
+		memcpy(data + nodeOffset + sizeof(KDNode), m_nodes, sizeof(KDNode) * (size_t) m_nodeCount);
+		if (hasCompressedIndices())
+			memcpy(data + indexOffset, m_compressedIndices, indexSize);
+		else
+			memcpy(data + indexOffset, m_indices, indexSize);
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+		if (hasTriAccel)
+			memcpy(data + triAccelOffset, m_triAccel, sizeof(TriAccel) * (size_t) getPrimitiveCount());
+#endif
+		mmap = NULL;
+		fs::rename(tempFile, filename);
+		Log(EDebug, "Wrote kd-tree cache file \"%s\" (%s)",
+			filename.string().c_str(), memString(fileSize).c_str());
+	} catch (const std::exception &ex) {
+		Log(EWarn, "Unable to write the kd-tree cache file \"%s\": %s",
+			filename.string().c_str(), ex.what());
+		boost::system::error_code ec;
+		fs::remove(tempFile, ec);
+	}
+}
+
+size_t ShapeKDTree::getMemoryUsage() const {
+	size_t usage = sizeof(KDNode) * (size_t) m_nodeCount + getIndexStorageSize();
+#if !defined(MTS_KD_CONSERVE_MEMORY)
+	if (m_triAccel)
+		usage += sizeof(TriAccel) * (size_t) getPrimitiveCount();
+#endif
+	return usage;
 }
 
 bool ShapeKDTree::rayIntersect(const Ray &ray, Intersection &its) const {
@@ -225,6 +530,29 @@ bool ShapeKDTree::rayIntersect(const Ray &ray) const {
 	return false;
 }
 
+void ShapeKDTree::rayIntersect(const Ray *rays, size_t count,
+		Intersection *its, bool *found) const {
+#if defined(MTS_HAS_COHERENT_RT)
+	for (size_t pos=0; pos<count; pos += MTS_KD_STREAM_SIZE)
+		rayIntersectStream<false>(rays + pos, std::min(count - pos,
+			(size_t) MTS_KD_STREAM_SIZE), its + pos, found + pos);
+#else
+	for (size_t i=0; i<count; ++i)
+		found[i] = rayIntersect(rays[i], its[i]);
+#endif
+}
+
+void ShapeKDTree::isOccluded(const Ray *rays, size_t count, bool *occluded) const {
+#if defined(MTS_HAS_COHERENT_RT)
+	for (size_t pos=0; pos<count; pos += MTS_KD_STREAM_SIZE)
+		rayIntersectStream<true>(rays + pos, std::min(count - pos,
+			(size_t) MTS_KD_STREAM_SIZE), NULL, occluded + pos);
+#else
+	for (size_t i=0; i<count; ++i)
+		occluded[i] = rayIntersect(rays[i]);
+#endif
+}
+
 #if defined(MTS_HAS_COHERENT_RT)
 
 /// Ray traversal stack entry for uncoherent ray tracing
@@ -240,6 +568,12 @@ static StatsCounter incoherentPackets("General", "Incoherent ray packets");
 
 void ShapeKDTree::rayIntersectPacket(const RayPacket4 &packet,
 		const RayInterval4 &rayInterval, Intersection4 &its, void *temp) const {
+	rayIntersectPacket<false>(NULL, packet, rayInterval, its, temp);
+}
+
+template<bool shadowRay> void ShapeKDTree::rayIntersectPacket(const Ray * const *rays,
+		const RayPacket4 &packet, const RayInterval4 &rayInterval,
+		Intersection4 &its, void *temp) const {
 	CoherentKDStackEntry MM_ALIGN16 stack[MTS_KD_MAXDEPTH];
 	RayInterval4 MM_ALIGN16 interval;
 
@@ -309,16 +643,24 @@ void ShapeKDTree::rayIntersectPacket(const RayPacket4 &packet,
 				searchEnd(_mm_min_ps(rayInterval.maxt.ps,
 					_mm_mul_ps(interval.maxt.ps, SSEConstants::op_eps.ps)));
 
-			for (IndexType entry=primStart; entry != primEnd; entry++) {
-				const TriAccel &kdTri = m_triAccel[m_indices[entry]];
-				if (EXPECT_TAKEN(kdTri.k != KNoTriangleFlag)) {
+			IndexType primIdx = 0;
+			for (IndexType entry=primStart; entry != primEnd; ) {
+				primIdx = nextPrimitive(entry, primIdx);
+				/* Shadow rays don't need to look any further once they hit something */
+				const __m128 inactive = shadowRay ?
+					_mm_or_ps(masked.ps, itsFound.ps) : masked.ps;
+
+				if (EXPECT_TAKEN(m_triAccel != NULL && m_triAccel[primIdx].k != KNoTriangleFlag)) {
 					itsFound.ps = _mm_or_ps(itsFound.ps,
-						mitsuba::rayIntersectPacket(kdTri, packet, searchStart.ps, searchEnd.ps, masked.ps, its));
+						mitsuba::rayIntersectPacket(m_triAccel[primIdx], packet,
+							searchStart.ps, searchEnd.ps, inactive, its));
 				} else {
-					const Shape *shape = m_shapes[kdTri.shapeIndex];
+					/* Other shapes (and triangles when using compact
+					   storage) are intersected one ray at a time */
+					const SSEVector skip(inactive);
 
 					for (int i=0; i<4; ++i) {
-						if (masked.i[i])
+						if (skip.i[i])
 							continue;
 						Ray ray;
 						for (int axis=0; axis<3; axis++) {
@@ -326,19 +668,40 @@ void ShapeKDTree::rayIntersectPacket(const RayPacket4 &packet,
 							ray.d[axis] = packet.d[axis].f[i];
 							ray.dRcp[axis] = packet.dRcp[axis].f[i];
 						}
-						Float t;
+						if (rays)
+							ray.time = rays[i]->time;
+
+						if (shadowRay) {
+							if (intersect(ray, primIdx, searchStart.f[i], searchEnd.f[i])) {
+								IndexType localIdx = primIdx;
+								its.shapeIndex.i[i] = findShape(localIdx);
+								its.primIndex.i[i] = m_triangleFlag[its.shapeIndex.i[i]]
+									? localIdx : (IndexType) KNoTriangleFlag;
+								itsFound.i[i] = 0xFFFFFFFF;
+							}
+							continue;
+						}
 
-						if (shape->rayIntersect(ray, searchStart.f[i], searchEnd.f[i], t,
-								reinterpret_cast<uint8_t *>(temp)
-								+ i * MTS_KD_INTERSECTION_TEMP + 2*sizeof(IndexType))) {
+						Float t;
+						uint8_t *laneTemp = reinterpret_cast<uint8_t *>(temp)
+							+ i * MTS_KD_INTERSECTION_TEMP;
+						if (intersect(ray, primIdx, searchStart.f[i], searchEnd.f[i], t, laneTemp)) {
+							const IntersectionCache *cache =
+								reinterpret_cast<const IntersectionCache *>(laneTemp);
 							its.t.f[i] = t;
-							its.shapeIndex.i[i] = kdTri.shapeIndex;
-							its.primIndex.i[i] = KNoTriangleFlag;
+							its.u.f[i] = cache->u;
+							its.v.f[i] = cache->v;
+							its.shapeIndex.i[i] = cache->shapeIndex;
+							its.primIndex.i[i] = cache->primIndex;
 							itsFound.i[i] = 0xFFFFFFFF;
 						}
 					}
 				}
-				searchEnd.ps = _mm_min_ps(searchEnd.ps, its.t.ps);
+
+				if (!shadowRay)
+					searchEnd.ps = _mm_min_ps(searchEnd.ps, its.t.ps);
+				else if (_mm_movemask_ps(_mm_or_ps(masked.ps, itsFound.ps)) == 0xF)
+					break;
 			}
 		}
 
@@ -355,6 +718,100 @@ void ShapeKDTree::rayIntersectPacket(const RayPacket4 &packet,
 	}
 }
 
+template<bool shadowRay> void ShapeKDTree::rayIntersectStream(const Ray *rays,
+		size_t count, Intersection *its, bool *found) const {
+	uint8_t MM_ALIGN16 temp[4 * MTS_KD_INTERSECTION_TEMP];
+	uint8_t octantIndices[8][MTS_KD_STREAM_SIZE];
+	size_t octantSize[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+
+	Assert(count <= MTS_KD_STREAM_SIZE);
+
+	/* Group the rays by the signs of their direction components
+	   so that all members of a packet traverse the tree in the
+	   same order */
+	for (size_t i=0; i<count; ++i) {
+		const Vector &d = rays[i].d;
+		int octant = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+		octantIndices[octant][octantSize[octant]++] = (uint8_t) i;
+	}
+
+	for (int octant=0; octant<8; ++octant) {
+		const uint8_t *indices = octantIndices[octant];
+		size_t size = octantSize[octant], pos = 0;
+
+		for (; pos + 4 <= size; pos += 4) {
+			RayPacket4 MM_ALIGN16 packet;
+			RayInterval4 MM_ALIGN16 interval;
+			Intersection4 MM_ALIGN16 its4;
+			const Ray *packetRays[4];
+
+			for (int i=0; i<4; ++i) {
+				const Ray &ray = rays[indices[pos+i]];
+				packetRays[i] = &ray;
+				for (int axis=0; axis<3; axis++) {
+					packet.o[axis].f[i] = ray.o[axis];
+					packet.d[axis].f[i] = ray.d[axis];
+					packet.dRcp[axis].f[i] = ray.dRcp[axis];
+					packet.signs[axis][i] = ray.d[axis] < 0 ? 1 : 0;
+				}
+
+				/* Use the same adaptive ray epsilon as the single-ray code */
+				Float rayMinT = ray.mint;
+				if (rayMinT == Epsilon) {
+					Float scale = std::max(std::max(std::abs(ray.o.x),
+						std::abs(ray.o.y)), std::abs(ray.o.z));
+					rayMinT *= shadowRay ? scale : std::max(scale, Epsilon);
+				}
+				interval.mint.f[i] = rayMinT;
+				interval.maxt.f[i] = ray.maxt;
+			}
+
+			rayIntersectPacket<shadowRay>(packetRays, packet, interval, its4, temp);
+
+			if (shadowRay)
+				shadowRaysTraced += 4;
+			else
+				raysTraced += 4;
+
+			for (int i=0; i<4; ++i) {
+				const size_t idx = indices[pos+i];
+				const bool hit = its4.shapeIndex.ui[i] != 0xFFFFFFFF;
+				found[idx] = hit;
+
+				if (shadowRay)
+					continue;
+
+				Intersection &result = its[idx];
+				if (!hit) {
+					result.t = std::numeric_limits<Float>::infinity();
+					continue;
+				}
+
+				/* Recreate the state that the single-ray code would have
+				   left behind, and use it to fill the intersection record */
+				uint8_t *rayTemp = temp + i * MTS_KD_INTERSECTION_TEMP;
+				IntersectionCache *cache = reinterpret_cast<IntersectionCache *>(rayTemp);
+				cache->shapeIndex = its4.shapeIndex.ui[i];
+				cache->primIndex = its4.primIndex.ui[i];
+				if (m_triangleFlag[cache->shapeIndex]) {
+					/* Non-triangle shapes keep their own data at this offset */
+					cache->u = its4.u.f[i];
+					cache->v = its4.v.f[i];
+				}
+				result.t = its4.t.f[i];
+				fillIntersectionRecord<true>(rays[idx], rayTemp, result);
+			}
+		}
+
+		/* Trace the remainder one ray at a time */
+		for (; pos < size; ++pos) {
+			const size_t idx = indices[pos];
+			found[idx] = shadowRay ? rayIntersect(rays[idx])
+				: rayIntersect(rays[idx], its[idx]);
+		}
+	}
+}
+
 void ShapeKDTree::rayIntersectPacketIncoherent(const RayPacket4 &packet,
 		const RayInterval4 &rayInterval, Intersection4 &its4, void *temp) const {
 
@@ -0,0 +1,261 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/texcache.h>
+#include <mitsuba/core/statistics.h>
+#include <mitsuba/core/atomic.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+MTS_NAMESPACE_BEGIN
+
+static StatsCounter statsHitRate("Texture cache", "Shared cache hit rate", EPercentage);
+static StatsCounter statsLoads("Texture cache", "Tile loads");
+static StatsCounter statsEvictions("Texture cache", "Tile evictions");
+
+/// Protects the creation of the process-wide cache instance
+static boost::mutex instanceMutex;
+
+ref<TextureTileCache> TextureTileCache::m_instance = NULL;
+
+/* Native TLS pointer to the current thread's tile table. This avoids the
+   comparably expensive ThreadLocal::get() in every lookup; the table itself
+   is still owned by m_localCache, which releases it when the thread exits.
+   There is only a single cache instance, hence one pointer suffices. */
+#if defined(__WINDOWS__)
+static __declspec(thread) void *localCachePtr = NULL;
+#elif defined(__LINUX__)
+static __thread void *localCachePtr = NULL;
+#endif
+
+struct TextureTileCache::Tile {
+	TileKey key;
+	size_t size;
+	volatile int32_t refCount;
+	/* Set when the tile is accessed through a thread-local table (these
+	   accesses don't update the LRU list). Such tiles get a second chance
+	   before being evicted. */
+	volatile bool used;
+	TileList::iterator lruPos;
+	uint8_t *data;
+};
+
+struct TextureTileCache::LocalCache : public Object {
+	Tile *tiles[MTS_TEXCACHE_LOCAL_SIZE];
+
+	LocalCache() {
+		memset(tiles, 0, sizeof(tiles));
+	}
+
+	~LocalCache() {
+		for (int i=0; i<MTS_TEXCACHE_LOCAL_SIZE; ++i) {
+			if (tiles[i])
+				TextureTileCache::decRef(tiles[i]);
+		}
+	}
+};
+
+TextureTileCache::TextureTileCache() : m_memoryLimit(0),
+		m_memoryUsage(0), m_sourceCounter(0) {
+	m_mutex = new Mutex();
+}
+
+TextureTileCache::~TextureTileCache() {
+	for (TileList::iterator it = m_lru.begin(); it != m_lru.end(); ++it)
+		decRef(*it);
+}
+
+TextureTileCache *TextureTileCache::getInstance() {
+	boost::lock_guard<boost::mutex> guard(instanceMutex);
+	if (!m_instance)
+		m_instance = new TextureTileCache();
+	return m_instance;
+}
+
+void TextureTileCache::incRef(Tile *tile) {
+	atomicAdd(&tile->refCount, 1);
+}
+
+void TextureTileCache::decRef(Tile *tile) {
+	if (atomicAdd(&tile->refCount, -1) == 0) {
+		freeAligned(tile->data);
+		delete tile;
+	}
+}
+
+void TextureTileCache::setMemoryLimit(size_t limit) {
+	LockGuard lock(m_mutex);
+	m_memoryLimit = limit;
+	evict();
+}
+
+size_t TextureTileCache::getMemoryUsage() const {
+	LockGuard lock(m_mutex);
+	return m_memoryUsage;
+}
+
+uint32_t TextureTileCache::registerSource(const TileSource *source, size_t tileSize) {
+	LockGuard lock(m_mutex);
+	Source entry;
+	entry.source = source;
+	entry.tileSize = tileSize;
+	uint32_t id = m_sourceCounter++;
+	m_sources[id] = entry;
+	return id;
+}
+
+void TextureTileCache::unregisterSource(uint32_t id) {
+	LockGuard lock(m_mutex);
+	m_sources.erase(id);
+
+	/* Tiles that are still referenced by thread-local tables will
+	   be released later on (identifiers are never reused) */
+	TileList::iterator it = m_lru.begin();
+	while (it != m_lru.end()) {
+		Tile *tile = *it;
+		if (tile->key.id == id) {
+			it = m_lru.erase(it);
+			m_tiles.erase(tile->key);
+			m_memoryUsage -= tile->size;
+			decRef(tile);
+		} else {
+			++it;
+		}
+	}
+}
+
+const void *TextureTileCache::lookup(uint32_t id, int level, int x, int y) {
+	TileKey key;
+	key.id = id; key.level = level;
+	key.x = x; key.y = y;
+
+#if defined(__WINDOWS__) || defined(__LINUX__)
+	LocalCache *local = static_cast<LocalCache *>(localCachePtr);
+#else
+	LocalCache *local = m_localCache.get();
+#endif
+	if (EXPECT_NOT_TAKEN(local == NULL)) {
+		local = m_localCache.get();
+		if (!local) {
+			local = new LocalCache();
+			m_localCache.set(local);
+		}
+#if defined(__WINDOWS__) || defined(__LINUX__)
+		localCachePtr = local;
+#endif
+	}
+
+	Tile *&entry = local->tiles[key.hash() % MTS_TEXCACHE_LOCAL_SIZE];
+	if (EXPECT_TAKEN(entry != NULL && entry->key == key)) {
+		if (!entry->used)
+			entry->used = true;
+		return entry->data;
+	}
+
+	Tile *tile = lookupShared(key);
+	if (entry)
+		decRef(entry);
+	entry = tile;
+
+	return tile->data;
+}
+
+TextureTileCache::Tile *TextureTileCache::lookupShared(const TileKey &key) {
+	Source source;
+
+	statsHitRate.incrementBase();
+	{
+		LockGuard lock(m_mutex);
+		TileMap::iterator it = m_tiles.find(key);
+		if (it != m_tiles.end()) {
+			Tile *tile = it->second;
+			m_lru.splice(m_lru.begin(), m_lru, tile->lruPos);
+			incRef(tile);
+			++statsHitRate;
+			return tile;
+		}
+
+		SourceMap::iterator it2 = m_sources.find(key.id);
+		if (it2 == m_sources.end())
+			Log(EError, "lookup(): unknown tile source %i!", key.id);
+		source = it2->second;
+	}
+
+	/* Load the tile without holding the lock. One reference
+	   is owned by the shared cache, and one by the caller */
+	Tile *tile = new Tile();
+	tile->key = key;
+	tile->size = source.tileSize;
+	tile->refCount = 2;
+	tile->used = false;
+	tile->data = static_cast<uint8_t *>(allocAligned(source.tileSize));
+	source.source->loadTile(key.level, key.x, key.y, tile->data);
+	++statsLoads;
+
+	LockGuard lock(m_mutex);
+	TileMap::iterator it = m_tiles.find(key);
+	if (it != m_tiles.end()) {
+		/* Another thread loaded the same tile in the meantime */
+		freeAligned(tile->data);
+		delete tile;
+		tile = it->second;
+		incRef(tile);
+		return tile;
+	}
+
+	m_lru.push_front(tile);
+	tile->lruPos = m_lru.begin();
+	m_tiles[key] = tile;
+	m_memoryUsage += tile->size;
+	evict();
+
+	return tile;
+}
+
+void TextureTileCache::evict() {
+	/* Approximate LRU: walk backwards, but give tiles that were
+	   recently accessed through a thread-local table a second chance */
+	while (m_memoryUsage > m_memoryLimit && m_tiles.size() > 1) {
+		Tile *tile = m_lru.back();
+		if (tile->used) {
+			tile->used = false;
+			m_lru.splice(m_lru.begin(), m_lru, tile->lruPos);
+			continue;
+		}
+		m_lru.pop_back();
+		m_tiles.erase(tile->key);
+		m_memoryUsage -= tile->size;
+		decRef(tile);
+		++statsEvictions;
+	}
+}
+
+std::string TextureTileCache::toString() const {
+	LockGuard lock(m_mutex);
+	std::ostringstream oss;
+	oss << "TextureTileCache[" << endl
+		<< "  memoryLimit = " << memString(m_memoryLimit) << "," << endl
+		<< "  memoryUsage = " << memString(m_memoryUsage) << "," << endl
+		<< "  tiles = " << m_tiles.size() << "," << endl
+		<< "  sources = " << m_sources.size() << endl
+		<< "]";
+	return oss.str();
+}
+
+MTS_IMPLEMENT_CLASS(TextureTileCache, false, Object)
+MTS_NAMESPACE_END
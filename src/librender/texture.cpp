@@ -18,6 +18,8 @@
 
 #include <mitsuba/render/scene.h>
 #include <mitsuba/render/mipmap.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 
 MTS_NAMESPACE_BEGIN
 
@@ -29,6 +31,82 @@ namespace stats {
 
 }
 
+/* State of the MIP map cache files that are currently locked or mapped
+   into memory. An entry is removed once it is neither of the two */
+struct MIPMapCacheLock::Entry {
+	boost::mutex mutex;
+	int refCount, mapCount;
+
+	Entry() : refCount(0), mapCount(0) { }
+};
+
+typedef std::map<std::string, MIPMapCacheLock::Entry *> MIPMapCacheEntryMap;
+static boost::mutex __mipCacheMutex;
+static MIPMapCacheEntryMap __mipCacheEntries;
+
+static std::string getCacheKey(const fs::path &cacheFile) {
+	return fs::absolute(cacheFile).string();
+}
+
+/// Release an entry if it is unused (must be called with __mipCacheMutex held)
+static void releaseCacheEntry(MIPMapCacheEntryMap::iterator it) {
+	MIPMapCacheLock::Entry *entry = it->second;
+	if (entry->refCount == 0 && entry->mapCount == 0) {
+		__mipCacheEntries.erase(it);
+		delete entry;
+	}
+}
+
+MIPMapCacheLock::MIPMapCacheLock(const fs::path &cacheFile) : m_entry(NULL) {
+	if (cacheFile.empty())
+		return;
+
+	m_key = getCacheKey(cacheFile);
+	{
+		boost::lock_guard<boost::mutex> guard(__mipCacheMutex);
+		Entry *&entry = __mipCacheEntries[m_key];
+		if (!entry)
+			entry = new Entry();
+		entry->refCount++;
+		m_entry = entry;
+	}
+	m_entry->mutex.lock();
+}
+
+MIPMapCacheLock::~MIPMapCacheLock() {
+	if (!m_entry)
+		return;
+
+	m_entry->mutex.unlock();
+
+	boost::lock_guard<boost::mutex> guard(__mipCacheMutex);
+	m_entry->refCount--;
+	releaseCacheEntry(__mipCacheEntries.find(m_key));
+}
+
+bool MIPMapCacheLock::isMapped(const fs::path &cacheFile) {
+	boost::lock_guard<boost::mutex> guard(__mipCacheMutex);
+	MIPMapCacheEntryMap::const_iterator it = __mipCacheEntries.find(getCacheKey(cacheFile));
+	return it != __mipCacheEntries.end() && it->second->mapCount > 0;
+}
+
+void MIPMapCacheLock::addMapping(const fs::path &cacheFile) {
+	boost::lock_guard<boost::mutex> guard(__mipCacheMutex);
+	Entry *&entry = __mipCacheEntries[getCacheKey(cacheFile)];
+	if (!entry)
+		entry = new Entry();
+	entry->mapCount++;
+}
+
+void MIPMapCacheLock::removeMapping(const fs::path &cacheFile) {
+	boost::lock_guard<boost::mutex> guard(__mipCacheMutex);
+	MIPMapCacheEntryMap::iterator it = __mipCacheEntries.find(getCacheKey(cacheFile));
+	if (it == __mipCacheEntries.end())
+		return;
+	it->second->mapCount--;
+	releaseCacheEntry(it);
+}
+
 Texture::Texture(const Properties &props)
  : ConfigurableObject(props) {
 }
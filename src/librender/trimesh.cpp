@@ -28,12 +28,13 @@
 #include <mitsuba/render/medium.h>
 #include <mitsuba/render/bsdf.h>
 #include <mitsuba/render/emitter.h>
+#include <mitsuba/core/mmap.h>
+#include <mitsuba/core/mstream.h>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/unordered_map.hpp>
 
-#define MTS_FILEFORMAT_HEADER     0x041C
-#define MTS_FILEFORMAT_VERSION_V3 0x0003
-#define MTS_FILEFORMAT_VERSION_V4 0x0004
+/* Alignment of the data arrays in uncompressed (V5) files */
+#define MTS_FILEFORMAT_ALIGNMENT  16
 
 MTS_NAMESPACE_BEGIN
 
@@ -172,6 +173,61 @@ static void readHelper(Stream *stream, bool fileDoublePrecision,
 	}
 }
 
+/* Number of padding bytes in front of a data array in uncompressed (V5)
+   files. Arrays are aligned relative to the beginning of the file. */
+static inline size_t paddingSize(size_t pos) {
+	return (MTS_FILEFORMAT_ALIGNMENT - pos % MTS_FILEFORMAT_ALIGNMENT)
+		% MTS_FILEFORMAT_ALIGNMENT;
+}
+
+/* Point to an array stored at (or right after) the given position of a
+   memory-mapped uncompressed file, and advance the position past it */
+template <typename T> static void mapArray(MemoryMappedFile *file,
+		size_t &pos, T *&target, size_t count) {
+	pos += paddingSize(pos);
+	if (pos + sizeof(T) * count > file->getSize())
+		SLog(EError, "Unable to unserialize mesh: the file \"%s\" is truncated!",
+			file->getFilename().string().c_str());
+	target = reinterpret_cast<T *>(static_cast<uint8_t *>(file->getData()) + pos);
+	pos += sizeof(T) * count;
+}
+
+template <typename T> void TriMesh::freeArray(T *&ptr) {
+	if (ptr && m_mappedFile) {
+		const uint8_t *start = static_cast<const uint8_t *>(m_mappedFile->getData());
+		const uint8_t *value = reinterpret_cast<const uint8_t *>(ptr);
+		if (value >= start && value < start + m_mappedFile->getSize())
+			ptr = NULL;
+	}
+	if (ptr) {
+		delete[] ptr;
+		ptr = NULL;
+	}
+}
+
+template <typename T> void TriMesh::copyMappedArray(T *&ptr, size_t count) {
+	if (!ptr)
+		return;
+	const uint8_t *start = static_cast<const uint8_t *>(m_mappedFile->getData());
+	const uint8_t *value = reinterpret_cast<const uint8_t *>(ptr);
+	if (value < start || value >= start + m_mappedFile->getSize())
+		return;
+	T *copy = new T[count];
+	memcpy(copy, ptr, sizeof(T) * count);
+	ptr = copy;
+}
+
+void TriMesh::copyMappedArrays() {
+	if (!m_mappedFile)
+		return;
+	copyMappedArray(m_positions, m_vertexCount);
+	copyMappedArray(m_normals, m_vertexCount);
+	copyMappedArray(m_texcoords, m_vertexCount);
+	copyMappedArray(m_colors, m_vertexCount);
+	copyMappedArray(m_triangles, m_triangleCount);
+	m_mappedFile = NULL;
+}
+
 void TriMesh::loadCompressed(Stream *_stream, int index) {
 	ref<Stream> stream = _stream;
 
@@ -187,11 +243,15 @@ void TriMesh::loadCompressed(Stream *_stream, int index) {
 		stream->skip(sizeof(short) * 2); // Skip the header
 	}
 
-	stream = new ZStream(stream);
-	stream->setByteOrder(Stream::ELittleEndian);
+	/* Version 5 files are stored without compression */
+	const bool compressed = version < MTS_FILEFORMAT_VERSION_V5;
+	if (compressed) {
+		stream = new ZStream(stream);
+		stream->setByteOrder(Stream::ELittleEndian);
+	}
 
 	uint32_t flags = stream->readUInt();
-	if (version == MTS_FILEFORMAT_VERSION_V4)
+	if (version >= MTS_FILEFORMAT_VERSION_V4)
 		m_name = stream->readString();
 	m_vertexCount = stream->readSize();
 	m_triangleCount = stream->readSize();
@@ -199,19 +259,19 @@ void TriMesh::loadCompressed(Stream *_stream, int index) {
 	bool fileDoublePrecision = flags & EDoublePrecision;
 	m_faceNormals = flags & EFaceNormals;
 
-	if (m_positions)
-		delete[] m_positions;
-
+	freeArray(m_positions);
 	m_positions = new Point[m_vertexCount];
+	if (!compressed)
+		stream->skip(paddingSize(stream->getPos()));
 	readHelper(stream, fileDoublePrecision,
 			reinterpret_cast<Float *>(m_positions),
 			m_vertexCount, sizeof(Point)/sizeof(Float));
 
-	if (m_normals)
-		delete[] m_normals;
-
+	freeArray(m_normals);
 	if (flags & EHasNormals) {
 		m_normals = new Normal[m_vertexCount];
+		if (!compressed)
+			stream->skip(paddingSize(stream->getPos()));
 		readHelper(stream, fileDoublePrecision,
 				reinterpret_cast<Float *>(m_normals),
 				m_vertexCount, sizeof(Normal)/sizeof(Float));
@@ -219,11 +279,11 @@ void TriMesh::loadCompressed(Stream *_stream, int index) {
 		m_normals = NULL;
 	}
 
-	if (m_texcoords)
-		delete[] m_texcoords;
-
+	freeArray(m_texcoords);
 	if (flags & EHasTexcoords) {
 		m_texcoords = new Point2[m_vertexCount];
+		if (!compressed)
+			stream->skip(paddingSize(stream->getPos()));
 		readHelper(stream, fileDoublePrecision,
 				reinterpret_cast<Float *>(m_texcoords),
 				m_vertexCount, sizeof(Point2)/sizeof(Float));
@@ -231,11 +291,11 @@ void TriMesh::loadCompressed(Stream *_stream, int index) {
 		m_texcoords = NULL;
 	}
 
-	if (m_colors)
-		delete[] m_colors;
-
+	freeArray(m_colors);
 	if (flags & EHasColors) {
 		m_colors = new Color3[m_vertexCount];
+		if (!compressed)
+			stream->skip(paddingSize(stream->getPos()));
 		readHelper(stream, fileDoublePrecision,
 				reinterpret_cast<Float *>(m_colors),
 				m_vertexCount, sizeof(Color3)/sizeof(Float));
@@ -243,7 +303,10 @@ void TriMesh::loadCompressed(Stream *_stream, int index) {
 		m_colors = NULL;
 	}
 
+	freeArray(m_triangles);
 	m_triangles = new Triangle[m_triangleCount];
+	if (!compressed)
+		stream->skip(paddingSize(stream->getPos()));
 	stream->readUIntArray(reinterpret_cast<uint32_t *>(m_triangles),
 		m_triangleCount * sizeof(Triangle)/sizeof(uint32_t));
 
@@ -251,6 +314,57 @@ void TriMesh::loadCompressed(Stream *_stream, int index) {
 	m_flipNormals = false;
 }
 
+void TriMesh::loadMapped(MemoryMappedFile *file, size_t offset) {
+	ref<MemoryStream> stream = new MemoryStream(file->getData(), file->getSize());
+	stream->setByteOrder(Stream::ELittleEndian);
+	stream->seek(offset);
+	const short version = readHeader(stream);
+
+#if defined(SINGLE_PRECISION)
+	const uint32_t hostPrecision = ESinglePrecision;
+#else
+	const uint32_t hostPrecision = EDoublePrecision;
+#endif
+
+	uint32_t flags = 0;
+	if (version >= MTS_FILEFORMAT_VERSION_V5)
+		flags = stream->readUInt();
+
+	if (version < MTS_FILEFORMAT_VERSION_V5 || !(flags & hostPrecision)
+		|| Stream::getHostByteOrder() != Stream::ELittleEndian) {
+		/* The data has to be converted -- read it from the mapped memory */
+		stream->seek(offset);
+		loadCompressed(stream);
+		return;
+	}
+
+	m_name = stream->readString();
+	m_vertexCount = stream->readSize();
+	m_triangleCount = stream->readSize();
+	m_faceNormals = flags & EFaceNormals;
+
+	freeArray(m_positions);
+	freeArray(m_normals);
+	freeArray(m_texcoords);
+	freeArray(m_colors);
+	freeArray(m_triangles);
+	m_mappedFile = file;
+
+	/* Reference the (aligned) arrays within the mapped file */
+	size_t pos = stream->getPos();
+	mapArray(file, pos, m_positions, m_vertexCount);
+	if (flags & EHasNormals)
+		mapArray(file, pos, m_normals, m_vertexCount);
+	if (flags & EHasTexcoords)
+		mapArray(file, pos, m_texcoords, m_vertexCount);
+	if (flags & EHasColors)
+		mapArray(file, pos, m_colors, m_vertexCount);
+	mapArray(file, pos, m_triangles, m_triangleCount);
+
+	m_surfaceArea = m_invSurfaceArea = -1;
+	m_flipNormals = false;
+}
+
 short TriMesh::readHeader(Stream *stream) {
 	short format = stream->readShort();
 	if (format == 0x1C04) {
@@ -263,7 +377,8 @@ short TriMesh::readHeader(Stream *stream) {
 	}
 	short version = stream->readShort();
 	if (version != MTS_FILEFORMAT_VERSION_V3 &&
-	    version != MTS_FILEFORMAT_VERSION_V4) {
+	    version != MTS_FILEFORMAT_VERSION_V4 &&
+	    version != MTS_FILEFORMAT_VERSION_V5) {
 		Log(EError, "Encountered an incompatible file version!");
 	}
 	return version;
@@ -283,7 +398,7 @@ size_t TriMesh::readOffset(Stream *stream, short version, int idx) {
 	}
 
 	// Seek to the correct position
-	if (version == MTS_FILEFORMAT_VERSION_V4) {
+	if (version >= MTS_FILEFORMAT_VERSION_V4) {
 		stream->seek(stream->getSize() - sizeof(uint64_t) * (count-idx) - sizeof(uint32_t));
 		return stream->readSize();
 	} else {
@@ -310,7 +425,7 @@ int TriMesh::readOffsetDictionary(Stream *stream, short version,
 
 	if (streamSize >= minSize) {
 		outOffsets.resize(count);
-		if (version == MTS_FILEFORMAT_VERSION_V4) {
+		if (version >= MTS_FILEFORMAT_VERSION_V4) {
 			stream->seek(stream->getSize() - sizeof(uint64_t) * count - sizeof(uint32_t));
 			if (typeid(size_t) == typeid(uint64_t)) {
 				stream->readArray(&outOffsets[0], count);
@@ -337,18 +452,12 @@ int TriMesh::readOffsetDictionary(Stream *stream, short version,
 }
 
 TriMesh::~TriMesh() {
-	if (m_positions)
-		delete[] m_positions;
-	if (m_normals)
-		delete[] m_normals;
-	if (m_texcoords)
-		delete[] m_texcoords;
-	if (m_tangents)
-		delete[] m_tangents;
-	if (m_colors)
-		delete[] m_colors;
-	if (m_triangles)
-		delete[] m_triangles;
+	freeArray(m_positions);
+	freeArray(m_normals);
+	freeArray(m_texcoords);
+	freeArray(m_tangents);
+	freeArray(m_colors);
+	freeArray(m_triangles);
 }
 
 AABB TriMesh::getAABB() const {
@@ -471,15 +580,8 @@ void TriMesh::rebuildTopology(Float maxAngle) {
 	const Float dpThresh = std::cos(degToRad(maxAngle));
 	size_t degenerateTriangles = 0;
 
-	if (m_normals) {
-		delete[] m_normals;
-		m_normals = NULL;
-	}
-
-	if (m_tangents) {
-		delete[] m_tangents;
-		m_tangents = NULL;
-	}
+	freeArray(m_normals);
+	freeArray(m_tangents);
 
 	Log(EInfo, "Rebuilding the topology of \"%s\" (" SIZE_T_FMT
 			" triangles, " SIZE_T_FMT " vertices, max. angle = %f)",
@@ -575,21 +677,21 @@ void TriMesh::rebuildTopology(Float maxAngle) {
 		for (int j=0; j<3; ++j)
 			Assert(newTriangles[i].idx[j] != 0xFFFFFFFFU);
 
-	delete[] m_triangles;
+	freeArray(m_triangles);
 	m_triangles = newTriangles;
 
-	delete[] m_positions;
+	freeArray(m_positions);
 	m_positions = new Point[newPositions.size()];
 	memcpy(m_positions, &newPositions[0], sizeof(Point) * newPositions.size());
 
 	if (m_texcoords) {
-		delete[] m_texcoords;
+		freeArray(m_texcoords);
 		m_texcoords = new Point2[newTexcoords.size()];
 		memcpy(m_texcoords, &newTexcoords[0], sizeof(Point2) * newTexcoords.size());
 	}
 
 	if (m_colors) {
-		delete[] m_colors;
+		freeArray(m_colors);
 		m_colors = new Color3[newColors.size()];
 		memcpy(m_colors, &newColors[0], sizeof(Color3) * newColors.size());
 	}
@@ -607,11 +709,10 @@ void TriMesh::rebuildTopology(Float maxAngle) {
 
 void TriMesh::computeNormals(bool force) {
 	int invalidNormals = 0;
+	if (force || m_flipNormals)
+		copyMappedArrays();
 	if (m_faceNormals) {
-		if (m_normals) {
-			delete[] m_normals;
-			m_normals = NULL;
-		}
+		freeArray(m_normals);
 
 		if (m_flipNormals) {
 			/* Change the winding order */
@@ -680,6 +781,29 @@ void TriMesh::computeNormals(bool force) {
 			m_name.c_str(), invalidNormals);
 }
 
+void TriMesh::updateVertexPositions(bool recomputeNormals) {
+	/* Detach from a file mapping that may be shared with other meshes
+	   before anything derived from the positions is updated in place */
+	copyMappedArrays();
+
+	m_aabb.reset();
+	for (size_t i=0; i<m_vertexCount; i++)
+		m_aabb.expandBy(m_positions[i]);
+
+	if (m_normals && recomputeNormals)
+		computeNormals(true);
+
+	if (m_tangents) {
+		delete[] m_tangents;
+		m_tangents = NULL;
+		computeUVTangents();
+	}
+
+	LockGuard guard(m_mutex);
+	m_areaDistr.clear();
+	m_surfaceArea = m_invSurfaceArea = -1;
+}
+
 void TriMesh::computeUVTangents() {
 	// int degenerate = 0;
 	if (!m_texcoords) {
@@ -1174,6 +1298,58 @@ void TriMesh::serialize(Stream *_stream) const {
 		m_triangleCount * sizeof(Triangle)/sizeof(uint32_t));
 }
 
+void TriMesh::serializeUncompressed(Stream *stream) const {
+	if (stream->getByteOrder() != Stream::ELittleEndian)
+		Log(EError, "Tried to serialize a shape to a stream, "
+			"which was not previously set to little endian byte order!");
+
+	stream->writeShort(MTS_FILEFORMAT_HEADER);
+	stream->writeShort(MTS_FILEFORMAT_VERSION_V5);
+
+#if defined(SINGLE_PRECISION)
+	uint32_t flags = ESinglePrecision;
+#else
+	uint32_t flags = EDoublePrecision;
+#endif
+
+	if (m_normals)
+		flags |= EHasNormals;
+	if (m_texcoords)
+		flags |= EHasTexcoords;
+	if (m_colors)
+		flags |= EHasColors;
+	if (m_faceNormals)
+		flags |= EFaceNormals;
+
+	stream->writeUInt(flags);
+	stream->writeString(m_name);
+	stream->writeSize(m_vertexCount);
+	stream->writeSize(m_triangleCount);
+
+	const uint8_t padding[MTS_FILEFORMAT_ALIGNMENT] = { 0 };
+	stream->write(padding, paddingSize(stream->getPos()));
+	stream->writeFloatArray(reinterpret_cast<Float *>(m_positions),
+		m_vertexCount * sizeof(Point)/sizeof(Float));
+	if (m_normals) {
+		stream->write(padding, paddingSize(stream->getPos()));
+		stream->writeFloatArray(reinterpret_cast<Float *>(m_normals),
+			m_vertexCount * sizeof(Normal)/sizeof(Float));
+	}
+	if (m_texcoords) {
+		stream->write(padding, paddingSize(stream->getPos()));
+		stream->writeFloatArray(reinterpret_cast<Float *>(m_texcoords),
+			m_vertexCount * sizeof(Point2)/sizeof(Float));
+	}
+	if (m_colors) {
+		stream->write(padding, paddingSize(stream->getPos()));
+		stream->writeFloatArray(reinterpret_cast<Float *>(m_colors),
+			m_vertexCount * sizeof(Color3)/sizeof(Float));
+	}
+	stream->write(padding, paddingSize(stream->getPos()));
+	stream->writeUIntArray(reinterpret_cast<uint32_t *>(m_triangles),
+		m_triangleCount * sizeof(Triangle)/sizeof(uint32_t));
+}
+
 size_t TriMesh::getPrimitiveCount() const {
 	return m_triangleCount;
 }
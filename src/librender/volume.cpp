@@ -49,6 +49,20 @@ Spectrum VolumeDataSource::lookupSpectrum(const Point &p) const {
 	return Spectrum(0.0f);
 }
 
+void VolumeDataSource::lookupFloats(const Point *p, Float *result, size_t count) const {
+	for (size_t i=0; i<count; ++i)
+		result[i] = lookupFloat(p[i]);
+}
+
+void VolumeDataSource::lookupSpectra(const Point *p, Spectrum *result, size_t count) const {
+	for (size_t i=0; i<count; ++i)
+		result[i] = lookupSpectrum(p[i]);
+}
+
+Float VolumeDataSource::getMaximumFloatValue(const AABB &aabb) const {
+	return getMaximumFloatValue();
+}
+
 Vector VolumeDataSource::lookupVector(const Point &p) const {
 	Log(EError, "'%s': does not implement lookupVector()!", getClass()->getName().c_str());
 	return Vector();
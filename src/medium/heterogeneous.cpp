@@ -19,6 +19,7 @@
 #include <mitsuba/render/scene.h>
 #include <mitsuba/render/volume.h>
 #include <mitsuba/core/statistics.h>
+#include <mitsuba/core/timer.h>
 #include <boost/algorithm/string.hpp>
 
 MTS_NAMESPACE_BEGIN
@@ -33,6 +34,9 @@ MTS_NAMESPACE_BEGIN
 /// Generate a few statistics related to the implementation?
 // #define HETVOL_STATISTICS 1
 
+/// Maximum number of density lookups that are batched during ray marching
+#define HETVOL_BATCH_SIZE 64
+
 #if defined(HETVOL_STATISTICS)
 static StatsCounter avgNewtonIterations("Heterogeneous volume",
 		"Avg. # of Newton-Bisection iterations", EAverage);
@@ -44,6 +48,75 @@ static StatsCounter earlyExits("Heterogeneous volume",
 		"Number of early exits", EPercentage);
 #endif
 
+static StatsCounter nullCollisions("Heterogeneous volume",
+		"Null collisions (Woodcock tracking)", EPercentage);
+static StatsCounter avgMajorantCells("Heterogeneous volume",
+		"Avg. # of majorant grid cells per tracked ray", EAverage);
+
+/**
+ * \brief Steps through the cells of the majorant grid that overlap a ray
+ * segment using a 3D-DDA [Amanatides and Woo 1987]
+ */
+class MajorantGridIterator {
+public:
+	MajorantGridIterator(const Ray &ray, Float mint, Float maxt, const AABB &aabb,
+			const Vector3i &res, const Vector &cellSize, const Float *majorants)
+		: m_t(mint), m_maxt(maxt), m_res(res), m_majorants(majorants) {
+		const Point p = ray(mint);
+		for (int i=0; i<3; ++i) {
+			const Float invD = 1.0f / ray.d[i];
+			m_cell[i] = std::min(std::max(
+				math::floorToInt((p[i] - aabb.min[i]) / cellSize[i]), 0), res[i] - 1);
+
+			if (ray.d[i] == 0) {
+				m_nextT[i] = std::numeric_limits<Float>::infinity();
+				m_deltaT[i] = 0;
+				m_step[i] = 0;
+				m_stop[i] = 0;
+			} else if (ray.d[i] > 0) {
+				m_nextT[i] = mint + (aabb.min[i] + (m_cell[i] + 1) * cellSize[i] - p[i]) * invD;
+				m_deltaT[i] = cellSize[i] * invD;
+				m_step[i] = 1;
+				m_stop[i] = res[i];
+			} else {
+				m_nextT[i] = mint + (aabb.min[i] + m_cell[i] * cellSize[i] - p[i]) * invD;
+				m_deltaT[i] = -cellSize[i] * invD;
+				m_step[i] = -1;
+				m_stop[i] = -1;
+			}
+		}
+	}
+
+	/// Return the next segment <tt>[t0, t1]</tt> and its majorant
+	inline bool next(Float &t0, Float &t1, Float &majorant) {
+		if (m_t >= m_maxt)
+			return false;
+
+		int axis = 0;
+		if (m_nextT[1] < m_nextT[axis])
+			axis = 1;
+		if (m_nextT[2] < m_nextT[axis])
+			axis = 2;
+
+		t0 = m_t;
+		t1 = std::min(m_nextT[axis], m_maxt);
+		majorant = m_majorants[(m_cell[2] * m_res.y + m_cell[1]) * m_res.x + m_cell[0]];
+
+		m_t = t1;
+		m_cell[axis] += m_step[axis];
+		m_nextT[axis] += m_deltaT[axis];
+		if (m_cell[axis] == m_stop[axis])
+			m_t = m_maxt;
+		return true;
+	}
+private:
+	Float m_t, m_maxt;
+	Float m_nextT[3], m_deltaT[3];
+	int m_cell[3], m_step[3], m_stop[3];
+	const Vector3i &m_res;
+	const Float *m_majorants;
+};
+
 /*!\plugin{heterogeneous}{Heterogeneous participating medium}
  * \order{2}
  * \parameters{
@@ -81,6 +154,17 @@ static StatsCounter earlyExits("Heterogeneous volume",
  *         Provided for convenience when accomodating data based on different units,
  *         or to simply tweak the density of the medium. \default{1}
  *     }
+ *     \parameter{majorantResolution}{\Integer}{
+ *         Woodcock tracking uses an upper bound of the density
+ *         (a \emph{majorant}) to take tentative steps through the medium.
+ *         To avoid taking many small steps through sparse regions of a
+ *         medium with a few dense features, the bounding box of the medium
+ *         is divided into a coarse grid with this many cells along its longest
+ *         axis, and every cell stores the maximum density within it. The
+ *         other axes receive proportionally fewer cells, so that the cells
+ *         are roughly cubical.
+ *         \default{16}
+ *     }
  *     \parameter{\Unnamed}{\Phase}{
  *          A nested phase function that describes the directional
  *          scattering properties of the medium. When none is specified,
@@ -184,6 +268,9 @@ public:
 		: Medium(props) {
 		m_stepSize = props.getFloat("stepSize", 0);
 		m_scale = props.getFloat("scale", 1);
+		m_majorantRes = props.getInteger("majorantResolution", 16);
+		if (m_majorantRes < 1)
+			Log(EError, "The 'majorantResolution' parameter must be positive!");
 		if (props.hasProperty("sigmaS") || props.hasProperty("sigmaA"))
 			Log(EError, "The 'sigmaS' and 'sigmaA' properties are only supported by "
 				"homogeneous media. Please use nested volume instances to supply "
@@ -210,6 +297,7 @@ public:
 		m_albedo = static_cast<VolumeDataSource *>(manager->getInstance(stream));
 		m_orientation = static_cast<VolumeDataSource *>(manager->getInstance(stream));
 		m_stepSize = stream->readFloat();
+		m_majorantRes = stream->readInt();
 		configure();
 	}
 
@@ -222,6 +310,7 @@ public:
 		manager->serialize(stream, m_albedo.get());
 		manager->serialize(stream, m_orientation.get());
 		stream->writeFloat(m_stepSize);
+		stream->writeInt(m_majorantRes);
 	}
 
 	void configure() {
@@ -234,12 +323,8 @@ public:
 		m_anisotropicMedium =
 			m_phaseFunction->needsDirectionallyVaryingCoefficients();
 
-		/* Assumes that the density medium does not
-		   contain values greater than one! */
-		m_maxDensity = m_scale * m_density->getMaximumFloatValue();
-		if (m_anisotropicMedium)
-			m_maxDensity *= m_phaseFunction->sigmaDirMax();
-		m_invMaxDensity = 1.0f/m_maxDensity;
+		if (m_method == EWoodcockTracking)
+			buildMajorantGrid();
 
 		if (m_stepSize == 0) {
 			m_stepSize = std::min(
@@ -259,6 +344,55 @@ public:
 				"did not specify a particle orientation field!");
 	}
 
+	/// Compute the maximum density within each cell of the majorant grid
+	void buildMajorantGrid() {
+		ref<Timer> timer = new Timer();
+		/* Use m_majorantRes cells along the longest axis and roughly
+		   cubical cells elsewhere */
+		const Vector extents = m_densityAABB.getExtents();
+		const Float maxExtent = extents[m_densityAABB.getLargestAxis()];
+		for (int i=0; i<3; ++i) {
+			m_majorantGridRes[i] = maxExtent > 0 ? std::max(1, std::min(m_majorantRes,
+				math::ceilToInt(m_majorantRes * extents[i] / maxExtent))) : 1;
+			m_majorantCellSize[i] = extents[i] / (Float) m_majorantGridRes[i];
+		}
+		const Vector3i &res = m_majorantGridRes;
+		m_majorants.resize((size_t) res.x * res.y * res.z);
+
+		Float factor = m_scale;
+		if (m_anisotropicMedium)
+			factor *= m_phaseFunction->sigmaDirMax();
+
+		#if defined(MTS_OPENMP)
+			#pragma omp parallel for schedule(dynamic)
+		#endif
+		for (int z=0; z<res.z; ++z) {
+			for (int y=0; y<res.y; ++y) {
+				for (int x=0; x<res.x; ++x) {
+					Point min = m_densityAABB.min + Vector(
+						x * m_majorantCellSize.x,
+						y * m_majorantCellSize.y,
+						z * m_majorantCellSize.z);
+					AABB cell(min, min + m_majorantCellSize);
+					m_majorants[((size_t) z*res.y + y)*res.x + x] =
+						factor * m_density->getMaximumFloatValue(cell);
+				}
+			}
+		}
+
+		m_maxDensity = 0;
+		size_t emptyCells = 0;
+		for (size_t i=0; i<m_majorants.size(); ++i) {
+			m_maxDensity = std::max(m_maxDensity, m_majorants[i]);
+			if (m_majorants[i] == 0)
+				++emptyCells;
+		}
+
+		Log(EDebug, "Built a %ix%ix%i majorant grid in %i ms (max. density %f, "
+			"%.1f%% empty cells)", res.x, res.y, res.z, timer->getMilliseconds(), m_maxDensity,
+			100.0f * emptyCells / (Float) m_majorants.size());
+	}
+
 	void addChild(const std::string &name, ConfigurableObject *child) {
 		if (child->getClass()->derivesFrom(MTS_CLASS(VolumeDataSource))) {
 			VolumeDataSource *volume = static_cast<VolumeDataSource *>(child);
@@ -341,34 +475,51 @@ public:
 
 		p += increment;
 
+		Point points[HETVOL_BATCH_SIZE];
+		Float densities[HETVOL_BATCH_SIZE];
 		Float m = 4;
-		for (uint32_t i=1; i<nSteps; ++i) {
-			integratedDensity += m * lookupDensity(p, ray.d);
-			m = 6 - m;
+		uint32_t i = 1;
+		bool stuck = false;
+
+		while (i < nSteps && !stuck) {
+			/* Collect the positions of the following nodes and look them up at once */
+			uint32_t count = 0;
+			while (count < HETVOL_BATCH_SIZE && i + count < nSteps) {
+				points[count++] = p;
+
+				Point next = p + increment;
+				if (p == next) {
+					Log(EWarn, "integrateDensity(): unable to make forward progress -- "
+							"round-off error issues? The step size was %e, mint=%f, "
+							"maxt=%f, nSteps=%i, ray=%s", stepSize, mint, maxt, nSteps,
+							ray.toString().c_str());
+					stuck = true;
+					break;
+				}
+				p = next;
+			}
 
-			#if defined(HETVOL_STATISTICS)
-				++avgRayMarchingStepsTransmittance;
-			#endif
+			lookupDensity(points, densities, count, ray.d);
 
-			#if defined(HETVOL_EARLY_EXIT)
-				if (integratedDensity > stopValue) {
-					// Reached the threshold -- stop early
-					#if defined(HETVOL_STATISTICS)
-						++earlyExits;
-					#endif
-					return std::numeric_limits<Float>::infinity();
-				}
-			#endif
+			for (uint32_t j=0; j<count; ++j) {
+				integratedDensity += m * densities[j];
+				m = 6 - m;
 
-			Point next = p + increment;
-			if (p == next) {
-				Log(EWarn, "integrateDensity(): unable to make forward progress -- "
-						"round-off error issues? The step size was %e, mint=%f, "
-						"maxt=%f, nSteps=%i, ray=%s", stepSize, mint, maxt, nSteps,
-						ray.toString().c_str());
-				break;
+				#if defined(HETVOL_STATISTICS)
+					++avgRayMarchingStepsTransmittance;
+				#endif
+
+				#if defined(HETVOL_EARLY_EXIT)
+					if (integratedDensity > stopValue) {
+						// Reached the threshold -- stop early
+						#if defined(HETVOL_STATISTICS)
+							++earlyExits;
+						#endif
+						return std::numeric_limits<Float>::infinity();
+					}
+				#endif
 			}
-			p = next;
+			i += count;
 		}
 
 		return integratedDensity * m_scale
@@ -459,9 +610,30 @@ public:
 			avgRayMarchingStepsSampling.incrementBase();
 		#endif
 
+		Point points[HETVOL_BATCH_SIZE];
+		Float densities[HETVOL_BATCH_SIZE];
+		uint32_t batchSteps = 1, batchPos = 0, batchCount = 0;
+
 		for (uint32_t i=0; i<nSteps; ++i) {
-			Float node2 = lookupDensity(p + halfStep, ray.d),
-				  node3 = lookupDensity(p + fullStep, ray.d),
+			if (batchPos == batchCount) {
+				/* Look up the nodes of several steps at once. The batch size
+				   starts small and doubles, which limits the number of wasted
+				   lookups when the solution lies within the first few steps */
+				uint32_t steps = std::min(batchSteps, nSteps - i);
+				Point q = p;
+				for (uint32_t j=0; j<steps; ++j) {
+					points[2*j] = q + halfStep;
+					points[2*j+1] = q + fullStep;
+					q += fullStep;
+				}
+				batchCount = 2*steps;
+				batchPos = 0;
+				lookupDensity(points, densities, batchCount, ray.d);
+				batchSteps = std::min(2*batchSteps, (uint32_t) HETVOL_BATCH_SIZE/2);
+			}
+
+			Float node2 = densities[batchPos++],
+				  node3 = densities[batchPos++],
 				  newDensity = integratedDensity + multiplier *
 						(node1+node2*4+node3);
 			#if defined(HETVOL_STATISTICS)
@@ -563,24 +735,42 @@ public:
 			Float result = 0;
 
 			for (int i=0; i<nSamples; ++i) {
-				Float t = mint;
-				while (true) {
-					t -= math::fastlog(1-sampler->next1D()) * m_invMaxDensity;
-					if (t >= maxt) {
-						result += 1;
-						break;
+				MajorantGridIterator it(ray, mint, maxt, m_densityAABB,
+					m_majorantGridRes, m_majorantCellSize, &m_majorants[0]);
+				Float t0, t1, majorant;
+				bool absorbed = false;
+
+				avgMajorantCells.incrementBase();
+				while (!absorbed && it.next(t0, t1, majorant)) {
+					++avgMajorantCells;
+					if (majorant == 0)
+						continue;
+
+					/* Free-flight sampling is memoryless, hence tracking
+					   simply restarts at the boundary of every cell */
+					Float invMajorant = 1.0f / majorant, t = t0;
+					while (true) {
+						t -= math::fastlog(1-sampler->next1D()) * invMajorant;
+						if (t >= t1)
+							break;
+
+						Point p = ray(t);
+						Float density = lookupDensity(p, ray.d) * m_scale;
+
+						#if defined(HETVOL_STATISTICS)
+							++avgRayMarchingStepsTransmittance;
+						#endif
+
+						nullCollisions.incrementBase();
+						if (density * invMajorant > sampler->next1D()) {
+							absorbed = true;
+							break;
+						}
+						++nullCollisions;
 					}
-
-					Point p = ray(t);
-					Float density = lookupDensity(p, ray.d) * m_scale;
-
-					#if defined(HETVOL_STATISTICS)
-						++avgRayMarchingStepsTransmittance;
-					#endif
-
-					if (density * m_invMaxDensity > sampler->next1D())
-						break;
 				}
+				if (!absorbed)
+					result += 1;
 			}
 			return Spectrum(result/nSamples);
 		}
@@ -629,31 +819,44 @@ public:
 			mint = std::max(mint, ray.mint);
 			maxt = std::min(maxt, ray.maxt);
 
-			Float t = mint, densityAtT = 0;
-			while (true) {
-				t -= math::fastlog(1-sampler->next1D()) * m_invMaxDensity;
-				if (t >= maxt)
-					break;
+			MajorantGridIterator it(ray, mint, maxt, m_densityAABB,
+				m_majorantGridRes, m_majorantCellSize, &m_majorants[0]);
+			Float t0, t1, majorant, densityAtT = 0;
 
-				Point p = ray(t);
-				densityAtT = lookupDensity(p, ray.d) * m_scale;
-				#if defined(HETVOL_STATISTICS)
-					++avgRayMarchingStepsSampling;
-				#endif
-				if (densityAtT * m_invMaxDensity > sampler->next1D()) {
-					mRec.t = t;
-					mRec.p = p;
-					Spectrum albedo = m_albedo->lookupSpectrum(p);
-					mRec.sigmaS = albedo * densityAtT;
-					mRec.sigmaA = Spectrum(densityAtT) - mRec.sigmaS;
-					mRec.transmittance = Spectrum(densityAtT != 0.0f ? 1.0f / densityAtT : 0);
-					if (!std::isfinite(mRec.transmittance[0])) // prevent rare overflow warnings
-						mRec.transmittance = Spectrum(0.0f);
-					mRec.orientation = m_orientation != NULL
-						? m_orientation->lookupVector(p) : Vector(0.0f);
-					mRec.medium = this;
-					success = true;
-					break;
+			avgMajorantCells.incrementBase();
+			while (!success && it.next(t0, t1, majorant)) {
+				++avgMajorantCells;
+				if (majorant == 0)
+					continue;
+
+				Float invMajorant = 1.0f / majorant, t = t0;
+				while (true) {
+					t -= math::fastlog(1-sampler->next1D()) * invMajorant;
+					if (t >= t1)
+						break;
+
+					Point p = ray(t);
+					densityAtT = lookupDensity(p, ray.d) * m_scale;
+					#if defined(HETVOL_STATISTICS)
+						++avgRayMarchingStepsSampling;
+					#endif
+					nullCollisions.incrementBase();
+					if (densityAtT * invMajorant > sampler->next1D()) {
+						mRec.t = t;
+						mRec.p = p;
+						Spectrum albedo = m_albedo->lookupSpectrum(p);
+						mRec.sigmaS = albedo * densityAtT;
+						mRec.sigmaA = Spectrum(densityAtT) - mRec.sigmaS;
+						mRec.transmittance = Spectrum(densityAtT != 0.0f ? 1.0f / densityAtT : 0);
+						if (!std::isfinite(mRec.transmittance[0])) // prevent rare overflow warnings
+							mRec.transmittance = Spectrum(0.0f);
+						mRec.orientation = m_orientation != NULL
+							? m_orientation->lookupVector(p) : Vector(0.0f);
+						mRec.medium = this;
+						success = true;
+						break;
+					}
+					++nullCollisions;
 				}
 			}
 		}
@@ -697,6 +900,7 @@ public:
 			<< "  albedo = " << indent(m_albedo.toString()) << "," << endl
 			<< "  orientation = " << indent(m_orientation.toString()) << "," << endl
 			<< "  stepSize = " << m_stepSize << "," << endl
+			<< "  majorantResolution = " << m_majorantRes << "," << endl
 			<< "  scale = " << m_scale << endl
 			<< "]";
 		return oss.str();
@@ -715,6 +919,22 @@ protected:
 		}
 		return density;
 	}
+
+	/// Look up the density at several positions (see \ref VolumeDataSource::lookupFloats())
+	inline void lookupDensity(const Point *p, Float *density, size_t count, const Vector &d) const {
+		m_density->lookupFloats(p, density, count);
+		if (!m_anisotropicMedium)
+			return;
+		for (size_t i=0; i<count; ++i) {
+			if (density[i] == 0)
+				continue;
+			Vector orientation = m_orientation->lookupVector(p[i]);
+			if (!orientation.isZero())
+				density[i] *= m_phaseFunction->sigmaDir(dot(d, orientation));
+			else
+				density[i] = 0;
+		}
+	}
 protected:
 	EIntegrationMethod m_method;
 	ref<VolumeDataSource> m_density;
@@ -725,7 +945,11 @@ protected:
 	Float m_stepSize;
 	AABB m_densityAABB;
 	Float m_maxDensity;
-	Float m_invMaxDensity;
+	/* Majorant grid used by Woodcock tracking */
+	int m_majorantRes;
+	Vector3i m_majorantGridRes;
+	Vector m_majorantCellSize;
+	std::vector<Float> m_majorants;
 };
 
 MTS_IMPLEMENT_CLASS_S(HeterogeneousMedium, false, Medium)
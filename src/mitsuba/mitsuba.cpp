@@ -34,6 +34,7 @@
 #include <mitsuba/core/statistics.h>
 #include <mitsuba/render/renderjob.h>
 #include <mitsuba/render/scenehandler.h>
+#include <mitsuba/render/texcache.h>
 #include <fstream>
 #include <stdexcept>
 #include <boost/algorithm/string.hpp>
@@ -77,8 +78,23 @@ void help() {
 	cout <<  "   -n name     Assign a node name to this instance (Default: host name)" << endl << endl;
 	cout <<  "   -x          Skip rendering of files where output already exists" << endl << endl;
 	cout <<  "   -r sec      Write (partial) output images every 'sec' seconds" << endl << endl;
+	cout <<  "   -P passes   Render progressively: repeat the sampling-based rendering of" << endl;
+	cout <<  "               the image 'passes' times and average the results" << endl << endl;
+	cout <<  "   -T sec      Stop progressive rendering after 'sec' seconds (once the" << endl;
+	cout <<  "               current pass is complete)" << endl << endl;
+	cout <<  "   -C sec      Save a checkpoint of the film (\"<output>.checkpoint\") after" << endl;
+	cout <<  "               a progressive pass once 'sec' seconds have passed since the" << endl;
+	cout <<  "               last one, and after the final pass" << endl << endl;
+	cout <<  "   -R          Resume from existing checkpoint files (requires -C)" << endl << endl;
 	cout <<  "   -b res      Specify the block resolution used to split images into parallel" << endl;
 	cout <<  "               workloads (default: 32). Only applies to some integrators." << endl << endl;
+	cout <<  "   -g          Disable work stealing: let all local workers acquire work" << endl;
+	cout <<  "               from a single shared queue (slower on many-core machines)" << endl << endl;
+	cout <<  "   -k accel    Override the ray tracing acceleration data structure of all" << endl;
+	cout <<  "               scenes (kdtree/bvh/twolevel)" << endl << endl;
+	cout <<  "   -m size     Bound the memory used by MIP map cache files (.mip) to 'size'" << endl;
+	cout <<  "               MiB by paging texture tiles in on demand (default: unlimited," << endl;
+	cout <<  "               can be overridden by the scene's 'textureMemory' parameter)" << endl << endl;
 	cout <<  "   -v          Be more verbose (can be specified twice)" << endl << endl;
 	cout <<  "   -L level    Explicitly specify the log level (trace/debug/info/warn/error)" << endl << endl;
 	cout <<  "   -w          Treat warnings as errors" << endl << endl;
@@ -143,6 +159,12 @@ int mitsuba_app(int argc, char **argv) {
 		std::map<std::string, std::string, SimpleStringOrdering> parameters;
 		int blockSize = 32;
 		int flushTimer = -1;
+		int progressivePasses = 1;
+		Float timeLimit = 0, checkpointInterval = -1;
+		bool resume = false;
+		bool workStealing = true;
+		int accelerator = -1;
+		int textureMemory = 0;
 
 		if (argc < 2) {
 			help();
@@ -151,7 +173,7 @@ int mitsuba_app(int argc, char **argv) {
 
 		optind = 1;
 		/* Parse command-line arguments */
-		while ((optchar = getopt(argc, argv, "a:c:D:s:j:n:o:r:b:p:L:qhzvtwx")) != -1) {
+		while ((optchar = getopt(argc, argv, "a:c:D:s:j:n:o:r:b:p:L:k:m:P:T:C:qhzvtwxgR")) != -1) {
 			switch (optchar) {
 				case 'a': {
 						std::vector<std::string> paths = tokenize(optarg, ";");
@@ -230,6 +252,24 @@ int mitsuba_app(int argc, char **argv) {
 					if (*end_ptr != '\0')
 						SLog(EError, "Could not parse the '-r' parameter argument!");
 					break;
+				case 'P':
+					progressivePasses = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || progressivePasses < 1)
+						SLog(EError, "Could not parse the progressive pass count!");
+					break;
+				case 'T':
+					timeLimit = (Float) strtod(optarg, &end_ptr);
+					if (*end_ptr != '\0' || timeLimit < 0)
+						SLog(EError, "Could not parse the time limit!");
+					break;
+				case 'C':
+					checkpointInterval = (Float) strtod(optarg, &end_ptr);
+					if (*end_ptr != '\0' || checkpointInterval < 0)
+						SLog(EError, "Could not parse the checkpoint interval!");
+					break;
+				case 'R':
+					resume = true;
+					break;
 				case 'b':
 					blockSize = strtol(optarg, &end_ptr, 10);
 					if (*end_ptr != '\0')
@@ -240,6 +280,27 @@ int mitsuba_app(int argc, char **argv) {
 				case 'z':
 					progressBars = false;
 					break;
+				case 'g':
+					workStealing = false;
+					break;
+				case 'k': {
+						std::string name = boost::to_lower_copy(std::string(optarg));
+						if (name == "kdtree")
+							accelerator = Scene::EKDTree;
+						else if (name == "bvh")
+							accelerator = Scene::EBVH;
+						else if (name == "twolevel")
+							accelerator = Scene::ETwoLevel;
+						else
+							SLog(EError, "Unknown acceleration data structure \"%s\" "
+								"(must be \"kdtree\", \"bvh\" or \"twolevel\")", optarg);
+					}
+					break;
+				case 'm':
+					textureMemory = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || textureMemory < 0)
+						SLog(EError, "Could not parse the texture memory limit!");
+					break;
 				case 'q':
 					quietMode = true;
 					break;
@@ -250,8 +311,16 @@ int mitsuba_app(int argc, char **argv) {
 			}
 		}
 
+		if (resume && checkpointInterval < 0)
+			SLog(EError, "Resuming from checkpoint files (-R) requires a "
+				"checkpoint interval (-C)!");
+
 		ProgressReporter::setEnabled(progressBars);
 
+		if (textureMemory > 0)
+			TextureTileCache::getInstance()->setMemoryLimit(
+				(size_t) textureMemory * 1024 * 1024);
+
 		/* Initialize OpenMP */
 		Thread::initializeOpenMP(nprocs);
 
@@ -276,6 +345,7 @@ int mitsuba_app(int argc, char **argv) {
 
 		/* Configure the scheduling subsystem */
 		Scheduler *scheduler = Scheduler::getInstance();
+		scheduler->setWorkStealing(workStealing);
 		bool useCoreAffinity = nprocs == nprocs_avail;
 		for (int i=0; i<nprocs; ++i)
 			scheduler->registerWorker(new LocalWorker(useCoreAffinity ? i : -1,
@@ -383,12 +453,18 @@ int mitsuba_app(int argc, char **argv) {
 			scene->setDestinationFile(destFile.length() > 0 ?
 				fs::path(destFile) : (filePath / baseName));
 			scene->setBlockSize(blockSize);
+			if (accelerator != -1)
+				scene->setAccelerator((Scene::EAccelerator) accelerator);
 
 			if (scene->destinationExists() && skipExisting)
 				continue;
 
 			ref<RenderJob> thr = new RenderJob(formatString("ren%i", jobIdx++),
 				scene, renderQueue, -1, -1, -1, true, flushTimer > 0);
+			thr->setProgressive(progressivePasses, timeLimit);
+			if (checkpointInterval >= 0)
+				thr->setCheckpoint(scene->getDestinationFile().string() + ".checkpoint",
+					checkpointInterval, resume);
 			thr->start();
 
 			renderQueue->waitLeft(numParallelScenes-1);
@@ -79,6 +79,10 @@ public:
 		return sampler.get();
 	}
 
+	void setSeed(uint64_t seed) {
+		m_random->seed(seed);
+	}
+
 	void generate(const Point2i &) {
 		for (size_t i=0; i<m_req1D.size(); i++)
 			for (size_t j=0; j<m_sampleCount * m_req1D[i]; ++j)
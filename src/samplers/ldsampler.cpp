@@ -182,6 +182,10 @@ public:
 		m_random->shuffle(samples, samples + sampleCount);
 	}
 
+	void setSeed(uint64_t seed) {
+		m_random->seed(seed);
+	}
+
 	void generate(const Point2i &) {
 		for (size_t i=0; i<m_maxDimension; ++i) {
 			generate1D(m_samples1D[i], m_sampleCount);
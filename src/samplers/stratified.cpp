@@ -144,6 +144,10 @@ public:
 		return sampler.get();
 	}
 
+	void setSeed(uint64_t seed) {
+		m_random->seed(seed);
+	}
+
 	void generate(const Point2i &) {
 		for (int i=0; i<m_maxDimension; i++) {
 			for (size_t j=0; j<m_sampleCount; j++)
@@ -25,11 +25,20 @@
 #include <mitsuba/core/properties.h>
 #include <mitsuba/core/fstream.h>
 #include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/statistics.h>
 
 #define MTS_HAIR_USE_FANCY_CLIPPING 1
 
+#if defined(MTS_SSE) && defined(SINGLE_PRECISION)
+/// Test the segments of a kd-tree leaf four at a time using SSE
+#define MTS_HAIR_USE_SSE 1
+#include <mitsuba/core/sse.h>
+#endif
+
 MTS_NAMESPACE_BEGIN
 
+static StatsCounter segmentTests("Hair", "Segment intersection tests");
+
 /*!\plugin{hair}{Hair intersection shape}
  * \order{11}
  * \parameters{
@@ -96,8 +105,40 @@ MTS_NAMESPACE_BEGIN
  * single-precision XYZ coordinates (again in little-endian byte ordering).
  * To mark the beginning of a new hair strand, a single $+\infty$ floating
  * point value can be inserted between the vertex data.
+ *
+ * Internally, the vertices of each hair strand are stored consecutively,
+ * and every vertex additionally records the orientation of the miter
+ * plane at its joint (packed into 32 bits). The segments referenced by
+ * a kd-tree leaf are intersected four at a time using SSE instructions.
  */
 
+/// Pack a unit vector into 32 bits using an octahedral mapping
+static uint32_t packUnitVector(const Vector3d &v) {
+	double invL1 = 1.0 / (std::abs(v.x) + std::abs(v.y) + std::abs(v.z));
+	double x = v.x * invL1, y = v.y * invL1;
+	if (v.z < 0) {
+		double tx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+		double ty = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+		x = tx; y = ty;
+	}
+	uint32_t qx = (uint32_t) std::floor((x * 0.5 + 0.5) * 65535 + 0.5);
+	uint32_t qy = (uint32_t) std::floor((y * 0.5 + 0.5) * 65535 + 0.5);
+	return std::min(qx, (uint32_t) 0xFFFF) | (std::min(qy, (uint32_t) 0xFFFF) << 16);
+}
+
+/// Inverse of \ref packUnitVector()
+static Vector3d unpackUnitVector(uint32_t value) {
+	double x = (value & 0xFFFF) * (2.0 / 65535) - 1;
+	double y = (value >> 16) * (2.0 / 65535) - 1;
+	double z = 1 - std::abs(x) - std::abs(y);
+	if (z < 0) {
+		double tx = (1 - std::abs(y)) * (x >= 0 ? 1 : -1);
+		double ty = (1 - std::abs(x)) * (y >= 0 ? 1 : -1);
+		x = tx; y = ty;
+	}
+	return normalize(Vector3d(x, y, z));
+}
+
 class HairKDTree : public SAHKDTree3D<HairKDTree> {
 	friend class GenericKDTree<AABB, SurfaceAreaHeuristic3, HairKDTree>;
 	friend class SAHKDTree3D<HairKDTree>;
@@ -105,14 +146,47 @@ public:
 	using SAHKDTree3D<HairKDTree>::IndexType;
 	using SAHKDTree3D<HairKDTree>::SizeType;
 
+	/**
+	 * \brief Per-vertex record
+	 *
+	 * Stores the vertex position along with the normal of the miter plane
+	 * at this vertex. A segment is thus fully described by two adjacent
+	 * records, which are 16 bytes each in single precision builds.
+	 *
+	 * The exact intersection test uses the quantized miter normals, hence
+	 * intersection points and normals near the joints deviate slightly
+	 * from those of full-precision miter planes. The segments meeting at
+	 * a joint share its quantized normal, so strands remain watertight.
+	 */
+	struct HairVertex {
+		Point p;
+		uint32_t miter;
+	};
+
 	HairKDTree(std::vector<Point> &vertices,
 			std::vector<bool> &vertexStartsFiber, Float radius)
 			: m_radius(radius) {
-		/* Take the supplied vertex & start fiber arrays (without copying) */
-		m_vertices.swap(vertices);
+		/* Take the supplied start fiber array (without copying) */
 		m_vertexStartsFiber.swap(vertexStartsFiber);
 		m_hairCount = 0;
 
+		/* Convert the vertices into the per-strand record layout */
+		m_vertices.resize(vertices.size());
+		for (size_t i=0; i<vertices.size(); i++) {
+			bool hasPrev = !m_vertexStartsFiber[i],
+			     hasNext = !m_vertexStartsFiber[i+1];
+			Vector3d prevTangent, nextTangent, miter(0, 0, 1);
+			if (hasPrev)
+				miter = prevTangent = normalize(Point3d(vertices[i]) - Point3d(vertices[i-1]));
+			if (hasNext)
+				miter = nextTangent = normalize(Point3d(vertices[i+1]) - Point3d(vertices[i]));
+			if (hasPrev && hasNext)
+				miter = normalize(prevTangent + nextTangent);
+			m_vertices[i].p = vertices[i];
+			m_vertices[i].miter = packUnitVector(miter);
+		}
+		std::vector<Point>().swap(vertices);
+
 		/* Compute the index of the first vertex in each segment. */
 		m_segIndex.reserve(m_vertices.size());
 		for (size_t i=0; i<m_vertices.size()-1; i++) {
@@ -142,12 +216,6 @@ public:
 
 		buildInternal();
 
-		Log(EDebug, "Total amount of storage (kd-tree & vertex data): %s",
-			memString(m_nodeCount * sizeof(KDNode)
-			+ m_indexCount * sizeof(IndexType)
-			+ vertices.size() * sizeof(Point)
-			+ vertexStartsFiber.size() / 8).c_str());
-
 		/* Optimization: replace all primitive indices by the
 		   associated vertex indices (this avoids an extra
 		   indirection during traversal later on) */
@@ -156,6 +224,16 @@ public:
 
 		/* Free the segIndex array, it is not needed anymore */
 		std::vector<IndexType>().swap(m_segIndex);
+
+		/* Leaves mostly reference runs of consecutive segments of the
+		   same strand, whose vertex indices compress very well */
+		compressIndices();
+
+		Log(EDebug, "Total amount of storage (kd-tree & vertex data): %s",
+			memString(m_nodeCount * sizeof(KDNode)
+			+ getIndexStorageSize()
+			+ m_vertices.size() * sizeof(HairVertex)
+			+ m_vertexStartsFiber.size() / 8).c_str());
 	}
 
 	/// Return the AABB of the hair kd-tree
@@ -163,9 +241,9 @@ public:
 		return m_aabb;
 	}
 
-	/// Return the list of vertices underlying the hair kd-tree
-	inline const std::vector<Point> &getVertices() const {
-		return m_vertices;
+	/// Return the position of a vertex
+	inline const Point &getVertex(size_t index) const {
+		return m_vertices[index].p;
 	}
 
 	/**
@@ -485,12 +563,13 @@ public:
 	inline bool intersect(const Ray &ray, IndexType iv,
 		Float mint, Float maxt, Float &t, void *tmp) const {
 		/* First compute the intersection with the infinite cylinder */
-		Vector3d axis = tangentDouble(iv);
+		Point3d v1 = firstVertexDouble(iv);
+		Point3d v2 = secondVertexDouble(iv);
+		Vector3d axis = normalize(v2 - v1);
 
 		// Projection of ray onto subspace normal to axis
 		Point3d rayO(ray.o);
 		Vector3d rayD(ray.d);
-		Point3d v1 = firstVertexDouble(iv);
 
 		Vector3d relOrigin = rayO - v1;
 		Vector3d projOrigin = relOrigin - dot(axis, relOrigin) * axis;
@@ -514,7 +593,6 @@ public:
 
 		Vector3d n1 = firstMiterNormalDouble(iv);
 		Vector3d n2 = secondMiterNormalDouble(iv);
-		Point3d v2 = secondVertexDouble(iv);
 		IntersectionStorage *storage = static_cast<IntersectionStorage *>(tmp);
 		Point p;
 
@@ -547,58 +625,273 @@ public:
 		return intersect(ray, iv, mint, maxt, tempT, NULL);
 	}
 
-	/* Some utility functions */
-	inline Point firstVertex(IndexType iv) const { return m_vertices[iv]; }
-	inline Point3d firstVertexDouble(IndexType iv) const { return Point3d(m_vertices[iv]); }
-	inline Point secondVertex(IndexType iv) const { return m_vertices[iv+1]; }
-	inline Point3d secondVertexDouble(IndexType iv) const { return Point3d(m_vertices[iv+1]); }
-	inline Point prevVertex(IndexType iv) const { return m_vertices[iv-1]; }
-	inline Point3d prevVertexDouble(IndexType iv) const { return Point3d(m_vertices[iv-1]); }
-	inline Point nextVertex(IndexType iv) const { return m_vertices[iv+2]; }
-	inline Point3d nextVertexDouble(IndexType iv) const { return Point3d(m_vertices[iv+2]); }
-
-	inline bool prevSegmentExists(IndexType iv) const { return !m_vertexStartsFiber[iv]; }
-	inline bool nextSegmentExists(IndexType iv) const { return !m_vertexStartsFiber[iv+2]; }
+	/**
+	 * \brief Intersect a ray against the segments of a leaf node
+	 *
+	 * Shadows the default implementation of \ref SAHKDTree3D. When SSE
+	 * support is available, the segments are passed through
+	 * \ref intersectCandidates() in batches of four, and only the
+	 * surviving ones undergo the exact test.
+	 */
+	template<bool shadowRay> FINLINE bool intersectLeaf(const KDNode *node,
+			const Ray &ray, Float mint, Float &maxt, Float &t, void *temp,
+			HashedMailbox &mailbox) const {
+		bool foundIntersection = false;
+		IndexType batch[4];
+		int batchSize = 0;
+
+		IndexType iv = 0;
+		for (IndexType entry=node->getPrimStart(),
+				last = node->getPrimEnd(); entry != last; ) {
+			iv = nextPrimitive(entry, iv);
+
+			#if defined(MTS_KD_MAILBOX_ENABLED)
+			if (mailbox.contains(iv))
+				continue;
+			mailbox.put(iv);
+			#endif
+
+			batch[batchSize++] = iv;
+			if (batchSize == 4) {
+				if (intersectBatch<shadowRay>(ray, batch, batchSize, mint, maxt, t, temp)) {
+					if (shadowRay)
+						return true;
+					foundIntersection = true;
+				}
+				batchSize = 0;
+			}
+		}
 
-	inline Vector tangent(IndexType iv) const { return normalize(secondVertex(iv) - firstVertex(iv)); }
-	inline Vector3d tangentDouble(IndexType iv) const { return normalize(Vector3d(secondVertex(iv)) - Vector3d(firstVertex(iv))); }
-	inline Vector prevTangent(IndexType iv) const { return normalize(firstVertex(iv) - prevVertex(iv)); }
-	inline Vector3d prevTangentDouble(IndexType iv) const { return normalize(firstVertexDouble(iv) - prevVertexDouble(iv)); }
-	inline Vector nextTangent(IndexType iv) const { return normalize(nextVertex(iv) - secondVertex(iv)); }
-	inline Vector3d nextTangentDouble(IndexType iv) const { return normalize(nextVertexDouble(iv) - secondVertexDouble(iv)); }
+		if (batchSize > 0 &&
+			intersectBatch<shadowRay>(ray, batch, batchSize, mint, maxt, t, temp))
+			foundIntersection = true;
+
+		return foundIntersection;
+	}
+
+	/// Intersect a ray against up to four segments (see \ref intersectLeaf())
+	template<bool shadowRay> FINLINE bool intersectBatch(const Ray &ray,
+			IndexType *batch, int batchSize, Float mint, Float &maxt,
+			Float &t, void *temp) const {
+		segmentTests += batchSize;
+
+		#if defined(MTS_HAIR_USE_SSE)
+			for (int i=batchSize; i<4; ++i)
+				batch[i] = batch[0];
+			int mask = intersectCandidates(ray, batch, mint, maxt)
+				& ((1 << batchSize) - 1);
+		#else
+			int mask = (1 << batchSize) - 1;
+		#endif
+
+		bool foundIntersection = false;
+		for (int i=0; mask != 0; ++i, mask >>= 1) {
+			if (!(mask & 1))
+				continue;
+
+			bool result;
+			if (!shadowRay)
+				result = intersect(ray, batch[i], mint, maxt, t, temp);
+			else
+				result = intersect(ray, batch[i], mint, maxt);
+
+			if (result) {
+				if (shadowRay)
+					return true;
+				maxt = t;
+				foundIntersection = true;
+			}
+		}
+		return foundIntersection;
+	}
+
+#if defined(MTS_HAIR_USE_SSE)
+	/**
+	 * \brief Conservatively test a ray against four segments at once
+	 *
+	 * This computes the parameter interval, along which the ray is inside
+	 * the infinite cylinder of each segment, and clips it against the two
+	 * miter planes and [mint, maxt]. The computation is done in single
+	 * precision, but the radius and miter planes are enlarged by a bound
+	 * on the roundoff error. A segment that \ref intersect() would report
+	 * is therefore never rejected.
+	 *
+	 * \return A bit mask of the segments that need an exact test
+	 */
+	inline int intersectCandidates(const Ray &ray, const IndexType *iv,
+			Float mint, Float maxt) const {
+		/* Gather the two vertex records of every segment and transpose */
+		__m128 v1[4], v2[4];
+		for (int i=0; i<4; ++i) {
+			const float *ptr = reinterpret_cast<const float *>(&m_vertices[iv[i]]);
+			v1[i] = _mm_loadu_ps(ptr);
+			v2[i] = _mm_loadu_ps(ptr + 4);
+		}
+		_MM_TRANSPOSE4_PS(v1[0], v1[1], v1[2], v1[3]);
+		_MM_TRANSPOSE4_PS(v2[0], v2[1], v2[2], v2[3]);
+
+		const __m128
+			ox = _mm_set1_ps(ray.o.x), oy = _mm_set1_ps(ray.o.y), oz = _mm_set1_ps(ray.o.z),
+			dx = _mm_set1_ps(ray.d.x), dy = _mm_set1_ps(ray.d.y), dz = _mm_set1_ps(ray.d.z),
+			signMask = SSEConstants::negation_mask.ps;
+
+		/* Segment axis and ray origin relative to the first vertex */
+		__m128 ax = _mm_sub_ps(v2[0], v1[0]),
+		       ay = _mm_sub_ps(v2[1], v1[1]),
+		       az = _mm_sub_ps(v2[2], v1[2]);
+		__m128 lengthSqr = dot3(ax, ay, az, ax, ay, az);
+		__m128 invLength = rsqrt(lengthSqr);
+		ax = _mm_mul_ps(ax, invLength);
+		ay = _mm_mul_ps(ay, invLength);
+		az = _mm_mul_ps(az, invLength);
+
+		__m128 rx = _mm_sub_ps(ox, v1[0]),
+		       ry = _mm_sub_ps(oy, v1[1]),
+		       rz = _mm_sub_ps(oz, v1[2]);
+
+		/* Bound on the roundoff error of the following steps (in units
+		   of length). This uses the L1 norm of the relative ray origin,
+		   which is an upper bound of its length */
+		__m128 err = _mm_add_ps(_mm_set1_ps(1e-3f * m_radius),
+			_mm_mul_ps(_mm_set1_ps(1e-5f), _mm_add_ps(
+			_mm_mul_ps(lengthSqr, invLength), _mm_add_ps(_mm_add_ps(
+			_mm_andnot_ps(signMask, rx), _mm_andnot_ps(signMask, ry)),
+			_mm_andnot_ps(signMask, rz)))));
+
+		/* Project the ray onto the plane normal to the axis */
+		__m128 rDotA = dot3(rx, ry, rz, ax, ay, az),
+		       dDotA = dot3(dx, dy, dz, ax, ay, az);
+		__m128 px = _mm_sub_ps(rx, _mm_mul_ps(rDotA, ax)),
+		       py = _mm_sub_ps(ry, _mm_mul_ps(rDotA, ay)),
+		       pz = _mm_sub_ps(rz, _mm_mul_ps(rDotA, az));
+		__m128 qx = _mm_sub_ps(dx, _mm_mul_ps(dDotA, ax)),
+		       qy = _mm_sub_ps(dy, _mm_mul_ps(dDotA, ay)),
+		       qz = _mm_sub_ps(dz, _mm_mul_ps(dDotA, az));
+
+		/* Rays (almost) parallel to the axis are left to the exact test */
+		__m128 A = dot3(qx, qy, qz, qx, qy, qz);
+		__m128 parallel = _mm_cmplt_ps(A, _mm_set1_ps(1e-12f));
+		__m128 invSqrtA = rsqrt(_mm_max_ps(A, _mm_set1_ps(1e-12f)));
+
+		/* Distance to the axis at the point of closest approach */
+		__m128 tClosest = _mm_mul_ps(negate_ps(dot3(px, py, pz, qx, qy, qz)),
+			_mm_mul_ps(invSqrtA, invSqrtA));
+		__m128 cx = _mm_add_ps(px, _mm_mul_ps(tClosest, qx)),
+		       cy = _mm_add_ps(py, _mm_mul_ps(tClosest, qy)),
+		       cz = _mm_add_ps(pz, _mm_mul_ps(tClosest, qz));
+		__m128 radius = _mm_add_ps(_mm_set1_ps(m_radius), err);
+		__m128 disc = _mm_sub_ps(_mm_mul_ps(radius, radius), dot3(cx, cy, cz, cx, cy, cz));
+		__m128 hit = _mm_cmpge_ps(disc, SSEConstants::zero.ps);
+
+		/* Most segments are rejected at this point */
+		if (_mm_movemask_ps(_mm_or_ps(hit, parallel)) == 0)
+			return 0;
+
+		/* Parameter interval, along which the ray is inside the cylinder */
+		__m128 dt = _mm_mul_ps(_mm_add_ps(_mm_sqrt_ps(_mm_max_ps(disc,
+			SSEConstants::zero.ps)), err), invSqrtA);
+		__m128 lo = _mm_max_ps(_mm_sub_ps(tClosest, dt), _mm_set1_ps(mint)),
+		       hi = _mm_min_ps(_mm_add_ps(tClosest, dt), _mm_set1_ps(maxt));
+
+		/* Clip against the half-spaces bounded by the miter planes. The
+		   normals are not renormalized after unpacking -- they are no
+		   longer than one, so the tolerance only grows */
+		__m128 n1x, n1y, n1z, n2x, n2y, n2z;
+		unpackUnitVectors(v1[3], n1x, n1y, n1z);
+		unpackUnitVectors(v2[3], n2x, n2y, n2z);
+
+		clipHalfSpace(_mm_add_ps(dot3(rx, ry, rz, n1x, n1y, n1z), err),
+			dot3(dx, dy, dz, n1x, n1y, n1z), lo, hi);
+		clipHalfSpace(_mm_sub_ps(err, dot3(_mm_sub_ps(ox, v2[0]),
+			_mm_sub_ps(oy, v2[1]), _mm_sub_ps(oz, v2[2]), n2x, n2y, n2z)),
+			negate_ps(dot3(dx, dy, dz, n2x, n2y, n2z)), lo, hi);
+
+		hit = _mm_or_ps(_mm_and_ps(hit, _mm_cmple_ps(lo, hi)), parallel);
+		return _mm_movemask_ps(hit);
+	}
 
-	inline Vector firstMiterNormal(IndexType iv) const {
-		if (prevSegmentExists(iv))
-			return normalize(prevTangent(iv) + tangent(iv));
-		else
-			return tangent(iv);
+	/// Reciprocal square root with one Newton-Raphson refinement step
+	static FINLINE __m128 rsqrt(__m128 x) {
+		__m128 r = _mm_rsqrt_ps(x);
+		return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r),
+			_mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_mul_ps(x, r), r)));
 	}
 
-	inline Vector secondMiterNormal(IndexType iv) const {
-		if (nextSegmentExists(iv))
-			return normalize(tangent(iv) + nextTangent(iv));
-		else
-			return tangent(iv);
+	/// Reciprocal with one Newton-Raphson refinement step
+	static FINLINE __m128 rcp(__m128 x) {
+		__m128 r = _mm_rcp_ps(x);
+		return _mm_sub_ps(_mm_add_ps(r, r), _mm_mul_ps(_mm_mul_ps(x, r), r));
 	}
 
-	inline Vector3d firstMiterNormalDouble(IndexType iv) const {
-		if (prevSegmentExists(iv))
-			return normalize(prevTangentDouble(iv) + tangentDouble(iv));
-		else
-			return tangentDouble(iv);
+	/// Four dot products of 3D vectors in SoA layout
+	static FINLINE __m128 dot3(__m128 ax, __m128 ay, __m128 az,
+			__m128 bx, __m128 by, __m128 bz) {
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx),
+			_mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+	}
+
+	/**
+	 * \brief Vectorized version of \ref unpackUnitVector()
+	 *
+	 * The results are not normalized (their length is between
+	 * 1/sqrt(3) and 1)
+	 */
+	static FINLINE void unpackUnitVectors(__m128 packed,
+			__m128 &x, __m128 &y, __m128 &z) {
+		const __m128
+			scale = _mm_set1_ps(2.0f / 65535),
+			signMask = SSEConstants::negation_mask.ps,
+			one = SSEConstants::one.ps;
+		__m128i value = _mm_castps_si128(packed);
+		x = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(value,
+			_mm_set1_epi32(0xFFFF))), scale), one);
+		y = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(
+			_mm_srli_epi32(value, 16)), scale), one);
+		__m128 absX = _mm_andnot_ps(signMask, x),
+		       absY = _mm_andnot_ps(signMask, y);
+		z = _mm_sub_ps(_mm_sub_ps(one, absX), absY);
+
+		/* Unfold the lower hemisphere */
+		__m128 lower = _mm_cmplt_ps(z, SSEConstants::zero.ps);
+		__m128 fx = _mm_or_ps(_mm_sub_ps(one, absY), _mm_and_ps(x, signMask)),
+		       fy = _mm_or_ps(_mm_sub_ps(one, absX), _mm_and_ps(y, signMask));
+		x = mux_ps(lower, fx, x);
+		y = mux_ps(lower, fy, y);
 	}
 
-	inline Vector3d secondMiterNormalDouble(IndexType iv) const {
-		if (nextSegmentExists(iv))
-			return normalize(tangentDouble(iv) + nextTangentDouble(iv));
-		else
-			return tangentDouble(iv);
+	/**
+	 * \brief Restrict the interval [lo, hi] to the ray parameters
+	 * t satisfying <tt>num + t * den >= 0</tt>
+	 */
+	static FINLINE void clipHalfSpace(__m128 num, __m128 den,
+			__m128 &lo, __m128 &hi) {
+		/* Keep the sign, but avoid divisions by zero */
+		const __m128 signMask = SSEConstants::negation_mask.ps;
+		den = _mm_or_ps(_mm_max_ps(_mm_andnot_ps(signMask, den),
+			_mm_set1_ps(1e-20f)), _mm_and_ps(den, signMask));
+		__m128 t = _mm_mul_ps(negate_ps(num), rcp(den));
+		__m128 positive = _mm_cmpgt_ps(den, SSEConstants::zero.ps);
+		lo = mux_ps(positive, _mm_max_ps(lo, t), lo);
+		hi = mux_ps(positive, hi, _mm_min_ps(hi, t));
 	}
+#endif
+
+	/* Some utility functions */
+	inline Point firstVertex(IndexType iv) const { return m_vertices[iv].p; }
+	inline Point3d firstVertexDouble(IndexType iv) const { return Point3d(m_vertices[iv].p); }
+	inline Point secondVertex(IndexType iv) const { return m_vertices[iv+1].p; }
+	inline Point3d secondVertexDouble(IndexType iv) const { return Point3d(m_vertices[iv+1].p); }
+
+	inline Vector tangent(IndexType iv) const { return normalize(secondVertex(iv) - firstVertex(iv)); }
 
+	inline Vector firstMiterNormal(IndexType iv) const { return Vector(firstMiterNormalDouble(iv)); }
+	inline Vector secondMiterNormal(IndexType iv) const { return Vector(secondMiterNormalDouble(iv)); }
+	inline Vector3d firstMiterNormalDouble(IndexType iv) const { return unpackUnitVector(m_vertices[iv].miter); }
+	inline Vector3d secondMiterNormalDouble(IndexType iv) const { return unpackUnitVector(m_vertices[iv+1].miter); }
 
 	MTS_DECLARE_CLASS()
 protected:
-	std::vector<Point> m_vertices;
+	std::vector<HairVertex> m_vertices;
 	std::vector<bool> m_vertexStartsFiber;
 	std::vector<IndexType> m_segIndex;
 	size_t m_segmentCount;
@@ -803,7 +1096,7 @@ HairShape::HairShape(Stream *stream, InstanceManager *manager)
 void HairShape::serialize(Stream *stream, InstanceManager *manager) const {
 	Shape::serialize(stream, manager);
 
-	const std::vector<Point> &vertices = m_kdtree->getVertices();
+	const std::vector<Point> vertices = getVertices();
 	const std::vector<bool> &vertexStartsFiber = m_kdtree->getStartFiber();
 
 	stream->writeFloat(m_kdtree->getRadius());
@@ -865,7 +1158,6 @@ ref<TriMesh> HairShape::createTriMesh() {
 	Triangle *triangles = mesh->getTriangles();
 	size_t triangleIdx = 0, vertexIdx = 0;
 
-	const std::vector<Point> &hairVertices = m_kdtree->getVertices();
 	const std::vector<bool> &vertexStartsFiber = m_kdtree->getStartFiber();
 	const Float radius = m_kdtree->getRadius();
 	Float *cosPhi = new Float[phiSteps];
@@ -876,7 +1168,7 @@ ref<TriMesh> HairShape::createTriMesh() {
 	}
 
 	uint32_t hairIdx = 0;
-	for (HairKDTree::IndexType iv=0; iv<(HairKDTree::IndexType) hairVertices.size()-1; iv++) {
+	for (HairKDTree::IndexType iv=0; iv<(HairKDTree::IndexType) m_kdtree->getVertexCount()-1; iv++) {
 		if (!vertexStartsFiber[iv+1]) {
 			for (uint32_t phi=0; phi<phiSteps; ++phi) {
 				Vector tangent = m_kdtree->tangent(iv);
@@ -923,8 +1215,11 @@ const KDTreeBase<AABB> *HairShape::getKDTree() const {
 	return m_kdtree.get();
 }
 
-const std::vector<Point> &HairShape::getVertices() const {
-	return m_kdtree->getVertices();
+std::vector<Point> HairShape::getVertices() const {
+	std::vector<Point> vertices(m_kdtree->getVertexCount());
+	for (size_t i=0; i<vertices.size(); ++i)
+		vertices[i] = m_kdtree->getVertex(i);
+	return vertices;
 }
 
 const std::vector<bool> &HairShape::getStartFiber() const {
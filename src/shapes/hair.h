@@ -47,8 +47,8 @@ public:
 	//! @{ \name Access the internal vertex data
 	// =============================================================
 
-	/// Return the list of vertices underlying the hair shape
-	const std::vector<Point> &getVertices() const;
+	/// Return a copy of the vertices underlying the hair shape
+	std::vector<Point> getVertices() const;
 
 	/**
 	 * Return a boolean list specifying whether a vertex
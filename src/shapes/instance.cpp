@@ -45,6 +45,12 @@ MTS_NAMESPACE_BEGIN
  * This plugin implements a geometry instance used to efficiently replicate
  * geometry many times. For details on how to create instances, refer to
  * the \pluginref{shapegroup} plugin.
+ *
+ * Scenes with a very large number of instances should set the scene's
+ * \code{accelerator} parameter to \code{twolevel}. Instances are then kept
+ * in a separate BVH over their bounds, which builds much faster than the
+ * default kd-tree. When the instance transformations change between frames,
+ * only this top-level BVH needs to be rebuilt.
  * \remarks{
  *   \item Note that it is \emph{not} possible to assign a different
  *    material to each instance --- the material assignment specified within
@@ -76,20 +82,27 @@ void Instance::configure() {
 }
 
 AABB Instance::getAABB() const {
-	const ShapeKDTree *kdtree = m_shapeGroup->getKDTree();
-	const AABB &aabb = kdtree->getAABB();
+	const AABB &aabb = m_shapeGroup->getGroupAABB();
 	if (!aabb.isValid()) // the geometry group is empty
 		return aabb;
 
-	std::set<Float> times;
-	m_transform->collectKeyframes(times);
+	std::set<Float> keyframes;
+	m_transform->collectKeyframes(keyframes);
+	std::vector<Float> times(keyframes.begin(), keyframes.end());
 
+	/* Interpolated rotations can leave the bounds of the keyframes,
+	   hence the transformation is also sampled in between them */
 	AABB result;
-	for (std::set<Float>::iterator it = times.begin(); it != times.end(); ++it) {
-		const Transform &trafo = m_transform->eval(*it);
-
-		for (int i=0; i<8; ++i)
-			result.expandBy(trafo(aabb.getCorner(i)));
+	for (size_t i=0; i<times.size(); ++i) {
+		int steps = (i+1 < times.size()) ? MTS_INSTANCE_MOTION_SAMPLES : 1;
+		for (int j=0; j<steps; ++j) {
+			Float time = (j == 0) ? times[i] :
+				times[i] + (times[i+1] - times[i]) * j / (Float) steps;
+			Transform trafo = m_transform->eval(time);
+
+			for (int k=0; k<8; ++k)
+				result.expandBy(trafo(aabb.getCorner(k)));
+		}
 	}
 
 	return result;
@@ -114,19 +127,23 @@ size_t Instance::getEffectivePrimitiveCount() const {
 
 bool Instance::rayIntersect(const Ray &_ray, Float mint,
 		Float maxt, Float &t, void *temp) const {
-	const ShapeKDTree *kdtree = m_shapeGroup->getKDTree();
 	const Transform &trafo = m_transform->eval(_ray.time);
 	Ray ray;
 	trafo.inverse()(_ray, ray);
-	return kdtree->rayIntersect(ray, mint, maxt, t, temp);
+	const ShapeBVH *bvh = m_shapeGroup->getBVH();
+	if (bvh)
+		return bvh->rayIntersect(ray, mint, maxt, t, temp);
+	return m_shapeGroup->getKDTree()->rayIntersect(ray, mint, maxt, t, temp);
 }
 
 bool Instance::rayIntersect(const Ray &_ray, Float mint, Float maxt) const {
-	const ShapeKDTree *kdtree = m_shapeGroup->getKDTree();
 	Ray ray;
 	const Transform &trafo = m_transform->eval(_ray.time);
 	trafo.inverse()(_ray, ray);
-	return kdtree->rayIntersect(ray, mint, maxt);
+	const ShapeBVH *bvh = m_shapeGroup->getBVH();
+	if (bvh)
+		return bvh->rayIntersect(ray, mint, maxt);
+	return m_shapeGroup->getKDTree()->rayIntersect(ray, mint, maxt);
 }
 
 void Instance::adjustTime(Intersection &its, Float time) const {
@@ -145,11 +162,14 @@ void Instance::adjustTime(Intersection &its, Float time) const {
 
 void Instance::fillIntersectionRecord(const Ray &_ray,
 	const void *temp, Intersection &its) const {
-	const ShapeKDTree *kdtree = m_shapeGroup->getKDTree();
 	const Transform &trafo = m_transform->eval(_ray.time);
 	Ray ray;
 	trafo.inverse()(_ray, ray);
-	kdtree->fillIntersectionRecord<false>(ray, temp, its);
+	const ShapeBVH *bvh = m_shapeGroup->getBVH();
+	if (bvh)
+		bvh->fillIntersectionRecord<false>(ray, temp, its);
+	else
+		m_shapeGroup->getKDTree()->fillIntersectionRecord<false>(ray, temp, its);
 
 	its.shFrame.n = normalize(trafo(its.shFrame.n));
 	its.geoFrame = Frame(normalize(trafo(its.geoFrame.n)));
@@ -18,6 +18,9 @@
 
 #include "shapegroup.h"
 
+/// Number of transformation samples per keyframe interval used to bound animated instances
+#define MTS_INSTANCE_MOTION_SAMPLES 8
+
 MTS_NAMESPACE_BEGIN
 
 /**
@@ -42,6 +45,14 @@ public:
 	/// Return the object-to-world transformation used by this instance
 	inline const AnimatedTransform *getWorldTransform() const { return m_transform.get(); }
 
+	/**
+	 * \brief Set the object-to-world transformation used by this instance
+	 *
+	 * When the instance is part of an initialized scene, \ref
+	 * Scene::updateInstances() must be called afterwards.
+	 */
+	inline void setWorldTransform(const AnimatedTransform *trafo) { m_transform = trafo; }
+
 	/// Add a child ConfigurableObject
 	void addChild(const std::string &name, ConfigurableObject *child);
 
@@ -60,6 +71,8 @@ public:
 
 	AABB getAABB() const;
 
+	bool isInstance() const { return true; }
+
 	bool rayIntersect(const Ray &_ray, Float mint,
 			Float maxt, Float &t, void *temp) const;
 
@@ -19,6 +19,7 @@
 #include <mitsuba/render/trimesh.h>
 #include <mitsuba/core/plugin.h>
 #include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/mmap.h>
 #include <mitsuba/core/timer.h>
 #include <mitsuba/render/emitter.h>
 #include <mitsuba/render/bsdf.h>
@@ -26,7 +27,16 @@
 #include <mitsuba/render/medium.h>
 #include <mitsuba/render/sensor.h>
 #include <mitsuba/hw/basicshader.h>
+#include <boost/unordered_map.hpp>
 #include <set>
+#include "textparse.h"
+
+#if defined(MTS_OPENMP)
+# include <omp.h>
+#endif
+
+/// Approximate number of bytes that are parsed per task
+#define OBJ_CHUNK_SIZE (1024 * 1024)
 
 MTS_NAMESPACE_BEGIN
 
@@ -139,6 +149,9 @@ MTS_NAMESPACE_BEGIN
  * actually needed (i.e. when the mesh contains creases or edges and does not come with
  * valid vertex normals).
  *
+ * The file is memory-mapped and parsed by all available cores. The time
+ * spent and the achieved throughput are reported in the log.
+ *
  * \remarks{
  * \item Importing geometry via OBJ files should only be used as an absolutely
  * last resort. Due to inherent limitations of this format, the files tend to be unreasonably
@@ -186,6 +199,221 @@ public:
 		return true;
 	}
 
+	/// Statement that affects how the triangles are grouped into meshes
+	struct OBJStatement {
+		enum EType {
+			EGroup,
+			EMaterial,
+			EMaterialLibrary
+		};
+
+		EType type;
+		size_t triangle; ///< Number of triangles preceding the statement
+		std::string name;
+	};
+
+	/// A range of lines that is parsed by a single thread
+	struct OBJChunk {
+		const char *start, *end;
+		size_t lineCount, vertexCount, normalCount, texcoordCount, triangleCount;
+		size_t firstLine, firstVertex, firstNormal, firstTexcoord, firstTriangle;
+		size_t errorLine;
+		std::vector<OBJStatement> statements;
+
+		inline OBJChunk() : start(NULL), end(NULL), lineCount(0), vertexCount(0),
+			normalCount(0), texcoordCount(0), triangleCount(0), firstLine(0),
+			firstVertex(0), firstNormal(0), firstTexcoord(0), firstTriangle(0),
+			errorLine((size_t) -1) { }
+	};
+
+	/**
+	 * \brief Fetch a line from a memory-mapped file, while handling
+	 * line breaks with backslashes
+	 *
+	 * The line is returned in <tt>[line, lineEnd)</tt>, which either points into
+	 * the file or, when several lines had to be joined, into \c buffer. The
+	 * number of consumed lines is added to \c lineCount.
+	 *
+	 * \return A pointer to the beginning of the next line
+	 */
+	static const char *fetchLine(const char *ptr, const char *end, const char *&line,
+			const char *&lineEnd, std::string &buffer, size_t &lineCount) {
+		const char *nl = textparse::lineEnd(ptr, end);
+		const char *next = nl < end ? nl + 1 : end;
+		line = ptr; lineEnd = nl; ++lineCount;
+		if (!textparse::isContinued(ptr, nl))
+			return next;
+
+		buffer.clear();
+		while (true) {
+			const char *last = nl;
+			while (last > ptr && textparse::isSpace(last[-1]))
+				--last;
+			if (last > ptr && last[-1] == '\\') {
+				buffer.append(ptr, last - 1);
+				if (next == end)
+					break;
+				ptr = next;
+				nl = textparse::lineEnd(ptr, end);
+				next = nl < end ? nl + 1 : end;
+				++lineCount;
+			} else {
+				buffer.append(ptr, nl);
+				break;
+			}
+		}
+		line = buffer.data();
+		lineEnd = line + buffer.size();
+		return next;
+	}
+
+	/// Extract the keyword at the beginning of a line
+	static inline std::pair<const char *, size_t> fetchKeyword(const char *&line, const char *lineEnd) {
+		textparse::skipSpaces(line, lineEnd);
+		const char *keyword = line;
+		while (line < lineEnd && !textparse::isSpace(*line))
+			++line;
+		return std::make_pair(keyword, (size_t) (line - keyword));
+	}
+
+	static inline bool isKeyword(const std::pair<const char *, size_t> &keyword, const char *str) {
+		return keyword.second == strlen(str) && memcmp(keyword.first, str, keyword.second) == 0;
+	}
+
+	/// First pass: count the vertices, normals, texture coordinates and triangles of a chunk
+	static void countElements(OBJChunk &chunk) {
+		std::string buffer;
+		const char *ptr = chunk.start, *line, *lineEnd;
+
+		while (ptr < chunk.end) {
+			ptr = fetchLine(ptr, chunk.end, line, lineEnd, buffer, chunk.lineCount);
+			std::pair<const char *, size_t> keyword = fetchKeyword(line, lineEnd);
+
+			if (isKeyword(keyword, "v")) {
+				++chunk.vertexCount;
+			} else if (isKeyword(keyword, "vn")) {
+				++chunk.normalCount;
+			} else if (isKeyword(keyword, "vt")) {
+				++chunk.texcoordCount;
+			} else if (isKeyword(keyword, "f")) {
+				/* Handle n-gons assuming a convex shape */
+				size_t count = 0;
+				while (fetchKeyword(line, lineEnd).second > 0)
+					++count;
+				if (count >= 3)
+					chunk.triangleCount += count - 2;
+			}
+		}
+	}
+
+	/// Resolve a (possibly relative) 1-based index of a face vertex
+	static inline int resolveIndex(int64_t index, size_t count) {
+		if (index < 0) {
+			index += (int64_t) count + 1;
+			if (index <= 0)
+				return -1;
+		}
+		return index > (int64_t) std::numeric_limits<int>::max() ? -1 : (int) index;
+	}
+
+	/// Parse a face vertex of the form <tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>
+	static inline bool parseFaceVertex(const char *&ptr, const char *end,
+			int64_t &p, int64_t &uv, int64_t &n) {
+		uv = n = 0;
+		if (!textparse::parseInt(ptr, end, p))
+			return false;
+		if (ptr < end && *ptr == '/') {
+			++ptr;
+			if (ptr < end && *ptr != '/' && !textparse::isSpace(*ptr)
+				&& !textparse::parseInt(ptr, end, uv))
+				return false;
+			if (ptr < end && *ptr == '/') {
+				++ptr;
+				if (ptr < end && !textparse::isSpace(*ptr)
+					&& !textparse::parseInt(ptr, end, n))
+					return false;
+			}
+		}
+		return ptr == end || textparse::isSpace(*ptr);
+	}
+
+	/// Second pass: parse a chunk and write its contents to their final location
+	static void parseChunk(OBJChunk &chunk, Point *vertices, Normal *normals,
+			Point2 *texcoords, OBJTriangle *triangles,
+			const Transform &objectToWorld, bool flipTexCoords) {
+		std::string buffer;
+		const char *ptr = chunk.start, *line, *lineEnd;
+		size_t vertexCount = chunk.firstVertex, normalCount = chunk.firstNormal,
+			   texcoordCount = chunk.firstTexcoord, triangleCount = chunk.firstTriangle,
+			   lineCount = chunk.firstLine;
+
+		while (ptr < chunk.end) {
+			size_t lineIndex = lineCount;
+			ptr = fetchLine(ptr, chunk.end, line, lineEnd, buffer, lineCount);
+			std::pair<const char *, size_t> keyword = fetchKeyword(line, lineEnd);
+
+			if (isKeyword(keyword, "v")) {
+				/* Parse + transform vertices */
+				Point p(0.0f);
+				textparse::parseFloat(line, lineEnd, p.x);
+				textparse::parseFloat(line, lineEnd, p.y);
+				textparse::parseFloat(line, lineEnd, p.z);
+				vertices[vertexCount++] = objectToWorld(p);
+			} else if (isKeyword(keyword, "vn")) {
+				Normal n(0.0f);
+				textparse::parseFloat(line, lineEnd, n.x);
+				textparse::parseFloat(line, lineEnd, n.y);
+				textparse::parseFloat(line, lineEnd, n.z);
+				n = objectToWorld(n);
+				if (!n.isZero())
+					n = normalize(n);
+				normals[normalCount++] = n;
+			} else if (isKeyword(keyword, "vt")) {
+				Point2 uv(0.0f);
+				textparse::parseFloat(line, lineEnd, uv.x);
+				textparse::parseFloat(line, lineEnd, uv.y);
+				if (flipTexCoords)
+					uv.y = 1-uv.y;
+				texcoords[texcoordCount++] = uv;
+			} else if (isKeyword(keyword, "f")) {
+				OBJTriangle t;
+				int index = 0;
+				int64_t p, uv, n;
+				textparse::skipSpaces(line, lineEnd);
+				while (line < lineEnd) {
+					if (!parseFaceVertex(line, lineEnd, p, uv, n)) {
+						if (chunk.errorLine == (size_t) -1)
+							chunk.errorLine = lineIndex;
+						break;
+					}
+					if (index >= 3) {
+						/* Handle n-gons assuming a convex shape */
+						t.p[1] = t.p[2];
+						t.uv[1] = t.uv[2];
+						t.n[1] = t.n[2];
+					}
+					int i = std::min(index++, 2);
+					t.p[i] = resolveIndex(p, vertexCount);
+					t.uv[i] = resolveIndex(uv, texcoordCount);
+					t.n[i] = resolveIndex(n, normalCount);
+					if (index >= 3)
+						triangles[triangleCount++] = t;
+					textparse::skipSpaces(line, lineEnd);
+				}
+			} else if (isKeyword(keyword, "g") || isKeyword(keyword, "usemtl")
+					|| isKeyword(keyword, "mtllib")) {
+				OBJStatement statement;
+				statement.type = keyword.first[0] == 'g' ? OBJStatement::EGroup :
+					(keyword.first[0] == 'u' ? OBJStatement::EMaterial : OBJStatement::EMaterialLibrary);
+				statement.triangle = triangleCount;
+				statement.name = trim(std::string(line, lineEnd));
+				chunk.statements.push_back(statement);
+			} else {
+				/* Ignore */
+			}
+		}
+	}
+
 	WavefrontOBJ(const Properties &props) : Shape(props) {
 		ref<FileResolver> fileResolver = Thread::getThread()->getFileResolver()->clone();
 		fs::path path = fileResolver->resolve(props.getString("filename"));
@@ -221,108 +449,136 @@ public:
 
 		/* Load the geometry */
 		Log(EInfo, "Loading geometry from \"%s\" ..", path.filename().string().c_str());
-		fs::ifstream is(path);
-		if (is.bad() || is.fail())
+		if (!fs::exists(path))
 			Log(EError, "Wavefront OBJ file '%s' not found!", path.string().c_str());
 
 		fileResolver->prependPath(fs::absolute(path).parent_path());
 
 		ref<Timer> timer = new Timer();
-		std::string buf;
-		std::vector<Point> vertices;
-		std::vector<Normal> normals;
-		std::vector<Point2> texcoords;
-		std::vector<OBJTriangle> triangles;
-		std::string name = m_name, line;
+		size_t fileSize = (size_t) fs::file_size(path);
+		ref<MemoryMappedFile> mmap;
+		const char *data = NULL;
+		if (fileSize > 0) {
+			mmap = new MemoryMappedFile(path, true);
+			data = (const char *) mmap->getData();
+		}
+
+		/* Split the file into chunks that begin at the start of a line. A
+		   first pass counts the elements of each chunk, so that the second
+		   pass can write them straight to their final location. */
+		size_t chunkCount = std::max((size_t) 1, fileSize / OBJ_CHUNK_SIZE);
+		std::vector<const char *> split = textparse::splitLines(
+			data, data + fileSize, chunkCount, true);
+		std::vector<OBJChunk> chunks(chunkCount);
+		for (size_t i=0; i<chunkCount; ++i) {
+			chunks[i].start = split[i];
+			chunks[i].end = split[i+1];
+		}
+
+		#if defined(MTS_OPENMP)
+			#pragma omp parallel for schedule(dynamic)
+		#endif
+		for (int i=0; i<(int) chunkCount; ++i)
+			countElements(chunks[i]);
+
+		for (size_t i=1; i<chunkCount; ++i) {
+			const OBJChunk &prev = chunks[i-1];
+			chunks[i].firstLine = prev.firstLine + prev.lineCount;
+			chunks[i].firstVertex = prev.firstVertex + prev.vertexCount;
+			chunks[i].firstNormal = prev.firstNormal + prev.normalCount;
+			chunks[i].firstTexcoord = prev.firstTexcoord + prev.texcoordCount;
+			chunks[i].firstTriangle = prev.firstTriangle + prev.triangleCount;
+		}
+
+		const OBJChunk &last = chunks[chunkCount-1];
+		std::vector<Point> vertices(last.firstVertex + last.vertexCount);
+		std::vector<Normal> normals(last.firstNormal + last.normalCount);
+		std::vector<Point2> texcoords(last.firstTexcoord + last.texcoordCount);
+		std::vector<OBJTriangle> triangles(last.firstTriangle + last.triangleCount);
+		OBJTriangle *triangleData = triangles.empty() ? NULL : &triangles[0];
+
+		#if defined(MTS_OPENMP)
+			#pragma omp parallel for schedule(dynamic)
+		#endif
+		for (int i=0; i<(int) chunkCount; ++i)
+			parseChunk(chunks[i], vertices.empty() ? NULL : &vertices[0],
+				normals.empty() ? NULL : &normals[0],
+				texcoords.empty() ? NULL : &texcoords[0],
+				triangleData, objectToWorld, flipTexCoords);
+
+		for (size_t i=0; i<chunkCount; ++i) {
+			if (chunks[i].errorLine != (size_t) -1)
+				Log(EError, "\"%s\" [line %i]: Invalid OBJ face format!",
+					path.filename().string().c_str(), (int) chunks[i].errorLine + 1);
+		}
+
+		Float seconds = std::max((Float) 1e-6f, (Float) (timer->getNanoseconds() * 1e-9));
+		Log(EInfo, "\"%s\": parsed " SIZE_T_FMT " vertices and " SIZE_T_FMT " triangles (%i ms, %.1f MiB/s)",
+			path.filename().string().c_str(), vertices.size(), triangles.size(),
+			timer->getMilliseconds(), fileSize / (1024.0f * 1024.0f * seconds));
+		mmap = NULL;
+
+		/* Group the triangles into meshes */
+		std::string name = m_name;
 		std::set<std::string> geomNames;
 		std::vector<Vertex> vertexBuffer;
 		fs::path materialLibrary;
 		int geomIndex = 0;
 		bool nameBeforeGeometry = false;
 		std::string materialName;
+		size_t firstTriangle = 0;
+
+		for (size_t i=0; i<chunkCount; ++i) {
+			for (size_t j=0; j<chunks[i].statements.size(); ++j) {
+				const OBJStatement &statement = chunks[i].statements[j];
+				size_t triangleCount = statement.triangle - firstTriangle;
+
+				if (statement.type == OBJStatement::EGroup && !m_collapse) {
+					std::string targetName;
+					const std::string &newName = statement.name;
+
+					/* There appear to be two different conventions
+					   for specifying object names in OBJ file -- try
+					   to detect which one is being used */
+					if (nameBeforeGeometry)
+						// Save geometry under the previously specified name
+						targetName = name;
+					else
+						targetName = newName;
+
+					if (triangleCount > 0) {
+						/// make sure that we have unique names
+						if (geomNames.find(targetName) != geomNames.end())
+							targetName = formatString("%s_%i", targetName.c_str(), geomIndex);
+						geomIndex += 1;
+						geomNames.insert(targetName);
+						if (shapeIndex < 0 || geomIndex-1 == shapeIndex)
+							createMesh(targetName, vertices, normals, texcoords,
+								triangleData + firstTriangle, triangleCount, materialName, vertexBuffer);
+						firstTriangle = statement.triangle;
+					} else {
+						nameBeforeGeometry = true;
+					}
+					name = newName;
+				} else if (statement.type == OBJStatement::EMaterial) {
+					/* Flush if necessary */
+					if (triangleCount > 0 && !m_collapse) {
+						/// make sure that we have unique names
+						if (geomNames.find(name) != geomNames.end())
+							name = formatString("%s_%i", name.c_str(), geomIndex);
+						geomIndex += 1;
+						geomNames.insert(name);
+						if (shapeIndex < 0 || geomIndex-1 == shapeIndex)
+							createMesh(name, vertices, normals, texcoords,
+								triangleData + firstTriangle, triangleCount, materialName, vertexBuffer);
+						firstTriangle = statement.triangle;
+						name = m_name;
+					}
 
-		while (is.good() && !is.eof() && fetch_line(is, line)) {
-			std::istringstream iss(line);
-			if (!(iss >> buf))
-				continue;
-
-			if (buf == "v") {
-				/* Parse + transform vertices */
-				Point p;
-				iss >> p.x >> p.y >> p.z;
-				vertices.push_back(p);
-			} else if (buf == "vn") {
-				Normal n;
-				iss >> n.x >> n.y >> n.z;
-				normals.push_back(n);
-			} else if (buf == "g" && !m_collapse) {
-				std::string targetName;
-				std::string newName = trim(line.substr(1, line.length()-1));
-
-				/* There appear to be two different conventions
-				   for specifying object names in OBJ file -- try
-				   to detect which one is being used */
-				if (nameBeforeGeometry)
-					// Save geometry under the previously specified name
-					targetName = name;
-				else
-					targetName = newName;
-
-				if (triangles.size() > 0) {
-					/// make sure that we have unique names
-					if (geomNames.find(targetName) != geomNames.end())
-						targetName = formatString("%s_%i", targetName.c_str(), geomIndex);
-					geomIndex += 1;
-					geomNames.insert(targetName);
-					if (shapeIndex < 0 || geomIndex-1 == shapeIndex)
-						createMesh(targetName, vertices, normals, texcoords,
-							triangles, materialName, objectToWorld, vertexBuffer);
-					triangles.clear();
-				} else {
-					nameBeforeGeometry = true;
-				}
-				name = newName;
-			} else if (buf == "usemtl") {
-				/* Flush if necessary */
-				if (triangles.size() > 0 && !m_collapse) {
-					/// make sure that we have unique names
-					if (geomNames.find(name) != geomNames.end())
-						name = formatString("%s_%i", name.c_str(), geomIndex);
-					geomIndex += 1;
-					geomNames.insert(name);
-					if (shapeIndex < 0 || geomIndex-1 == shapeIndex)
-						createMesh(name, vertices, normals, texcoords,
-							triangles, materialName, objectToWorld, vertexBuffer);
-					triangles.clear();
-					name = m_name;
-				}
-
-				materialName = trim(line.substr(6, line.length()-1));
-			} else if (buf == "mtllib") {
-				materialLibrary = fileResolver->resolve(trim(line.substr(6, line.length()-1)));
-			} else if (buf == "vt") {
-				Float u, v;
-				iss >> u >> v;
-				if (flipTexCoords)
-					v = 1-v;
-				texcoords.push_back(Point2(u, v));
-			} else if (buf == "f") {
-				std::string  tmp;
-				OBJTriangle t;
-				iss >> tmp; parse(t, 0, tmp);
-				iss >> tmp; parse(t, 1, tmp);
-				iss >> tmp; parse(t, 2, tmp);
-				triangles.push_back(t);
-				/* Handle n-gons assuming a convex shape */
-				while (iss >> tmp) {
-					t.p[1] = t.p[2];
-					t.uv[1] = t.uv[2];
-					t.n[1] = t.n[2];
-					parse(t, 2, tmp);
-					triangles.push_back(t);
+					materialName = statement.name;
+				} else if (statement.type == OBJStatement::EMaterialLibrary) {
+					materialLibrary = fileResolver->resolve(statement.name);
 				}
-			} else {
-				/* Ignore */
 			}
 		}
 		if (geomNames.find(name) != geomNames.end())
@@ -331,7 +587,8 @@ public:
 
 		if (shapeIndex < 0 || geomIndex-1 == shapeIndex)
 			createMesh(name, vertices, normals, texcoords,
-				triangles, materialName, objectToWorld, vertexBuffer);
+				triangleData + firstTriangle, triangles.size() - firstTriangle,
+				materialName, vertexBuffer);
 
 		if (props.hasProperty("maxSmoothAngle")) {
 			if (m_faceNormals)
@@ -368,27 +625,6 @@ public:
 			manager->serialize(stream, m_meshes[i]);
 	}
 
-	void parse(OBJTriangle &t, int i, const std::string &str) {
-		std::vector<std::string> tokens = tokenize(str, "/");
-		if (tokens.size() == 1) {
-			t.p[i] = atoi(tokens[0].c_str());
-		} else if (tokens.size() == 2) {
-			if (str.find("//") == std::string::npos) {
-				t.p[i]  = atoi(tokens[0].c_str());
-				t.uv[i] = atoi(tokens[1].c_str());
-			} else {
-				t.p[i] = atoi(tokens[0].c_str());
-				t.n[i] = atoi(tokens[1].c_str());
-			}
-		} else if (tokens.size() == 3) {
-			t.p[i] = atoi(tokens[0].c_str());
-			t.uv[i] = atoi(tokens[1].c_str());
-			t.n[i] = atoi(tokens[2].c_str());
-		} else {
-			Log(EError, "Invalid OBJ face format!");
-		}
-	}
-
 	Texture *loadTexture(const FileResolver *fileResolver,
 			std::map<std::string, Texture *> &cache,
 			const fs::path &mtlPath, std::string filename,
@@ -580,28 +816,25 @@ public:
 		Point2 uv;
 	};
 
-	/// For using vertices as keys in an associative structure
-	struct vertex_key_order : public
-		std::binary_function<Vertex, Vertex, bool> {
-	public:
+	/// For using vertices as keys in a hash table
+	struct vertex_key_hash {
+		size_t operator()(const Vertex &v) const {
+			size_t seed = 0;
+			boost::hash_combine(seed, v.p.x);
+			boost::hash_combine(seed, v.p.y);
+			boost::hash_combine(seed, v.p.z);
+			boost::hash_combine(seed, v.n.x);
+			boost::hash_combine(seed, v.n.y);
+			boost::hash_combine(seed, v.n.z);
+			boost::hash_combine(seed, v.uv.x);
+			boost::hash_combine(seed, v.uv.y);
+			return seed;
+		}
+	};
+
+	struct vertex_key_equal {
 		bool operator()(const Vertex &v1, const Vertex &v2) const {
-			if (v1.p.x < v2.p.x) return true;
-			else if (v1.p.x > v2.p.x) return false;
-			if (v1.p.y < v2.p.y) return true;
-			else if (v1.p.y > v2.p.y) return false;
-			if (v1.p.z < v2.p.z) return true;
-			else if (v1.p.z > v2.p.z) return false;
-			if (v1.n.x < v2.n.x) return true;
-			else if (v1.n.x > v2.n.x) return false;
-			if (v1.n.y < v2.n.y) return true;
-			else if (v1.n.y > v2.n.y) return false;
-			if (v1.n.z < v2.n.z) return true;
-			else if (v1.n.z > v2.n.z) return false;
-			if (v1.uv.x < v2.uv.x) return true;
-			else if (v1.uv.x > v2.uv.x) return false;
-			if (v1.uv.y < v2.uv.y) return true;
-			else if (v1.uv.y > v2.uv.y) return false;
-			return false;
+			return v1.p == v2.p && v1.n == v2.n && v1.uv == v2.uv;
 		}
 	};
 
@@ -609,14 +842,14 @@ public:
 			const std::vector<Point> &vertices,
 			const std::vector<Normal> &normals,
 			const std::vector<Point2> &texcoords,
-			const std::vector<OBJTriangle> &triangles,
+			const OBJTriangle *triangles, size_t triangleCount,
 			const std::string &materialName,
-			const Transform &objectToWorld,
 			std::vector<Vertex> &vertexBuffer) {
-		if (triangles.size() == 0)
+		if (triangleCount == 0)
 			return;
-		typedef std::map<Vertex, uint32_t, vertex_key_order> VertexMapType;
-		VertexMapType vertexMap;
+		typedef boost::unordered_map<Vertex, uint32_t,
+			vertex_key_hash, vertex_key_equal> VertexMapType;
+		VertexMapType vertexMap(triangleCount);
 
 		vertexBuffer.reserve(vertices.size());
 		size_t numMerged = 0;
@@ -627,8 +860,8 @@ public:
 		vertexBuffer.clear();
 
 		/* Collapse the mesh into a more usable form */
-		Triangle *triangleArray = new Triangle[triangles.size()];
-		for (uint32_t i=0; i<triangles.size(); i++) {
+		Triangle *triangleArray = new Triangle[triangleCount];
+		for (size_t i=0; i<triangleCount; i++) {
 			Triangle tri;
 			for (uint32_t j=0; j<3; j++) {
 				int vertexId = triangles[i].p[j];
@@ -636,26 +869,19 @@ public:
 				int uvId = triangles[i].uv[j];
 				uint32_t key;
 
+				/* Relative indices were already resolved while parsing, and
+				   vertices and normals have been transformed to world space */
 				Vertex vertex;
-				if (vertexId < 0)
-					vertexId += (int) vertices.size() + 1;
-				if (normalId < 0)
-					normalId += (int) normals.size() + 1;
-				if (uvId < 0)
-					uvId += (int) texcoords.size() + 1;
-
 				if (vertexId > (int) vertices.size() || vertexId <= 0)
 					Log(EError, "Out of bounds: tried to access vertex %i (max: %i)", vertexId, (int) vertices.size());
 
-				vertex.p = objectToWorld(vertices[vertexId-1]);
+				vertex.p = vertices[vertexId-1];
 				aabb.expandBy(vertex.p);
 
 				if (normalId != 0) {
 					if (normalId > (int) normals.size() || normalId < 0)
 						Log(EError, "Out of bounds: tried to access normal %i (max: %i)", normalId, (int) normals.size());
-					vertex.n = objectToWorld(normals[normalId-1]);
-					if (!vertex.n.isZero())
-						vertex.n = normalize(vertex.n);
+					vertex.n = normals[normalId-1];
 					hasNormals = true;
 				} else {
 					vertex.n = Normal(0.0f);
@@ -686,11 +912,12 @@ public:
 		}
 
 		ref<TriMesh> mesh = new TriMesh(name,
-			triangles.size(), vertexBuffer.size(),
+			triangleCount, vertexBuffer.size(),
 			hasNormals, hasTexcoords, false,
 			m_flipNormals, m_faceNormals);
 
-		std::copy(triangleArray, triangleArray+triangles.size(), mesh->getTriangles());
+		std::copy(triangleArray, triangleArray+triangleCount, mesh->getTriangles());
+		delete[] triangleArray;
 
 		Point    *target_positions = mesh->getVertexPositions();
 		Normal   *target_normals   = mesh->getVertexNormals();
@@ -711,7 +938,7 @@ public:
 		m_meshes.push_back(mesh);
 		Log(EInfo, "%s: " SIZE_T_FMT " triangles, " SIZE_T_FMT
 			" vertices (merged " SIZE_T_FMT " vertices).", name.c_str(),
-			triangles.size(), vertexBuffer.size(), numMerged);
+			triangleCount, vertexBuffer.size(), numMerged);
 	}
 
 	virtual ~WavefrontOBJ() {
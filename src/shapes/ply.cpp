@@ -20,8 +20,10 @@
 #include <mitsuba/core/fresolver.h>
 #include <mitsuba/core/properties.h>
 #include <mitsuba/core/fstream.h>
+#include <mitsuba/core/mmap.h>
 #include <mitsuba/core/timer.h>
 #include <ply/ply_parser.hpp>
+#include "textparse.h"
 
 #if MTS_USE_BOOST_TR1
 #include <boost/tr1/functional.hpp>
@@ -39,10 +41,192 @@
 # define PLY_USE_NULLPTR 0
 #endif
 
+#if defined(MTS_OPENMP)
+# include <omp.h>
+#endif
+
+/// Number of vertices or faces that are decoded per task when loading binary files
+#define PLY_BINARY_CHUNK_SIZE 65536
+
+/// Approximate number of bytes that are parsed per task when loading ASCII files
+#define PLY_ASCII_CHUNK_SIZE (1024 * 1024)
+
 using namespace std::tr1::placeholders;
 
 MTS_NAMESPACE_BEGIN
 
+/// Scalar data types that can occur in a PLY file
+enum EPLYType {
+	EPLYInt8 = 0, EPLYUInt8, EPLYInt16, EPLYUInt16,
+	EPLYInt32, EPLYUInt32, EPLYFloat32, EPLYFloat64,
+	EPLYInvalid
+};
+
+static const size_t plyTypeSizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+
+static EPLYType parsePLYType(const std::string &name) {
+	if (name == "char"   || name == "int8")    return EPLYInt8;
+	if (name == "uchar"  || name == "uint8")   return EPLYUInt8;
+	if (name == "short"  || name == "int16")   return EPLYInt16;
+	if (name == "ushort" || name == "uint16")  return EPLYUInt16;
+	if (name == "int"    || name == "int32")   return EPLYInt32;
+	if (name == "uint"   || name == "uint32")  return EPLYUInt32;
+	if (name == "float"  || name == "float32") return EPLYFloat32;
+	if (name == "double" || name == "float64") return EPLYFloat64;
+	return EPLYInvalid;
+}
+
+/// Vertex attributes that are recognized by the PLY loader
+enum EPLYVertexAttribute {
+	EPositionX = 0, EPositionY, EPositionZ,
+	ENormalX, ENormalY, ENormalZ,
+	ETexcoordU, ETexcoordV,
+	EColorR, EColorG, EColorB,
+	EPLYVertexAttributeCount
+};
+
+static int parsePLYVertexAttribute(const std::string &name) {
+	if (name == "x") return EPositionX;
+	if (name == "y") return EPositionY;
+	if (name == "z") return EPositionZ;
+	if (name == "nx") return ENormalX;
+	if (name == "ny") return ENormalY;
+	if (name == "nz") return ENormalZ;
+	if (name == "u" || name == "texture_u" || name == "s") return ETexcoordU;
+	if (name == "v" || name == "texture_v" || name == "t") return ETexcoordV;
+	if (name == "red"   || name == "diffuse_red")   return EColorR;
+	if (name == "green" || name == "diffuse_green") return EColorG;
+	if (name == "blue"  || name == "diffuse_blue")  return EColorB;
+	return -1;
+}
+
+/// Contents of a PLY file header
+struct PLYHeader {
+	enum EFormat {
+		EASCII,
+		EBinaryLittleEndian,
+		EBinaryBigEndian
+	};
+
+	struct Property {
+		std::string name;
+		EPLYType type;     ///< Value type (or element type of a list)
+		EPLYType sizeType; ///< Type of the list size (\c EPLYInvalid for scalars)
+	};
+
+	struct Element {
+		std::string name;
+		size_t count;
+		std::vector<Property> properties;
+	};
+
+	EFormat format;
+	std::vector<Element> elements;
+	size_t dataOffset; ///< Byte offset of the first element
+	size_t lineCount;  ///< Number of lines in the header
+
+	/**
+	 * \brief Parse the header of a memory-mapped PLY file
+	 *
+	 * Returns \c false if the header is malformed.
+	 */
+	bool parse(const char *data, size_t size) {
+		const char *ptr = data, *end = data + size;
+		bool hasFormat = false;
+		lineCount = 0;
+
+		while (ptr < end) {
+			const char *lineEnd = textparse::lineEnd(ptr, end);
+			std::vector<std::string> tokens = tokenize(std::string(ptr, lineEnd), " \t\r");
+			ptr = lineEnd < end ? lineEnd + 1 : end;
+
+			if (lineCount++ == 0) {
+				if (tokens.size() != 1 || tokens[0] != "ply")
+					return false;
+			} else if (tokens.empty() || tokens[0] == "comment" || tokens[0] == "obj_info") {
+				continue;
+			} else if (tokens[0] == "format" && tokens.size() == 3) {
+				if (tokens[1] == "ascii")
+					format = EASCII;
+				else if (tokens[1] == "binary_little_endian")
+					format = EBinaryLittleEndian;
+				else if (tokens[1] == "binary_big_endian")
+					format = EBinaryBigEndian;
+				else
+					return false;
+				hasFormat = true;
+			} else if (tokens[0] == "element" && tokens.size() == 3) {
+				Element element;
+				char *endPtr = NULL;
+				element.name = tokens[1];
+				element.count = (size_t) strtoull(tokens[2].c_str(), &endPtr, 10);
+				if (*endPtr != '\0')
+					return false;
+				elements.push_back(element);
+			} else if (tokens[0] == "property" && !elements.empty()) {
+				Property property;
+				if (tokens.size() == 5 && tokens[1] == "list") {
+					property.sizeType = parsePLYType(tokens[2]);
+					property.type = parsePLYType(tokens[3]);
+					property.name = tokens[4];
+					if (property.sizeType == EPLYInvalid)
+						return false;
+				} else if (tokens.size() == 3) {
+					property.sizeType = EPLYInvalid;
+					property.type = parsePLYType(tokens[1]);
+					property.name = tokens[2];
+				} else {
+					return false;
+				}
+				if (property.type == EPLYInvalid)
+					return false;
+				elements[elements.size()-1].properties.push_back(property);
+			} else if (tokens[0] == "end_header") {
+				dataOffset = ptr - data;
+				return hasFormat;
+			} else {
+				return false;
+			}
+		}
+		return false;
+	}
+};
+
+/// Read a value from a (possibly unaligned) binary record
+template <typename T> static inline T readPLYValue(const uint8_t *ptr, bool swap) {
+	T value;
+	memcpy(&value, ptr, sizeof(T));
+	return swap ? endianness_swap(value) : value;
+}
+
+/// Read a value of the specified type from a binary record and convert it to \c double
+static inline double readPLYScalar(const uint8_t *ptr, EPLYType type, bool swap) {
+	switch (type) {
+		case EPLYInt8:    return (double) *((const int8_t *) ptr);
+		case EPLYUInt8:   return (double) *ptr;
+		case EPLYInt16:   return (double) readPLYValue<int16_t>(ptr, swap);
+		case EPLYUInt16:  return (double) readPLYValue<uint16_t>(ptr, swap);
+		case EPLYInt32:   return (double) readPLYValue<int32_t>(ptr, swap);
+		case EPLYUInt32:  return (double) readPLYValue<uint32_t>(ptr, swap);
+		case EPLYFloat32: return (double) readPLYValue<float>(ptr, swap);
+		case EPLYFloat64: return readPLYValue<double>(ptr, swap);
+		default:          return 0.0;
+	}
+}
+
+/// Read an integer of the specified type from a binary record
+static inline int64_t readPLYInteger(const uint8_t *ptr, EPLYType type, bool swap) {
+	switch (type) {
+		case EPLYInt8:    return (int64_t) *((const int8_t *) ptr);
+		case EPLYUInt8:   return (int64_t) *ptr;
+		case EPLYInt16:   return (int64_t) readPLYValue<int16_t>(ptr, swap);
+		case EPLYUInt16:  return (int64_t) readPLYValue<uint16_t>(ptr, swap);
+		case EPLYInt32:   return (int64_t) readPLYValue<int32_t>(ptr, swap);
+		case EPLYUInt32:  return (int64_t) readPLYValue<uint32_t>(ptr, swap);
+		default:          return -1;
+	}
+}
+
 /*!\plugin{ply}{PLY (Stanford Triangle Format) mesh loader}
  * \order{6}
  * \parameters{
@@ -83,6 +267,12 @@ MTS_NAMESPACE_BEGIN
  * The current plugin implementation supports triangle meshes with optional
  * UV coordinates, vertex normals, and vertex colors.
  *
+ * Files with the common layout (a \code{vertex} element followed by a
+ * \code{face} element) are memory-mapped and decoded by all available
+ * cores, writing directly into the final mesh arrays. The time spent and
+ * the achieved throughput are reported in the log. Other files are
+ * loaded using \code{libply}.
+ *
  * When loading meshes that contain vertex colors, note that they need to be
  * explicitly referenced in a BSDF using a special texture named
  * \pluginref{vertexcolors}.
@@ -127,14 +317,6 @@ public:
 				"can't be specified at the same time!");
 			rebuildTopology(props.getFloat("maxSmoothAngle"));
 		}
-
-		if (m_triangleCount < m_faceCount * 2) {
-			/* Needed less memory than the earlier conservative estimate -- free it! */
-			Triangle *temp = new Triangle[m_triangleCount];
-			memcpy(temp, m_triangles, sizeof(Triangle) * m_triangleCount);
-			delete[] m_triangles;
-			m_triangles = temp;
-		}
 	}
 
 
@@ -142,6 +324,49 @@ public:
 
 	void loadPLY(const fs::path &path);
 
+	/**
+	 * \brief Memory-map a PLY file and decode it in parallel
+	 *
+	 * Returns \c false without modifying the mesh when the file
+	 * layout is not supported (such files are handled by
+	 * \ref loadLibPLY()).
+	 */
+	bool loadMapped(const fs::path &path);
+
+	/// Decode the vertex and face data of a binary PLY file
+	void decodeBinary(const PLYHeader &header, const uint8_t *data,
+		size_t size, const int *attributes, const uint8_t *byteColors);
+
+	/// Decode the vertex and face data of an ASCII PLY file
+	void decodeASCII(const PLYHeader &header, const char *data,
+		size_t size, const int *attributes, const uint8_t *byteColors);
+
+	/// Load a PLY file using the callback interface of \c libply
+	void loadLibPLY(const fs::path &path);
+
+	/// Transform and store a vertex that was decoded by one of the parallel loaders
+	inline void storeVertex(size_t index, const Float *values, AABB &aabb) {
+		Point p = m_objectToWorld(Point(values[EPositionX],
+			values[EPositionY], values[EPositionZ]));
+		aabb.expandBy(p);
+		m_positions[index] = p;
+		if (m_normals)
+			m_normals[index] = normalize(m_objectToWorld(Normal(values[ENormalX],
+				values[ENormalY], values[ENormalZ])));
+		if (m_texcoords)
+			m_texcoords[index] = Point2(values[ETexcoordU], values[ETexcoordV]);
+		if (m_colors) {
+			if (m_sRGB)
+				m_colors[index] = Color3(
+					fromSRGBComponent(values[EColorR]),
+					fromSRGBComponent(values[EColorG]),
+					fromSRGBComponent(values[EColorB]));
+			else
+				m_colors[index] = Color3(values[EColorR],
+					values[EColorG], values[EColorB]);
+		}
+	}
+
 	void info_callback(const std::string& filename, std::size_t line_number,
 			const std::string& message) {
 		Log(EInfo, "\"%s\" [line %i] info: %s", filename.c_str(), line_number,
@@ -495,6 +720,422 @@ template<> std::tr1::tuple<std::tr1::function<void (ply::uint32)>,
 
 
 void PLYLoader::loadPLY(const fs::path &path) {
+	ref<Timer> timer = new Timer();
+	size_t fileSize = (size_t) fs::file_size(path);
+
+	if (!loadMapped(path))
+		loadLibPLY(path);
+
+	size_t vertexSize = sizeof(Point);
+	if (m_normals)
+		vertexSize += sizeof(Normal);
+	if (m_colors)
+		vertexSize += sizeof(Spectrum);
+	if (m_texcoords)
+		vertexSize += sizeof(Point2);
+
+	Float seconds = std::max((Float) 1e-6f, (Float) (timer->getNanoseconds() * 1e-9));
+	Log(EInfo, "\"%s\": Loaded " SIZE_T_FMT " triangles, " SIZE_T_FMT
+			" vertices (%s in %i ms, %.1f MiB/s).", m_name.c_str(), m_triangleCount, m_vertexCount,
+			memString(sizeof(uint32_t) * m_triangleCount * 3 + vertexSize * m_vertexCount).c_str(),
+			timer->getMilliseconds(), fileSize / (1024.0f * 1024.0f * seconds));
+}
+
+bool PLYLoader::loadMapped(const fs::path &path) {
+	if (fs::file_size(path) == 0)
+		return false;
+
+	ref<MemoryMappedFile> mmap = new MemoryMappedFile(path, true);
+	const char *data = (const char *) mmap->getData();
+	size_t size = mmap->getSize();
+
+	PLYHeader header;
+	if (!header.parse(data, size) || header.elements.size() < 2)
+		return false;
+
+	const PLYHeader::Element &vertices = header.elements[0];
+	const PLYHeader::Element &faces = header.elements[1];
+	if (vertices.name != "vertex" || faces.name != "face" ||
+		vertices.count == 0 || faces.count == 0 ||
+		vertices.properties.empty())
+		return false;
+
+	/* Determine which vertex attributes are stored in the file */
+	std::vector<int> attributes(vertices.properties.size());
+	std::vector<uint8_t> byteColors(vertices.properties.size());
+	bool hasAttribute[EPLYVertexAttributeCount];
+	memset(hasAttribute, 0, sizeof(hasAttribute));
+	for (size_t i=0; i<vertices.properties.size(); ++i) {
+		const PLYHeader::Property &property = vertices.properties[i];
+		if (property.sizeType != EPLYInvalid)
+			return false;
+		attributes[i] = parsePLYVertexAttribute(property.name);
+		byteColors[i] = attributes[i] >= EColorR && property.type == EPLYUInt8;
+		if (attributes[i] >= 0)
+			hasAttribute[attributes[i]] = true;
+	}
+
+	/* The faces must contain exactly one list of vertex indices */
+	int indexLists = 0;
+	for (size_t i=0; i<faces.properties.size(); ++i) {
+		const PLYHeader::Property &property = faces.properties[i];
+		if (property.sizeType == EPLYInvalid)
+			continue;
+		if ((property.name != "vertex_indices" && property.name != "vertex_index") ||
+			property.type >= EPLYFloat32 || property.sizeType >= EPLYFloat32)
+			return false;
+		++indexLists;
+	}
+	if (indexLists != 1)
+		return false;
+
+	m_vertexCount = vertices.count;
+	m_faceCount = faces.count;
+	m_positions = new Point[m_vertexCount];
+	if (hasAttribute[ENormalX])
+		m_normals = new Normal[m_vertexCount];
+	if (hasAttribute[ETexcoordU])
+		m_texcoords = new Point2[m_vertexCount];
+	if (hasAttribute[EColorR])
+		m_colors = new Color3[m_vertexCount];
+
+	if (header.format == PLYHeader::EASCII)
+		decodeASCII(header, data, size, &attributes[0], &byteColors[0]);
+	else
+		decodeBinary(header, (const uint8_t *) data, size, &attributes[0], &byteColors[0]);
+
+	m_vertexCtr = m_vertexCount;
+	m_faceCtr = m_faceCount;
+	return true;
+}
+
+void PLYLoader::decodeBinary(const PLYHeader &header, const uint8_t *data,
+		size_t size, const int *attributes, const uint8_t *byteColors) {
+	const PLYHeader::Element &vertices = header.elements[0];
+	const PLYHeader::Element &faces = header.elements[1];
+	bool swap = (header.format == PLYHeader::EBinaryLittleEndian)
+		!= (Stream::getHostByteOrder() == Stream::ELittleEndian);
+
+	/* Vertices are stored as fixed-size records */
+	std::vector<size_t> offsets(vertices.properties.size());
+	size_t vertexStride = 0;
+	for (size_t i=0; i<vertices.properties.size(); ++i) {
+		offsets[i] = vertexStride;
+		vertexStride += plyTypeSizes[vertices.properties[i].type];
+	}
+
+	if (m_vertexCount > (size - header.dataOffset) / vertexStride)
+		Log(EError, "\"%s\": unexpected end of file while reading the vertex data!",
+			m_name.c_str());
+
+	const uint8_t *vertexData = data + header.dataOffset;
+	size_t vertexChunks = (m_vertexCount + PLY_BINARY_CHUNK_SIZE - 1) / PLY_BINARY_CHUNK_SIZE;
+	std::vector<AABB> aabbs(vertexChunks);
+
+	#if defined(MTS_OPENMP)
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+	for (int chunk=0; chunk<(int) vertexChunks; ++chunk) {
+		size_t start = (size_t) chunk * PLY_BINARY_CHUNK_SIZE,
+		       stop  = std::min(start + PLY_BINARY_CHUNK_SIZE, m_vertexCount);
+		Float values[EPLYVertexAttributeCount];
+		for (int i=0; i<EPLYVertexAttributeCount; ++i)
+			values[i] = 0.0f;
+		AABB aabb;
+
+		for (size_t i=start; i<stop; ++i) {
+			const uint8_t *ptr = vertexData + i * vertexStride;
+			for (size_t j=0; j<offsets.size(); ++j) {
+				if (attributes[j] < 0)
+					continue;
+				Float value = (Float) readPLYScalar(ptr + offsets[j],
+					vertices.properties[j].type, swap);
+				if (byteColors[j])
+					value /= 255.0f;
+				values[attributes[j]] = value;
+			}
+			storeVertex(i, values, aabb);
+		}
+		aabbs[chunk] = aabb;
+	}
+	for (size_t i=0; i<vertexChunks; ++i)
+		m_aabb.expandBy(aabbs[i]);
+
+	/* Faces consist of scalar properties before and after the index list */
+	size_t prefixSize = 0, suffixSize = 0;
+	EPLYType sizeType = EPLYInvalid, indexType = EPLYInvalid;
+	for (size_t i=0; i<faces.properties.size(); ++i) {
+		const PLYHeader::Property &property = faces.properties[i];
+		if (property.sizeType != EPLYInvalid) {
+			sizeType = property.sizeType;
+			indexType = property.type;
+		} else if (sizeType == EPLYInvalid) {
+			prefixSize += plyTypeSizes[property.type];
+		} else {
+			suffixSize += plyTypeSizes[property.type];
+		}
+	}
+	size_t sizeSize = plyTypeSizes[sizeType], indexSize = plyTypeSizes[indexType];
+	const uint8_t *faceData = vertexData + m_vertexCount * vertexStride, *end = data + size;
+
+	if ((size_t) (end - faceData) < prefixSize + sizeSize)
+		Log(EError, "\"%s\": unexpected end of file while reading the face data!",
+			m_name.c_str());
+
+	int64_t faceSize = readPLYInteger(faceData + prefixSize, sizeType, swap);
+	if (faceSize != 3 && faceSize != 4)
+		Log(EError, "Encountered a face with %i vertices! "
+			"Only triangle and quad-based PLY meshes are supported for now.", (int) faceSize);
+
+	/* Optimistically assume that all faces have the same size. Then they are
+	   stored as fixed-size records, and each one maps to a known position in
+	   the triangle array. Otherwise, fall back to a sequential scan. */
+	size_t faceStride = prefixSize + sizeSize + (size_t) faceSize * indexSize + suffixSize;
+	size_t trianglesPerFace = (size_t) faceSize - 2;
+	bool uniform = m_faceCount <= (size_t) (end - faceData) / faceStride;
+	int64_t invalidFace = -1;
+
+	if (uniform) {
+		size_t faceChunks = (m_faceCount + PLY_BINARY_CHUNK_SIZE - 1) / PLY_BINARY_CHUNK_SIZE;
+		std::vector<int64_t> invalidFaces(faceChunks, -1);
+		std::vector<uint8_t> mismatch(faceChunks, 0);
+		m_triangleCount = m_faceCount * trianglesPerFace;
+		m_triangles = new Triangle[m_triangleCount];
+
+		#if defined(MTS_OPENMP)
+			#pragma omp parallel for schedule(dynamic)
+		#endif
+		for (int chunk=0; chunk<(int) faceChunks; ++chunk) {
+			size_t start = (size_t) chunk * PLY_BINARY_CHUNK_SIZE,
+			       stop  = std::min(start + PLY_BINARY_CHUNK_SIZE, m_faceCount);
+
+			for (size_t i=start; i<stop; ++i) {
+				const uint8_t *ptr = faceData + i * faceStride + prefixSize;
+				if (readPLYInteger(ptr, sizeType, swap) != faceSize) {
+					mismatch[chunk] = 1;
+					break;
+				}
+				ptr += sizeSize;
+
+				uint32_t idx[4];
+				for (int64_t k=0; k<faceSize; ++k) {
+					int64_t index = readPLYInteger(ptr + k * indexSize, indexType, swap);
+					if (index < 0 || index >= (int64_t) m_vertexCount) {
+						if (invalidFaces[chunk] < 0)
+							invalidFaces[chunk] = (int64_t) i;
+						index = 0;
+					}
+					idx[k] = (uint32_t) index;
+				}
+
+				Triangle *tri = m_triangles + i * trianglesPerFace;
+				tri[0].idx[0] = idx[0]; tri[0].idx[1] = idx[1]; tri[0].idx[2] = idx[2];
+				if (faceSize == 4) {
+					tri[1].idx[0] = idx[3]; tri[1].idx[1] = idx[0]; tri[1].idx[2] = idx[2];
+				}
+			}
+		}
+
+		for (size_t i=0; i<faceChunks; ++i) {
+			if (mismatch[i])
+				uniform = false;
+			if (invalidFaces[i] >= 0 && invalidFace < 0)
+				invalidFace = invalidFaces[i];
+		}
+
+		if (!uniform) {
+			delete[] m_triangles;
+			m_triangles = NULL;
+			invalidFace = -1;
+		}
+	}
+
+	if (!uniform) {
+		/* Faces of varying size (e.g. a mixture of triangles and quads) */
+		m_triangles = new Triangle[m_faceCount * 2];
+		m_triangleCount = 0;
+		const uint8_t *ptr = faceData;
+
+		for (size_t i=0; i<m_faceCount; ++i) {
+			if ((size_t) (end - ptr) < prefixSize + sizeSize)
+				Log(EError, "\"%s\": unexpected end of file while reading the face data!",
+					m_name.c_str());
+			ptr += prefixSize;
+			int64_t count = readPLYInteger(ptr, sizeType, swap);
+			if (count != 3 && count != 4)
+				Log(EError, "Encountered a face with %i vertices! "
+					"Only triangle and quad-based PLY meshes are supported for now.", (int) count);
+			ptr += sizeSize;
+			if ((size_t) (end - ptr) < (size_t) count * indexSize + suffixSize)
+				Log(EError, "\"%s\": unexpected end of file while reading the face data!",
+					m_name.c_str());
+
+			uint32_t idx[4];
+			for (int64_t k=0; k<count; ++k) {
+				int64_t index = readPLYInteger(ptr, indexType, swap);
+				if ((index < 0 || index >= (int64_t) m_vertexCount) && invalidFace < 0)
+					invalidFace = (int64_t) i;
+				idx[k] = (uint32_t) index;
+				ptr += indexSize;
+			}
+			ptr += suffixSize;
+
+			Triangle &tri = m_triangles[m_triangleCount++];
+			tri.idx[0] = idx[0]; tri.idx[1] = idx[1]; tri.idx[2] = idx[2];
+			if (count == 4) {
+				Triangle &tri2 = m_triangles[m_triangleCount++];
+				tri2.idx[0] = idx[3]; tri2.idx[1] = idx[0]; tri2.idx[2] = idx[2];
+			}
+		}
+
+		if (m_triangleCount < m_faceCount * 2) {
+			/* Needed less memory than the earlier conservative estimate -- free it! */
+			Triangle *temp = new Triangle[m_triangleCount];
+			memcpy(temp, m_triangles, sizeof(Triangle) * m_triangleCount);
+			delete[] m_triangles;
+			m_triangles = temp;
+		}
+	}
+
+	if (invalidFace >= 0)
+		Log(EError, "\"%s\": face %i references a vertex that does not exist!",
+			m_name.c_str(), (int) invalidFace);
+}
+
+void PLYLoader::decodeASCII(const PLYHeader &header, const char *data,
+		size_t size, const int *attributes, const uint8_t *byteColors) {
+	const PLYHeader::Element &vertices = header.elements[0];
+	const PLYHeader::Element &faces = header.elements[1];
+	const char *start = data + header.dataOffset, *end = data + size;
+	size_t lastLine = m_vertexCount + m_faceCount;
+
+	/* Split the file into chunks that start at the beginning of a line */
+	size_t chunkCount = std::max((size_t) 1, (size_t) (end - start) / PLY_ASCII_CHUNK_SIZE);
+	std::vector<const char *> chunks = textparse::splitLines(start, end, chunkCount);
+
+	/* Index of the first line within each chunk, the first triangle
+	   generated by it, and the first line that failed to parse */
+	std::vector<size_t> firstLine(chunkCount + 1, 0), firstTriangle(chunkCount + 1, 0);
+	std::vector<size_t> errorLine(chunkCount, (size_t) -1);
+
+	int listIndex = 0;
+	while (faces.properties[listIndex].sizeType == EPLYInvalid)
+		++listIndex;
+
+	#if defined(MTS_OPENMP)
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+	for (int chunk=0; chunk<(int) chunkCount; ++chunk)
+		firstLine[chunk+1] = textparse::countLines(chunks[chunk], chunks[chunk+1]);
+	for (size_t i=0; i<chunkCount; ++i)
+		firstLine[i+1] += firstLine[i];
+
+	if (firstLine[chunkCount] < lastLine)
+		Log(EError, "\"%s\": unexpected end of file (expected " SIZE_T_FMT
+			" lines of vertex and face data, found " SIZE_T_FMT ")!",
+			m_name.c_str(), lastLine, firstLine[chunkCount]);
+
+	/* First pass over the faces: determine how many triangles each chunk generates */
+	#if defined(MTS_OPENMP)
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+	for (int chunk=0; chunk<(int) chunkCount; ++chunk) {
+		size_t line = firstLine[chunk], triangles = 0;
+		const char *ptr = chunks[chunk], *chunkEnd = chunks[chunk+1];
+		if (firstLine[chunk+1] <= m_vertexCount)
+			continue;
+
+		for (; ptr < chunkEnd && line < lastLine; ++line) {
+			if (line >= m_vertexCount) {
+				int64_t faceSize = 0;
+				double value;
+				for (int i=0; i<listIndex; ++i)
+					textparse::parseFloat(ptr, chunkEnd, value);
+				if (!textparse::parseInt(ptr, chunkEnd, faceSize) || (faceSize != 3 && faceSize != 4)) {
+					errorLine[chunk] = line;
+					break;
+				}
+				triangles += (size_t) faceSize - 2;
+			}
+			ptr = textparse::nextLine(ptr, chunkEnd);
+		}
+		firstTriangle[chunk+1] = triangles;
+	}
+	for (size_t i=0; i<chunkCount; ++i) {
+		if (errorLine[i] != (size_t) -1)
+			Log(EError, "\"%s\" [line " SIZE_T_FMT "]: Only triangle and quad-based "
+				"PLY meshes are supported for now.", m_name.c_str(),
+				header.lineCount + errorLine[i] + 1);
+		firstTriangle[i+1] += firstTriangle[i];
+	}
+
+	m_triangleCount = firstTriangle[chunkCount];
+	m_triangles = new Triangle[m_triangleCount];
+	std::vector<AABB> aabbs(chunkCount);
+
+	/* Second pass: parse the vertices and faces */
+	#if defined(MTS_OPENMP)
+		#pragma omp parallel for schedule(dynamic)
+	#endif
+	for (int chunk=0; chunk<(int) chunkCount; ++chunk) {
+		size_t line = firstLine[chunk];
+		const char *ptr = chunks[chunk], *chunkEnd = chunks[chunk+1];
+		Triangle *tri = m_triangles + firstTriangle[chunk];
+		Float values[EPLYVertexAttributeCount];
+		for (int i=0; i<EPLYVertexAttributeCount; ++i)
+			values[i] = 0.0f;
+		AABB aabb;
+		bool success = true;
+
+		for (; ptr < chunkEnd && line < lastLine && success; ++line) {
+			double value;
+			if (line < m_vertexCount) {
+				for (size_t i=0; i<vertices.properties.size(); ++i) {
+					if (!textparse::parseFloat(ptr, chunkEnd, value)) {
+						success = false;
+						break;
+					}
+					if (attributes[i] >= 0)
+						values[attributes[i]] = byteColors[i]
+							? (Float) value / 255.0f : (Float) value;
+				}
+				storeVertex(line, values, aabb);
+			} else {
+				int64_t faceSize = 0, idx[4];
+				for (int i=0; i<listIndex; ++i)
+					textparse::parseFloat(ptr, chunkEnd, value);
+				textparse::parseInt(ptr, chunkEnd, faceSize);
+				for (int64_t k=0; k<faceSize && success; ++k) {
+					success = textparse::parseInt(ptr, chunkEnd, idx[k])
+						&& idx[k] >= 0 && idx[k] < (int64_t) m_vertexCount;
+				}
+				if (!success)
+					break;
+
+				tri->idx[0] = (uint32_t) idx[0]; tri->idx[1] = (uint32_t) idx[1];
+				tri->idx[2] = (uint32_t) idx[2]; ++tri;
+				if (faceSize == 4) {
+					tri->idx[0] = (uint32_t) idx[3]; tri->idx[1] = (uint32_t) idx[0];
+					tri->idx[2] = (uint32_t) idx[2]; ++tri;
+				}
+			}
+			ptr = textparse::nextLine(ptr, chunkEnd);
+		}
+		if (!success)
+			errorLine[chunk] = line;
+		aabbs[chunk] = aabb;
+	}
+
+	for (size_t i=0; i<chunkCount; ++i) {
+		if (errorLine[i] != (size_t) -1)
+			Log(EError, "\"%s\" [line " SIZE_T_FMT "]: malformed %s data!",
+				m_name.c_str(), header.lineCount + errorLine[i] + 1,
+				errorLine[i] < m_vertexCount ? "vertex" : "face");
+		m_aabb.expandBy(aabbs[i]);
+	}
+}
+
+void PLYLoader::loadLibPLY(const fs::path &path) {
 	ply::ply_parser ply_parser;
 	ply_parser.info_callback(std::tr1::bind(&PLYLoader::info_callback,
 		this, std::tr1::ref(m_name), _1, _2));
@@ -530,21 +1171,15 @@ void PLYLoader::loadPLY(const fs::path &path) {
 	ply_parser.scalar_property_definition_callbacks(scalar_property_definition_callbacks);
 	ply_parser.list_property_definition_callbacks(list_property_definition_callbacks);
 
-	ref<Timer> timer = new Timer();
 	ply_parser.parse(path.string());
 
-	size_t vertexSize = sizeof(Point);
-	if (m_normals)
-		vertexSize += sizeof(Normal);
-	if (m_colors)
-		vertexSize += sizeof(Spectrum);
-	if (m_texcoords)
-		vertexSize += sizeof(Point2);
-
-	Log(EInfo, "\"%s\": Loaded " SIZE_T_FMT " triangles, " SIZE_T_FMT
-			" vertices (%s in %i ms).", m_name.c_str(), m_triangleCount, m_vertexCount,
-			memString(sizeof(uint32_t) * m_triangleCount * 3 + vertexSize * m_vertexCount).c_str(),
-			timer->getMilliseconds());
+	if (m_triangleCount < m_faceCount * 2) {
+		/* Needed less memory than the earlier conservative estimate -- free it! */
+		Triangle *temp = new Triangle[m_triangleCount];
+		memcpy(temp, m_triangles, sizeof(Triangle) * m_triangleCount);
+		delete[] m_triangles;
+		m_triangles = temp;
+	}
 }
 
 
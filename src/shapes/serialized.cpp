@@ -19,19 +19,39 @@
 #include <mitsuba/render/trimesh.h>
 #include <mitsuba/core/properties.h>
 #include <mitsuba/core/fstream.h>
+#include <mitsuba/core/mstream.h>
+#include <mitsuba/core/mmap.h>
 #include <mitsuba/core/fresolver.h>
 #include <mitsuba/core/timer.h>
 #include <mitsuba/core/lrucache.h>
+#include <mitsuba/core/lock.h>
 
 #include <boost/make_shared.hpp>
 
+#if defined(MTS_OPENMP)
+# include <omp.h>
+#endif
+
 /// How many files to keep open in the cache, per thread
 #define MTS_SERIALIZED_CACHE_SIZE 4
 
+/**
+ * When loading a sub-shape of a compressed file, the following sub-shapes
+ * are decompressed in parallel as well (this many per OpenMP thread)
+ */
+#define MTS_SERIALIZED_PREFETCH_PER_THREAD 4
+
+/**
+ * Upper bound on the memory taken up by sub-shapes that were decompressed
+ * ahead of time but not requested yet. The oldest ones are evicted first.
+ */
+#define MTS_SERIALIZED_PREFETCH_MEMORY (128 * 1024 * 1024)
+
 MTS_NAMESPACE_BEGIN
 
 /* Avoid having to include scenehandler.h */
 extern MTS_EXPORT_RENDER void pushSceneCleanupHandler(void (*cleanup)());
+extern MTS_EXPORT_RENDER bool isSceneLoaderThread();
 
 /*!\plugin{serialized}{Serialized mesh loader}
  * \order{7}
@@ -142,6 +162,16 @@ extern MTS_EXPORT_RENDER void pushSceneCleanupHandler(void (*cleanup)());
  * \bottomrule
  * \end{longtable}
  * \end{center}
+ *
+ * \paragraph{Uncompressed variant:}
+ * Files with the version identifier \code{0x0005} have the same structure,
+ * except that the mesh data is not compressed. In addition, every array is
+ * preceded by up to 15 zero bytes of padding so that it starts at a multiple
+ * of 16 bytes relative to the beginning of the file. Such files are larger,
+ * but the loader memory-maps them and directly references the stored arrays
+ * when their precision matches that of Mitsuba, which avoids decompression
+ * and any copies. They can be created using the \code{-u} flag of \code{mtsimport},
+ * which can also convert existing \code{.serialized} files.
  */
 class SerializedMesh : public TriMesh {
 public:
@@ -163,8 +193,9 @@ public:
 		Log(EInfo, "Loading shape %i from \"%s\" ..", shapeIndex, filePath.filename().string().c_str());
 		ref<Timer> timer = new Timer();
 		loadCompressed(filePath, shapeIndex);
-		Log(EDebug, "Done (" SIZE_T_FMT " triangles, " SIZE_T_FMT " vertices, %i ms)",
-			m_triangleCount, m_vertexCount, timer->getMilliseconds());
+		Log(EDebug, "Done (" SIZE_T_FMT " triangles, " SIZE_T_FMT " vertices, %i ms%s)",
+			m_triangleCount, m_vertexCount, timer->getMilliseconds(),
+			m_mappedFile ? ", memory-mapped" : "");
 
 		if (m_name.empty())
 			m_name = name;
@@ -181,6 +212,13 @@ public:
 		/* Causes all normals to be flipped */
 		m_flipNormals = props.getBoolean("flipNormals", false);
 
+		/* Meshes that reference a file mapping share it with all other meshes
+		   loaded from the same file (and sub-shape) on this thread. Use private
+		   copies of the arrays if they are about to be modified in place */
+		if (!objectToWorld.isIdentity() || m_flipNormals
+				|| props.hasProperty("maxSmoothAngle"))
+			copyMappedArrays();
+
 		if (!objectToWorld.isIdentity()) {
 			m_aabb.reset();
 			for (size_t i=0; i<m_vertexCount; ++i) {
@@ -215,48 +253,91 @@ public:
 	MTS_DECLARE_CLASS()
 
 private:
+	/// Create an empty mesh (used to decompress sub-shapes ahead of time)
+	SerializedMesh() : TriMesh(Properties()) { }
+
+	/// Take over the geometry of a mesh that was decompressed ahead of time
+	void takeGeometry(SerializedMesh *mesh) {
+		m_name = mesh->m_name;
+		m_vertexCount = mesh->m_vertexCount;
+		m_triangleCount = mesh->m_triangleCount;
+		m_faceNormals = mesh->m_faceNormals;
+		std::swap(m_positions, mesh->m_positions);
+		std::swap(m_normals, mesh->m_normals);
+		std::swap(m_texcoords, mesh->m_texcoords);
+		std::swap(m_colors, mesh->m_colors);
+		std::swap(m_triangles, mesh->m_triangles);
+		m_surfaceArea = m_invSurfaceArea = -1;
+		m_flipNormals = false;
+	}
+
+	/// Return the size of the geometry arrays in bytes
+	size_t getGeometrySize() const {
+		size_t perVertex = sizeof(Point);
+		if (m_normals)
+			perVertex += sizeof(Normal);
+		if (m_texcoords)
+			perVertex += sizeof(Point2);
+		if (m_colors)
+			perVertex += sizeof(Color3);
+		return perVertex * m_vertexCount + sizeof(Triangle) * m_triangleCount;
+	}
 
 	/**
 	 * Helper class for loading serialized meshes from the same file
 	 * repeatedly: it is common for scene to load multiple meshes from the same
 	 * file, most times even in ascending order. This class loads the mesh
-	 * offsets dictionary only once and keeps the stream open.
+	 * offsets dictionary only once and keeps the file mapped into memory.
+	 * Meshes that directly reference the mapping copy their arrays
+	 * before transforming them (see \ref TriMesh::copyMappedArrays()).
 	 *
 	 * Instances of this class are not thread safe.
 	 */
 	class MeshLoader {
 	public:
 		MeshLoader(const fs::path& filePath) {
-			m_fstream = new FileStream(filePath, FileStream::EReadOnly);
-			m_fstream->setByteOrder(Stream::ELittleEndian);
-			const short version = SerializedMesh::readHeader(m_fstream);
-			if (SerializedMesh::readOffsetDictionary(m_fstream,
+			m_file = MemoryMappedFile::createCopyOnWrite(filePath);
+			ref<MemoryStream> stream = new MemoryStream(
+				m_file->getData(), m_file->getSize());
+			stream->setByteOrder(Stream::ELittleEndian);
+			const short version = SerializedMesh::readHeader(stream);
+			m_compressed = version < MTS_FILEFORMAT_VERSION_V5;
+			if (SerializedMesh::readOffsetDictionary(stream,
 				version, m_offsets) < 0) {
 				// Assume there is a single mesh in the file at offset 0
 				m_offsets.resize(1, 0);
 			}
 		}
 
-		/**
-		 * Positions the stream at the location for the given shape index.
-		 * Returns the modified stream.
-		 */
-		inline FileStream* seekStream(size_t shapeIndex) {
-			if (shapeIndex > m_offsets.size()) {
+		/// Return the file offset of the given shape index
+		inline size_t getOffset(size_t shapeIndex) const {
+			if (shapeIndex >= m_offsets.size()) {
 				SLog(EError, "Unable to unserialize mesh, "
 					"shape index is out of range! (requested %i out of 0..%i)",
 					shapeIndex, (int) (m_offsets.size()-1));
 			}
-			const size_t pos = m_offsets[shapeIndex];
-			m_fstream->seek(pos);
-			return m_fstream;
+			return m_offsets[shapeIndex];
 		}
 
+		/// Return the number of sub-shapes
+		inline size_t getShapeCount() const { return m_offsets.size(); }
+
+		/// Does the file store compressed meshes?
+		inline bool isCompressed() const { return m_compressed; }
+
+		/// Return the memory-mapped file
+		inline MemoryMappedFile *getFile() { return m_file; }
+
 	private:
 		std::vector<size_t> m_offsets;
-		ref<FileStream> m_fstream;
+		ref<MemoryMappedFile> m_file;
+		bool m_compressed;
 	};
 
+	/// Sub-shapes that were decompressed ahead of time, by file and shape index
+	typedef std::pair<fs::path, size_t> PrefetchKey;
+	typedef std::map<PrefetchKey, ref<SerializedMesh> > PrefetchMap;
+
 	typedef LRUCache<fs::path, std::less<fs::path>,
 		boost::shared_ptr<MeshLoader> > MeshLoaderCache;
 
@@ -276,12 +357,16 @@ private:
 		}
 	};
 
-	/// Release all currently held offset caches / file streams
+	/// Release all currently held offset caches / file mappings
 	static void flushCache() {
 		m_cache.set(NULL);
+		LockGuard lock(m_prefetchMutex);
+		m_prefetched.clear();
+		m_prefetchOrder.clear();
+		m_prefetchMemory = 0;
 	}
 
-	/// Loads the mesh from the thread-local file stream cache
+	/// Loads the mesh from the thread-local file mapping cache
 	void loadCompressed(const fs::path& filePath, const int idx) {
 		if (EXPECT_NOT_TAKEN(idx < 0)) {
 			Log(EError, "Unable to unserialize mesh, "
@@ -296,15 +381,127 @@ private:
 			mitsuba::pushSceneCleanupHandler(&SerializedMesh::flushCache);
 		}
 
+		/* Was this sub-shape already decompressed ahead of time? */
+		const size_t index = (size_t) idx;
+		ref<SerializedMesh> prefetched;
+		{
+			LockGuard lock(m_prefetchMutex);
+			const PrefetchKey key(filePath, index);
+			PrefetchMap::iterator it = m_prefetched.find(key);
+			if (it != m_prefetched.end()) {
+				prefetched = it->second;
+				m_prefetchMemory -= prefetched->getGeometrySize();
+				m_prefetched.erase(it);
+
+				/* Also drop the key from the eviction order -- otherwise, it
+				   would evict a later prefetch of the same sub-shape early */
+				std::deque<PrefetchKey>::iterator it2 = std::find(
+					m_prefetchOrder.begin(), m_prefetchOrder.end(), key);
+				if (it2 != m_prefetchOrder.end())
+					m_prefetchOrder.erase(it2);
+			}
+		}
+		if (prefetched) {
+			takeGeometry(prefetched);
+			return;
+		}
+
 		boost::shared_ptr<MeshLoader> meshLoader = cache->get(filePath);
 		Assert(meshLoader != NULL);
-		TriMesh::loadCompressed(meshLoader->seekStream((size_t) idx));
+		const size_t offset = meshLoader->getOffset(index);
+
+		/* Scenes usually load many sub-shapes of a compressed file in
+		   ascending order. Decompress the subsequent ones in parallel
+		   and keep them until they are requested. This is skipped on
+		   the scene loader threads, which already construct the queued
+		   shapes in parallel, and within OpenMP parallel regions. Since
+		   the scene loader routes all shapes with a filename through its
+		   threads on multi-core machines, prefetching mainly benefits
+		   shapes that are created directly (e.g. via the Python API). */
+		bool prefetch = meshLoader->isCompressed() && !isSceneLoaderThread();
+		#if defined(MTS_OPENMP)
+			prefetch &= !omp_in_parallel();
+		#endif
+
+		size_t count = 1;
+		if (prefetch)
+			count = std::min(meshLoader->getShapeCount() - index,
+				(size_t) mts_omp_get_max_threads() * MTS_SERIALIZED_PREFETCH_PER_THREAD);
+
+		if (count <= 1) {
+			TriMesh::loadMapped(meshLoader->getFile(), offset);
+			return;
+		}
+
+		ref<Timer> timer = new Timer();
+		ref_vector<SerializedMesh> meshes(count);
+		#if defined(MTS_OPENMP)
+			#pragma omp parallel for schedule(dynamic)
+		#endif
+		for (int i=0; i<(int) count; ++i) {
+			try {
+				ref<SerializedMesh> mesh = new SerializedMesh();
+				mesh->loadMapped(meshLoader->getFile(),
+					meshLoader->getOffset(index + i));
+				meshes[i] = mesh;
+			} catch (const std::exception &) {
+				/* Errors are reported once the shape is actually requested */
+			}
+		}
+
+		size_t prefetchCount = 0, evictCount = 0;
+		{
+			LockGuard lock(m_prefetchMutex);
+			for (size_t i=1; i<count; ++i) {
+				if (!meshes[i])
+					continue;
+				const PrefetchKey key(filePath, index + i);
+				const size_t size = meshes[i]->getGeometrySize();
+
+				/* Make room by evicting the oldest unused sub-shapes */
+				while (m_prefetchMemory + size > MTS_SERIALIZED_PREFETCH_MEMORY
+						&& !m_prefetchOrder.empty()) {
+					PrefetchMap::iterator it = m_prefetched.find(m_prefetchOrder.front());
+					m_prefetchOrder.pop_front();
+					if (it != m_prefetched.end()) {
+						m_prefetchMemory -= it->second->getGeometrySize();
+						m_prefetched.erase(it);
+						++evictCount;
+					}
+				}
+
+				if (m_prefetchMemory + size > MTS_SERIALIZED_PREFETCH_MEMORY)
+					break;
+
+				if (m_prefetched.insert(std::make_pair(key, meshes[i])).second) {
+					m_prefetchOrder.push_back(key);
+					m_prefetchMemory += size;
+					++prefetchCount;
+				}
+			}
+		}
+		Log(EDebug, "Decompressed " SIZE_T_FMT " additional shapes from \"%s\" "
+			"in parallel (%i ms, " SIZE_T_FMT " unused ones evicted)", prefetchCount,
+			filePath.filename().string().c_str(), timer->getMilliseconds(), evictCount);
+
+		if (meshes[0])
+			takeGeometry(meshes[0]);
+		else
+			TriMesh::loadMapped(meshLoader->getFile(), offset);
 	}
 
 	static ThreadLocal<FileStreamCache> m_cache;
+	static PrefetchMap m_prefetched;
+	static std::deque<PrefetchKey> m_prefetchOrder;
+	static size_t m_prefetchMemory;
+	static ref<Mutex> m_prefetchMutex;
 };
 
 ThreadLocal<SerializedMesh::FileStreamCache> SerializedMesh::m_cache;
+SerializedMesh::PrefetchMap SerializedMesh::m_prefetched;
+std::deque<SerializedMesh::PrefetchKey> SerializedMesh::m_prefetchOrder;
+size_t SerializedMesh::m_prefetchMemory = 0;
+ref<Mutex> SerializedMesh::m_prefetchMutex = new Mutex();
 
 MTS_IMPLEMENT_CLASS_S(SerializedMesh, false, TriMesh)
 MTS_EXPORT_PLUGIN(SerializedMesh, "Serialized mesh loader");
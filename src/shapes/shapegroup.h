@@ -17,6 +17,7 @@
 */
 
 #include <mitsuba/render/skdtree.h>
+#include <mitsuba/render/shapebvh.h>
 #include <mitsuba/render/bsdf.h>
 #include <mitsuba/render/subsurface.h>
 #include <mitsuba/render/emitter.h>
@@ -25,7 +26,7 @@ MTS_NAMESPACE_BEGIN
 
 /**
  * \brief "Fake" shape that groups sub-shapes into a
- * separate KD-tree.
+ * separate KD-tree or BVH.
  *
  * This shape doesn't actually generate any intersectable
  * geometry on its own. Instead, the "instance" plugin must
@@ -42,7 +43,7 @@ public:
 	/// Serialize to a binary data stream
 	void serialize(Stream *stream, InstanceManager *manager) const;
 
-	/// Build the internal KD-tree
+	/// Build the internal acceleration data structure
 	void configure();
 
 	/// Add a child object
@@ -59,9 +60,22 @@ public:
 	/// Returns the surface area
 	Float getSurfaceArea() const;
 
-	/// Return a pointer to the internal KD-tree
+	/// Return a pointer to the internal KD-tree (or \c NULL when a BVH is used)
 	inline const ShapeKDTree *getKDTree() const { return m_kdtree.get(); }
 
+	/// Return a pointer to the internal BVH (or \c NULL when a KD-tree is used)
+	inline const ShapeBVH *getBVH() const { return m_bvh.get(); }
+
+	/// Return the grouped shapes
+	inline const std::vector<const Shape *> &getShapes() const {
+		return m_bvh.get() ? m_bvh->getShapes() : m_kdtree->getShapes();
+	}
+
+	/// Return an axis-aligned bounding box of the grouped shapes
+	inline const AABB &getGroupAABB() const {
+		return m_bvh.get() ? m_bvh->getAABB() : m_kdtree->getAABB();
+	}
+
 	/// Return the primitive count of the nested shapes
 	size_t getPrimitiveCount() const;
 
@@ -74,6 +88,7 @@ public:
 	MTS_DECLARE_CLASS()
 private:
 	ref<ShapeKDTree> m_kdtree;
+	ref<ShapeBVH> m_bvh;
 };
 
 MTS_NAMESPACE_END
@@ -0,0 +1,244 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__TEXTPARSE_H)
+#define __TEXTPARSE_H
+
+#include <mitsuba/mitsuba.h>
+#include <cstring>
+
+MTS_NAMESPACE_BEGIN
+
+/**
+ * \brief Helper functions for parsing memory-mapped text files
+ * (used by the ASCII PLY and Wavefront OBJ loaders)
+ *
+ * All functions operate on a character range <tt>[ptr, end)</tt>, which
+ * need not be null-terminated. This makes it possible to parse a file in
+ * several independent chunks, each on its own thread.
+ */
+namespace textparse {
+	/// Is \c c a whitespace character that separates tokens on a line?
+	inline bool isSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+	}
+
+	inline bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	/// Skip whitespace characters (but not line breaks)
+	inline void skipSpaces(const char *&ptr, const char *end) {
+		while (ptr < end && isSpace(*ptr))
+			++ptr;
+	}
+
+	/// Return a pointer to the character following the next line break
+	inline const char *nextLine(const char *ptr, const char *end) {
+		const char *nl = (const char *) memchr(ptr, '\n', end - ptr);
+		return nl ? nl + 1 : end;
+	}
+
+	/// Return a pointer to the end of the current line (excluding the line break)
+	inline const char *lineEnd(const char *ptr, const char *end) {
+		const char *nl = (const char *) memchr(ptr, '\n', end - ptr);
+		return nl ? nl : end;
+	}
+
+	/// Count the number of lines in a character range
+	inline size_t countLines(const char *ptr, const char *end) {
+		size_t count = 0;
+		while (ptr < end) {
+			const char *nl = (const char *) memchr(ptr, '\n', end - ptr);
+			if (!nl)
+				return count + 1;
+			++count;
+			ptr = nl + 1;
+		}
+		return count;
+	}
+
+	/**
+	 * \brief Does the line break at \c nl continue the line
+	 * (i.e. is it preceded by a backslash and optional whitespace)?
+	 */
+	inline bool isContinued(const char *start, const char *nl) {
+		const char *ptr = nl;
+		while (ptr > start && isSpace(ptr[-1]))
+			--ptr;
+		return ptr > start && ptr[-1] == '\\';
+	}
+
+	/**
+	 * \brief Split the character range <tt>[start, end)</tt> into
+	 * \c chunkCount parts of roughly equal size, which all begin
+	 * at the start of a line.
+	 *
+	 * \param continuation
+	 *    When set to \c true, line breaks preceded by a backslash
+	 *    do not terminate a line.
+	 * \return A list of <tt>chunkCount+1</tt> pointers, where chunk \c i
+	 *    covers the range <tt>[result[i], result[i+1])</tt>. Chunks
+	 *    may be empty.
+	 */
+	inline std::vector<const char *> splitLines(const char *start,
+			const char *end, size_t chunkCount, bool continuation = false) {
+		std::vector<const char *> result(chunkCount + 1);
+		size_t size = end - start;
+		result[0] = start;
+		for (size_t i=1; i<chunkCount; ++i) {
+			const char *ptr = std::max(start + (size * i) / chunkCount, result[i-1]);
+			while (ptr < end && ptr > start && (ptr[-1] != '\n' ||
+					(continuation && isContinued(start, ptr - 1))))
+				ptr = nextLine(ptr, end);
+			result[i] = ptr;
+		}
+		result[chunkCount] = end;
+		return result;
+	}
+
+	/**
+	 * \brief Parse an integer and advance \c ptr past it
+	 *
+	 * Leading whitespace is skipped. Returns \c false if no
+	 * number could be found at this position.
+	 */
+	inline bool parseInt(const char *&ptr, const char *end, int64_t &value) {
+		const char *p = ptr;
+		skipSpaces(p, end);
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		if (p == end || !isDigit(*p))
+			return false;
+		int64_t result = 0;
+		while (p < end && isDigit(*p))
+			result = result * 10 + (*p++ - '0');
+		value = negative ? -result : result;
+		ptr = p;
+		return true;
+	}
+
+	/**
+	 * \brief Parse a floating point number and advance \c ptr past it
+	 *
+	 * Leading whitespace is skipped. Numbers with at most 15 significant
+	 * digits and small exponents (i.e. practically all numbers found in
+	 * mesh files) are converted exactly using a fast path. Everything else
+	 * (including \c inf and \c nan) is passed on to \c strtod().
+	 * Returns \c false if no number could be found at this position.
+	 */
+	inline bool parseFloat(const char *&ptr, const char *end, double &value) {
+		static const double powersOf10[] = {
+			1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+			1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+			1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+		};
+
+		skipSpaces(ptr, end);
+		const char *p = ptr;
+		bool negative = false, anyDigits = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+
+		uint64_t mantissa = 0;
+		int digits = 0, exponent = 0;
+		while (p < end && isDigit(*p)) {
+			if (digits < 18) {
+				mantissa = mantissa * 10 + (*p - '0');
+				digits += mantissa != 0 ? 1 : 0;
+			} else {
+				++exponent;
+				digits++;
+			}
+			++p; anyDigits = true;
+		}
+		if (p < end && *p == '.') {
+			++p;
+			while (p < end && isDigit(*p)) {
+				if (digits < 18) {
+					mantissa = mantissa * 10 + (*p - '0');
+					digits += mantissa != 0 ? 1 : 0;
+					--exponent;
+				} else {
+					digits++;
+				}
+				++p; anyDigits = true;
+			}
+		}
+		if (anyDigits && p < end && (*p == 'e' || *p == 'E')) {
+			const char *q = p + 1;
+			bool negativeExp = false;
+			if (q < end && (*q == '-' || *q == '+'))
+				negativeExp = *q++ == '-';
+			if (q < end && isDigit(*q)) {
+				int exp = 0;
+				while (q < end && isDigit(*q)) {
+					if (exp < 10000)
+						exp = exp * 10 + (*q - '0');
+					++q;
+				}
+				exponent += negativeExp ? -exp : exp;
+				p = q;
+			}
+		}
+
+		if (anyDigits && digits <= 15 && exponent >= -22 && exponent <= 22
+				&& (p == end || isSpace(*p) || *p == '\n' || *p == '/')) {
+			/* Both the mantissa and the power of ten are exactly
+			   representable, hence the result is correctly rounded */
+			double result = (double) mantissa;
+			if (exponent < 0)
+				result /= powersOf10[-exponent];
+			else
+				result *= powersOf10[exponent];
+			value = negative ? -result : result;
+			ptr = p;
+			return true;
+		}
+
+		/* Slow path: copy the token into a null-terminated buffer */
+		char buf[128];
+		size_t length = 0;
+		p = ptr;
+		while (p < end && !isSpace(*p) && *p != '\n' && *p != '/'
+				&& length < sizeof(buf) - 1)
+			buf[length++] = *p++;
+		buf[length] = '\0';
+		char *endPtr = NULL;
+		double result = std::strtod(buf, &endPtr);
+		if (endPtr == buf)
+			return false;
+		value = result;
+		ptr += endPtr - buf;
+		return true;
+	}
+
+	/// Parse a floating point number into a single precision variable
+	inline bool parseFloat(const char *&ptr, const char *end, float &value) {
+		double temp;
+		if (!parseFloat(ptr, end, temp))
+			return false;
+		value = (float) temp;
+		return true;
+	}
+} /* namespace textparse */
+
+MTS_NAMESPACE_END
+
+#endif /* __TEXTPARSE_H */
@@ -1515,9 +1515,11 @@ public:
 					if (currNode->isLeaf()) {
 						/// Index number format (max 2^32 prims)
 						const uint32_t primEnd = currNode->getPrimEnd();
+						uint32_t globalIdx = 0;
 						for (uint32_t entry = currNode->getPrimStart();
-							 entry < primEnd; entry++) {
-							uint32_t primIdx = scene->getKDTree()->getIndices()[entry];
+							 entry < primEnd; ) {
+							globalIdx = scene->getKDTree()->nextPrimitive(entry, globalIdx);
+							uint32_t primIdx = globalIdx;
 							uint32_t shapeIdx = scene->getKDTree()->findShape(primIdx);
 							if (its.shape ==
 								scene->getKDTree()->getShapes()[shapeIdx]) {
@@ -1667,6 +1669,9 @@ public:
 				MTS_CLASS(SamplingIntegrator)))
 			Log(EError, "The single scattering pluging requires "
 						"a sampling-based surface integrator!");
+		if (!m_fastSingleScatter && scene->getAccelerator() != Scene::EKDTree)
+			Log(EError, "fastSingleScatter=false traverses the kd-tree directly "
+						"and requires accelerator=\"kdtree\"!");
 		return true;
 	}
 
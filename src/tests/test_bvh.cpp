@@ -0,0 +1,144 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/render/testcase.h>
+#include <mitsuba/render/skdtree.h>
+#include <mitsuba/render/shapebvh.h>
+#include "../shapes/instance.h"
+
+MTS_NAMESPACE_BEGIN
+
+class TestBVH : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_twoLevelHits)
+	MTS_END_TESTCASE()
+
+	ref<Shape> createShape(const std::string &pluginName, const Transform &trafo) {
+		Properties props(pluginName);
+		props.setTransform("toWorld", trafo);
+		ref<Shape> shape = static_cast<Shape *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(Shape), props));
+		return shape;
+	}
+
+	/// Random rigid transformation within [-10, 10]^3
+	Transform randomTransform(Random *random) {
+		Vector axis = warp::squareToUniformSphere(Point2(random->nextFloat(), random->nextFloat()));
+		return Transform::translate(Vector(
+				random->nextFloat(), random->nextFloat(), random->nextFloat()) * 20 - Vector(10.0f))
+			* Transform::rotate(axis, random->nextFloat() * 360);
+	}
+
+	ref<ShapeKDTree> buildKDTree(const std::vector<ref<Shape> > &shapes) {
+		ref<ShapeKDTree> kdtree = new ShapeKDTree();
+		kdtree->setLogLevel(ETrace);
+		for (size_t i=0; i<shapes.size(); ++i)
+			kdtree->addShape(shapes[i].get());
+		kdtree->build();
+		return kdtree;
+	}
+
+	/// Compare the closest hits of both acceleration data structures
+	void compareHits(const ShapeKDTree *kdtree, const ShapeBVH *bvh, Random *random) {
+		const size_t nRays = 100000;
+		BSphere bsphere = kdtree->getAABB().getBSphere();
+		size_t nHits = 0, nMismatches = 0;
+
+		for (size_t i=0; i<nRays; ++i) {
+			Point p1 = bsphere.center + warp::squareToUniformSphere(
+				Point2(random->nextFloat(), random->nextFloat())) * bsphere.radius;
+			Point p2 = bsphere.center + warp::squareToUniformSphere(
+				Point2(random->nextFloat(), random->nextFloat())) * bsphere.radius * 0.5f;
+			Ray ray(p1, normalize(p2-p1), 0.0f);
+
+			Intersection its1, its2;
+			bool hit1 = kdtree->rayIntersect(ray, its1),
+			     hit2 = bvh->rayIntersect(ray, its2);
+
+			if (hit1 != hit2 || (hit1 && (its1.shape != its2.shape ||
+					std::abs(its1.t - its2.t) > 1e-3f * std::max(its1.t, (Float) 1))))
+				++nMismatches;
+			if (hit1)
+				++nHits;
+		}
+
+		Log(EInfo, "  " SIZE_T_FMT " of " SIZE_T_FMT " rays hit, " SIZE_T_FMT
+			" mismatches", nHits, nRays, nMismatches);
+		assertTrue(nHits > nRays / 10);
+
+		/* Allow for rays grazing triangle edges */
+		assertTrue(nMismatches <= nRays / 10000);
+	}
+
+	void test01_twoLevelHits() {
+		ref<Random> random = new Random();
+
+		/* Shape group containing two cubes */
+		Properties groupProps("shapegroup");
+		groupProps.setString("accelerator", "bvh");
+		ref<Shape> group = static_cast<Shape *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(Shape), groupProps));
+		for (int i=0; i<2; ++i) {
+			ref<Shape> cube = createShape("cube",
+				Transform::translate(Vector(0, 0, 2.5f * i)) * Transform::scale(Vector(0.5f)));
+			cube->configure();
+			group->addChild(cube);
+		}
+		group->configure();
+
+		/* Many instances and a non-instanced mesh */
+		std::vector<ref<Shape> > shapes;
+		std::vector<Instance *> instances;
+		for (int i=0; i<500; ++i) {
+			ref<Shape> instance = createShape("instance", randomTransform(random));
+			instance->addChild(group);
+			instance->configure();
+			assertTrue(instance->isInstance());
+			instances.push_back(static_cast<Instance *>(instance.get()));
+			shapes.push_back(instance);
+		}
+		ref<Shape> mesh = createShape("cube", Transform::scale(Vector(3.0f)));
+		mesh->configure();
+		assertFalse(mesh->isInstance());
+		shapes.push_back(mesh);
+
+		ref<ShapeBVH> bvh = new ShapeBVH();
+		bvh->setTwoLevel(true);
+		for (size_t i=0; i<shapes.size(); ++i)
+			bvh->addShape(shapes[i].get());
+		bvh->build();
+		assertTrue(bvh->getInstanceBVH() != NULL);
+		assertTrue(bvh->getInstanceBVH()->getShapes().size() == instances.size());
+
+		Log(EInfo, "Comparing the two-level BVH against the kd-tree");
+		compareHits(buildKDTree(shapes), bvh, random);
+
+		/* Move half of the instances and only rebuild the top level */
+		for (size_t i=0; i<instances.size(); i += 2)
+			instances[i]->setWorldTransform(new AnimatedTransform(randomTransform(random)));
+		bvh->updateInstances();
+
+		Log(EInfo, "Comparing again after moving half of the instances");
+		compareHits(buildKDTree(shapes), bvh, random);
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestBVH, "Testcase for the bounding volume hierarchy")
+MTS_NAMESPACE_END
@@ -0,0 +1,112 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/version.h>
+#include <mitsuba/render/testcase.h>
+#include <mitsuba/render/scene.h>
+#include <mitsuba/render/texture.h>
+#include <boost/filesystem/operations.hpp>
+
+MTS_NAMESPACE_BEGIN
+
+class TestMIPMap : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_sharedCacheFile)
+	MTS_END_TESTCASE()
+
+	void checkTextures(const Scene *scene, const Texture2D *reference, int textureCount) {
+		const ref_vector<ConfigurableObject> &objects = scene->getReferencedObjects();
+		int found = 0;
+
+		for (size_t i=0; i<objects.size(); ++i) {
+			if (!objects[i]->getClass()->derivesFrom(MTS_CLASS(Texture2D)))
+				continue;
+			const Texture2D *texture = static_cast<const Texture2D *>(objects[i].get());
+			assertEqualsEpsilon(texture->getAverage(), reference->getAverage(), 1e-5f);
+			for (int j=0; j<16; ++j) {
+				Point2 uv((j % 4 + 0.5f) / 4, (j / 4 + 0.5f) / 4);
+				assertEqualsEpsilon(texture->eval(uv), reference->eval(uv), 1e-5f);
+			}
+			++found;
+		}
+
+		assertEquals(found, textureCount);
+		assertTrue(scene->getEnvironmentEmitter() != NULL);
+	}
+
+	void test01_sharedCacheFile() {
+		/* Write a small image whose MIP map cache file is shared by
+		   several textures and an environment map */
+		const Vector2i size(64, 32);
+		ref<Bitmap> bitmap = new Bitmap(Bitmap::ERGB, Bitmap::EFloat32, size);
+		float *data = bitmap->getFloat32Data();
+		for (int y=0; y<size.y; ++y) {
+			for (int x=0; x<size.x; ++x) {
+				*data++ = (float) x / size.x;
+				*data++ = (float) y / size.y;
+				*data++ = (float) ((x ^ y) & 7) / 8;
+			}
+		}
+		bitmap->setGamma(1.0f);
+
+		fs::path filename = fs::temp_directory_path() / fs::unique_path("mts-%%%%-%%%%.pfm");
+		fs::path cacheFile = filename;
+		cacheFile.replace_extension(".mip");
+		bitmap->write(Bitmap::EPFM, filename);
+
+		/* Reference texture that doesn't use a cache file */
+		Properties props("bitmap");
+		props.setString("filename", filename.string());
+		props.setBoolean("cache", false);
+		ref<Texture2D> reference = static_cast<Texture2D *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(Texture), props));
+		reference->configure();
+
+		/* The loader constructs these plugins on several threads at once */
+		const int textureCount = 8;
+		std::ostringstream oss;
+		oss << "<scene version=\"" << MTS_VERSION << "\">" << endl;
+		for (int i=0; i<textureCount; ++i) {
+			oss << "\t<texture type=\"bitmap\" id=\"tex" << i << "\">" << endl
+			    << "\t\t<string name=\"filename\" value=\"" << filename.string() << "\"/>" << endl
+			    << "\t\t<boolean name=\"cache\" value=\"true\"/>" << endl
+			    << "\t</texture>" << endl;
+		}
+		oss << "\t<emitter type=\"envmap\">" << endl
+		    << "\t\t<string name=\"filename\" value=\"" << filename.string() << "\"/>" << endl
+		    << "\t\t<boolean name=\"cache\" value=\"true\"/>" << endl
+		    << "\t</emitter>" << endl
+		    << "</scene>" << endl;
+
+		/* The first load generates the cache file, the second one reuses it */
+		for (int i=0; i<2; ++i) {
+			ref<Scene> scene = loadSceneFromString(oss.str());
+			assertTrue(fs::exists(cacheFile));
+			checkTextures(scene, reference, textureCount);
+		}
+
+		reference = NULL;
+		fs::remove(cacheFile);
+		fs::remove(filename);
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestMIPMap, "Testcase for shared MIP map cache files")
+MTS_NAMESPACE_END
@@ -0,0 +1,92 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/fstream.h>
+#include <mitsuba/render/testcase.h>
+#include <mitsuba/render/trimesh.h>
+#include <boost/filesystem/operations.hpp>
+
+MTS_NAMESPACE_BEGIN
+
+class TestSerialized : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_mappedInstances)
+	MTS_END_TESTCASE()
+
+	ref<TriMesh> loadShape(const fs::path &filename, const Transform &trafo) {
+		Properties props("serialized");
+		props.setString("filename", filename.string());
+		props.setInteger("shapeIndex", 0);
+		props.setTransform("toWorld", trafo);
+		ref<TriMesh> mesh = static_cast<TriMesh *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(TriMesh), props));
+		mesh->configure();
+		return mesh;
+	}
+
+	void test01_mappedInstances() {
+		/* Write a single triangle to an uncompressed (memory-mappable) file */
+		ref<TriMesh> triangle = new TriMesh("triangle", 1, 3, true);
+		Point *positions = triangle->getVertexPositions();
+		Normal *normals = triangle->getVertexNormals();
+		Triangle *triangles = triangle->getTriangles();
+		positions[0] = Point(0, 0, 0);
+		positions[1] = Point(1, 0, 0);
+		positions[2] = Point(0, 1, 0);
+		for (int i=0; i<3; ++i) {
+			normals[i] = Normal(0, 0, 1);
+			triangles[0].idx[i] = i;
+		}
+
+		fs::path filename = fs::temp_directory_path() / fs::unique_path("mts-%%%%-%%%%.serialized");
+		ref<FileStream> stream = new FileStream(filename, FileStream::ETruncReadWrite);
+		stream->setByteOrder(Stream::ELittleEndian);
+		triangle->serializeUncompressed(stream);
+		stream->close();
+
+		/* Load the same sub-shape several times on this thread, which
+		   makes all of them use the same file mapping */
+		const Transform trafo1 = Transform::translate(Vector(1, 0, 0)),
+		                trafo2 = Transform::scale(Vector(-1, 2, 1));
+		ref<TriMesh> mesh1 = loadShape(filename, trafo1);
+		ref<TriMesh> mesh2 = loadShape(filename, trafo2);
+		ref<TriMesh> mesh3 = loadShape(filename, Transform());
+
+		for (int i=0; i<3; ++i) {
+			assertEquals(mesh1->getVertexPositions()[i], trafo1(positions[i]));
+			assertEquals(mesh2->getVertexPositions()[i], trafo2(positions[i]));
+			assertEquals(mesh3->getVertexPositions()[i], positions[i]);
+			assertEquals(Vector(mesh1->getVertexNormals()[i]), Vector(0, 0, 1));
+			assertEquals(Vector(mesh3->getVertexNormals()[i]), Vector(0, 0, 1));
+			assertTrue(mesh1->getTriangles()[0].idx[i] == (uint32_t) i);
+			assertTrue(mesh3->getTriangles()[0].idx[i] == (uint32_t) i);
+		}
+
+		/* The mirroring transformation must only change the winding order of mesh2 */
+		assertTrue(mesh2->getTriangles()[0].idx[0] == 1);
+		assertTrue(mesh2->getTriangles()[0].idx[1] == 0);
+
+		mesh1 = mesh2 = mesh3 = NULL;
+		fs::remove(filename);
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestSerialized, "Testcase for the serialized mesh loader")
+MTS_NAMESPACE_END
@@ -0,0 +1,119 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/random.h>
+#include <mitsuba/render/testcase.h>
+#include <mitsuba/render/volume.h>
+
+MTS_NAMESPACE_BEGIN
+
+/// Density that is linear in volume space, so that trilinear interpolation is exact
+class LinearVolume : public VolumeDataSource {
+public:
+	LinearVolume() : VolumeDataSource(Properties("linear")) {
+		m_aabb = AABB(Point(0.0f), Point(1.0f));
+	}
+
+	static Float eval(const Point &p) {
+		return 1 + p.x + 2*p.y + 3*p.z;
+	}
+
+	bool supportsFloatLookups() const { return true; }
+	Float lookupFloat(const Point &p) const { return eval(p); }
+	Float getStepSize() const { return 1.0f / 32; }
+	Float getMaximumFloatValue() const { return 7.0f; }
+};
+
+class TestVolumeCache : public TestCase {
+public:
+	MTS_BEGIN_TESTCASE()
+	MTS_DECLARE_TEST(test01_transformedLookups)
+	MTS_END_TESTCASE()
+
+	/// Looks up random points and records the largest error
+	class LookupThread : public Thread {
+	public:
+		LookupThread(const VolumeDataSource *cache, const Transform &trafo, int index)
+			: Thread(formatString("lookup%i", index)), m_cache(cache),
+			  m_trafo(trafo), m_random(new Random((uint64_t) index)), m_maxError(0) { }
+
+		void run() {
+			for (int i=0; i<20000; ++i) {
+				Point p(0.05f + 0.9f * m_random->nextFloat(),
+					0.05f + 0.9f * m_random->nextFloat(),
+					0.05f + 0.9f * m_random->nextFloat());
+				Float error = std::abs(m_cache->lookupFloat(m_trafo(p)) - LinearVolume::eval(p));
+				m_maxError = std::max(m_maxError, error);
+			}
+		}
+
+		inline Float getMaxError() const { return m_maxError; }
+	protected:
+		virtual ~LookupThread() { }
+	private:
+		const VolumeDataSource *m_cache;
+		Transform m_trafo;
+		ref<Random> m_random;
+		Float m_maxError;
+	};
+
+	ref<VolumeDataSource> createCache(const Transform &trafo, int64_t memoryLimit) {
+		Properties props("volcache");
+		props.setTransform("toWorld", trafo);
+		props.setLong("memoryLimit", memoryLimit);
+		ref<VolumeDataSource> cache = static_cast<VolumeDataSource *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(VolumeDataSource), props));
+		cache->addChild("", new LinearVolume());
+		cache->configure();
+		return cache;
+	}
+
+	Float runLookups(const VolumeDataSource *cache, const Transform &trafo, int threadCount) {
+		ref_vector<LookupThread> threads;
+		for (int i=0; i<threadCount; ++i) {
+			threads.push_back(new LookupThread(cache, trafo, i));
+			threads[i]->start();
+		}
+
+		Float maxError = 0;
+		for (int i=0; i<threadCount; ++i) {
+			threads[i]->join();
+			maxError = std::max(maxError, threads[i]->getMaxError());
+		}
+		return maxError;
+	}
+
+	void test01_transformedLookups() {
+		const Transform trafo = Transform::translate(Vector(2, -1, 3))
+			* Transform::rotate(Vector(1, 1, 0), 30);
+
+		/* Cached path: a single thread with enough memory for all blocks */
+		ref<VolumeDataSource> cache = createCache(trafo, 1024);
+		assertEqualsEpsilon(runLookups(cache, trafo, 1), (Float) 0, 1e-3f);
+
+		/* A memory limit of zero leaves a single block, so that concurrent
+		   lookups frequently fall back to the nested data source */
+		cache = createCache(trafo, 0);
+		assertEqualsEpsilon(runLookups(cache, trafo,
+			std::max(8, getCoreCount())), (Float) 0, 1e-3f);
+	}
+};
+
+MTS_EXPORT_TESTCASE(TestVolumeCache, "Testcase for the volume cache")
+MTS_NAMESPACE_END
@@ -155,6 +155,18 @@ MTS_NAMESPACE_BEGIN
  *    Mitsuba is able to work with truly massive textures that would otherwise exhaust the main system memory.
  * \end{enumerate}
  *
+ * When rendering scenes with many large textures, the amount of texture memory can
+ * furthermore be bounded using the \code{textureMemory} parameter of the scene or
+ * the \code{-m} command line parameter of \code{mitsuba} (both specified in MiB).
+ * The cache is shared by the whole process, hence the scene parameter overrides
+ * \code{-m} while the scene is loaded; the previous limit is restored afterwards.
+ * In this case, MIP maps backed by a cache file are split into tiles of
+ * $64\times 64$ texels, which are loaded on demand into a shared cache. When the cache
+ * exceeds the given size, the least recently used tiles are discarded.
+ * Textures without a cache file (by default, those with at most 1M pixels) are kept
+ * in memory and do not count towards this limit. Set \code{cache} to \code{true}
+ * to page them as well.
+ *
  * The texture caches are automatically regenerated when the input texture is modified.
  * Of course, the cache files can be cumbersome when they are not needed anymore. On Linux
  * or Mac OS, they can safely be deleted by executing the following command within a scene directory.
@@ -207,7 +219,7 @@ public:
 			else
 				cacheFile.replace_extension(formatString(".%s.mip", m_channel.c_str()));
 
-			tryReuseCache = fs::exists(cacheFile) && props.getBoolean("cache", true);
+			tryReuseCache = props.getBoolean("cache", true);
 		}
 
 		std::string filterType = boost::to_lower_copy(props.getString("filterType", "ewa"));
@@ -234,6 +246,11 @@ public:
 		if (m_filterType != EEWA)
 			m_maxAnisotropy = 1.0f;
 
+		/* Other plugins that are constructed concurrently may use the same
+		   cache file -- hold its lock until the MIP map has been created */
+		MIPMapCacheLock cacheLock(cacheFile);
+		tryReuseCache = tryReuseCache && fs::exists(cacheFile);
+
 		if (tryReuseCache && MIPMap3::validateCacheFile(cacheFile, timestamp,
 				Bitmap::ERGB, m_wrapModeU, m_wrapModeV, m_filterType, m_gamma)) {
 			/* Reuse an existing MIP map cache file */
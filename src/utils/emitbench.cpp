@@ -0,0 +1,184 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/util.h>
+#include <mitsuba/render/emitter.h>
+#include <mitsuba/core/timer.h>
+#include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/random.h>
+#if defined(WIN32)
+#include <mitsuba/core/getopt.h>
+#endif
+
+MTS_NAMESPACE_BEGIN
+
+class EmitBench : public Utility {
+public:
+	void help() {
+		cout << endl;
+		cout << "Synopsis: Environment map sampling benchmark. Loads an environment map" << endl;
+		cout << "using both supported sampling methods (inversion and alias tables) and" << endl;
+		cout << "reports the number of direction samples per second. Following this, it" << endl;
+		cout << "estimates the irradiance arriving at an upward-facing surface using both" << endl;
+		cout << "independent and stratified samples and reports the relative variance of" << endl;
+		cout << "the resulting estimates." << endl;
+		cout << endl;
+		cout << "Usage: mtsutil emitbench [options] <Environment map image>" << endl;
+		cout << "Options/Arguments:" << endl;
+		cout << "   -h             Display this help text" << endl << endl;
+		cout << "   -t count       Number of samples used to measure throughput" << endl;
+		cout << "                  (default: 10000000)" << endl << endl;
+		cout << "   -n count       Number of samples per irradiance estimate. When" << endl;
+		cout << "                  stratifying, this is rounded to a square number" << endl;
+		cout << "                  (default: 64)" << endl << endl;
+		cout << "   -r count       Number of irradiance estimates used to compute" << endl;
+		cout << "                  the variance (default: 10000)" << endl << endl;
+	}
+
+	ref<Emitter> createEmitter(const fs::path &path, const std::string &method) {
+		Properties props("envmap");
+		props.setString("filename", path.string());
+		props.setString("sampling", method);
+		ref<Emitter> emitter = static_cast<Emitter *> (PluginManager::getInstance()->
+			createObject(MTS_CLASS(Emitter), props));
+		emitter->configure();
+		return emitter;
+	}
+
+	/// Sample \c count directions and return the elapsed time in milliseconds
+	Float benchThroughput(const Emitter *emitter, const std::vector<Point2> &samples,
+			size_t count, Float &checksum) {
+		DirectionSamplingRecord dRec;
+		PositionSamplingRecord pRec(0.0f);
+		ref<Timer> timer = new Timer();
+		Float sum = 0;
+		for (size_t i=0; i<count; ++i) {
+			Spectrum weight = emitter->sampleDirection(dRec, pRec,
+				samples[i % samples.size()], NULL);
+			sum += weight[0] + dRec.d.y;
+		}
+		checksum = sum;
+		return (Float) timer->getMilliseconds();
+	}
+
+	/// Compute the mean and relative variance of irradiance estimates
+	void benchVariance(const Emitter *emitter, int sampleCount, int runs,
+			bool stratified, Float &mean, Float &relVariance) {
+		ref<Random> random = new Random();
+		DirectionSamplingRecord dRec;
+		PositionSamplingRecord pRec(0.0f);
+		int res = std::max(1, (int) std::sqrt((Float) sampleCount));
+		if (stratified)
+			sampleCount = res*res;
+		Float invRes = 1 / (Float) res;
+
+		double sum = 0, sumSqr = 0;
+		for (int run=0; run<runs; ++run) {
+			double estimate = 0;
+			for (int i=0; i<sampleCount; ++i) {
+				Point2 sample(random->nextFloat(), random->nextFloat());
+				if (stratified)
+					sample = Point2(((i % res) + sample.x) * invRes,
+						((i / res) + sample.y) * invRes);
+
+				Spectrum weight = emitter->sampleDirection(dRec, pRec, sample, NULL);
+				/* dRec.d points away from the environment */
+				estimate += weight.getLuminance() * std::max((Float) 0, -dRec.d.y);
+			}
+			estimate /= sampleCount;
+			sum += estimate;
+			sumSqr += estimate*estimate;
+		}
+		mean = (Float) (sum / runs);
+		Float variance = (Float) (sumSqr / runs) - mean*mean;
+		relVariance = mean > 0 ? std::max((Float) 0, variance) / (mean*mean) : (Float) 0;
+	}
+
+	int run(int argc, char **argv) {
+		ref<FileResolver> fileResolver = Thread::getThread()->getFileResolver();
+		int optchar;
+		char *end_ptr = NULL;
+		size_t throughputCount = 10000000;
+		int sampleCount = 64, runs = 10000;
+		optind = 1;
+
+		/* Parse command-line arguments */
+		while ((optchar = getopt(argc, argv, "t:n:r:h")) != -1) {
+			switch (optchar) {
+				case 'h': {
+						help();
+						return 0;
+					}
+					break;
+				case 't':
+					throughputCount = (size_t) strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || throughputCount == 0)
+						SLog(EError, "Could not parse the throughput sample count!");
+					break;
+				case 'n':
+					sampleCount = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || sampleCount <= 0)
+						SLog(EError, "Could not parse the sample count!");
+					break;
+				case 'r':
+					runs = strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || runs <= 1)
+						SLog(EError, "Could not parse the number of runs!");
+					break;
+			};
+		}
+
+		if (optind == argc || optind+1 < argc) {
+			help();
+			return 0;
+		}
+
+		fs::path path = fileResolver->resolve(argv[optind]);
+
+		/* Pregenerate random numbers so that they don't affect the timings */
+		ref<Random> random = new Random();
+		std::vector<Point2> samples(1 << 16);
+		for (size_t i=0; i<samples.size(); ++i)
+			samples[i] = Point2(random->nextFloat(), random->nextFloat());
+
+		const char *methods[] = { "inversion", "alias" };
+		for (int i=0; i<2; ++i) {
+			ref<Emitter> emitter = createEmitter(path, methods[i]);
+			Float checksum = 0, mean, relVariance;
+
+			Float ms = benchThroughput(emitter, samples, throughputCount, checksum);
+			SLog(EInfo, "%s: %.2f million samples/sec (checksum %f)", methods[i],
+				throughputCount / (ms * (Float) 1000), checksum);
+
+			benchVariance(emitter, sampleCount, runs, false, mean, relVariance);
+			SLog(EInfo, "%s: independent samples: mean irradiance %f, relative variance %f",
+				methods[i], mean, relVariance);
+			benchVariance(emitter, sampleCount, runs, true, mean, relVariance);
+			SLog(EInfo, "%s: stratified samples: mean irradiance %f, relative variance %f",
+				methods[i], mean, relVariance);
+		}
+
+		return 0;
+	}
+
+	MTS_DECLARE_UTILITY()
+};
+
+MTS_EXPORT_UTILITY(EmitBench, "Environment map sampling benchmark")
+MTS_NAMESPACE_END
@@ -20,6 +20,7 @@
 #include <mitsuba/core/timer.h>
 #include <mitsuba/core/fresolver.h>
 #include <mitsuba/core/plugin.h>
+#include <mitsuba/core/statistics.h>
 #include <boost/algorithm/string.hpp>
 #if defined(WIN32)
 #include <mitsuba/core/getopt.h>
@@ -31,10 +32,13 @@ class KDBench : public Utility {
 public:
 	void help() {
 		cout << endl;
-		cout << "Synopsis: kd-tree performance benchmark. Traces uniformly distributed rays" << endl;
-		cout << "though the bounding sphere of a scene and reports the resulting number of" << endl;
-		cout << "rays per second. The main intent of this utility is to optimize the kd-tree" << endl;
-		cout << "construction parameters for particular scenes and machines." << endl;
+		cout << "Synopsis: kd-tree performance benchmark. Reports construction statistics" << endl;
+		cout << "(build time, memory usage and SAH cost), then traces uniformly distributed" << endl;
+		cout << "rays though the bounding sphere of a scene and reports the resulting number" << endl;
+		cout << "of rays per second. For scenes containing hair shapes, the number of ray-" << endl;
+		cout << "segment intersection tests per second is reported as well. The main intent" << endl;
+		cout << "of this utility is to optimize the kd-tree construction parameters for" << endl;
+		cout << "particular scenes and machines." << endl;
 		cout << endl;
 		cout << "Usage: mtsutil kdbench [options] <Scene XML file or PLY file>" << endl;
 		cout << "Options/Arguments:" << endl;
@@ -46,6 +50,8 @@ public:
 		cout << "   -c true/false  Enable/disable primitive clipping (aka. \"perfect splits\")" << endl << endl;
 		cout << "   -p true/false  Enable/disable parallel tree construction" << endl << endl;
 		cout << "   -r true/false  Enable/disable retraction of bad splits" << endl << endl;
+		cout << "   -m true/false  Enable/disable compact storage (compressed index lists," << endl;
+		cout << "                  no precomputed triangle data)" << endl << endl;
 		cout << "   -l value       Specify the primitive count, below which a leaf node" << endl;
 		cout << "                  will always be created" << endl << endl;
 		cout << "   -d depth       Specify the maximum tree depth" << endl << endl;
@@ -55,6 +61,8 @@ public:
 		cout << "                  optimization method." << endl << endl;
 		cout << "   -f             Try to empirically find the best SAH cost values by" << endl;
 		cout << "                  fitting the cost model to collected performance data" << endl << endl;
+		cout << "   -s             Only build the tree and report construction statistics" << endl;
+		cout << "                  (skips the ray tracing benchmark)" << endl << endl;
 		cout << "Examples:" << endl;
 		cout << "  E.g. to build a tree for the Stanford bunny having a low SAH cost, type " << endl << endl;
 		cout << "  $ mtsutil kdbench -e .9 -l1 -d48 -x100000 data/tests/bunny.ply" << endl << endl;
@@ -71,10 +79,12 @@ public:
 		Float intersectionCost = -1, traversalCost = -1, emptySpaceBonus = -1;
 		int stopPrims = -1, maxDepth = -1, exactPrims = -1, minMaxBins = -1;
 		bool clip = true, parallel = true, retract = true, fitParameters = false;
+		bool compact = false;
+		bool buildOnly = false;
 		optind = 1;
 
 		/* Parse command-line arguments */
-		while ((optchar = getopt(argc, argv, "i:t:e:c:p:r:l:x:b:d:hf")) != -1) {
+		while ((optchar = getopt(argc, argv, "i:t:e:c:p:r:m:l:x:b:d:hfs")) != -1) {
 			switch (optchar) {
 				case 'h': {
 						help();
@@ -84,6 +94,9 @@ public:
 				case 'f':
 					fitParameters = true;
 					break;
+				case 's':
+					buildOnly = true;
+					break;
 				case 'i':
 					intersectionCost = (Float) strtod(optarg, &end_ptr);
 					if (*end_ptr != '\0')
@@ -143,6 +156,14 @@ public:
 					else
 						SLog(EError, "Could not parse the retraction parameter!");
 					break;
+				case 'm':
+					if (strcmp(optarg, "true") == 0)
+						compact = true;
+					else if (strcmp(optarg, "false") == 0)
+						compact = false;
+					else
+						SLog(EError, "Could not parse the compact storage parameter!");
+					break;
 			};
 		}
 
@@ -195,6 +216,7 @@ public:
 		kdtree->setClip(clip);
 		kdtree->setRetract(retract);
 		kdtree->setParallelBuild(parallel);
+		kdtree->setCompactStorage(compact);
 
 		/* Show some statistics, and make sure it roughly fits in 80cols */
 		Logger *logger = Thread::getThread()->getLogger();
@@ -207,16 +229,40 @@ public:
 		else
 			kdtree->build();
 
+		size_t nodeStorage = kdtree->getNodeCount() * sizeof(ShapeKDTree::KDNode),
+			   indexStorage = kdtree->getIndexStorageSize(),
+			   totalStorage = kdtree->getMemoryUsage();
+		Log(EInfo, "kd-tree construction statistics:");
+		Log(EInfo, "   Primitives        : %i", kdtree->getPrimitiveCount());
+		Log(EInfo, "   Build time        : %i ms", kdtree->getBuildTime());
+		Log(EInfo, "   Temporary memory  : %s",
+			memString(kdtree->getBuildMemoryUsage()).c_str());
+		Log(EInfo, "   Node storage      : %s", memString(nodeStorage).c_str());
+		Log(EInfo, "   Index storage     : %s%s", memString(indexStorage).c_str(),
+			kdtree->hasCompressedIndices() ? " (compressed)" : "");
+		Log(EInfo, "   Total storage     : %s (%.1f bytes per primitive)",
+			memString(totalStorage).c_str(),
+			totalStorage / (Float) std::max(kdtree->getPrimitiveCount(), (ShapeKDTree::SizeType) 1));
+		Log(EInfo, "   SAH cost          : %.2f", kdtree->getHeuristicCost());
+		Log(EInfo, "");
+
 		BSphere bsphere(kdtree->getAABB().getBSphere());
 		const size_t nRays = 5000000;
 
-		if (!fitParameters) {
+		/* Only available when the 'hair' plugin has been loaded */
+		const StatsCounter *segmentTests = Statistics::getInstance()->getCounter(
+			"Hair", "Segment intersection tests");
+
+		if (buildOnly) {
+			/* Nothing else to do */
+		} else if (!fitParameters) {
 			Log(EInfo, "Bounding sphere: %s", bsphere.toString().c_str());
 			Float best = 0;
 			for (int j=0; j<3; ++j) {
 				ref<Random> random = new Random();
 				ref<Timer> timer = new Timer();
 				size_t nIntersections = 0;
+				uint64_t nSegmentTests = segmentTests ? segmentTests->getValue() : 0;
 
 				Log(EInfo, "Shooting " SIZE_T_FMT " rays (1 thread, incoherent) ..", nRays);
 
@@ -236,6 +282,12 @@ public:
 					nIntersections, timer->getMilliseconds());
 				Float mrays = nRays / (timer->getMilliseconds() * (Float) 1000);
 				Log(EInfo, "-> %.3f MRays/s", mrays);
+				if (segmentTests) {
+					nSegmentTests = segmentTests->getValue() - nSegmentTests;
+					Log(EInfo, "-> %.3f MSegments/s (%.1f hair segment tests per ray)",
+						nSegmentTests / (timer->getMilliseconds() * (Float) 1000),
+						nSegmentTests / (Float) nRays);
+				}
 				Log(EInfo, "");
 				best = std::max(best, mrays);
 			}
@@ -0,0 +1,164 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/util.h>
+#include <mitsuba/render/mipmap.h>
+#include <mitsuba/core/timer.h>
+#include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/fstream.h>
+#include <mitsuba/core/plugin.h>
+#include <mitsuba/core/random.h>
+#if defined(WIN32)
+#include <mitsuba/core/getopt.h>
+#endif
+
+MTS_NAMESPACE_BEGIN
+
+class TexBench : public Utility {
+public:
+	typedef TSpectrum<Float, 3> Color3;
+	typedef TSpectrum<half, 3>  Color3h;
+	typedef TMIPMap<Color3, Color3h> MIPMap3;
+
+	struct Lookup {
+		Point2 uv;
+		Vector2 d0, d1;
+	};
+
+	void help() {
+		cout << endl;
+		cout << "Synopsis: Texture filtering benchmark. Builds a MIP map of the specified" << endl;
+		cout << "image (using half precision storage like the 'bitmap' texture plugin) and" << endl;
+		cout << "performs filtered lookups with randomly chosen anisotropic footprints using" << endl;
+		cout << "each of the supported filter types. Reports the number of lookups per second" << endl;
+		cout << "and the average number of texels accessed by each EWA lookup." << endl;
+		cout << endl;
+		cout << "Usage: mtsutil texbench [options] <Image file>" << endl;
+		cout << "Options/Arguments:" << endl;
+		cout << "   -h             Display this help text" << endl << endl;
+		cout << "   -n count       Number of lookups per filter type (default: 2000000)" << endl << endl;
+		cout << "   -a value       Maximum anisotropy of the EWA filter (default: 20)" << endl << endl;
+		cout << "   -s value       Maximum footprint size in texels (default: 64)" << endl << endl;
+	}
+
+	int run(int argc, char **argv) {
+		ref<FileResolver> fileResolver = Thread::getThread()->getFileResolver();
+		int optchar;
+		char *end_ptr = NULL;
+		size_t lookupCount = 2000000;
+		Float maxAnisotropy = 20, maxSize = 64;
+		optind = 1;
+
+		/* Parse command-line arguments */
+		while ((optchar = getopt(argc, argv, "n:a:s:h")) != -1) {
+			switch (optchar) {
+				case 'h': {
+						help();
+						return 0;
+					}
+					break;
+				case 'n':
+					lookupCount = (size_t) strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || lookupCount == 0)
+						SLog(EError, "Could not parse the lookup count!");
+					break;
+				case 'a':
+					maxAnisotropy = (Float) strtod(optarg, &end_ptr);
+					if (*end_ptr != '\0' || maxAnisotropy < 1)
+						SLog(EError, "Could not parse the maximum anisotropy!");
+					break;
+				case 's':
+					maxSize = (Float) strtod(optarg, &end_ptr);
+					if (*end_ptr != '\0' || maxSize < 1)
+						SLog(EError, "Could not parse the maximum footprint size!");
+					break;
+			};
+		}
+
+		if (optind == argc || optind+1 < argc) {
+			help();
+			return 0;
+		}
+
+		fs::path path = fileResolver->resolve(argv[optind]);
+		ref<FileStream> fs = new FileStream(path, FileStream::EReadOnly);
+		ref<Bitmap> bitmap = new Bitmap(Bitmap::EAuto, fs);
+		bitmap = bitmap->convert(Bitmap::ERGB, Bitmap::EFloat);
+
+		Properties rfilterProps("lanczos");
+		rfilterProps.setInteger("lobes", 2);
+		ref<ReconstructionFilter> rfilter = static_cast<ReconstructionFilter *> (
+			PluginManager::getInstance()->createObject(
+			MTS_CLASS(ReconstructionFilter), rfilterProps));
+		rfilter->configure();
+
+		/* Generate the lookups in advance: uniformly distributed positions,
+		   footprints with a log-uniform size, random orientation and
+		   anisotropy (which may exceed the limit of the EWA filter) */
+		ref<Random> random = new Random();
+		const Vector2i &size = bitmap->getSize();
+		Float logMaxSize = math::log2(maxSize);
+		std::vector<Lookup> lookups(std::min(lookupCount, (size_t) (1 << 20)));
+		for (size_t i=0; i<lookups.size(); ++i) {
+			Lookup &lookup = lookups[i];
+			Float major = std::pow((Float) 2, random->nextFloat() * logMaxSize),
+			      minor = major / (1 + random->nextFloat() * (2 * maxAnisotropy - 1)),
+			      angle = random->nextFloat() * M_PI, sinAngle, cosAngle;
+			math::sincos(angle, &sinAngle, &cosAngle);
+			lookup.uv = Point2(random->nextFloat(), random->nextFloat());
+			lookup.d0 = Vector2(cosAngle * major / size.x, sinAngle * major / size.y);
+			lookup.d1 = Vector2(-sinAngle * minor / size.x, cosAngle * minor / size.y);
+		}
+
+		const char *filterNames[] = { "nearest", "bilinear", "trilinear", "ewa" };
+		for (int type = ENearest; type <= EEWA; ++type) {
+			ref<MIPMap3> mipmap = new MIPMap3(bitmap, Bitmap::ERGB, Bitmap::EFloat,
+				rfilter, ReconstructionFilter::ERepeat, ReconstructionFilter::ERepeat,
+				(EMIPFilterType) type, maxAnisotropy);
+
+			uint64_t samples = stats::avgEWASamples.getValue(),
+			         lookupsEWA = stats::avgEWASamples.getBase();
+
+			ref<Timer> timer = new Timer();
+			Color3 checksum(0.0f);
+			for (size_t i=0; i<lookupCount; ++i) {
+				const Lookup &lookup = lookups[i % lookups.size()];
+				checksum += mipmap->eval(lookup.uv, lookup.d0, lookup.d1);
+			}
+			Float ms = (Float) timer->getMilliseconds();
+
+			samples = stats::avgEWASamples.getValue() - samples;
+			lookupsEWA = stats::avgEWASamples.getBase() - lookupsEWA;
+
+			if (type == EEWA)
+				Log(EInfo, "%s: %.3f million lookups/sec, %.1f texels per EWA lookup (checksum %f)",
+					filterNames[type], lookupCount / (ms * (Float) 1000),
+					samples / (Float) std::max(lookupsEWA, (uint64_t) 1), checksum.average());
+			else
+				Log(EInfo, "%s: %.3f million lookups/sec (checksum %f)", filterNames[type],
+					lookupCount / (ms * (Float) 1000), checksum.average());
+		}
+
+		return 0;
+	}
+
+	MTS_DECLARE_UTILITY()
+};
+
+MTS_EXPORT_UTILITY(TexBench, "Texture filtering benchmark")
+MTS_NAMESPACE_END
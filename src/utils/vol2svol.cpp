@@ -0,0 +1,181 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/util.h>
+#include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/fstream.h>
+#include <mitsuba/core/mstream.h>
+#include <mitsuba/core/mmap.h>
+
+/* Brick layout, must match the 'sparsevolume' plugin */
+#define SVOL_BRICK_SHIFT 3
+#define SVOL_BRICK_CELLS (1 << SVOL_BRICK_SHIFT)
+#define SVOL_BRICK_RES   (SVOL_BRICK_CELLS + 1)
+#define SVOL_BRICK_SIZE  (SVOL_BRICK_RES * SVOL_BRICK_RES * SVOL_BRICK_RES)
+
+MTS_NAMESPACE_BEGIN
+
+class Vol2SVol : public Utility {
+public:
+	void help() {
+		cout << endl;
+		cout << "Synopsis: Converts a dense volume data file (as used by the 'gridvolume'" << endl;
+		cout << "plugin) into the sparse format of the 'sparsevolume' plugin. Bricks of" << endl;
+		cout << SVOL_BRICK_CELLS << "x" << SVOL_BRICK_CELLS << "x" << SVOL_BRICK_CELLS
+			 << " cells, whose samples all have an absolute value below or equal" << endl;
+		cout << "to the threshold (default: 0) are omitted. Supports float32 and uint8-based" << endl;
+		cout << "volumes with 1 or 3 channels." << endl;
+		cout << endl;
+		cout << "Usage: mtsutil vol2svol <input.vol> <output.svol> [threshold]" << endl << endl;
+	}
+
+	void convert(const fs::path &inputPath, const fs::path &outputPath, Float threshold) {
+		ref<MemoryMappedFile> mmap = new MemoryMappedFile(inputPath);
+		ref<MemoryStream> stream = new MemoryStream(mmap->getData(), mmap->getSize());
+		stream->setByteOrder(Stream::ELittleEndian);
+
+		char header[3];
+		stream->read(header, 3);
+		if (header[0] != 'V' || header[1] != 'O' || header[2] != 'L')
+			Log(EError, "Encountered an invalid volume data file "
+				"(incorrect header identifier)");
+		uint8_t version;
+		stream->read(&version, 1);
+		if (version != 3)
+			Log(EError, "Encountered an invalid volume data file "
+				"(incorrect file version)");
+		int type = stream->readInt();
+		if (type != 1 && type != 3)
+			Log(EError, "Only float32 and uint8-based volume data files are supported!");
+
+		Vector3i res(stream);
+		int channels = stream->readInt();
+		if (channels != 1 && channels != 3)
+			Log(EError, "Encountered an unsupported volume data file (%i channels, "
+				"only 1 and 3 are supported)", channels);
+
+		float aabb[6];
+		stream->readSingleArray(aabb, 6);
+
+		size_t nEntries = (size_t) res.x * (size_t) res.y * (size_t) res.z * channels;
+		size_t entrySize = type == 1 ? sizeof(float) : sizeof(uint8_t);
+		if (stream->getPos() + nEntries * entrySize > mmap->getSize())
+			Log(EError, "The volume data file is truncated!");
+		const float *floatData = (const float *) ((const uint8_t *) mmap->getData() + stream->getPos());
+		const uint8_t *byteData = (const uint8_t *) floatData;
+
+		ref<FileStream> out = new FileStream(outputPath, FileStream::ETruncReadWrite);
+		out->setByteOrder(Stream::ELittleEndian);
+		out->write("SVL", 3);
+		version = 1;
+		out->write(&version, 1);
+		out->writeInt(channels);
+		res.serialize(out);
+		out->writeSingleArray(aabb, 6);
+		size_t countPos = out->getPos();
+		out->writeInt(0);
+
+		Vector3i brickRes;
+		for (int i=0; i<3; ++i)
+			brickRes[i] = std::max((res[i] - 1 + SVOL_BRICK_CELLS - 1) >> SVOL_BRICK_SHIFT, 1);
+
+		std::vector<float> brick(SVOL_BRICK_SIZE * channels);
+		int brickCount = 0;
+
+		for (int bz=0; bz<brickRes.z; ++bz) {
+			for (int by=0; by<brickRes.y; ++by) {
+				for (int bx=0; bx<brickRes.x; ++bx) {
+					float min = std::numeric_limits<float>::infinity(),
+						  max = -std::numeric_limits<float>::infinity();
+					bool empty = true;
+					float *target = &brick[0];
+
+					for (int z=0; z<SVOL_BRICK_RES; ++z) {
+						for (int y=0; y<SVOL_BRICK_RES; ++y) {
+							for (int x=0; x<SVOL_BRICK_RES; ++x) {
+								int gx = (bx << SVOL_BRICK_SHIFT) + x,
+									gy = (by << SVOL_BRICK_SHIFT) + y,
+									gz = (bz << SVOL_BRICK_SHIFT) + z;
+
+								/* Samples beyond the grid are never accessed by lookups */
+								bool valid = gx < res.x && gy < res.y && gz < res.z;
+								size_t idx = (((size_t) gz * res.y + gy) * res.x + gx) * channels;
+
+								for (int c=0; c<channels; ++c) {
+									float value = 0.0f;
+									if (valid)
+										value = type == 1 ? floatData[idx+c]
+											: byteData[idx+c] / 255.0f;
+									empty &= std::abs(value) <= threshold;
+									min = std::min(min, value);
+									max = std::max(max, value);
+									*target++ = value;
+								}
+							}
+						}
+					}
+
+					if (empty)
+						continue;
+
+					out->writeInt(bx);
+					out->writeInt(by);
+					out->writeInt(bz);
+					out->writeSingle(min);
+					out->writeSingle(max);
+					out->writeSingleArray(&brick[0], brick.size());
+					++brickCount;
+				}
+			}
+		}
+
+		out->seek(countPos);
+		out->writeInt(brickCount);
+		out->seek(out->getSize());
+
+		size_t totalBricks = (size_t) brickRes.x * brickRes.y * brickRes.z;
+		Log(EInfo, "Wrote \"%s\": %i/" SIZE_T_FMT " bricks (%.1f%% occupancy), %s (dense: %s)",
+			outputPath.filename().string().c_str(), brickCount, totalBricks,
+			100.0f * brickCount / (Float) totalBricks, memString(out->getSize()).c_str(),
+			memString(mmap->getSize()).c_str());
+	}
+
+	int run(int argc, char **argv) {
+		if (argc < 3 || argc > 4) {
+			help();
+			return 0;
+		}
+
+		Float threshold = 0;
+		if (argc == 4) {
+			char *end_ptr = NULL;
+			threshold = (Float) strtod(argv[3], &end_ptr);
+			if (*end_ptr != '\0' || threshold < 0)
+				Log(EError, "Could not parse the threshold!");
+		}
+
+		ref<FileResolver> fileResolver = Thread::getThread()->getFileResolver();
+		convert(fileResolver->resolve(argv[1]), argv[2], threshold);
+		return 0;
+	}
+
+	MTS_DECLARE_UTILITY()
+};
+
+MTS_EXPORT_UTILITY(Vol2SVol, "Convert dense volume data into a sparse representation");
+MTS_NAMESPACE_END
@@ -0,0 +1,220 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/util.h>
+#include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/fstream.h>
+#include <mitsuba/core/mstream.h>
+#include <mitsuba/core/mmap.h>
+#if defined(WIN32)
+#include <mitsuba/core/getopt.h>
+#endif
+
+/* Brick layout, must match the 'gridvolume' plugin */
+#define VOL_BRICK_SHIFT 3
+#define VOL_BRICK_RES   (1 << VOL_BRICK_SHIFT)
+#define VOL_BRICK_SIZE  (VOL_BRICK_RES * VOL_BRICK_RES * VOL_BRICK_RES)
+
+MTS_NAMESPACE_BEGIN
+
+class VolQuant : public Utility {
+public:
+	void help() {
+		cout << endl;
+		cout << "Synopsis: Converts a dense float32 or uint8-based volume data file into" << endl;
+		cout << "the brick-ordered quantized encoding of the 'gridvolume' plugin. Every" << endl;
+		cout << "brick of " << VOL_BRICK_RES << "x" << VOL_BRICK_RES << "x" << VOL_BRICK_RES
+			 << " samples is quantized relative to its own value range." << endl;
+		cout << endl;
+		cout << "Usage: mtsutil volquant [options] <input.vol> <output.vol>" << endl;
+		cout << "Options/Arguments:" << endl;
+		cout << "   -h             Display this help text" << endl << endl;
+		cout << "   -b bits        Number of bits per sample (8 or 16, default: 8)" << endl << endl;
+	}
+
+	/// Fetch a sample of the dense input volume
+	inline float getValue(size_t idx) const {
+		return m_type == 1 ? m_floatData[idx] : m_byteData[idx] / 255.0f;
+	}
+
+	void convert(const fs::path &inputPath, const fs::path &outputPath, int bits) {
+		ref<MemoryMappedFile> mmap = new MemoryMappedFile(inputPath);
+		ref<MemoryStream> stream = new MemoryStream(mmap->getData(), mmap->getSize());
+		stream->setByteOrder(Stream::ELittleEndian);
+
+		char header[3];
+		stream->read(header, 3);
+		if (header[0] != 'V' || header[1] != 'O' || header[2] != 'L')
+			Log(EError, "Encountered an invalid volume data file "
+				"(incorrect header identifier)");
+		uint8_t version;
+		stream->read(&version, 1);
+		if (version != 3)
+			Log(EError, "Encountered an invalid volume data file "
+				"(incorrect file version)");
+		m_type = stream->readInt();
+		if (m_type != 1 && m_type != 3)
+			Log(EError, "Only float32 and uint8-based volume data files are supported!");
+
+		Vector3i res(stream);
+		int channels = stream->readInt();
+		if (channels != 1 && channels != 3)
+			Log(EError, "Encountered an unsupported volume data file (%i channels, "
+				"only 1 and 3 are supported)", channels);
+
+		float aabb[6];
+		stream->readSingleArray(aabb, 6);
+
+		size_t nEntries = (size_t) res.x * (size_t) res.y * (size_t) res.z * channels;
+		if (stream->getPos() + nEntries * (m_type == 1 ? 4 : 1) > mmap->getSize())
+			Log(EError, "The volume data file is truncated!");
+		m_floatData = (const float *) ((const uint8_t *) mmap->getData() + stream->getPos());
+		m_byteData = (const uint8_t *) m_floatData;
+
+		Vector3i brickRes;
+		for (int i=0; i<3; ++i)
+			brickRes[i] = (res[i] + VOL_BRICK_RES - 1) >> VOL_BRICK_SHIFT;
+		size_t nBricks = (size_t) brickRes.x * brickRes.y * brickRes.z;
+		const float maxSample = (float) ((1 << bits) - 1);
+
+		/* Determine the value range of every brick and channel */
+		std::vector<float> ranges(nBricks * channels * 2);
+		for (size_t brick=0; brick<nBricks; ++brick) {
+			Vector3i offset = getBrickOffset(brick, brickRes);
+			for (int c=0; c<channels; ++c) {
+				float min = std::numeric_limits<float>::infinity(),
+				      max = -std::numeric_limits<float>::infinity();
+				for (int z=offset.z; z<std::min(offset.z + VOL_BRICK_RES, res.z); ++z) {
+					for (int y=offset.y; y<std::min(offset.y + VOL_BRICK_RES, res.y); ++y) {
+						for (int x=offset.x; x<std::min(offset.x + VOL_BRICK_RES, res.x); ++x) {
+							float value = getValue((((size_t) z * res.y + y) * res.x + x) * channels + c);
+							min = std::min(min, value);
+							max = std::max(max, value);
+						}
+					}
+				}
+				ranges[2*(brick*channels + c)] = min;
+				ranges[2*(brick*channels + c) + 1] = (max - min) / maxSample;
+			}
+		}
+
+		ref<FileStream> out = new FileStream(outputPath, FileStream::ETruncReadWrite);
+		out->setByteOrder(Stream::ELittleEndian);
+		out->write("VOL", 3);
+		version = 3;
+		out->write(&version, 1);
+		out->writeInt(bits == 8 ? 5 : 6);
+		res.serialize(out);
+		out->writeInt(channels);
+		out->writeSingleArray(aabb, 6);
+		out->writeSingleArray(&ranges[0], ranges.size());
+
+		/* Quantize the samples brick by brick. Padding is stored as zero */
+		std::vector<uint8_t> brickData8(bits == 8 ? VOL_BRICK_SIZE * channels : 0);
+		std::vector<uint16_t> brickData16(bits == 16 ? VOL_BRICK_SIZE * channels : 0);
+		Float maxError = 0;
+
+		for (size_t brick=0; brick<nBricks; ++brick) {
+			Vector3i offset = getBrickOffset(brick, brickRes);
+			for (int z=0; z<VOL_BRICK_RES; ++z) {
+				for (int y=0; y<VOL_BRICK_RES; ++y) {
+					for (int x=0; x<VOL_BRICK_RES; ++x) {
+						int gx = offset.x + x, gy = offset.y + y, gz = offset.z + z;
+						bool valid = gx < res.x && gy < res.y && gz < res.z;
+						size_t target = (((size_t) z * VOL_BRICK_RES + y) * VOL_BRICK_RES + x) * channels;
+
+						for (int c=0; c<channels; ++c) {
+							uint32_t q = 0;
+							if (valid) {
+								float value = getValue((((size_t) gz * res.y + gy) * res.x + gx) * channels + c),
+								      min = ranges[2*(brick*channels + c)],
+								      scale = ranges[2*(brick*channels + c) + 1];
+								if (scale > 0)
+									q = (uint32_t) std::min(maxSample, std::max(0.0f,
+										(value - min) / scale + 0.5f));
+								maxError = std::max(maxError, (Float) std::abs(min + scale * q - value));
+							}
+							if (bits == 8)
+								brickData8[target + c] = (uint8_t) q;
+							else
+								brickData16[target + c] = (uint16_t) q;
+						}
+					}
+				}
+			}
+			if (bits == 8)
+				out->write(&brickData8[0], brickData8.size());
+			else
+				out->writeUShortArray(&brickData16[0], brickData16.size());
+		}
+
+		Log(EInfo, "Wrote \"%s\": " SIZE_T_FMT " bricks, %s (originally %s), max. absolute error = %f",
+			outputPath.filename().string().c_str(), nBricks, memString(out->getSize()).c_str(),
+			memString(mmap->getSize()).c_str(), maxError);
+	}
+
+	int run(int argc, char **argv) {
+		int optchar;
+		char *end_ptr = NULL;
+		int bits = 8;
+		optind = 1;
+
+		/* Parse command-line arguments */
+		while ((optchar = getopt(argc, argv, "b:h")) != -1) {
+			switch (optchar) {
+				case 'h': {
+						help();
+						return 0;
+					}
+					break;
+				case 'b':
+					bits = (int) strtol(optarg, &end_ptr, 10);
+					if (*end_ptr != '\0' || (bits != 8 && bits != 16))
+						Log(EError, "Could not parse the number of bits (must be 8 or 16)!");
+					break;
+			};
+		}
+
+		if (optind + 2 != argc) {
+			help();
+			return 0;
+		}
+
+		ref<FileResolver> fileResolver = Thread::getThread()->getFileResolver();
+		convert(fileResolver->resolve(argv[optind]), argv[optind+1], bits);
+		return 0;
+	}
+
+	MTS_DECLARE_UTILITY()
+protected:
+	/// Return the position of the first sample of a brick
+	static Vector3i getBrickOffset(size_t brick, const Vector3i &brickRes) {
+		return Vector3i(
+			(int) (brick % brickRes.x),
+			(int) ((brick / brickRes.x) % brickRes.y),
+			(int) (brick / ((size_t) brickRes.x * brickRes.y))) * VOL_BRICK_RES;
+	}
+
+protected:
+	int m_type;
+	const float *m_floatData;
+	const uint8_t *m_byteData;
+};
+
+MTS_EXPORT_UTILITY(VolQuant, "Convert dense volume data into a quantized brick-ordered encoding");
+MTS_NAMESPACE_END
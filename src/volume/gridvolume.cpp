@@ -21,6 +21,7 @@
 #include <mitsuba/core/fresolver.h>
 #include <mitsuba/core/properties.h>
 #include <mitsuba/core/mmap.h>
+#include <mitsuba/core/sse.h>
 
 
 // Uncomment to enable nearest-neighbor direction interpolation
@@ -29,6 +30,11 @@
 // Number of power iteration steps used to find the dominant direction
 #define POWER_ITERATION_STEPS 5
 
+// Brick size of the quantized brick-ordered encodings (log2)
+#define VOL_BRICK_SHIFT 3
+#define VOL_BRICK_RES   (1 << VOL_BRICK_SHIFT)
+#define VOL_BRICK_SIZE  (VOL_BRICK_RES * VOL_BRICK_RES * VOL_BRICK_RES)
+
 MTS_NAMESPACE_BEGIN
 
 /*!\plugin{gridvolume}{Grid-based volume data source}
@@ -71,6 +77,9 @@ MTS_NAMESPACE_BEGIN
  * \item Dense \code{uint8}-based representation (The range 0..255 will be mapped to 0..1)
  * \item Dense quantized directions. The directions are stored in spherical
  * coordinates with a total storage cost of 16 bit per entry.
+ * \item Brick-ordered \code{uint8}-based representation with per-brick value ranges
+ * (see below)
+ * \item Brick-ordered \code{uint16}-based representation with per-brick value ranges
  * \end{enumerate}\\
  * Bytes 9-12 &  Number of cells along the X axis (32 bit integer)\\
  * Bytes 13-16 &  Number of cells along the Y axis (32 bit integer)\\
@@ -91,6 +100,24 @@ MTS_NAMESPACE_BEGIN
  * Note that Mitsuba expects that entries in direction volumes are either
  * zero or valid unit vectors.
  *
+ * The brick-ordered encodings (5 and 6) reduce the memory footprint and
+ * bandwidth requirements of large float-valued volumes. Here, the grid is
+ * split into bricks of $8\times8\times8$ samples (the last brick along each
+ * axis is padded). The data section begins with two single precision values
+ * per brick and channel, whose linear combination with the
+ * quantized sample values yields the actual data:
+ * \code{value = range[2*(brick*channels + chan)] + range[2*(brick*channels + chan) + 1] * sample}.
+ * Here, \code{brick = (bz*nby + by)*nbx + bx} is the index of the brick
+ * containing the sample, and \code{nbx}, \code{nby} denote the number of
+ * bricks along the X and Y axes. The ranges are followed by the quantized
+ * samples of all bricks, in the same order. Within a brick, the samples
+ * are stored in the dense ordering explained above. Such files are created
+ * from dense \code{float32} or \code{uint8}-based volumes using the
+ * \code{volquant} utility:
+ * \begin{shell}
+ * $\texttt{\$}$ mtsutil volquant [-b 16] albedo.vol albedo-quantized.vol
+ * \end{shell}
+ *
  * When using this data source to represent floating point density volumes,
  * please ensure that the values are all normalized to lie in the
  * range $[0, 1]$---otherwise, the Woodcock-Tracking integration method in
@@ -102,7 +129,9 @@ public:
 		EFloat32 = 1,
 		EFloat16 = 2,
 		EUInt8 = 3,
-		EQuantizedDirections = 4
+		EQuantizedDirections = 4,
+		EBrickedUInt8 = 5,
+		EBrickedUInt16 = 6
 	};
 
 	GridDataSource(const Properties &props)
@@ -161,6 +190,13 @@ public:
 			case EFloat16: return 2 * nEntries * m_channels;
 			case EUInt8:   return 1 * nEntries * m_channels;
 			case EQuantizedDirections:  return 2 * nEntries;
+			case EBrickedUInt8:
+			case EBrickedUInt16: {
+					Vector3i brickRes = getBrickResolution();
+					size_t nBricks = (size_t) brickRes.x * (size_t) brickRes.y * (size_t) brickRes.z;
+					return nBricks * m_channels * (2 * sizeof(float) + VOL_BRICK_SIZE
+						* (m_volumeType == EBrickedUInt8 ? 1 : 2));
+				}
 			default:
 				Log(EError, "Unknown volume format!");
 				return 0;
@@ -212,6 +248,21 @@ public:
 		m_cosPhi[255] = m_sinPhi[255] = 0;
 		m_cosTheta[255] = m_sinTheta[255] = 0;
 		m_densityMap[255] = 1.0f;
+
+		if (m_volumeType == EBrickedUInt8 || m_volumeType == EBrickedUInt16) {
+			m_brickRes = getBrickResolution();
+			m_brickRanges = (float *) m_data;
+			m_brickData = m_data + (size_t) m_brickRes.x * m_brickRes.y
+				* m_brickRes.z * m_channels * 2 * sizeof(float);
+		}
+	}
+
+	/// Return the number of bricks along each axis (for brick-ordered encodings)
+	Vector3i getBrickResolution() const {
+		return Vector3i(
+			(m_res.x + VOL_BRICK_RES - 1) >> VOL_BRICK_SHIFT,
+			(m_res.y + VOL_BRICK_RES - 1) >> VOL_BRICK_SHIFT,
+			(m_res.z + VOL_BRICK_RES - 1) >> VOL_BRICK_SHIFT);
 	}
 
 	void loadFromFile(const fs::path &filename) {
@@ -264,6 +315,13 @@ public:
 							"volume data file (%i channels, only 3 are supported)",
 							m_channels);
 				break;
+			case EBrickedUInt8:
+			case EBrickedUInt16:
+				format = type == EBrickedUInt8 ? "bricked uint8" : "bricked uint16";
+				if (m_channels != 1 && m_channels != 3)
+					Log(EError, "Encountered an unsupported %s volume data file "
+						"(%i channels, only 1 and 3 are supported)", format.c_str(), m_channels);
+				break;
 			default:
 				Log(EError, "Encountered a volume data file of unknown type (type=%i, channels=%i)!", type, m_channels);
 		}
@@ -382,11 +440,37 @@ public:
 					   ((d100*_fx + d101*fx)*_fy +
 						(d110*_fx + d111*fx)*fy)*fz;
 			}
+			case EBrickedUInt8: {
+				/* Bricked volumes store 1 or 3 channels, all of which are decoded */
+				Float result[3];
+				lookupBricked<uint8_t>(x1, y1, z1, fx, fy, fz, result);
+				return result[0];
+			}
+			case EBrickedUInt16: {
+				Float result[3];
+				lookupBricked<uint16_t>(x1, y1, z1, fx, fy, fz, result);
+				return result[0];
+			}
 			default:
 				return 0.0f;
 		}
 	}
 
+	void lookupFloats(const Point *p, Float *result, size_t count) const {
+		if (m_channels != 1 || (m_volumeType != EFloat32 && m_volumeType != EUInt8)) {
+			VolumeDataSource::lookupFloats(p, result, count);
+			return;
+		}
+
+		size_t i = 0;
+#if defined(MTS_SSE)
+		for (; i+4 <= count; i += 4)
+			lookupFloat4(p + i, result + i);
+#endif
+		for (; i<count; ++i)
+			result[i] = lookupFloat(p[i]);
+	}
+
 	Spectrum lookupSpectrum(const Point &_p) const {
 		const Point p = m_worldToGrid.transformAffine(_p);
 		const int x1 = math::floorToInt(p.x),
@@ -460,6 +544,19 @@ public:
 						 (d110*_fx + d111*fx)*fy)*fz).toSpectrum();
 
 				}
+			case EBrickedUInt8:
+			case EBrickedUInt16: {
+				Float rgb[3];
+				if (m_volumeType == EBrickedUInt8)
+					lookupBricked<uint8_t>(x1, y1, z1, fx, fy, fz, rgb);
+				else
+					lookupBricked<uint16_t>(x1, y1, z1, fx, fy, fz, rgb);
+				if (m_channels == 1)
+					rgb[1] = rgb[2] = rgb[0];
+				Spectrum result;
+				result.fromLinearRGB(rgb[0], rgb[1], rgb[2]);
+				return result;
+				}
 			default: return Spectrum(0.0f);
 		}
 	}
@@ -584,6 +681,57 @@ public:
 		return 1.0f;
 	}
 
+	Float getMaximumFloatValue(const AABB &aabb) const {
+		if (m_channels != 1 || (m_volumeType != EFloat32 && m_volumeType != EUInt8
+				&& m_volumeType != EBrickedUInt8 && m_volumeType != EBrickedUInt16))
+			return getMaximumFloatValue();
+
+		/* Find all voxels that contribute to trilinear lookups within the region */
+		AABB gridAABB;
+		for (int i=0; i<8; ++i)
+			gridAABB.expandBy(m_worldToGrid.transformAffine(aabb.getCorner(i)));
+
+		int min[3], max[3];
+		for (int i=0; i<3; ++i) {
+			min[i] = std::max(math::floorToInt(gridAABB.min[i]), 0);
+			max[i] = std::min(math::ceilToInt(gridAABB.max[i]), m_res[i] - 1);
+			if (min[i] > max[i])
+				return 0.0f;
+		}
+
+		Float result = 0.0f;
+		if (m_volumeType == EBrickedUInt8 || m_volumeType == EBrickedUInt16) {
+			/* Bound the values using the ranges of the overlapping bricks */
+			Float maxSample = m_volumeType == EBrickedUInt8 ? 255.0f : 65535.0f;
+			for (int bz=min[2] >> VOL_BRICK_SHIFT; bz<=max[2] >> VOL_BRICK_SHIFT; ++bz) {
+				for (int by=min[1] >> VOL_BRICK_SHIFT; by<=max[1] >> VOL_BRICK_SHIFT; ++by) {
+					for (int bx=min[0] >> VOL_BRICK_SHIFT; bx<=max[0] >> VOL_BRICK_SHIFT; ++bx) {
+						const float *range = m_brickRanges +
+							2 * (((size_t) bz*m_brickRes.y + by)*m_brickRes.x + bx);
+						result = std::max(result, range[0] + range[1] * maxSample);
+					}
+				}
+			}
+			return result;
+		}
+
+		for (int z=min[2]; z<=max[2]; ++z) {
+			for (int y=min[1]; y<=max[1]; ++y) {
+				size_t idx = ((size_t) z*m_res.y + y)*m_res.x + min[0];
+				if (m_volumeType == EFloat32) {
+					const float *floatData = (float *) m_data + idx;
+					for (int x=min[0]; x<=max[0]; ++x)
+						result = std::max(result, (Float) *floatData++);
+				} else {
+					const uint8_t *byteData = m_data + idx;
+					for (int x=min[0]; x<=max[0]; ++x)
+						result = std::max(result, m_densityMap[*byteData++]);
+				}
+			}
+		}
+		return result;
+	}
+
 	std::string toString() const {
 		std::ostringstream oss;
 		oss << "GridVolume[" << endl
@@ -605,6 +753,129 @@ protected:
 		);
 	}
 
+#if defined(MTS_SSE)
+	/**
+	 * \brief Trilinearly interpolate a single-channel \c float32
+	 * or \c uint8 volume at four points using SSE2
+	 *
+	 * Produces the same results as \ref lookupFloat().
+	 */
+	void lookupFloat4(const Point *p, float *result) const {
+		const Matrix4x4 &m = m_worldToGrid.getMatrix();
+		const __m128
+			px = _mm_set_ps(p[3].x, p[2].x, p[1].x, p[0].x),
+			py = _mm_set_ps(p[3].y, p[2].y, p[1].y, p[0].y),
+			pz = _mm_set_ps(p[3].z, p[2].z, p[1].z, p[0].z);
+		const __m128i one = _mm_set1_epi32(1);
+
+		/* Transform into grid space, then determine the integer cell
+		   coordinates, the fractional offsets and whether the lookups
+		   lie within the grid */
+		__m128i cell[3], valid = _mm_set1_epi32(-1);
+		__m128 frac[3];
+		for (int j=0; j<3; ++j) {
+			__m128 g = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_set1_ps(m(j, 0)), px),
+				_mm_mul_ps(_mm_set1_ps(m(j, 1)), py)),
+				_mm_mul_ps(_mm_set1_ps(m(j, 2)), pz)),
+				_mm_set1_ps(m(j, 3)));
+
+			/* Conversion truncates towards zero -- subtract one for negative values */
+			__m128i c = _mm_cvttps_epi32(g);
+			c = _mm_add_epi32(c, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(c), g)));
+
+			valid = _mm_andnot_si128(_mm_cmplt_epi32(c, _mm_setzero_si128()), valid);
+			valid = _mm_and_si128(valid, _mm_cmplt_epi32(
+				_mm_add_epi32(c, one), _mm_set1_epi32(m_res[j])));
+
+			cell[j] = c;
+			frac[j] = _mm_sub_ps(g, _mm_cvtepi32_ps(c));
+		}
+
+		int32_t MM_ALIGN16 x[4], y[4], z[4], mask[4];
+		_mm_store_si128((__m128i *) x, cell[0]);
+		_mm_store_si128((__m128i *) y, cell[1]);
+		_mm_store_si128((__m128i *) z, cell[2]);
+		_mm_store_si128((__m128i *) mask, valid);
+
+		/* Gather the values at the cell corners (d[k], where the bits
+		   of k select the upper corner along the X, Y and Z axes) */
+		float MM_ALIGN16 d[8][4];
+		const size_t dy = (size_t) m_res.x, dz = (size_t) m_res.x * m_res.y;
+		for (int i=0; i<4; ++i) {
+			if (!mask[i]) {
+				for (int k=0; k<8; ++k)
+					d[k][i] = 0.0f;
+				continue;
+			}
+			const size_t idx = ((size_t) z[i]*m_res.y + y[i])*m_res.x + x[i];
+			if (m_volumeType == EFloat32) {
+				const float *floatData = (const float *) m_data + idx;
+				d[0][i] = floatData[0];     d[1][i] = floatData[1];
+				d[2][i] = floatData[dy];    d[3][i] = floatData[dy+1];
+				d[4][i] = floatData[dz];    d[5][i] = floatData[dz+1];
+				d[6][i] = floatData[dz+dy]; d[7][i] = floatData[dz+dy+1];
+			} else {
+				const uint8_t *byteData = m_data + idx;
+				d[0][i] = m_densityMap[byteData[0]];     d[1][i] = m_densityMap[byteData[1]];
+				d[2][i] = m_densityMap[byteData[dy]];    d[3][i] = m_densityMap[byteData[dy+1]];
+				d[4][i] = m_densityMap[byteData[dz]];    d[5][i] = m_densityMap[byteData[dz+1]];
+				d[6][i] = m_densityMap[byteData[dz+dy]]; d[7][i] = m_densityMap[byteData[dz+dy+1]];
+			}
+		}
+
+		const __m128 ones = _mm_set1_ps(1.0f),
+			fx = frac[0], fy = frac[1], fz = frac[2],
+			_fx = _mm_sub_ps(ones, fx), _fy = _mm_sub_ps(ones, fy), _fz = _mm_sub_ps(ones, fz);
+
+		__m128 v[4];
+		for (int k=0; k<4; ++k)
+			v[k] = _mm_add_ps(_mm_mul_ps(_mm_load_ps(d[2*k]), _fx),
+			                  _mm_mul_ps(_mm_load_ps(d[2*k+1]), fx));
+
+		const __m128
+			v0 = _mm_add_ps(_mm_mul_ps(v[0], _fy), _mm_mul_ps(v[1], fy)),
+			v1 = _mm_add_ps(_mm_mul_ps(v[2], _fy), _mm_mul_ps(v[3], fy)),
+			r  = _mm_add_ps(_mm_mul_ps(v0, _fz), _mm_mul_ps(v1, fz));
+
+		_mm_storeu_ps(result, _mm_and_ps(r, _mm_castsi128_ps(valid)));
+	}
+#endif
+
+	/**
+	 * \brief Trilinearly interpolate all channels of a
+	 * brick-ordered quantized volume
+	 */
+	template <typename T> FINLINE void lookupBricked(int x1, int y1, int z1,
+			Float fx, Float fy, Float fz, Float *result) const {
+		const T *data = (const T *) m_brickData;
+		const int mask = VOL_BRICK_RES - 1;
+		const Float _fx = 1.0f - fx, _fy = 1.0f - fy, _fz = 1.0f - fz;
+
+		/* Find the brick and sample index of each corner */
+		size_t brickIdx[8], sampleIdx[8];
+		for (int k=0; k<8; ++k) {
+			int x = x1 + (k & 1), y = y1 + ((k & 2) >> 1), z = z1 + ((k & 4) >> 2);
+			brickIdx[k] = ((size_t) (z >> VOL_BRICK_SHIFT) * m_brickRes.y
+				+ (y >> VOL_BRICK_SHIFT)) * m_brickRes.x + (x >> VOL_BRICK_SHIFT);
+			sampleIdx[k] = brickIdx[k] * VOL_BRICK_SIZE +
+				(((z & mask) << VOL_BRICK_SHIFT) + (y & mask)) * VOL_BRICK_RES + (x & mask);
+		}
+
+		for (int c=0; c<m_channels; ++c) {
+			Float d[8];
+			for (int k=0; k<8; ++k) {
+				const float *range = m_brickRanges + 2 * (brickIdx[k] * m_channels + c);
+				d[k] = range[0] + range[1] * (Float) data[sampleIdx[k] * m_channels + c];
+			}
+
+			result[c] = ((d[0]*_fx + d[1]*fx)*_fy +
+						 (d[2]*_fx + d[3]*fx)*fy)*_fz +
+						((d[4]*_fx + d[5]*fx)*_fy +
+						 (d[6]*_fx + d[7]*fx)*fy)*fz;
+		}
+	}
+
 protected:
 	fs::path m_filename;
 	uint8_t *m_data;
@@ -621,6 +892,10 @@ protected:
 	Float m_cosTheta[256], m_sinTheta[256];
 	Float m_cosPhi[256], m_sinPhi[256];
 	Float m_densityMap[256];
+	/* Brick-ordered encodings */
+	Vector3i m_brickRes;
+	const float *m_brickRanges;
+	const uint8_t *m_brickData;
 };
 
 MTS_IMPLEMENT_CLASS_S(GridDataSource, false, VolumeDataSource);
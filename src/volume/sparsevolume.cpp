@@ -0,0 +1,479 @@
+/*
+    This file is part of Mitsuba, a physically based rendering system.
+
+    Copyright (c) 2007-2014 by Wenzel Jakob and others.
+
+    Mitsuba is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Mitsuba is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <mitsuba/render/volume.h>
+#include <mitsuba/core/mstream.h>
+#include <mitsuba/core/fresolver.h>
+#include <mitsuba/core/properties.h>
+#include <mitsuba/core/mmap.h>
+
+/// Number of cells along each axis of a leaf brick (log2)
+#define SVOL_BRICK_SHIFT 3
+#define SVOL_BRICK_CELLS (1 << SVOL_BRICK_SHIFT)
+/// Number of samples along each axis of a leaf brick (incl. the shared border)
+#define SVOL_BRICK_RES   (SVOL_BRICK_CELLS + 1)
+#define SVOL_BRICK_SIZE  (SVOL_BRICK_RES * SVOL_BRICK_RES * SVOL_BRICK_RES)
+/// Number of bricks along each axis of an internal node (log2)
+#define SVOL_NODE_SHIFT  3
+#define SVOL_NODE_BRICKS (1 << SVOL_NODE_SHIFT)
+#define SVOL_NODE_SIZE   (SVOL_NODE_BRICKS * SVOL_NODE_BRICKS * SVOL_NODE_BRICKS)
+
+MTS_NAMESPACE_BEGIN
+
+/*!\plugin{sparsevolume}{Sparse grid-based volume data source}
+ * \parameters{
+ *     \parameter{filename}{\String}{
+ *       Specifies the filename of the sparse volume data file to be loaded
+ *     }
+ *     \parameter{sendData}{\Boolean}{
+ *       When this parameter is set to \code{true}, the implementation will
+ *       send all volume data to other network render nodes. Otherwise, they
+ *       are expected to have access to an identical volume data file that can be
+ *       mapped into memory. \default{\code{false}}
+ *     }
+ *     \parameter{toWorld}{\Transform}{
+ *         Optional linear transformation that should be applied to the data
+ *     }
+ *     \parameter{min, max}{\Point}{
+ *         Optional parameter that can be used to re-scale the data so that
+ *         it lies in the bounding box between \code{min} and \code{max}.
+ *     }
+ * }
+ *
+ * This plugin provides the same trilinearly interpolated float- and
+ * spectrum-valued lookups as \pluginref{gridvolume}, but it only stores
+ * the parts of the grid that are not empty. This is useful for volumes
+ * such as smoke simulations, where most of the bounding box contains
+ * no medium at all.
+ *
+ * The grid is partitioned into leaf \emph{bricks} of $8\times8\times8$ cells.
+ * Bricks whose samples are all zero are omitted, and the remaining ones
+ * are referenced by a tree with one level of internal nodes that
+ * each cover $8\times8\times8$ bricks. Every brick stores its samples
+ * along with the ones on its upper boundary (i.e. $9\times9\times9$
+ * samples), so that any interpolated lookup can be answered using
+ * a single brick. Internal nodes and bricks additionally record the
+ * range of their values. The \pluginref{heterogeneous} medium uses
+ * this information to skip empty regions and to bound the density of
+ * occupied ones when using Woodcock tracking.
+ *
+ * Sparse volume files are created from the dense format of \pluginref{gridvolume}
+ * (\code{float32} or \code{uint8}-based, with 1 or 3 channels) using the
+ * \code{vol2svol} utility:
+ * \begin{shell}
+ * $\texttt{\$}$ mtsutil vol2svol density.vol density.svol
+ * \end{shell}
+ * An optional third argument specifies a threshold, below which
+ * sample values are treated as zero when deciding whether a brick is empty.
+ *
+ * The file format uses a little endian encoding and is specified as
+ * follows:\vspace{3mm}
+ *
+ * \begin{center}
+ * \begin{tabular}{>{\bfseries}p{2cm}p{11cm}}
+ * \toprule
+ * Position & Content\\
+ * \midrule
+ * Bytes 1-3&   ASCII Bytes '\code{S}', '\code{V}', and '\code{L}' \\
+ * Byte  4&     File format version number (currently 1)\\
+ * Bytes 5-8&   Number of channels (32 bit integer, supported values: 1 or 3)\\
+ * Bytes 9-20 &  Number of samples along the X, Y and Z axes (32 bit integers)\\
+ * Bytes 21-44 & Axis-aligned bounding box of the data stored in single
+ *                precision (order: xmin, ymin, zmin, xmax, ymax, zmax)\\
+ * Bytes 45-48 & Number of stored bricks (32 bit integer)\\
+ * Bytes 49-*  &  Brick records, each consisting of the brick index along
+ *                the X, Y and Z axes (32 bit integers), the minimum and maximum
+ *                value of its samples (single precision), and the samples
+ *                themselves (single precision), ordered so that
+ *                \code{data[((z*9 + y)*9 + x)*channels + chan]} refers to the
+ *                sample at position \code{(8*bx+x, 8*by+y, 8*bz+z)} in the
+ *                original grid.\\
+ * \bottomrule
+ * \end{tabular}
+ * \end{center}
+ */
+class SparseDataSource : public VolumeDataSource {
+public:
+	/// Internal node of the brick tree
+	struct Node {
+		/// Pointers to the brick data or \c NULL for empty bricks
+		const float *bricks[SVOL_NODE_SIZE];
+		/// Maximum value of every brick
+		float brickMax[SVOL_NODE_SIZE];
+		/// Value range of all bricks referenced by this node
+		float min, max;
+	};
+
+	SparseDataSource(const Properties &props)
+		: VolumeDataSource(props), m_data(NULL) {
+		m_volumeToWorld = props.getTransform("toWorld", Transform());
+
+		if (props.hasProperty("min") && props.hasProperty("max")) {
+			/* Optionally allow to use an AABB other than
+			   the one specified by the volume file */
+			m_dataAABB.min = props.getPoint("min");
+			m_dataAABB.max = props.getPoint("max");
+		}
+
+		m_sendData = props.getBoolean("sendData", false);
+
+		loadFromFile(props.getString("filename"));
+	}
+
+	SparseDataSource(Stream *stream, InstanceManager *manager)
+			: VolumeDataSource(stream, manager), m_data(NULL) {
+		m_volumeToWorld = Transform(stream);
+		m_dataAABB = AABB(stream);
+		m_sendData = stream->readBool();
+		m_filename = stream->readString();
+		if (m_sendData) {
+			m_dataSize = (size_t) stream->readSize();
+			m_data = new uint8_t[m_dataSize];
+			stream->read(m_data, m_dataSize);
+			parse(m_data, m_dataSize);
+		} else {
+			loadFromFile(m_filename);
+		}
+		configure();
+	}
+
+	virtual ~SparseDataSource() {
+		if (m_data)
+			delete[] m_data;
+	}
+
+	void serialize(Stream *stream, InstanceManager *manager) const {
+		VolumeDataSource::serialize(stream, manager);
+
+		m_volumeToWorld.serialize(stream);
+		m_dataAABB.serialize(stream);
+		stream->writeBool(m_sendData);
+		stream->writeString(m_filename.string());
+
+		if (m_sendData) {
+			const uint8_t *data = m_mmap.get() ? (const uint8_t *) m_mmap->getData() : m_data;
+			stream->writeSize(m_dataSize);
+			stream->write(data, m_dataSize);
+		}
+	}
+
+	void configure() {
+		Vector extents(m_dataAABB.getExtents());
+		m_worldToVolume = m_volumeToWorld.inverse();
+		m_worldToGrid = Transform::scale(Vector(
+				(m_res[0] - 1) / extents[0],
+				(m_res[1] - 1) / extents[1],
+				(m_res[2] - 1) / extents[2])
+			) * Transform::translate(-Vector(m_dataAABB.min)) * m_worldToVolume;
+		m_stepSize = std::numeric_limits<Float>::infinity();
+		for (int i=0; i<3; ++i)
+			m_stepSize = std::min(m_stepSize, 0.5f * extents[i] / (Float) (m_res[i]-1));
+		m_aabb.reset();
+		for (int i=0; i<8; ++i)
+			m_aabb.expandBy(m_volumeToWorld(m_dataAABB.getCorner(i)));
+	}
+
+	void loadFromFile(const fs::path &filename) {
+		m_filename = filename;
+		fs::path resolved = Thread::getThread()->getFileResolver()->resolve(filename);
+		m_mmap = new MemoryMappedFile(resolved);
+		m_dataSize = m_mmap->getSize();
+
+		Log(EDebug, "Mapped \"%s\" into memory (%s)", resolved.filename().string().c_str(),
+			memString(m_dataSize).c_str());
+
+		parse((const uint8_t *) m_mmap->getData(), m_dataSize);
+	}
+
+	/// Read the header and build the brick tree (the samples are referenced in-place)
+	void parse(const uint8_t *data, size_t size) {
+		ref<MemoryStream> stream = new MemoryStream((void *) data, size);
+		stream->setByteOrder(Stream::ELittleEndian);
+
+		char header[3];
+		stream->read(header, 3);
+		if (header[0] != 'S' || header[1] != 'V' || header[2] != 'L')
+			Log(EError, "Encountered an invalid sparse volume data file "
+				"(incorrect header identifier)");
+		uint8_t version;
+		stream->read(&version, 1);
+		if (version != 1)
+			Log(EError, "Encountered an invalid sparse volume data file "
+				"(incorrect file version)");
+
+		m_channels = stream->readInt();
+		if (m_channels != 1 && m_channels != 3)
+			Log(EError, "Encountered an unsupported sparse volume data "
+				"file (%i channels, only 1 and 3 are supported)", m_channels);
+
+		int xres = stream->readInt(),
+			yres = stream->readInt(),
+			zres = stream->readInt();
+		m_res = Vector3i(xres, yres, zres);
+
+		Float xmin = stream->readSingle(),
+			  ymin = stream->readSingle(),
+			  zmin = stream->readSingle();
+		Float xmax = stream->readSingle(),
+			  ymax = stream->readSingle(),
+			  zmax = stream->readSingle();
+		if (!m_dataAABB.isValid())
+			m_dataAABB = AABB(Point(xmin, ymin, zmin), Point(xmax, ymax, zmax));
+
+		int brickCount = stream->readInt();
+
+		/* Allocate the root table of the tree */
+		for (int i=0; i<3; ++i) {
+			int bricks = (m_res[i] - 1 + SVOL_BRICK_CELLS - 1) >> SVOL_BRICK_SHIFT;
+			m_brickRes[i] = std::max(bricks, 1);
+			m_nodeRes[i] = (m_brickRes[i] + SVOL_NODE_BRICKS - 1) >> SVOL_NODE_SHIFT;
+		}
+		m_root.clear();
+		m_root.resize((size_t) m_nodeRes.x * m_nodeRes.y * m_nodeRes.z, -1);
+		m_nodes.clear();
+		m_maximum = 0.0f;
+
+		const size_t brickSize = sizeof(float) * SVOL_BRICK_SIZE * m_channels;
+		for (int i=0; i<brickCount; ++i) {
+			int bx = stream->readInt(),
+				by = stream->readInt(),
+				bz = stream->readInt();
+			float min = stream->readSingle(),
+				  max = stream->readSingle();
+			size_t pos = stream->getPos();
+
+			if (bx < 0 || by < 0 || bz < 0 || bx >= m_brickRes.x ||
+				by >= m_brickRes.y || bz >= m_brickRes.z || pos + brickSize > size)
+				Log(EError, "Encountered an invalid sparse volume data file "
+					"(brick %i is out of bounds)", i);
+
+			size_t rootIdx = ((size_t) (bz >> SVOL_NODE_SHIFT) * m_nodeRes.y
+				+ (by >> SVOL_NODE_SHIFT)) * m_nodeRes.x + (bx >> SVOL_NODE_SHIFT);
+			if (m_root[rootIdx] < 0) {
+				m_root[rootIdx] = (int32_t) m_nodes.size();
+				m_nodes.push_back(Node());
+				Node &node = m_nodes.back();
+				memset(node.bricks, 0, sizeof(node.bricks));
+				memset(node.brickMax, 0, sizeof(node.brickMax));
+				node.min = std::numeric_limits<float>::infinity();
+				node.max = -std::numeric_limits<float>::infinity();
+			}
+
+			Node &node = m_nodes[m_root[rootIdx]];
+			int brickIdx = getBrickIndex(bx, by, bz);
+			node.bricks[brickIdx] = (const float *) (data + pos);
+			node.brickMax[brickIdx] = max;
+			node.min = std::min(node.min, min);
+			node.max = std::max(node.max, max);
+			m_maximum = std::max(m_maximum, (Float) max);
+
+			stream->skip(brickSize);
+		}
+
+		size_t totalBricks = (size_t) m_brickRes.x * m_brickRes.y * m_brickRes.z;
+		Log(EInfo, "Loaded sparse volume \"%s\": %ix%ix%i (%i channels), %i/" SIZE_T_FMT
+			" bricks in " SIZE_T_FMT " nodes (%.1f%% occupancy), %s", m_filename.filename().string().c_str(),
+			m_res.x, m_res.y, m_res.z, m_channels, brickCount, totalBricks, m_nodes.size(),
+			100.0f * brickCount / (Float) totalBricks,
+			memString(brickCount * brickSize + m_nodes.size() * sizeof(Node)).c_str());
+	}
+
+	Float lookupFloat(const Point &_p) const {
+		const Point p = m_worldToGrid.transformAffine(_p);
+		const int x1 = math::floorToInt(p.x),
+			  y1 = math::floorToInt(p.y),
+			  z1 = math::floorToInt(p.z);
+
+		if (x1 < 0 || y1 < 0 || z1 < 0 || x1+1 >= m_res.x ||
+		    y1+1 >= m_res.y || z1+1 >= m_res.z)
+			return 0;
+
+		const float *brick = lookupBrick(x1, y1, z1);
+		if (!brick)
+			return 0;
+
+		const Float fx = p.x - x1, fy = p.y - y1, fz = p.z - z1,
+				_fx = 1.0f - fx, _fy = 1.0f - fy, _fz = 1.0f - fz;
+
+		const int dy = SVOL_BRICK_RES, dz = SVOL_BRICK_RES * SVOL_BRICK_RES;
+		const float *d = brick + getSampleIndex(x1, y1, z1);
+		const Float
+			d000 = d[0],       d001 = d[1],
+			d010 = d[dy],      d011 = d[dy+1],
+			d100 = d[dz],      d101 = d[dz+1],
+			d110 = d[dz+dy],   d111 = d[dz+dy+1];
+
+		return ((d000*_fx + d001*fx)*_fy +
+				(d010*_fx + d011*fx)*fy)*_fz +
+			   ((d100*_fx + d101*fx)*_fy +
+				(d110*_fx + d111*fx)*fy)*fz;
+	}
+
+	Spectrum lookupSpectrum(const Point &_p) const {
+		const Point p = m_worldToGrid.transformAffine(_p);
+		const int x1 = math::floorToInt(p.x),
+			  y1 = math::floorToInt(p.y),
+			  z1 = math::floorToInt(p.z);
+
+		if (x1 < 0 || y1 < 0 || z1 < 0 || x1+1 >= m_res.x ||
+		    y1+1 >= m_res.y || z1+1 >= m_res.z)
+			return Spectrum(0.0f);
+
+		const float *brick = lookupBrick(x1, y1, z1);
+		if (!brick)
+			return Spectrum(0.0f);
+
+		const Float fx = p.x - x1, fy = p.y - y1, fz = p.z - z1,
+				_fx = 1.0f - fx, _fy = 1.0f - fy, _fz = 1.0f - fz;
+
+		const int dx = 3, dy = 3*SVOL_BRICK_RES, dz = 3*SVOL_BRICK_RES*SVOL_BRICK_RES;
+		const float *d = brick + 3*getSampleIndex(x1, y1, z1);
+		Float rgb[3];
+		for (int i=0; i<3; ++i, ++d) {
+			rgb[i] = ((d[0]*_fx     + d[dx]*fx)*_fy +
+					  (d[dy]*_fx    + d[dy+dx]*fx)*fy)*_fz +
+					 ((d[dz]*_fx    + d[dz+dx]*fx)*_fy +
+					  (d[dz+dy]*_fx + d[dz+dy+dx]*fx)*fy)*fz;
+		}
+
+		Spectrum result;
+		result.fromLinearRGB(rgb[0], rgb[1], rgb[2]);
+		return result;
+	}
+
+	bool supportsFloatLookups() const { return m_channels == 1; }
+	bool supportsSpectrumLookups() const { return m_channels == 3; }
+	bool supportsVectorLookups() const { return false; }
+	Float getStepSize() const { return m_stepSize; }
+
+	Float getMaximumFloatValue() const {
+		return m_maximum;
+	}
+
+	Float getMaximumFloatValue(const AABB &aabb) const {
+		/* Find all samples that contribute to trilinear lookups within the region */
+		AABB gridAABB;
+		for (int i=0; i<8; ++i)
+			gridAABB.expandBy(m_worldToGrid.transformAffine(aabb.getCorner(i)));
+
+		/* .. and the bricks storing the cells that are spanned by them */
+		int minBrick[3], maxBrick[3];
+		for (int i=0; i<3; ++i) {
+			int minSample = std::max(math::floorToInt(gridAABB.min[i]), 0),
+			    maxSample = std::min(math::ceilToInt(gridAABB.max[i]), m_res[i] - 1);
+			if (minSample > maxSample)
+				return 0.0f;
+			minBrick[i] = std::min(minSample >> SVOL_BRICK_SHIFT, m_brickRes[i] - 1);
+			maxBrick[i] = std::min(std::max(maxSample - 1, minSample) >> SVOL_BRICK_SHIFT, m_brickRes[i] - 1);
+		}
+
+		Float result = 0.0f;
+		for (int nz=minBrick[2] >> SVOL_NODE_SHIFT; nz<=maxBrick[2] >> SVOL_NODE_SHIFT; ++nz) {
+			for (int ny=minBrick[1] >> SVOL_NODE_SHIFT; ny<=maxBrick[1] >> SVOL_NODE_SHIFT; ++ny) {
+				for (int nx=minBrick[0] >> SVOL_NODE_SHIFT; nx<=maxBrick[0] >> SVOL_NODE_SHIFT; ++nx) {
+					int32_t nodeIdx = m_root[((size_t) nz*m_nodeRes.y + ny)*m_nodeRes.x + nx];
+					if (nodeIdx < 0)
+						continue;
+
+					const Node &node = m_nodes[nodeIdx];
+					if (node.max <= result)
+						continue;
+
+					/* Range of bricks of this node that overlap the region */
+					int start[3], end[3], n[3] = { nx, ny, nz };
+					bool contained = true;
+					for (int i=0; i<3; ++i) {
+						start[i] = std::max(minBrick[i], n[i] << SVOL_NODE_SHIFT);
+						end[i] = std::min(maxBrick[i], ((n[i]+1) << SVOL_NODE_SHIFT) - 1);
+						contained &= start[i] == (n[i] << SVOL_NODE_SHIFT)
+							&& end[i] == ((n[i]+1) << SVOL_NODE_SHIFT) - 1;
+					}
+
+					if (contained) {
+						result = node.max;
+						continue;
+					}
+
+					for (int bz=start[2]; bz<=end[2]; ++bz)
+						for (int by=start[1]; by<=end[1]; ++by)
+							for (int bx=start[0]; bx<=end[0]; ++bx)
+								result = std::max(result, (Float) node.brickMax[getBrickIndex(bx, by, bz)]);
+				}
+			}
+		}
+		return result;
+	}
+
+	std::string toString() const {
+		std::ostringstream oss;
+		oss << "SparseVolume[" << endl
+			<< "  res = " << m_res.toString() << "," << endl
+			<< "  channels = " << m_channels << "," << endl
+			<< "  nodes = " << m_nodes.size() << "," << endl
+			<< "  aabb = " << m_dataAABB.toString() << endl
+			<< "]";
+		return oss.str();
+	}
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// Index of a brick within its internal node
+	static FINLINE int getBrickIndex(int bx, int by, int bz) {
+		const int mask = SVOL_NODE_BRICKS - 1;
+		return (((bz & mask) << SVOL_NODE_SHIFT) + (by & mask)) * SVOL_NODE_BRICKS + (bx & mask);
+	}
+
+	/// Index of a sample (in units of the channel count) within its brick
+	static FINLINE int getSampleIndex(int x, int y, int z) {
+		const int mask = SVOL_BRICK_CELLS - 1;
+		return ((z & mask) * SVOL_BRICK_RES + (y & mask)) * SVOL_BRICK_RES + (x & mask);
+	}
+
+	/// Return the brick containing the cell with the given lower corner, or \c NULL
+	FINLINE const float *lookupBrick(int x, int y, int z) const {
+		const int bx = x >> SVOL_BRICK_SHIFT,
+			  by = y >> SVOL_BRICK_SHIFT,
+			  bz = z >> SVOL_BRICK_SHIFT;
+		int32_t nodeIdx = m_root[((bz >> SVOL_NODE_SHIFT) * m_nodeRes.y
+			+ (by >> SVOL_NODE_SHIFT)) * m_nodeRes.x + (bx >> SVOL_NODE_SHIFT)];
+		if (nodeIdx < 0)
+			return NULL;
+		return m_nodes[nodeIdx].bricks[getBrickIndex(bx, by, bz)];
+	}
+
+protected:
+	fs::path m_filename;
+	uint8_t *m_data;
+	size_t m_dataSize;
+	bool m_sendData;
+	Vector3i m_res, m_brickRes, m_nodeRes;
+	int m_channels;
+	std::vector<int32_t> m_root;
+	std::vector<Node> m_nodes;
+	Float m_maximum;
+	Transform m_worldToGrid;
+	Transform m_worldToVolume;
+	Transform m_volumeToWorld;
+	Float m_stepSize;
+	AABB m_dataAABB;
+	ref<MemoryMappedFile> m_mmap;
+};
+
+MTS_IMPLEMENT_CLASS_S(SparseDataSource, false, VolumeDataSource);
+MTS_EXPORT_PLUGIN(SparseDataSource, "Sparse grid data source");
+MTS_NAMESPACE_END
@@ -19,30 +19,22 @@
 #include <mitsuba/render/volume.h>
 #include <mitsuba/core/properties.h>
 #include <mitsuba/core/statistics.h>
-#include <mitsuba/core/sched.h>
-#include <mitsuba/core/lrucache.h>
+#include <mitsuba/core/atomic.h>
+#include <mitsuba/core/lock.h>
 #include <fstream>
 
+/// Number of directory entries that are allocated at once (log2)
+#define VOLCACHE_CHUNK_SHIFT 12
+#define VOLCACHE_CHUNK_SIZE  (1 << VOLCACHE_CHUNK_SHIFT)
+
 MTS_NAMESPACE_BEGIN
 
 static StatsCounter statsHitRate("Volume cache", "Cache hit rate", EPercentage);
+static StatsCounter statsMisses("Volume cache", "Cache misses");
 static StatsCounter statsCreate("Volume cache", "Block creations");
-static StatsCounter statsDestruct("Volume cache", "Block destructions");
+static StatsCounter statsEvict("Volume cache", "Block evictions");
 static StatsCounter statsEmpty("Volume cache", "Empty blocks", EPercentage);
 
-/* Lexicographic ordering for Vector3i */
-struct Vector3iKeyOrder : public std::binary_function<Vector3i, Vector3i, bool> {
-	inline bool operator()(const Vector3i &v1, const Vector3i &v2) const {
-		if (v1.x < v2.x) return true;
-		else if (v1.x > v2.x) return false;
-		if (v1.y < v2.y) return true;
-		else if (v1.y > v2.y) return false;
-		if (v1.z < v2.z) return true;
-		else if (v1.z > v2.z) return false;
-		return false;
-	}
-};
-
 /*!\plugin{volcache}{Caching volume data source}
  * \parameters{
  *     \parameter{blockSize}{\Integer}{
@@ -67,22 +59,43 @@ struct Vector3iKeyOrder : public std::binary_function<Vector3i, Vector3i, bool>
  * }
  *
  * This plugin can be added between the renderer and another
- * data source, for which it caches all data lookups using a
- * LRU scheme. This is useful when the nested volume data source
- * is expensive to evaluate.
+ * data source, for which it caches all data lookups. This is
+ * useful when the nested volume data source is expensive to evaluate.
  *
  * The cache works by performing on-demand rasterization of subregions
  * of the nested volume into blocks ($8\times 8 \times 8$ by default).
- * These are kept in memory until a user-specifiable threshold is exeeded,
- * after which point a \emph{least recently used} (LRU) policy removes
- * records that haven't been accessed in a long time.
+ * The blocks are shared by all rendering threads and kept in memory until
+ * the memory limit is reached, after which point a \emph{clock} policy
+ * (an approximation of least recently used replacement) recycles blocks
+ * that haven't been accessed in a long time. Blocks that are entirely
+ * empty don't count towards the memory limit. Lookups of cached blocks
+ * don't acquire any locks; their only write is setting the block's
+ * reference flag when it is clear.
  */
 class CachingDataSource : public VolumeDataSource {
 public:
-	typedef LRUCache<Vector3i, Vector3iKeyOrder, float *> BlockCache;
+	/**
+	 * \brief Storage for one cached block
+	 *
+	 * Blocks are recycled by the eviction policy, but their memory is only
+	 * released when the cache is destroyed. This permits lookups to
+	 * read a block without holding a lock: the version number is odd while
+	 * the contents are being replaced, and a lookup that observes a change
+	 * of the version number simply retries.
+	 */
+	struct Block {
+		/// Linear index of the cached block (-1 if unused)
+		volatile int64_t index;
+		/// Incremented before and after replacing the contents
+		volatile int32_t version;
+		/// Set by lookups (only if clear), cleared by the clock hand
+		volatile bool referenced;
+		/// Rasterized samples of the nested data source
+		float *data;
+	};
 
 	CachingDataSource(const Properties &props)
-		: VolumeDataSource(props) {
+		: VolumeDataSource(props), m_directory(NULL) {
 		/// Size of an individual block (must be a power of 2)
 		m_blockSize = props.getInteger("blockSize", 8);
 
@@ -102,12 +115,13 @@ public:
 	}
 
 	CachingDataSource(Stream *stream, InstanceManager *manager)
-	: VolumeDataSource(stream, manager) {
+	: VolumeDataSource(stream, manager), m_directory(NULL) {
 		m_nested = static_cast<VolumeDataSource *>(manager->getInstance(stream));
 		configure();
 	}
 
 	virtual ~CachingDataSource() {
+		clear();
 	}
 
 	void serialize(Stream *stream, InstanceManager *manager) const {
@@ -125,12 +139,11 @@ public:
 		if (m_voxelWidth == -1)
 			m_voxelWidth = m_nested->getStepSize();
 
-		size_t memoryLimitPerCore = m_memoryLimit
-			/ std::max((size_t) 1, Scheduler::getInstance()->getLocalWorkerCount());
-
 		Vector totalCells  = m_aabb.getExtents() / m_voxelWidth;
-		for (int i=0; i<3; ++i)
+		for (int i=0; i<3; ++i) {
 			m_cellCount[i] = (int) std::ceil(totalCells[i]);
+			m_blockCount[i] = (m_cellCount[i] + m_blockSize - 1) / m_blockSize;
+		}
 
 		if (m_nested->supportsFloatLookups())
 			m_channels = 1;
@@ -143,7 +156,7 @@ public:
 
 		m_blockRes = m_blockSize+1;
 		int blockMemoryUsage = (int) std::pow((Float) m_blockRes, 3) * m_channels * sizeof(float);
-		m_blocksPerCore = memoryLimitPerCore / blockMemoryUsage;
+		m_maxBlocks = std::max((size_t) 1, m_memoryLimit / blockMemoryUsage);
 
 		m_worldToVolume = m_volumeToWorld.inverse();
 		m_worldToGrid = Transform::scale(Vector(1/m_voxelWidth))
@@ -152,13 +165,26 @@ public:
 		m_blockMask = ~(m_blockSize-1);
 		m_blockShift = math::log2i((uint32_t) m_blockSize);
 
+		/* The directory maps block indices to cache records. It is
+		   allocated in chunks as the corresponding regions are accessed */
+		clear();
+		size_t blockCount = (size_t) m_blockCount.x * m_blockCount.y * m_blockCount.z;
+		m_chunkCount = (blockCount + VOLCACHE_CHUNK_SIZE - 1) >> VOLCACHE_CHUNK_SHIFT;
+		m_directory = new Block ** volatile[m_chunkCount];
+		memset((void *) m_directory, 0, sizeof(Block **) * m_chunkCount);
+		m_emptyBlock.index = -1;
+		m_emptyBlock.version = 0;
+		m_emptyBlock.referenced = true;
+		m_emptyBlock.data = NULL;
+		m_clockHand = 0;
+		m_mutex = new Mutex();
+
 		Log(EInfo, "Volume cache configuration");
 		Log(EInfo, "   Block size in voxels      = %i", m_blockSize);
 		Log(EInfo, "   Voxel width               = %f", m_voxelWidth);
 		Log(EInfo, "   Memory usage of one block = %s", memString(blockMemoryUsage).c_str());
 		Log(EInfo, "   Memory limit              = %s", memString(m_memoryLimit).c_str());
-		Log(EInfo, "   Memory limit per core     = %s", memString(memoryLimitPerCore).c_str());
-		Log(EInfo, "   Max. blocks per core      = %i", m_blocksPerCore);
+		Log(EInfo, "   Max. blocks               = " SIZE_T_FMT, m_maxBlocks);
 		Log(EInfo, "   Effective resolution      = %s", totalCells.toString().c_str());
 		Log(EInfo, "   Effective storage         = %s", memString((size_t)
 			(totalCells[0]*totalCells[1]*totalCells[2]*sizeof(float)*m_channels)).c_str());
@@ -174,77 +200,64 @@ public:
 			z < 0 || z >= m_cellCount.z))
 			return 0.0f;
 
-		BlockCache *cache = m_cache.get();
-		if (EXPECT_NOT_TAKEN(cache == NULL)) {
-			cache = new BlockCache(m_blocksPerCore,
-				boost::bind(&CachingDataSource::renderBlock, this, _1),
-				boost::bind(&CachingDataSource::destroyBlock, this, _1));
-			m_cache.set(cache);
-		}
-
-#if defined(VOLCACHE_DEBUG)
-		if (cache->isFull()) {
-			/* For debugging: when the cache is full, dump locations
-			   of all cache records into an OBJ file and exit */
-			std::vector<Vector3i> keys;
-			cache->get_keys(std::back_inserter(keys));
-
-			std::ofstream os("keys.obj");
-			os << "o Keys" << endl;
-			for (size_t i=0; i<keys.size(); i++) {
-				Vector3i key = keys[i];
-				key = key * m_blockSize + Vector3i(m_blockSize/2);
-
-				Point p(key.x * m_voxelWidth + m_aabb.min.x,
-					key.y * m_voxelWidth + m_aabb.min.y,
-					key.z * m_voxelWidth + m_aabb.min.z);
-
-				os << "v " << p.x << " " << p.y << " " << p.z << endl;
-			}
-
-			/// Need to generate some fake geometry so that blender will import the points
-			for (size_t i=3; i<=keys.size(); i++)
-				os << "f " << i << " " << i-1 << " " << i-2 << endl;
-			os.close();
-			_exit(-1);
-		}
-#endif
-
-		bool hit = false;
-		float *blockData = cache->get(Vector3i(
-			(x & m_blockMask) >> m_blockShift,
-			(y & m_blockMask) >> m_blockShift,
-			(z & m_blockMask) >> m_blockShift), hit);
-
-		statsHitRate.incrementBase();
-		if (hit)
-			++statsHitRate;
-
-		if (blockData == NULL)
-			return 0.0f;
+		const int64_t index = ((int64_t) ((z & m_blockMask) >> m_blockShift) * m_blockCount.y
+			+ ((y & m_blockMask) >> m_blockShift)) * m_blockCount.x + ((x & m_blockMask) >> m_blockShift);
 
-		const int x1 = x & m_voxelMask, y1 = y & m_voxelMask, z1 = z & m_voxelMask,
-				x2 = x1 + 1, y2 = y1 + 1, z2 = z1 + 1;
+		const int x1 = x & m_voxelMask, y1 = y & m_voxelMask, z1 = z & m_voxelMask;
+		const int offset = (z1*m_blockRes + y1)*m_blockRes + x1,
+		          dy = m_blockRes, dz = m_blockRes*m_blockRes;
 
 		const float fx = (float) p.x - x, fy = (float) p.y - y, fz = (float) p.z - z,
 				_fx = 1.0f - fx, _fy = 1.0f - fy, _fz = 1.0f - fz;
 
-		const float
-			&d000 = blockData[(z1*m_blockRes + y1)*m_blockRes + x1],
-			&d001 = blockData[(z1*m_blockRes + y1)*m_blockRes + x2],
-			&d010 = blockData[(z1*m_blockRes + y2)*m_blockRes + x1],
-			&d011 = blockData[(z1*m_blockRes + y2)*m_blockRes + x2],
-			&d100 = blockData[(z2*m_blockRes + y1)*m_blockRes + x1],
-			&d101 = blockData[(z2*m_blockRes + y1)*m_blockRes + x2],
-			&d110 = blockData[(z2*m_blockRes + y2)*m_blockRes + x1],
-			&d111 = blockData[(z2*m_blockRes + y2)*m_blockRes + x2];
-
-		float result = ((d000*_fx + d001*fx)*_fy +
-				 (d010*_fx + d011*fx)*fy)*_fz +
-				((d100*_fx + d101*fx)*_fy +
-				 (d110*_fx + d111*fx)*fy)*fz;
-
-		return result;
+		statsHitRate.incrementBase();
+		bool hit = true;
+
+		while (true) {
+			Block *block = getBlock(index);
+
+			if (block == &m_emptyBlock) {
+				if (hit)
+					++statsHitRate;
+				return 0.0f;
+			} else if (block) {
+				const int32_t version = block->version;
+				if ((version & 1) == 0 && block->index == index) {
+					/* The block may be recycled concurrently -- read through a
+					   volatile pointer so that the loads are not reordered with
+					   respect to the following check of the version number */
+					const volatile float *d = block->data + offset;
+					const float
+						d000 = d[0],       d001 = d[1],
+						d010 = d[dy],      d011 = d[dy+1],
+						d100 = d[dz],      d101 = d[dz+1],
+						d110 = d[dz+dy],   d111 = d[dz+dy+1];
+
+					if (block->version == version) {
+						/* Mark the block for the clock policy. This is the only
+						   shared write on the hit path, and it is skipped when
+						   the flag is already set so that hot blocks don't
+						   bounce their cache line between cores. The flag is
+						   not covered by the version number: a racing store
+						   can at worst keep a recycled block alive for one more
+						   pass of the clock hand, and lookups never read it */
+						if (!block->referenced)
+							block->referenced = true;
+						if (hit)
+							++statsHitRate;
+
+						return ((d000*_fx + d001*fx)*_fy +
+								(d010*_fx + d011*fx)*fy)*_fz +
+							   ((d100*_fx + d101*fx)*_fy +
+								(d110*_fx + d111*fx)*fy)*fz;
+					}
+				}
+			}
+
+			hit = false;
+			if (!loadBlock(index))
+				return m_nested->lookupFloat(m_worldToVolume(_p));
+		}
 	}
 
 	Spectrum lookupSpectrum(const Point &_p) const {
@@ -280,12 +293,16 @@ public:
 		}
 	}
 
-	float *renderBlock(const Vector3i &blockIdx) const {
-		float *result = new float[m_blockRes*m_blockRes*m_blockRes];
+	/// Rasterize a block of the nested data source. Returns \c false if it is empty.
+	bool renderBlock(int64_t index, float *target) const {
+		const int bx = (int) (index % m_blockCount.x),
+		          by = (int) ((index / m_blockCount.x) % m_blockCount.y),
+		          bz = (int) (index / ((int64_t) m_blockCount.x * m_blockCount.y));
+
 		Point offset = m_aabb.min + Vector(
-			blockIdx.x * m_blockSize * m_voxelWidth,
-			blockIdx.y * m_blockSize * m_voxelWidth,
-			blockIdx.z * m_blockSize * m_voxelWidth);
+			bx * m_blockSize * m_voxelWidth,
+			by * m_blockSize * m_voxelWidth,
+			bz * m_blockSize * m_voxelWidth);
 
 		int idx = 0;
 		bool nonempty = false;
@@ -294,7 +311,7 @@ public:
 				for (int x = 0; x<m_blockRes; ++x) {
 					Point p = offset + Vector((Float) x, (Float) y, (Float) z) * m_voxelWidth;
 					float value = (float) m_nested->lookupFloat(p);
-					result[idx++] = value;
+					target[idx++] = value;
 					nonempty |= (value != 0);
 				}
 			}
@@ -302,26 +319,181 @@ public:
 
 		++statsCreate;
 		statsEmpty.incrementBase();
+		if (!nonempty)
+			++statsEmpty;
+
+		return nonempty;
+	}
+
+	Float getMaximumFloatValue() const {
+		return m_nested->getMaximumFloatValue();
+	}
+
+	Float getMaximumFloatValue(const AABB &aabb) const {
+		/* The nested data source is queried in volume space, and the
+		   cached values are interpolated from samples up to one voxel
+		   outside of the region */
+		AABB volumeAABB;
+		for (int i=0; i<8; ++i)
+			volumeAABB.expandBy(m_worldToVolume(aabb.getCorner(i)));
+		volumeAABB.min -= Vector(m_voxelWidth);
+		volumeAABB.max += Vector(m_voxelWidth);
+		return m_nested->getMaximumFloatValue(volumeAABB);
+	}
+
+	MTS_DECLARE_CLASS()
+protected:
+	/// Return the directory entry of a block without locking
+	FINLINE Block *getBlock(int64_t index) const {
+		Block ** chunk = m_directory[index >> VOLCACHE_CHUNK_SHIFT];
+		if (!chunk)
+			return NULL;
+		return ((Block * volatile *) chunk)[index & (VOLCACHE_CHUNK_SIZE-1)];
+	}
+
+	/**
+	 * \brief Slow path of a lookup: rasterize a block that isn't cached
+	 *
+	 * Returns \c false when the block is currently being rasterized by
+	 * another thread, or when all blocks are. Instead of waiting, the caller
+	 * should then query the nested data source directly.
+	 */
+	bool loadBlock(int64_t index) const {
+		m_mutex->lock();
+		Block ** volatile &chunk = m_directory[index >> VOLCACHE_CHUNK_SHIFT];
+		if (!chunk) {
+			Block **entries = new Block*[VOLCACHE_CHUNK_SIZE];
+			memset(entries, 0, sizeof(Block *) * VOLCACHE_CHUNK_SIZE);
+			/* Publish with a barrier, since lookups read the chunk without locking */
+			atomicCompareAndExchangePtr((Block ***) &chunk, entries, (Block **) NULL);
+		}
+
+		Block * volatile &entry = ((Block * volatile *) chunk)[index & (VOLCACHE_CHUNK_SIZE-1)];
+		if (entry) {
+			/* Another thread got here first */
+			bool busy = entry->version & 1;
+			m_mutex->unlock();
+			return !busy;
+		}
+
+		Block *block = acquireBlock();
+		if (!block) {
+			m_mutex->unlock();
+			return false;
+		}
+
+		++statsMisses;
+		atomicAdd(&block->version, 1);
+		block->index = index;
+		block->referenced = true;
+		entry = block;
+		m_mutex->unlock();
+
+		bool nonempty = renderBlock(index, block->data);
 
 		if (nonempty) {
-			return result;
+			atomicAdd(&block->version, 1);
 		} else {
-			++statsEmpty;
-			delete[] result;
-			return NULL;
+			/* Empty blocks are marked in the directory and don't use any memory */
+			LockGuard lock(m_mutex);
+			entry = const_cast<Block *>(&m_emptyBlock);
+			block->index = -1;
+			atomicAdd(&block->version, 1);
+			m_freeBlocks.push_back(block);
+		}
+		return true;
+	}
+
+	/// Return an unused block or evict one (must be called with the mutex held)
+	Block *acquireBlock() const {
+		if (!m_freeBlocks.empty()) {
+			Block *block = m_freeBlocks.back();
+			m_freeBlocks.pop_back();
+			return block;
+		}
+
+		if (m_blocks.size() < m_maxBlocks) {
+			Block *block = new Block();
+			block->index = -1;
+			block->version = 0;
+			block->referenced = false;
+			block->data = new float[m_blockRes*m_blockRes*m_blockRes];
+			m_blocks.push_back(block);
+			return block;
+		}
+
+#if defined(VOLCACHE_DEBUG)
+		dumpKeys();
+#endif
+
+		/* Clock policy: skip over recently used blocks (clearing their reference
+		   flags) and blocks that are currently being rasterized */
+		for (size_t i=0; i<2*m_blocks.size(); ++i) {
+			Block *block = m_blocks[m_clockHand];
+			m_clockHand = (m_clockHand + 1) % m_blocks.size();
+
+			if ((block->version & 1) || block->index < 0)
+				continue;
+
+			if (block->referenced) {
+				block->referenced = false;
+				continue;
+			}
+
+			((Block * volatile *) m_directory[block->index >> VOLCACHE_CHUNK_SHIFT])
+				[block->index & (VOLCACHE_CHUNK_SIZE-1)] = NULL;
+			++statsEvict;
+			return block;
 		}
+
+		return NULL;
 	}
 
-	void destroyBlock(float *ptr) const {
-		++statsDestruct;
-		delete[] ptr;
+#if defined(VOLCACHE_DEBUG)
+	/// For debugging: dump locations of all cache records into an OBJ file and exit
+	void dumpKeys() const {
+		std::ofstream os("keys.obj");
+		os << "o Keys" << endl;
+		for (size_t i=0; i<m_blocks.size(); i++) {
+			int64_t index = m_blocks[i]->index;
+			Vector3i key(
+				(int) (index % m_blockCount.x),
+				(int) ((index / m_blockCount.x) % m_blockCount.y),
+				(int) (index / ((int64_t) m_blockCount.x * m_blockCount.y)));
+			key = key * m_blockSize + Vector3i(m_blockSize/2);
+
+			Point p(key.x * m_voxelWidth + m_aabb.min.x,
+				key.y * m_voxelWidth + m_aabb.min.y,
+				key.z * m_voxelWidth + m_aabb.min.z);
+
+			os << "v " << p.x << " " << p.y << " " << p.z << endl;
+		}
+
+		/// Need to generate some fake geometry so that blender will import the points
+		for (size_t i=3; i<=m_blocks.size(); i++)
+			os << "f " << i << " " << i-1 << " " << i-2 << endl;
+		os.close();
+		_exit(-1);
 	}
+#endif
 
-	Float getMaximumFloatValue() const {
-		return m_nested->getMaximumFloatValue();
+	/// Release all blocks and the directory
+	void clear() {
+		for (size_t i=0; i<m_blocks.size(); ++i) {
+			delete[] m_blocks[i]->data;
+			delete m_blocks[i];
+		}
+		m_blocks.clear();
+		m_freeBlocks.clear();
+
+		if (m_directory) {
+			for (size_t i=0; i<m_chunkCount; ++i)
+				delete[] m_directory[i];
+			delete[] m_directory;
+			m_directory = NULL;
+		}
 	}
 
-	MTS_DECLARE_CLASS()
 protected:
 	ref<VolumeDataSource> m_nested;
 	Transform m_volumeToWorld;
@@ -330,12 +502,20 @@ protected:
 	Float m_voxelWidth;
 	Float m_stepSizeMultiplier;
 	size_t m_memoryLimit;
-	size_t m_blocksPerCore;
+	size_t m_maxBlocks;
 	int m_channels;
 	int m_blockSize, m_blockRes;
 	int m_blockMask, m_voxelMask, m_blockShift;
-	Vector3i m_cellCount;
-	mutable ThreadLocal<BlockCache> m_cache;
+	Vector3i m_cellCount, m_blockCount;
+
+	/* Shared block cache */
+	mutable ref<Mutex> m_mutex;
+	Block ** volatile *m_directory;
+	size_t m_chunkCount;
+	Block m_emptyBlock;
+	mutable std::vector<Block *> m_blocks;
+	mutable std::vector<Block *> m_freeBlocks;
+	mutable size_t m_clockHand;
 };
 
 MTS_IMPLEMENT_CLASS_S(CachingDataSource, false, VolumeDataSource);